@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#ifdef SAML_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+char* USAGE = "\
+Usage: bench_deflate [options] test-data-dir\n\
+Options:\n\
+  -s seconds     duration of each run (default: 1)\n\
+\n\
+Deflates and inflates authn_request.xml and response.xml the way the redirect binding does, at each\n\
+deflate_level and deflate_mem_level, once with a new zlib stream per message and once resetting one stream.\n\
+The KB/op columns are what zlib allocates per message; a reset stream allocates nothing.  bytes is the\n\
+deflated size, before base64 and URL encoding.\n\
+\n\
+Built with make DEFLATE=libdeflate, it then does the same with libdeflate at each level, and checks that\n\
+what either library deflates, the other inflates back to the original.\n\
+\n";
+
+static const char* FILES[] = { "authn_request.xml", "response.xml" };
+static const int LEVELS[] = { 1, 6, 9 };
+static const int MEM_LEVELS[] = { 1, 8, 9 };
+#ifdef SAML_LIBDEFLATE
+#define DEF_MEM_LEVEL 8
+static const int LIBDEFLATE_LEVELS[] = { 1, 6, 9, 12 };
+#endif
+
+typedef struct {
+  unsigned char* in;
+  uLong in_len;
+  unsigned char* out;
+  uLong out_len;
+  unsigned char* deflated;
+  uLong deflated_len;
+  int level;
+  int mem_level;
+  z_stream stream;
+  size_t allocated; // by zlib since the last run
+#ifdef SAML_LIBDEFLATE
+  struct libdeflate_compressor* compressor;
+  struct libdeflate_decompressor* decompressor;
+#endif
+} bench_t;
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static voidpf counting_alloc(voidpf opaque, uInt items, uInt size) {
+  ((bench_t*)opaque)->allocated += (size_t)items * size;
+  return calloc(items, size);
+}
+
+
+static void counting_free(voidpf opaque, voidpf address) {
+  free(address);
+}
+
+
+static void stream_init(bench_t* b) {
+  memset(&b->stream, 0, sizeof(z_stream));
+  b->stream.zalloc = counting_alloc;
+  b->stream.zfree = counting_free;
+  b->stream.opaque = b;
+}
+
+
+// Returns ops per second and the KB allocated per op, or -1 if the op failed
+static double run(int (*op)(bench_t*), bench_t* b, double seconds, double* kb) {
+  long n = 0;
+  b->allocated = 0;
+  double start = now(), stop = start + seconds, end;
+  do {
+    for (int i = 0; i < 4; i++, n++) {
+      if (op(b) < 0) {
+        return -1;
+      }
+    }
+    end = now();
+  } while (end < stop);
+  *kb = b->allocated / 1024.0 / n;
+  return n / (end - start);
+}
+
+
+static int deflate_once(bench_t* b) {
+  b->stream.next_in = b->in;
+  b->stream.avail_in = b->in_len;
+  b->stream.next_out = b->out;
+  b->stream.avail_out = b->out_len;
+  if (deflate(&b->stream, Z_FINISH) != Z_STREAM_END) {
+    return -1;
+  }
+  b->deflated_len = b->stream.total_out;
+  return 0;
+}
+
+
+static int deflate_new(bench_t* b) {
+  stream_init(b);
+  if (deflateInit2(&b->stream, b->level, Z_DEFLATED, -15, b->mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return -1;
+  }
+  int res = deflate_once(b);
+  deflateEnd(&b->stream);
+  return res;
+}
+
+
+static int deflate_reset(bench_t* b) {
+  return deflateReset(&b->stream) == Z_OK ? deflate_once(b) : -1;
+}
+
+
+static int inflate_once(bench_t* b) {
+  b->stream.next_in = b->deflated;
+  b->stream.avail_in = b->deflated_len;
+  b->stream.next_out = b->out;
+  b->stream.avail_out = b->out_len;
+  return inflate(&b->stream, Z_NO_FLUSH) == Z_STREAM_END && b->stream.total_out == b->in_len ? 0 : -1;
+}
+
+
+static int inflate_new(bench_t* b) {
+  stream_init(b);
+  if (inflateInit2(&b->stream, -15) != Z_OK) {
+    return -1;
+  }
+  int res = inflate_once(b);
+  inflateEnd(&b->stream);
+  return res;
+}
+
+
+static int inflate_reset(bench_t* b) {
+  return inflateReset(&b->stream) == Z_OK ? inflate_once(b) : -1;
+}
+
+
+static unsigned char* read_file(const char* dir, const char* name, uLong* len) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s%s", dir, name);
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  unsigned char* buf = malloc(*len);
+  if (buf != NULL && fread(buf, 1, *len, f) != *len) {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+
+#ifdef SAML_LIBDEFLATE
+
+static int libdeflate_compress(bench_t* b) {
+  b->deflated_len = libdeflate_deflate_compress(b->compressor, b->in, b->in_len, b->out, b->out_len);
+  return b->deflated_len == 0 ? -1 : 0;
+}
+
+
+static int libdeflate_decompress(bench_t* b) {
+  size_t out_len;
+  enum libdeflate_result res = libdeflate_deflate_decompress(b->decompressor, b->deflated, b->deflated_len, b->out, b->out_len, &out_len);
+  return res == LIBDEFLATE_SUCCESS && out_len == b->in_len ? 0 : -1;
+}
+
+
+// Deflates with each library and inflates with the other, returning -1 unless both give back the input
+static int interop(bench_t* b) {
+  int level = b->level > 9 ? 9 : b->level;
+  stream_init(b);
+  if (deflateInit2(&b->stream, level, Z_DEFLATED, -15, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return -1;
+  }
+  int res = deflate_once(b);
+  deflateEnd(&b->stream);
+  memcpy(b->deflated, b->out, b->deflated_len);
+  memset(b->out, 0, b->out_len);
+  if (res < 0 || libdeflate_decompress(b) < 0 || memcmp(b->out, b->in, b->in_len) != 0) {
+    return -1;
+  }
+
+  if (libdeflate_compress(b) < 0) {
+    return -1;
+  }
+  memcpy(b->deflated, b->out, b->deflated_len);
+  memset(b->out, 0, b->out_len);
+  stream_init(b);
+  if (inflateInit2(&b->stream, -15) != Z_OK) {
+    return -1;
+  }
+  res = inflate_once(b);
+  inflateEnd(&b->stream);
+  return res == 0 && memcmp(b->out, b->in, b->in_len) == 0 ? 0 : -1;
+}
+
+
+static int bench_libdeflate(const char* test_data_dir, double seconds) {
+  printf("\n%-18s %5s %8s %12s %12s %8s\n", "file", "level", "bytes", "compress", "decompress", "interop");
+  int failed = 0;
+  for (int i = 0; i < sizeof(FILES) / sizeof(FILES[0]); i++) {
+    bench_t b;
+    memset(&b, 0, sizeof(bench_t));
+    b.in = read_file(test_data_dir, FILES[i], &b.in_len);
+    if (b.in == NULL) {
+      fprintf(stderr, "could not read %s%s\n", test_data_dir, FILES[i]);
+      return 1;
+    }
+    b.out_len = compressBound(b.in_len) + b.in_len;
+    b.out = malloc(b.out_len);
+    b.deflated = malloc(b.out_len);
+    b.decompressor = libdeflate_alloc_decompressor();
+
+    for (int j = 0; j < sizeof(LIBDEFLATE_LEVELS) / sizeof(LIBDEFLATE_LEVELS[0]); j++) {
+      b.level = LIBDEFLATE_LEVELS[j];
+      b.compressor = libdeflate_alloc_compressor(b.level);
+      double unused_kb;
+      double compresses = b.compressor == NULL ? -1 : run(libdeflate_compress, &b, seconds, &unused_kb);
+      memcpy(b.deflated, b.out, b.deflated_len);
+      double decompresses = compresses < 0 || b.decompressor == NULL ? -1 : run(libdeflate_decompress, &b, seconds, &unused_kb);
+      size_t deflated_len = b.deflated_len;
+      int interoperates = decompresses >= 0 && interop(&b) == 0;
+      libdeflate_free_compressor(b.compressor);
+
+      if (compresses < 0 || decompresses < 0) {
+        printf("%-18s %5d %8s\n", FILES[i], b.level, "failed");
+        failed = 1;
+        continue;
+      }
+      printf("%-18s %5d %8lu %12.0f %12.0f %8s\n", FILES[i], b.level, deflated_len, compresses, decompresses,
+             interoperates ? "ok" : "FAILED");
+      failed |= !interoperates;
+    }
+
+    libdeflate_free_decompressor(b.decompressor);
+    free(b.in);
+    free(b.out);
+    free(b.deflated);
+  }
+  return failed;
+}
+
+#endif
+
+
+int main(int argc, char* argv[]) {
+  double seconds = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      default:
+        seconds = -1;
+        break;
+    }
+  }
+  if (argc - optind < 1 || seconds <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* test_data_dir = argv[optind];
+
+  printf("%-18s %5s %8s %8s %12s %12s %10s %12s %12s %10s\n", "file", "level", "memLevel", "bytes",
+         "deflate new", "deflate rst", "KB/op", "inflate new", "inflate rst", "KB/op");
+  int failed = 0;
+  for (int i = 0; i < sizeof(FILES) / sizeof(FILES[0]); i++) {
+    bench_t b;
+    memset(&b, 0, sizeof(bench_t));
+    b.in = read_file(test_data_dir, FILES[i], &b.in_len);
+    if (b.in == NULL) {
+      fprintf(stderr, "could not read %s%s\n", test_data_dir, FILES[i]);
+      return 1;
+    }
+    b.out_len = compressBound(b.in_len) + b.in_len;
+    b.out = malloc(b.out_len);
+    b.deflated = malloc(b.out_len);
+
+    for (int j = 0; j < sizeof(LEVELS) / sizeof(LEVELS[0]); j++) {
+      for (int k = 0; k < sizeof(MEM_LEVELS) / sizeof(MEM_LEVELS[0]); k++) {
+        b.level = LEVELS[j];
+        b.mem_level = MEM_LEVELS[k];
+        double deflate_kb, inflate_kb, unused_kb;
+        double deflates = run(deflate_new, &b, seconds, &deflate_kb);
+
+        stream_init(&b);
+        double deflate_resets = -1;
+        if (deflateInit2(&b.stream, b.level, Z_DEFLATED, -15, b.mem_level, Z_DEFAULT_STRATEGY) == Z_OK) {
+          deflate_resets = run(deflate_reset, &b, seconds, &unused_kb);
+          deflateEnd(&b.stream);
+        }
+        memcpy(b.deflated, b.out, b.deflated_len);
+
+        double inflates = deflates < 0 ? -1 : run(inflate_new, &b, seconds, &inflate_kb);
+        stream_init(&b);
+        double inflate_resets = -1;
+        if (inflates >= 0 && inflateInit2(&b.stream, -15) == Z_OK) {
+          inflate_resets = run(inflate_reset, &b, seconds, &unused_kb);
+          inflateEnd(&b.stream);
+        }
+
+        if (deflates < 0 || deflate_resets < 0 || inflates < 0 || inflate_resets < 0) {
+          printf("%-18s %5d %8d %8s\n", FILES[i], b.level, b.mem_level, "failed");
+          failed = 1;
+          continue;
+        }
+        printf("%-18s %5d %8d %8lu %12.0f %12.0f %10.1f %12.0f %12.0f %10.1f\n", FILES[i], b.level, b.mem_level,
+               b.deflated_len, deflates, deflate_resets, deflate_kb, inflates, inflate_resets, inflate_kb);
+      }
+    }
+
+    free(b.in);
+    free(b.out);
+    free(b.deflated);
+  }
+#ifdef SAML_LIBDEFLATE
+  failed |= bench_libdeflate(test_data_dir, seconds);
+#endif
+  return failed;
+}
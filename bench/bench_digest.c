@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/c14n.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <openssl/evp.h>
+#include <xmlsec/crypto.h>
+#include <xmlsec/xmltree.h>
+
+#include "saml.h"
+
+char* USAGE = "\
+Usage: bench_digest [options] data-dir test-data-dir\n\
+Options:\n\
+  -s seconds     duration of each run (default: 1)\n\
+\n\
+Signs response.xml with sp.key and each Reference digest, with the AttributeStatement grown to make larger\n\
+assertions.  The sign_doc column includes the RSA signature, which is the same for every digest, so the\n\
+difference between rows of one size is the cost of the digest.  The MB/s column hashes the canonical form\n\
+of the same document with OpenSSL alone.\n\
+\n";
+
+typedef struct {
+  const char* name;
+  const char* href;
+  const EVP_MD* (*md)(void);
+} digest_t;
+
+static const digest_t DIGESTS[] = {
+  { "sha1", "http://www.w3.org/2000/09/xmldsig#sha1", EVP_sha1 },
+  { "sha256", "http://www.w3.org/2001/04/xmlenc#sha256", EVP_sha256 },
+  { "sha512", "http://www.w3.org/2001/04/xmlenc#sha512", EVP_sha512 },
+};
+
+static const int ATTRIBUTES[] = { 0, 16, 256, 4096 };
+
+typedef struct {
+  xmlSecKey* key;
+  xmlSecTransformId transform_id;
+  xmlDoc* doc;
+  saml_doc_opts_t opts;
+  const EVP_MD* md;
+  xmlChar* c14n;
+  int c14n_len;
+} bench_t;
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Returns ops per second, or -1 if the op failed
+static double run(int (*op)(bench_t*), bench_t* b, double seconds) {
+  long n = 0;
+  double start = now(), stop = start + seconds, end;
+  do {
+    for (int i = 0; i < 4; i++, n++) {
+      if (op(b) < 0) {
+        return -1;
+      }
+    }
+    end = now();
+  } while (end < stop);
+  return n / (end - start);
+}
+
+
+static int sign(bench_t* b) {
+  xmlDoc* doc = xmlCopyDoc(b->doc, 1);
+  int res = doc != NULL && saml_sign_doc(b->key, b->transform_id, doc, &b->opts) == 0 ? 0 : -1;
+  xmlFreeDoc(doc);
+  return res;
+}
+
+
+static int digest(bench_t* b) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  return EVP_Digest(b->c14n, b->c14n_len, md, NULL, b->md, NULL) == 1 ? 0 : -1;
+}
+
+
+// Whether the CPU advertises SHA instructions, as the kernel reports them
+static const char* sha_extensions() {
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) {
+    return "unknown";
+  }
+  char line[4096];
+  const char* res = "no";
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "flags", 5) != 0 && strncmp(line, "Features", 8) != 0) {
+      continue;
+    }
+    if (strstr(line, " sha_ni") != NULL || strstr(line, " sha2") != NULL) {
+      res = "yes";
+    }
+    break;
+  }
+  fclose(f);
+  return res;
+}
+
+
+// Appends copies of the first Attribute to its AttributeStatement
+static int grow(xmlDoc* doc, int n) {
+  xmlNode* statement = xmlSecFindNode(xmlDocGetRootElement(doc), (xmlChar*)"AttributeStatement", (xmlChar*)SAML_XMLNS_ASSERTION);
+  xmlNode* attribute = statement == NULL ? NULL : xmlSecFindChild(statement, (xmlChar*)"Attribute", (xmlChar*)SAML_XMLNS_ASSERTION);
+  if (attribute == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    xmlNode* copy = xmlDocCopyNode(attribute, doc, 1);
+    if (copy == NULL || xmlAddChild(statement, copy) == NULL) {
+      xmlFreeNode(copy);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+  double seconds = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      default:
+        seconds = -1;
+        break;
+    }
+  }
+  if (argc - optind < 2 || seconds <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* test_data_dir = argv[optind + 1];
+
+  saml_init_opts_t opts = { .debug = getenv("SAML_DEBUG") != NULL, .data_dir = argv[optind], .lazy_schema = 1 };
+  if (saml_init(&opts) < 0) {
+    fprintf(stderr, "initialization failed\n");
+    return 1;
+  }
+
+  bench_t b;
+  memset(&b, 0, sizeof(bench_t));
+  b.opts.id_attr = (xmlChar*)"ID";
+  b.opts.insert_after_ns = (xmlChar*)SAML_XMLNS_ASSERTION;
+  b.opts.insert_after_el = (xmlChar*)"Issuer";
+  b.transform_id = saml_find_transform("http://www.w3.org/2001/04/xmldsig-more#rsa-sha256");
+
+  char path[512];
+  snprintf(path, sizeof(path), "%ssp.key", test_data_dir);
+  b.key = xmlSecCryptoAppKeyLoad(path, xmlSecKeyDataFormatPem, NULL, NULL, NULL);
+  if (b.key == NULL) {
+    fprintf(stderr, "could not load %s\n", path);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%sresponse.xml", test_data_dir);
+  xmlDoc* response = xmlReadFile(path, NULL, 0);
+  if (response == NULL) {
+    fprintf(stderr, "could not read %s\n", path);
+    return 1;
+  }
+
+  printf("sha extensions: %s\n", sha_extensions());
+  printf("%-10s %-8s %10s %12s %10s\n", "attributes", "digest", "bytes", "sign_doc/s", "MB/s");
+  int failed = 0;
+  for (int i = 0; i < sizeof(ATTRIBUTES) / sizeof(ATTRIBUTES[0]); i++) {
+    b.doc = xmlCopyDoc(response, 1);
+    if (b.doc == NULL || grow(b.doc, ATTRIBUTES[i]) < 0
+        || xmlC14NDocDumpMemory(b.doc, NULL, XML_C14N_EXCLUSIVE_1_0, NULL, 0, &b.c14n) < 0) {
+      printf("%-10d %s\n", ATTRIBUTES[i], "failed");
+      xmlFreeDoc(b.doc);
+      failed = 1;
+      continue;
+    }
+    b.c14n_len = xmlStrlen(b.c14n);
+
+    for (int j = 0; j < sizeof(DIGESTS) / sizeof(DIGESTS[0]); j++) {
+      b.opts.digest_id = saml_find_transform(DIGESTS[j].href);
+      b.md = DIGESTS[j].md();
+      double signs = b.opts.digest_id == NULL ? -1 : run(sign, &b, seconds);
+      double digests = run(digest, &b, seconds);
+      if (signs < 0 || digests < 0) {
+        printf("%-10d %-8s %10s\n", ATTRIBUTES[i], DIGESTS[j].name, "failed");
+        failed = 1;
+        continue;
+      }
+      printf("%-10d %-8s %10d %12.0f %10.0f\n", ATTRIBUTES[i], DIGESTS[j].name, b.c14n_len, signs, digests * b.c14n_len / 1e6);
+    }
+
+    xmlFree(b.c14n);
+    xmlFreeDoc(b.doc);
+  }
+
+  xmlFreeDoc(response);
+  xmlSecKeyDestroy(b.key);
+  saml_shutdown();
+  return failed;
+}
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/parser.h>
+#include <xmlsec/crypto.h>
+
+#include "saml.h"
+
+char* USAGE = "\
+Usage: bench_keys [options] data-dir test-data-dir\n\
+Options:\n\
+  -s seconds     duration of each run (default: 1)\n\
+\n\
+Signs and verifies with each key type in test-data-dir on a single thread, so the rates are per core.\n\
+The redirect rows sign the query string of a redirect binding.  The post rows sign response.xml as\n\
+saml_binding_post_create does, including copying the document, and verify the result as\n\
+saml_binding_post_verify does; the signer row signs the same way with a saml_signer_t, and the build row\n\
+writes and signs the same response with saml_response_build, including serializing it.  Schema\n\
+validation, base64 and deflate are left out, being the same for every key.\n\
+\n";
+
+#define QUERY "SAMLRequest=fVNNr9MwELz3V1i%2BN3Hy%2BkGtNqi0fFQqbdQEDlyQsTfUUmwH23mv%2FHuc0KIgQU6W7JnZmd312jFVN3Tb&RelayState=%2F&SigAlg=http%3A%2F%2Fwww.w3.org%2F2001%2F04%2Fxmldsig-more%23rsa-sha256"
+
+typedef int (*op_t)(void* arg);
+
+typedef struct {
+  const char* name;
+  const char* key_file;
+  const char* cert_file;
+  const char* href;
+} alg_t;
+
+static const alg_t ALGS[] = {
+  { "rsa-2048", "sp.key", "sp.crt", "http://www.w3.org/2001/04/xmldsig-more#rsa-sha256" },
+  { "rsa-3072", "sp-rsa3072.key", "sp-rsa3072.crt", "http://www.w3.org/2001/04/xmldsig-more#rsa-sha256" },
+  { "ecdsa-p256", "sp-ec-p256.key", "sp-ec-p256.crt", "http://www.w3.org/2001/04/xmldsig-more#ecdsa-sha256" },
+  { "ecdsa-p384", "sp-ec-p384.key", "sp-ec-p384.crt", "http://www.w3.org/2001/04/xmldsig-more#ecdsa-sha384" },
+};
+
+typedef struct {
+  xmlSecKey* key;
+  xmlSecKey* cert;
+  xmlSecKeysMngr* mngr;
+  xmlSecTransformId transform_id;
+  str_t sig;
+  xmlDoc* response;
+  xmlDoc* signed_response;
+  saml_signer_t* signer;
+} bench_t;
+
+static xmlChar* ROLES[] = { (xmlChar*)"users", (xmlChar*)"examplerole1" };
+static xmlChar* UID[] = { (xmlChar*)"test" };
+static xmlChar* MAIL[] = { (xmlChar*)"test@example.com" };
+static saml_attr_t ATTRS[] = {
+  { (xmlChar*)"uid", UID, 1 },
+  { (xmlChar*)"mail", MAIL, 1 },
+  { (xmlChar*)"eduPersonAffiliation", ROLES, 2 },
+};
+
+// The content of response.xml
+static const saml_response_t RESPONSE = {
+  .id = "_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6",
+  .issue_instant = "2014-07-17T01:01:48Z",
+  .destination = "http://sp.example.com/demo1/index.php?acs",
+  .in_response_to = "ONELOGIN_4fee3b046395c4e751011e97f8900b5273d56685",
+  .issuer = "http://idp.example.com/metadata.php",
+  .assertion_id = "_d71a3a8e9fcc45c9e9d248ef7049393fc8f04e5f75",
+  .name_id = "_ce3d2948b4cf20146dee0a0b3dd6f69b6cf86f62d7",
+  .name_id_format = "urn:oasis:names:tc:SAML:2.0:nameid-format:transient",
+  .sp_name_qualifier = "http://sp.example.com/demo1/metadata.php",
+  .not_before = "2014-07-17T01:01:18Z",
+  .not_on_or_after = "2024-01-18T06:21:48Z",
+  .audience = "http://sp.example.com/demo1/metadata.php",
+  .session_index = "_be9967abd904ddcae3c0eb4189adbe3f71e327cf93",
+  .authn_context_class_ref = "urn:oasis:names:tc:SAML:2.0:ac:classes:Password",
+  .attrs = ATTRS,
+  .attrs_len = sizeof(ATTRS) / sizeof(ATTRS[0]),
+};
+
+static saml_doc_opts_t DOC_OPTS = {
+  .id_attr = (xmlChar*)"ID",
+  .insert_after_el = (xmlChar*)"Issuer",
+};
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Returns ops per second, or -1 if the op failed
+static double run(op_t op, void* arg, double seconds) {
+  long n = 0;
+  double start = now(), stop = start + seconds, end;
+  do {
+    for (int i = 0; i < 4; i++, n++) {
+      if (op(arg) < 0) {
+        return -1;
+      }
+    }
+    end = now();
+  } while (end < stop);
+  return n / (end - start);
+}
+
+
+static int redirect_sign(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  str_t sig;
+  if (saml_sign_binary_str(b->key, b->transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1, &sig) < 0) {
+    return -1;
+  }
+  str_free(&sig);
+  return 0;
+}
+
+
+static int redirect_verify(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  return saml_verify_binary(b->cert, b->transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1, (unsigned char*)b->sig.data, b->sig.len) == 0 ? 0 : -1;
+}
+
+
+static int post_sign(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  xmlDoc* doc = xmlCopyDoc(b->response, 1);
+  int res = doc != NULL && saml_sign_doc(b->key, b->transform_id, doc, &DOC_OPTS) == 0 ? 0 : -1;
+  xmlFreeDoc(doc);
+  return res;
+}
+
+
+static int post_signer(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  xmlDoc* doc = xmlCopyDoc(b->response, 1);
+  int res = doc != NULL && saml_signer_sign_doc(b->signer, doc, &DOC_OPTS) == 0 ? 0 : -1;
+  xmlFreeDoc(doc);
+  return res;
+}
+
+
+static int post_build(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  str_t xml;
+  if (saml_response_build(b->signer, &RESPONSE, &xml) != 0) {
+    return -1;
+  }
+  str_free(&xml);
+  return 0;
+}
+
+
+static int post_verify(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  return saml_verify_doc(b->mngr, b->signed_response, &DOC_OPTS) == 0 ? 0 : -1;
+}
+
+
+static xmlSecKey* load_key(const char* dir, const char* name, xmlSecKeyDataFormat format) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s%s", dir, name);
+  xmlSecKey* key = xmlSecCryptoAppKeyLoad(path, format, NULL, NULL, NULL);
+  if (key == NULL) {
+    fprintf(stderr, "could not load %s\n", path);
+  }
+  return key;
+}
+
+
+static int bench_init(bench_t* b, const alg_t* alg, const char* dir, xmlDoc* response) {
+  memset(b, 0, sizeof(bench_t));
+  char path[512];
+  snprintf(path, sizeof(path), "%s%s", dir, alg->cert_file);
+  b->key = load_key(dir, alg->key_file, xmlSecKeyDataFormatPem);
+  b->cert = load_key(dir, alg->cert_file, xmlSecKeyDataFormatCertPem);
+  b->transform_id = saml_find_transform(alg->href);
+  if (b->key == NULL || b->cert == NULL || xmlSecCryptoAppKeyCertLoad(b->key, path, xmlSecKeyDataFormatCertPem) < 0) {
+    return -1;
+  }
+  if (b->transform_id == NULL) {
+    fprintf(stderr, "unsupported algorithm %s\n", alg->href);
+    return -1;
+  }
+
+  b->mngr = xmlSecKeysMngrCreate();
+  xmlSecKey* copy = xmlSecKeyDuplicate(b->cert);
+  if (b->mngr == NULL || xmlSecCryptoAppDefaultKeysMngrInit(b->mngr) < 0 || copy == NULL
+      || xmlSecCryptoAppDefaultKeysMngrAdoptKey(b->mngr, copy) < 0) {
+    fprintf(stderr, "could not create keys manager for %s\n", alg->cert_file);
+    return -1;
+  }
+
+  b->response = response;
+  b->signed_response = xmlCopyDoc(response, 1);
+  if (saml_sign_binary_str(b->key, b->transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1, &b->sig) < 0
+      || b->signed_response == NULL || saml_sign_doc(b->key, b->transform_id, b->signed_response, &DOC_OPTS) != 0) {
+    fprintf(stderr, "could not sign with %s\n", alg->key_file);
+    return -1;
+  }
+
+  b->signer = saml_signer_create(b->key, b->transform_id, NULL);
+  if (b->signer == NULL) {
+    fprintf(stderr, "could not create signer for %s\n", alg->key_file);
+    return -1;
+  }
+  return 0;
+}
+
+
+static void bench_free(bench_t* b) {
+  if (b->key != NULL) {
+    xmlSecKeyDestroy(b->key);
+  }
+  if (b->cert != NULL) {
+    xmlSecKeyDestroy(b->cert);
+  }
+  if (b->mngr != NULL) {
+    xmlSecKeysMngrDestroy(b->mngr);
+  }
+  if (b->sig.data != NULL) {
+    str_free(&b->sig);
+  }
+  xmlFreeDoc(b->signed_response);
+  saml_signer_free(b->signer);
+}
+
+
+int main(int argc, char* argv[]) {
+  double seconds = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      default:
+        seconds = -1;
+        break;
+    }
+  }
+  if (argc - optind < 2 || seconds <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* test_data_dir = argv[optind + 1];
+
+  saml_init_opts_t opts = { .debug = getenv("SAML_DEBUG") != NULL, .data_dir = argv[optind], .lazy_schema = 1 };
+  if (saml_init(&opts) < 0) {
+    fprintf(stderr, "initialization failed\n");
+    return 1;
+  }
+
+  DOC_OPTS.insert_after_ns = (xmlChar*)SAML_XMLNS_ASSERTION;
+  char path[512];
+  snprintf(path, sizeof(path), "%sresponse.xml", test_data_dir);
+  xmlDoc* response = xmlReadFile(path, NULL, 0);
+  if (response == NULL) {
+    fprintf(stderr, "could not read %s\n", path);
+    return 1;
+  }
+
+  struct {
+    const char* binding;
+    const char* op;
+    op_t fn;
+  } rows[] = {
+    { "redirect", "sign", redirect_sign },
+    { "redirect", "verify", redirect_verify },
+    { "post", "sign", post_sign },
+    { "post", "signer", post_signer },
+    { "post", "build", post_build },
+    { "post", "verify", post_verify },
+  };
+
+  printf("%-12s %-9s %-7s %12s %10s\n", "key", "binding", "op", "ops/sec", "us/op");
+  int failed = 0;
+  for (int i = 0; i < sizeof(ALGS) / sizeof(ALGS[0]); i++) {
+    bench_t b;
+    if (bench_init(&b, ALGS + i, test_data_dir, response) < 0) {
+      printf("%-12s %s\n", ALGS[i].name, "failed");
+      bench_free(&b);
+      failed = 1;
+      continue;
+    }
+    for (int j = 0; j < sizeof(rows) / sizeof(rows[0]); j++) {
+      double rate = run(rows[j].fn, &b, seconds);
+      if (rate < 0) {
+        printf("%-12s %-9s %-7s %12s\n", ALGS[i].name, rows[j].binding, rows[j].op, "failed");
+        failed = 1;
+        continue;
+      }
+      printf("%-12s %-9s %-7s %12.0f %10.2f\n", ALGS[i].name, rows[j].binding, rows[j].op, rate, 1e6 / rate);
+    }
+    bench_free(&b);
+  }
+
+  xmlFreeDoc(response);
+  saml_shutdown();
+  return failed;
+}
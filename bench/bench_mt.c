@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/parser.h>
+#include <xmlsec/crypto.h>
+
+#include "saml.h"
+
+char* USAGE = "\
+Usage: bench_mt [options] data-dir test-data-dir\n\
+Options:\n\
+  -t threads     maximum number of threads, doubling from 1 (default: number of cores)\n\
+  -s seconds     duration of each run (default: 2)\n\
+  -w workloads   comma separated mix of redirect-create,post-parse,validate,verify,sign-doc,signer-sign\n\
+                 (default: all)\n\
+\n\
+Each thread cycles through the workloads using the files in test-data-dir.  Besides throughput and\n\
+latency, every workload reports how much of its wall time was spent on cpu and how many voluntary\n\
+context switches it made per op; a falling cpu/wall ratio or rising csw/op as threads are added\n\
+points at lock contention inside libxml2, xmlsec or openssl rather than a lack of cores.  sign-doc signs\n\
+with the one key every thread shares, signer-sign with a signer, which gives each thread its own copy.\n\
+Compare them in separate runs (-w sign-doc, then -w signer-sign): in one mix, every thread alternates\n\
+between them, so their ops/sec come out equal whichever is faster.\n\
+\n";
+
+#define SHA256_HREF "http://www.w3.org/2001/04/xmldsig-more#rsa-sha256"
+
+typedef enum {
+  WORKLOAD_REDIRECT_CREATE,
+  WORKLOAD_POST_PARSE,
+  WORKLOAD_VALIDATE,
+  WORKLOAD_VERIFY,
+  WORKLOAD_SIGN_DOC,
+  WORKLOAD_SIGNER_SIGN,
+  WORKLOAD_COUNT,
+} workload_t;
+
+static const char* WORKLOAD_NAMES[] = { "redirect-create", "post-parse", "validate", "verify", "sign-doc", "signer-sign" };
+
+#define MIX_MAX 32
+
+typedef struct {
+  double* samples;
+  long len, total;
+  double cpu;
+  long csw;
+} stats_t;
+
+typedef struct {
+  // shared, read-only
+  int* mix;
+  int mix_len;
+  double seconds;
+  xmlSecKey* key;
+  xmlSecKeysMngr* mngr;
+  saml_signer_t* signer;
+  char* authn_request;
+  char* response;
+  xmlDoc* response_doc;
+  xmlDoc* unsigned_doc;
+
+  // per thread
+  long errors;
+  stats_t stats[WORKLOAD_COUNT];
+} worker_t;
+
+
+static double now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static long voluntary_csw() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_nvcsw;
+}
+
+
+static void stats_add(stats_t* s, double sample) {
+  if (s->len == s->total) {
+    s->total = s->total == 0 ? 1024 : 2 * s->total;
+    s->samples = realloc(s->samples, s->total * sizeof(double));
+  }
+  s->samples[s->len++] = sample;
+}
+
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+
+static double percentile(stats_t* s, double p) {
+  if (s->len == 0) {
+    return 0;
+  }
+  long i = (long)(p * (s->len - 1));
+  return s->samples[i];
+}
+
+
+static char* read_file(const char* dir, const char* name) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s%s", dir, name);
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* buf = malloc(len + 1);
+  if (fread(buf, 1, len, f) != len) {
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+    len--;
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+
+static int run_workload(worker_t* w, workload_t workload, xmlDoc* doc) {
+  str_t query;
+  xmlDoc* parsed = NULL;
+  saml_doc_opts_t sign_opts = { .id_attr = (xmlChar*)"ID", .insert_after_ns = (xmlChar*)SAML_XMLNS_ASSERTION, .insert_after_el = (xmlChar*)"Issuer" };
+  int ok = 0;
+  switch (workload) {
+    case WORKLOAD_REDIRECT_CREATE:
+      ok = saml_binding_redirect_create(w->key, "SAMLRequest", w->authn_request, SHA256_HREF, "/", &query) == SAML_OK;
+      if (ok) {
+        str_free(&query);
+      }
+      break;
+    case WORKLOAD_POST_PARSE:
+      ok = saml_binding_post_parse(w->response, &parsed) == SAML_OK;
+      if (parsed != NULL) {
+        xmlFreeDoc(parsed);
+      }
+      break;
+    case WORKLOAD_VALIDATE:
+      ok = saml_doc_validate(doc);
+      break;
+    case WORKLOAD_VERIFY:
+      ok = saml_binding_post_verify(w->mngr, doc) == SAML_OK;
+      break;
+    case WORKLOAD_SIGN_DOC:
+    case WORKLOAD_SIGNER_SIGN:
+      parsed = xmlCopyDoc(w->unsigned_doc, 1);
+      ok = parsed != NULL && (workload == WORKLOAD_SIGN_DOC
+        ? saml_sign_doc(w->key, xmlSecTransformRsaSha256Id, parsed, &sign_opts)
+        : saml_signer_sign_doc(w->signer, parsed, &sign_opts)) == 0;
+      if (parsed != NULL) {
+        xmlFreeDoc(parsed);
+      }
+      break;
+    default:
+      break;
+  }
+  return ok;
+}
+
+
+static void* work(void* arg) {
+  worker_t* w = (worker_t*)arg;
+  // libxml2 documents are not safe to share, so every thread validates and verifies its own copy
+  xmlDoc* doc = xmlCopyDoc(w->response_doc, 1);
+
+  double stop = now(CLOCK_MONOTONIC) + w->seconds;
+  for (long i = 0; now(CLOCK_MONOTONIC) < stop; i++) {
+    workload_t workload = w->mix[i % w->mix_len];
+    stats_t* s = w->stats + workload;
+
+    long csw = voluntary_csw();
+    double cpu = now(CLOCK_THREAD_CPUTIME_ID);
+    double start = now(CLOCK_MONOTONIC);
+    if (!run_workload(w, workload, doc)) {
+      w->errors++;
+    }
+    stats_add(s, now(CLOCK_MONOTONIC) - start);
+    s->cpu += now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    s->csw += voluntary_csw() - csw;
+  }
+
+  xmlFreeDoc(doc);
+  saml_thread_cleanup();
+  return NULL;
+}
+
+
+// Merge the per-thread samples into totals, returning the overall ops/sec
+static double run(int num_threads, worker_t* tmpl, stats_t* totals, long* errors) {
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  worker_t* workers = calloc(num_threads, sizeof(worker_t));
+  for (int i = 0; i < num_threads; i++) {
+    workers[i] = *tmpl;
+    pthread_create(threads + i, NULL, work, workers + i);
+  }
+
+  memset(totals, 0, WORKLOAD_COUNT * sizeof(stats_t));
+  *errors = 0;
+  long ops = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+    *errors += workers[i].errors;
+    for (int j = 0; j < WORKLOAD_COUNT; j++) {
+      stats_t* s = workers[i].stats + j;
+      for (long k = 0; k < s->len; k++) {
+        stats_add(totals + j, s->samples[k]);
+      }
+      totals[j].cpu += s->cpu;
+      totals[j].csw += s->csw;
+      ops += s->len;
+      free(s->samples);
+    }
+  }
+
+  for (int j = 0; j < WORKLOAD_COUNT; j++) {
+    qsort(totals[j].samples, totals[j].len, sizeof(double), cmp_double);
+  }
+  free(threads);
+  free(workers);
+  return ops / tmpl->seconds;
+}
+
+
+// Workloads may be repeated to weight the mix, e.g. verify,verify,redirect-create
+static int parse_mix(char* arg, int* mix) {
+  int len = 0;
+  for (char* name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+    int i = 0;
+    while (i < WORKLOAD_COUNT && strcmp(name, WORKLOAD_NAMES[i]) != 0) {
+      i++;
+    }
+    if (i == WORKLOAD_COUNT || len == MIX_MAX) {
+      return -1;
+    }
+    mix[len++] = i;
+  }
+  return len;
+}
+
+
+int main(int argc, char* argv[]) {
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  double seconds = 2;
+  int mix[MIX_MAX] = { WORKLOAD_REDIRECT_CREATE, WORKLOAD_POST_PARSE, WORKLOAD_VALIDATE, WORKLOAD_VERIFY, WORKLOAD_SIGN_DOC, WORKLOAD_SIGNER_SIGN };
+  int mix_len = WORKLOAD_COUNT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:w:")) != -1) {
+    switch (opt) {
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'w':
+        mix_len = parse_mix(optarg, mix);
+        break;
+      default:
+        mix_len = -1;
+        break;
+    }
+  }
+  if (argc - optind < 2 || max_threads < 1 || seconds <= 0 || mix_len <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* data_dir = argv[optind];
+  char* test_data_dir = argv[optind + 1];
+
+  saml_init_opts_t opts = { .debug = getenv("SAML_DEBUG") != NULL, .data_dir = data_dir, .lazy_schema = 0 };
+  if (saml_init(&opts) < 0) {
+    fprintf(stderr, "initialization failed\n");
+    return 1;
+  }
+
+  char key_file[512], cert_file[512];
+  snprintf(key_file, sizeof(key_file), "%ssp.key", test_data_dir);
+  snprintf(cert_file, sizeof(cert_file), "%ssp.crt", test_data_dir);
+  xmlSecKey* key = xmlSecCryptoAppKeyLoad(key_file, xmlSecKeyDataFormatPem, NULL, NULL, NULL);
+  xmlSecKey* cert = xmlSecCryptoAppKeyLoad(cert_file, xmlSecKeyDataFormatCertPem, NULL, NULL, NULL);
+  if (key == NULL || cert == NULL) {
+    fprintf(stderr, "could not load %s or %s\n", key_file, cert_file);
+    return 1;
+  }
+
+  xmlSecKeysMngr* mngr = xmlSecKeysMngrCreate();
+  if (mngr == NULL || xmlSecCryptoAppDefaultKeysMngrInit(mngr) < 0 || xmlSecCryptoAppDefaultKeysMngrAdoptKey(mngr, cert) < 0) {
+    fprintf(stderr, "could not create keys manager\n");
+    return 1;
+  }
+
+  worker_t tmpl = {
+    .mix = mix,
+    .mix_len = mix_len,
+    .seconds = seconds,
+    .key = key,
+    .mngr = mngr,
+    .signer = saml_signer_create(key, xmlSecTransformRsaSha256Id, NULL),
+    .authn_request = read_file(test_data_dir, "authn_request.xml"),
+    .response = read_file(test_data_dir, "response-signed.xml.b64"),
+  };
+  char* unsigned_response = read_file(test_data_dir, "response.xml");
+  if (tmpl.authn_request == NULL || tmpl.response == NULL || saml_binding_post_parse(tmpl.response, &tmpl.response_doc) != SAML_OK
+      || unsigned_response == NULL || (tmpl.unsigned_doc = xmlReadMemory(unsigned_response, strlen(unsigned_response), NULL, NULL, 0)) == NULL) {
+    fprintf(stderr, "could not read authn_request.xml, response-signed.xml.b64 or response.xml\n");
+    return 1;
+  }
+  if (tmpl.signer == NULL) {
+    fprintf(stderr, "could not create signer\n");
+    return 1;
+  }
+
+  printf("%7s %-16s %10s %10s %10s %9s %8s %8s\n", "threads", "workload", "ops/sec", "p50 (us)", "p99 (us)", "cpu/wall", "csw/op", "errors");
+  double base = 0;
+  int failed = 0;
+  stats_t totals[WORKLOAD_COUNT];
+  // Doubles from 1, ending on max_threads itself when it is not a power of two
+  for (int n = 1; n <= max_threads; n = n < max_threads && n * 2 > max_threads ? max_threads : n * 2) {
+    long errors;
+    double ops = run(n, &tmpl, totals, &errors);
+    if (n == 1) {
+      base = ops;
+    }
+
+    for (int j = 0; j < WORKLOAD_COUNT; j++) {
+      stats_t* s = totals + j;
+      if (s->len == 0) {
+        continue;
+      }
+      double wall = 0;
+      for (long k = 0; k < s->len; k++) {
+        wall += s->samples[k];
+      }
+      printf("%7d %-16s %10.1f %10.1f %10.1f %9.2f %8.3f\n", n, WORKLOAD_NAMES[j], s->len / seconds,
+             percentile(s, 0.5) * 1e6, percentile(s, 0.99) * 1e6, s->cpu / wall, (double)s->csw / s->len);
+      free(s->samples);
+    }
+    printf("%7d %-16s %10.1f %32s %8ld  efficiency %.0f%%\n\n", n, "total", ops, "", errors, 100 * ops / (n * base));
+
+    failed = failed || errors > 0;
+  }
+
+  xmlFreeDoc(tmpl.response_doc);
+  xmlFreeDoc(tmpl.unsigned_doc);
+  free(unsigned_response);
+  saml_signer_free(tmpl.signer);
+  free(tmpl.authn_request);
+  free(tmpl.response);
+  xmlSecKeyDestroy(key);
+  xmlSecKeysMngrDestroy(mngr);
+  saml_shutdown();
+  return failed;
+}
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <xmlsec/crypto.h>
+#include <xmlsec/xmltree.h>
+
+#include "saml.h"
+
+char* USAGE = "\
+Usage: bench_post [options] data-dir test-data-dir\n\
+Options:\n\
+  -s seconds     duration of each run (default: 1)\n\
+\n\
+Creates POST bindings from response.xml signed with sp.key, with the AttributeStatement grown to make larger\n\
+responses.  The buffered rows serialize the signed document with xmlDocDumpMemory, base64-encode it and copy\n\
+that into the form, as saml_binding_post_create used to; the streamed rows call saml_binding_post_create_doc.\n\
+Both sign a fresh copy of the document each time, and the sign rows do only that.  The peak column is the\n\
+most heap held at once on top of that copy, so the difference from the sign row is what building the form costs.\n\
+\n";
+
+static const int ATTRIBUTES[] = { 0, 256, 4096, 16384 };
+
+typedef struct {
+  xmlSecKey* key;
+  xmlSecTransformId transform_id;
+  xmlDoc* doc;
+} bench_t;
+
+// Heap accounting for the whole process, by interposing the allocator.  The bench is single threaded.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void __libc_free(void* p);
+
+static size_t heap_used, heap_peak;
+
+static void* heap_count(void* p) {
+  if (p != NULL) {
+    heap_used += malloc_usable_size(p);
+    if (heap_used > heap_peak) {
+      heap_peak = heap_used;
+    }
+  }
+  return p;
+}
+
+void* malloc(size_t size) {
+  return heap_count(__libc_malloc(size));
+}
+
+void* calloc(size_t n, size_t size) {
+  return heap_count(__libc_calloc(n, size));
+}
+
+void* realloc(void* p, size_t size) {
+  if (p != NULL) {
+    heap_used -= malloc_usable_size(p);
+  }
+  return heap_count(__libc_realloc(p, size));
+}
+
+void free(void* p) {
+  if (p != NULL) {
+    heap_used -= malloc_usable_size(p);
+  }
+  __libc_free(p);
+}
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Returns ops per second, or -1 if the op failed.  Each op gets its own copy of the unsigned document, which is
+// neither timed nor counted.  *peak is the most heap any one op held on top of it.
+static double run(int (*op)(bench_t*, xmlDoc*), bench_t* b, double seconds, size_t* peak) {
+  long n = 0;
+  double elapsed = 0, start, end = now(), stop = end + seconds;
+  *peak = 0;
+  do {
+    xmlDoc* doc = xmlCopyDoc(b->doc, 1);
+    if (doc == NULL) {
+      return -1;
+    }
+    size_t before = heap_used;
+    heap_peak = heap_used;
+    start = now();
+    int res = op(b, doc);
+    end = now();
+    elapsed += end - start;
+    if (heap_peak - before > *peak) {
+      *peak = heap_peak - before;
+    }
+    xmlFreeDoc(doc);
+    if (res < 0) {
+      return -1;
+    }
+    n++;
+  } while (end < stop);
+  return n / elapsed;
+}
+
+
+static int sign(bench_t* b, xmlDoc* doc) {
+  saml_doc_opts_t opts = { .id_attr = (xmlChar*)"ID", .insert_after_ns = (xmlChar*)SAML_XMLNS_ASSERTION, .insert_after_el = (xmlChar*)"Issuer" };
+  return saml_sign_doc(b->key, b->transform_id, doc, &opts) == 0 ? 0 : -1;
+}
+
+
+static int buffered(bench_t* b, xmlDoc* doc) {
+  if (sign(b, doc) < 0) {
+    return -1;
+  }
+
+  xmlChar* buf;
+  int buf_len;
+  xmlDocDumpMemory(doc, &buf, &buf_len);
+  char* encoded = saml_base64_encode(buf, buf_len);
+  xmlFree(buf);
+
+  str_t html;
+  str_init(&html, 1024);
+  str_cat(&html, encoded, strlen(encoded));
+  free(encoded);
+  str_free(&html);
+  return 0;
+}
+
+
+static int streamed(bench_t* b, xmlDoc* doc) {
+  str_t html;
+  int res = saml_binding_post_create_doc(b->key, "SAMLResponse", doc, "http://www.w3.org/2001/04/xmldsig-more#rsa-sha256", "/", "https://sp.example.com/acs", &html);
+  if (res != SAML_OK) {
+    return -1;
+  }
+  str_free(&html);
+  return 0;
+}
+
+
+// Appends copies of the first Attribute to its AttributeStatement
+static int grow(xmlDoc* doc, int n) {
+  xmlNode* statement = xmlSecFindNode(xmlDocGetRootElement(doc), (xmlChar*)"AttributeStatement", (xmlChar*)SAML_XMLNS_ASSERTION);
+  xmlNode* attribute = statement == NULL ? NULL : xmlSecFindChild(statement, (xmlChar*)"Attribute", (xmlChar*)SAML_XMLNS_ASSERTION);
+  if (attribute == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    xmlNode* copy = xmlDocCopyNode(attribute, doc, 1);
+    if (copy == NULL || xmlAddChild(statement, copy) == NULL) {
+      xmlFreeNode(copy);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+  double seconds = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      default:
+        seconds = -1;
+        break;
+    }
+  }
+  if (argc - optind < 2 || seconds <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* test_data_dir = argv[optind + 1];
+
+  saml_init_opts_t opts = { .debug = getenv("SAML_DEBUG") != NULL, .data_dir = argv[optind], .lazy_schema = 1 };
+  if (saml_init(&opts) < 0) {
+    fprintf(stderr, "initialization failed\n");
+    return 1;
+  }
+
+  bench_t b;
+  memset(&b, 0, sizeof(bench_t));
+  b.transform_id = saml_find_transform("http://www.w3.org/2001/04/xmldsig-more#rsa-sha256");
+
+  char path[512];
+  snprintf(path, sizeof(path), "%ssp.key", test_data_dir);
+  b.key = xmlSecCryptoAppKeyLoad(path, xmlSecKeyDataFormatPem, NULL, NULL, NULL);
+  if (b.key == NULL) {
+    fprintf(stderr, "could not load %s\n", path);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%sresponse.xml", test_data_dir);
+  xmlDoc* response = xmlReadFile(path, NULL, 0);
+  if (response == NULL) {
+    fprintf(stderr, "could not read %s\n", path);
+    return 1;
+  }
+
+  printf("%-10s %-9s %10s %10s %12s\n", "attributes", "mode", "bytes", "ops/s", "peak KB");
+  int failed = 0;
+  for (int i = 0; i < sizeof(ATTRIBUTES) / sizeof(ATTRIBUTES[0]); i++) {
+    b.doc = xmlCopyDoc(response, 1);
+    if (b.doc == NULL || grow(b.doc, ATTRIBUTES[i]) < 0) {
+      printf("%-10d %s\n", ATTRIBUTES[i], "failed");
+      xmlFreeDoc(b.doc);
+      failed = 1;
+      continue;
+    }
+    xmlChar* buf;
+    int buf_len;
+    xmlDocDumpMemory(b.doc, &buf, &buf_len);
+    xmlFree(buf);
+
+    struct { const char* name; int (*op)(bench_t*, xmlDoc*); } modes[] = { { "sign", sign }, { "buffered", buffered }, { "streamed", streamed } };
+    for (int j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+      size_t peak;
+      double ops = run(modes[j].op, &b, seconds, &peak);
+      if (ops < 0) {
+        printf("%-10d %-9s %10s\n", ATTRIBUTES[i], modes[j].name, "failed");
+        failed = 1;
+        continue;
+      }
+      printf("%-10d %-9s %10d %10.0f %12zu\n", ATTRIBUTES[i], modes[j].name, buf_len, ops, peak / 1024);
+    }
+    xmlFreeDoc(b.doc);
+  }
+
+  xmlFreeDoc(response);
+  xmlSecKeyDestroy(b.key);
+  saml_shutdown();
+  return failed;
+}
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <xmlsec/crypto.h>
+#include <xmlsec/openssl/evp.h>
+
+#include "saml.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#  define EVP_MD_CTX_new EVP_MD_CTX_create
+#  define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+char* USAGE = "\
+Usage: bench_sig [options] data-dir test-data-dir\n\
+Options:\n\
+  -s seconds     duration of each run (default: 1)\n\
+  -a href        signature algorithm (default: rsa-sha256)\n\
+  -k file        private key, relative to test-data-dir (default: sp.key)\n\
+  -c file        certificate, relative to test-data-dir (default: sp.crt)\n\
+\n\
+Signs and verifies the query string of a redirect binding.  The openssl rows call EVP_DigestSign* and\n\
+EVP_DigestVerify* directly and are the cost of the math alone; the overhead column is how much each\n\
+path adds on top of that.  xmlsec builds a transform context per call, native is the library's own\n\
+path, which uses a prepared EVP_PKEY_CTX for RSA and ECDSA keys.  sp-rsa3072.key/crt and\n\
+sp-ec-p256.key/crt are there to compare key types, e.g.\n\
+  bench_sig -k sp-ec-p256.key -c sp-ec-p256.crt -a http://www.w3.org/2001/04/xmldsig-more#ecdsa-sha256 ...\n\
+\n";
+
+#define QUERY "SAMLRequest=fVNNr9MwELz3V1i%2BN3Hy%2BkGtNqi0fFQqbdQEDlyQsTfUUmwH23mv%2FHuc0KIgQU6W7JnZmd312jFVN3Tb&RelayState=%2F&SigAlg=http%3A%2F%2Fwww.w3.org%2F2001%2F04%2Fxmldsig-more%23rsa-sha256"
+
+typedef int (*op_t)(void* arg);
+
+typedef struct {
+  xmlSecKey* key;
+  xmlSecKey* cert;
+  xmlSecTransformId transform_id;
+  const EVP_MD* md;
+  // OpenSSL's ECDSA signatures are DER, XML DSig's are r || s, so each side verifies its own
+  unsigned char der[1024];
+  size_t der_len;
+  unsigned char sig[1024];
+  size_t sig_len;
+} bench_t;
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Returns microseconds per op, or -1 if the op failed
+static double run(op_t op, void* arg, double seconds) {
+  long n = 0;
+  double start = now(), stop = start + seconds, end;
+  do {
+    for (int i = 0; i < 16; i++, n++) {
+      if (op(arg) < 0) {
+        return -1;
+      }
+    }
+    end = now();
+  } while (end < stop);
+  return (end - start) * 1e6 / n;
+}
+
+
+static EVP_PKEY* evp_pkey(xmlSecKey* key) {
+  return xmlSecOpenSSLEvpKeyDataGetEvp(xmlSecKeyGetValue(key));
+}
+
+
+static int openssl_sign(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  b->der_len = sizeof(b->der);
+  int ok = EVP_DigestSignInit(ctx, NULL, b->md, NULL, evp_pkey(b->key)) == 1
+    && EVP_DigestSignUpdate(ctx, QUERY, sizeof(QUERY) - 1) == 1
+    && EVP_DigestSignFinal(ctx, b->der, &b->der_len) == 1;
+  EVP_MD_CTX_free(ctx);
+  return ok ? 0 : -1;
+}
+
+
+static int openssl_verify(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  int ok = EVP_DigestVerifyInit(ctx, NULL, b->md, NULL, evp_pkey(b->cert)) == 1
+    && EVP_DigestVerifyUpdate(ctx, QUERY, sizeof(QUERY) - 1) == 1
+    && EVP_DigestVerifyFinal(ctx, b->der, b->der_len) == 1;
+  EVP_MD_CTX_free(ctx);
+  return ok ? 0 : -1;
+}
+
+
+static int xmlsec_sign(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  xmlSecTransformCtx* ctx = saml_sign_binary(b->key, b->transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1);
+  if (ctx == NULL) {
+    return -1;
+  }
+  xmlSecTransformCtxDestroy(ctx);
+  return 0;
+}
+
+
+static int native_sign(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  str_t sig;
+  if (saml_sign_binary_str(b->key, b->transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1, &sig) < 0) {
+    return -1;
+  }
+  str_free(&sig);
+  return 0;
+}
+
+
+// What saml_verify_binary does for algorithms it has no native path for
+static int xmlsec_verify(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  xmlSecTransformCtx* ctx = xmlSecTransformCtxCreate();
+  if (ctx == NULL || xmlSecPtrListAdd(&ctx->enabledTransforms, (void*)b->transform_id) < 0) {
+    return -1;
+  }
+  xmlSecTransform* transform = xmlSecTransformCtxCreateAndAppend(ctx, b->transform_id);
+  int res = -1;
+  if (transform != NULL) {
+    transform->operation = xmlSecTransformOperationVerify;
+    if (xmlSecTransformSetKey(transform, b->cert) == 0
+        && xmlSecTransformCtxBinaryExecute(ctx, (unsigned char*)QUERY, sizeof(QUERY) - 1) == 0
+        && xmlSecTransformVerify(transform, b->sig, b->sig_len, ctx) == 0) {
+      res = transform->status == xmlSecTransformStatusOk ? 0 : -1;
+    }
+  }
+  xmlSecTransformCtxDestroy(ctx);
+  return res;
+}
+
+
+static int native_verify(void* arg) {
+  bench_t* b = (bench_t*)arg;
+  return saml_verify_binary(b->cert, b->transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1, b->sig, b->sig_len) == 0 ? 0 : -1;
+}
+
+
+static xmlSecKey* load_key(const char* dir, const char* name, xmlSecKeyDataFormat format) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s%s", dir, name);
+  xmlSecKey* key = xmlSecCryptoAppKeyLoad(path, format, NULL, NULL, NULL);
+  if (key == NULL) {
+    fprintf(stderr, "could not load %s\n", path);
+  }
+  return key;
+}
+
+
+int main(int argc, char* argv[]) {
+  double seconds = 1;
+  char* href = "http://www.w3.org/2001/04/xmldsig-more#rsa-sha256";
+  char* key_file = "sp.key";
+  char* cert_file = "sp.crt";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:a:k:c:")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'a':
+        href = optarg;
+        break;
+      case 'k':
+        key_file = optarg;
+        break;
+      case 'c':
+        cert_file = optarg;
+        break;
+      default:
+        seconds = -1;
+        break;
+    }
+  }
+  if (argc - optind < 2 || seconds <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* test_data_dir = argv[optind + 1];
+
+  saml_init_opts_t opts = { .debug = getenv("SAML_DEBUG") != NULL, .data_dir = argv[optind], .lazy_schema = 1 };
+  if (saml_init(&opts) < 0) {
+    fprintf(stderr, "initialization failed\n");
+    return 1;
+  }
+
+  bench_t b = {
+    .key = load_key(test_data_dir, key_file, xmlSecKeyDataFormatPem),
+    .cert = load_key(test_data_dir, cert_file, xmlSecKeyDataFormatCertPem),
+    .transform_id = saml_find_transform(href),
+  };
+  if (b.key == NULL || b.cert == NULL) {
+    return 1;
+  }
+  if (b.transform_id == NULL || (b.md = EVP_get_digestbyname(strrchr(href, '-') + 1)) == NULL) {
+    fprintf(stderr, "unsupported algorithm %s\n", href);
+    return 1;
+  }
+  xmlSecTransformCtx* ctx = saml_sign_binary(b.key, b.transform_id, (unsigned char*)QUERY, sizeof(QUERY) - 1);
+  if (openssl_sign(&b) < 0 || ctx == NULL || xmlSecBufferGetSize(ctx->result) > sizeof(b.sig)) {
+    fprintf(stderr, "could not sign with %s\n", key_file);
+    return 1;
+  }
+  b.sig_len = xmlSecBufferGetSize(ctx->result);
+  memcpy(b.sig, xmlSecBufferGetData(ctx->result), b.sig_len);
+  xmlSecTransformCtxDestroy(ctx);
+
+  struct {
+    const char* op;
+    const char* path;
+    op_t fn;
+  } rows[] = {
+    { "sign", "openssl", openssl_sign },
+    { "sign", "xmlsec", xmlsec_sign },
+    { "sign", "native", native_sign },
+    { "verify", "openssl", openssl_verify },
+    { "verify", "xmlsec", xmlsec_verify },
+    { "verify", "native", native_verify },
+  };
+
+  printf("%s, %d bit key\n", href, EVP_PKEY_bits(evp_pkey(b.key)));
+  printf("%-7s %-8s %10s %10s %14s\n", "op", "path", "ops/sec", "us/op", "overhead (us)");
+  double base = 0;
+  int failed = 0;
+  for (int i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+    double us = run(rows[i].fn, &b, seconds);
+    if (us < 0) {
+      printf("%-7s %-8s %10s\n", rows[i].op, rows[i].path, "failed");
+      failed = 1;
+      continue;
+    }
+    if (strcmp(rows[i].path, "openssl") == 0) {
+      base = us;
+    }
+    printf("%-7s %-8s %10.0f %10.2f %14.2f\n", rows[i].op, rows[i].path, 1e6 / us, us, us - base);
+  }
+
+  xmlSecKeyDestroy(b.key);
+  xmlSecKeyDestroy(b.cert);
+  saml_shutdown();
+  return failed;
+}
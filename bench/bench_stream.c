@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <xmlsec/crypto.h>
+#include <xmlsec/xmltree.h>
+
+#include "saml.h"
+
+char* USAGE = "\
+Usage: bench_stream [options] data-dir test-data-dir\n\
+Options:\n\
+  -s seconds     duration of each run (default: 1)\n\
+\n\
+Signs response.xml with sp.key, with the AttributeStatement grown to make larger assertions, and verifies\n\
+it with sp.crt both ways: parsing the document and passing it to saml_verify_doc, and with saml_verify_xml,\n\
+which digests the document as it is parsed.  The summary column also reads the Issuer, NameID and\n\
+attributes, from the tree in the first case.  Every run includes the RSA signature check.\n\
+\n";
+
+static const int ATTRIBUTES[] = { 0, 16, 256, 4096 };
+
+typedef struct {
+  xmlSecKeysMngr* mngr;
+  saml_doc_opts_t opts;
+  xmlChar* xml;
+  int xml_len;
+} bench_t;
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Returns ops per second, or -1 if the op failed
+static double run(int (*op)(bench_t*), bench_t* b, double seconds) {
+  long n = 0;
+  double start = now(), stop = start + seconds, end;
+  do {
+    for (int i = 0; i < 4; i++, n++) {
+      if (op(b) < 0) {
+        return -1;
+      }
+    }
+    end = now();
+  } while (end < stop);
+  return n / (end - start);
+}
+
+
+static int parse_verify(bench_t* b) {
+  xmlDoc* doc = xmlReadMemory((char*)b->xml, b->xml_len, "tmp.xml", NULL, 0);
+  int res = doc != NULL && saml_verify_doc(b->mngr, doc, &b->opts) == 0 ? 0 : -1;
+  xmlFreeDoc(doc);
+  return res;
+}
+
+
+static int parse_verify_summary(bench_t* b) {
+  xmlDoc* doc = xmlReadMemory((char*)b->xml, b->xml_len, "tmp.xml", NULL, 0);
+  int res = doc != NULL && saml_verify_doc(b->mngr, doc, &b->opts) == 0 ? 0 : -1;
+  if (res == 0) {
+    xmlFree(saml_doc_issuer(doc));
+    xmlFree(saml_doc_name_id(doc));
+    saml_attr_t* attrs;
+    size_t attrs_len;
+    if (saml_doc_attrs(doc, &attrs, &attrs_len) == 0) {
+      saml_attrs_free(attrs, attrs_len);
+    }
+  }
+  xmlFreeDoc(doc);
+  return res;
+}
+
+
+static int verify_xml(bench_t* b) {
+  return saml_verify_xml(b->mngr, (char*)b->xml, b->xml_len, &b->opts, NULL) == 0 ? 0 : -1;
+}
+
+
+static int verify_xml_summary(bench_t* b) {
+  saml_summary_t summary;
+  if (saml_verify_xml(b->mngr, (char*)b->xml, b->xml_len, &b->opts, &summary) != 0 || !summary.streamed) {
+    return -1;
+  }
+  saml_summary_free(&summary);
+  return 0;
+}
+
+
+// Appends copies of the first Attribute to its AttributeStatement
+static int grow(xmlDoc* doc, int n) {
+  xmlNode* statement = xmlSecFindNode(xmlDocGetRootElement(doc), (xmlChar*)"AttributeStatement", (xmlChar*)SAML_XMLNS_ASSERTION);
+  xmlNode* attribute = statement == NULL ? NULL : xmlSecFindChild(statement, (xmlChar*)"Attribute", (xmlChar*)SAML_XMLNS_ASSERTION);
+  if (attribute == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    xmlNode* copy = xmlDocCopyNode(attribute, doc, 1);
+    if (copy == NULL || xmlAddChild(statement, copy) == NULL) {
+      xmlFreeNode(copy);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+  double seconds = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      default:
+        seconds = -1;
+        break;
+    }
+  }
+  if (argc - optind < 2 || seconds <= 0) {
+    fprintf(stderr, "%s", USAGE);
+    return 1;
+  }
+  char* test_data_dir = argv[optind + 1];
+
+  saml_init_opts_t opts = { .debug = getenv("SAML_DEBUG") != NULL, .data_dir = argv[optind], .lazy_schema = 1 };
+  if (saml_init(&opts) < 0) {
+    fprintf(stderr, "initialization failed\n");
+    return 1;
+  }
+
+  bench_t b;
+  memset(&b, 0, sizeof(bench_t));
+  b.opts.id_attr = (xmlChar*)"ID";
+  b.opts.insert_after_ns = (xmlChar*)SAML_XMLNS_ASSERTION;
+  b.opts.insert_after_el = (xmlChar*)"Issuer";
+  xmlSecTransformId transform_id = saml_find_transform("http://www.w3.org/2001/04/xmldsig-more#rsa-sha256");
+
+  char path[512];
+  snprintf(path, sizeof(path), "%ssp.key", test_data_dir);
+  xmlSecKey* key = xmlSecCryptoAppKeyLoad(path, xmlSecKeyDataFormatPem, NULL, NULL, NULL);
+  snprintf(path, sizeof(path), "%ssp.crt", test_data_dir);
+  xmlSecKey* cert = xmlSecCryptoAppKeyLoad(path, xmlSecKeyDataFormatCertPem, NULL, NULL, NULL);
+  b.mngr = xmlSecKeysMngrCreate();
+  if (key == NULL || cert == NULL || b.mngr == NULL || xmlSecCryptoAppDefaultKeysMngrInit(b.mngr) < 0
+      || xmlSecCryptoAppDefaultKeysMngrAdoptKey(b.mngr, cert) < 0) {
+    fprintf(stderr, "could not load keys from %s\n", test_data_dir);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%sresponse.xml", test_data_dir);
+  xmlDoc* response = xmlReadFile(path, NULL, 0);
+  if (response == NULL) {
+    fprintf(stderr, "could not read %s\n", path);
+    return 1;
+  }
+
+  printf("%-10s %10s %-8s %12s %12s %8s\n", "attributes", "bytes", "summary", "verify_doc/s", "verify_xml/s", "speedup");
+  int failed = 0;
+  for (int i = 0; i < sizeof(ATTRIBUTES) / sizeof(ATTRIBUTES[0]); i++) {
+    xmlDoc* doc = xmlCopyDoc(response, 1);
+    if (doc == NULL || grow(doc, ATTRIBUTES[i]) < 0 || saml_sign_doc(key, transform_id, doc, &b.opts) != 0) {
+      printf("%-10d %s\n", ATTRIBUTES[i], "failed");
+      xmlFreeDoc(doc);
+      failed = 1;
+      continue;
+    }
+    xmlDocDumpMemory(doc, &b.xml, &b.xml_len);
+    xmlFreeDoc(doc);
+
+    for (int summary = 0; summary < 2; summary++) {
+      double docs = run(summary ? parse_verify_summary : parse_verify, &b, seconds);
+      double streams = run(summary ? verify_xml_summary : verify_xml, &b, seconds);
+      if (docs < 0 || streams < 0) {
+        printf("%-10d %10d %-8s %12s\n", ATTRIBUTES[i], b.xml_len, summary ? "yes" : "no", "failed");
+        failed = 1;
+        continue;
+      }
+      printf("%-10d %10d %-8s %12.0f %12.0f %7.2fx\n", ATTRIBUTES[i], b.xml_len, summary ? "yes" : "no", docs, streams, streams / docs);
+    }
+    xmlFree(b.xml);
+  }
+
+  xmlFreeDoc(response);
+  xmlSecKeyDestroy(key);
+  xmlSecKeysMngrDestroy(b.mngr);
+  saml_shutdown();
+  return failed;
+}
@@ -356,7 +356,7 @@ int main(int argc, char* argv[]) {
 
   char* debug = getenv("SAML_DEBUG");
 
-  saml_init_opts_t opts = (saml_init_opts_t){ .debug = debug != NULL, .data_dir = data_dir };
+  saml_init_opts_t opts = (saml_init_opts_t){ .debug = debug != NULL, .data_dir = data_dir, .lazy_schema = 0 };
   if (saml_init(&opts) < 0) {
     fprintf(stderr, "initialization failed\n");
     return 1;
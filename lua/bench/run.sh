@@ -0,0 +1,38 @@
+#!/bin/bash
+# Usage: run.sh [seconds] [connections]
+#
+# Keeps the nginx worker busy signing or verifying POST bindings, inline and on the thread pool, while a
+# second client measures the latency of /health on the same worker.  With the crypto inline, every health
+# check queues behind whatever signatures the worker is in the middle of; on the pool it should not.
+#
+# Needs wrk and an OpenResty with ngx.run_worker_thread (1.21.4 or later) that has the rock installed.
+set -e
+
+DURATION=${1:-30}
+CONNECTIONS=${2:-32}
+HERE=$(cd "$(dirname "$0")" && pwd)
+URL=http://127.0.0.1:8090
+
+: ${DATA_DIR:?DATA_DIR must point at the installed rock data}
+export TEST_DATA_DIR=${TEST_DATA_DIR:-$HERE/../../test-data/}
+
+mkdir -p /tmp/saml-bench/logs
+openresty -p /tmp/saml-bench -c "$HERE/nginx.conf" -g "daemon off; pid /tmp/saml-bench/nginx.pid;" &
+NGINX=$!
+trap 'kill $NGINX' EXIT
+sleep 1
+
+printf "%-16s %12s %12s %12s %14s\n" "load" "health p50" "health p99" "health max" "load req/sec"
+for load in sign/inline sign/thread verify/inline verify/thread; do
+  # The load starts first and stops last, so every health check sees it
+  wrk -t 2 -c "$CONNECTIONS" -d "$((DURATION + 2))s" "$URL/$load" > /tmp/saml-bench-load.txt &
+  LOAD=$!
+  sleep 1
+  health=$(wrk -t 1 -c 4 -d "${DURATION}s" --latency "$URL/health")
+  wait $LOAD
+  p50=$(echo "$health" | awk '$1 == "50%" { print $2 }')
+  p99=$(echo "$health" | awk '$1 == "99%" { print $2 }')
+  max=$(echo "$health" | awk '$1 == "Latency" { print $4 }')
+  rps=$(awk '$1 == "Requests/sec:" { print $2 }' /tmp/saml-bench-load.txt)
+  printf "%-16s %12s %12s %12s %14s\n" "$load" "$p50" "$p99" "$max" "$rps"
+done
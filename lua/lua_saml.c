@@ -1,5 +1,9 @@
 /// Functions for working with XML documents and signatures
 // @module saml
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <lua.h>
 #include <lauxlib.h>
 
@@ -54,7 +58,7 @@ static int key_gc(lua_State* L) {
   xmlSecKey** key_ref = (xmlSecKey**)luaL_checkudata(L, 1, "xmlSecKey*");
   luaL_argcheck(L, *key_ref != NULL, 1, "`xmlSecKey*' expected");
   lua_pop(L, 1);
-  xmlSecKeyDestroy(*key_ref);
+  saml_key_free(*key_ref);
   *key_ref = NULL;
   return 0;
 }
@@ -113,6 +117,70 @@ static xmlSecKeysMngr* keys_mngr_check(lua_State* L, int i) {
 }
 
 
+static int signer_gc(lua_State* L) {
+  lua_settop(L, 1);
+  saml_signer_t** signer_ref = (saml_signer_t**)luaL_checkudata(L, 1, "saml_signer_t*");
+  luaL_argcheck(L, *signer_ref != NULL, 1, "`saml_signer_t*' expected");
+  lua_pop(L, 1);
+  saml_signer_free(*signer_ref);
+  *signer_ref = NULL;
+  return 0;
+}
+
+
+static const luaL_Reg signer_mt[] = {
+  {"__gc", signer_gc},
+  {NULL, NULL}
+};
+
+
+static void signer_new(lua_State* L, saml_signer_t* signer) {
+  saml_signer_t** signer_ref = (saml_signer_t**)lua_newuserdata(L, sizeof(saml_signer_t*));
+  *signer_ref = signer;
+  luaL_getmetatable(L, "saml_signer_t*");
+  lua_setmetatable(L, -2);
+}
+
+
+static saml_signer_t* signer_check(lua_State* L, int i) {
+  saml_signer_t** signer_ref = (saml_signer_t**)luaL_checkudata(L, i, "saml_signer_t*");
+  luaL_argcheck(L, *signer_ref != NULL, i, "`saml_signer_t*' expected");
+  return *signer_ref;
+}
+
+
+static int trust_gc(lua_State* L) {
+  lua_settop(L, 1);
+  saml_trust_t** trust_ref = (saml_trust_t**)luaL_checkudata(L, 1, "saml_trust_t*");
+  luaL_argcheck(L, *trust_ref != NULL, 1, "`saml_trust_t*' expected");
+  lua_pop(L, 1);
+  saml_trust_free(*trust_ref);
+  *trust_ref = NULL;
+  return 0;
+}
+
+
+static const luaL_Reg trust_mt[] = {
+  {"__gc", trust_gc},
+  {NULL, NULL}
+};
+
+
+static void trust_new(lua_State* L, saml_trust_t* trust) {
+  saml_trust_t** trust_ref = (saml_trust_t**)lua_newuserdata(L, sizeof(saml_trust_t*));
+  *trust_ref = trust;
+  luaL_getmetatable(L, "saml_trust_t*");
+  lua_setmetatable(L, -2);
+}
+
+
+static saml_trust_t* trust_check(lua_State* L, int i) {
+  saml_trust_t** trust_ref = (saml_trust_t**)luaL_checkudata(L, i, "saml_trust_t*");
+  luaL_argcheck(L, *trust_ref != NULL, i, "`saml_trust_t*' expected");
+  return *trust_ref;
+}
+
+
 /***
 Initialize the libxml2 parser and xmlsec; see @{01-Installation.md}
 @function init
@@ -124,12 +192,27 @@ static int init(lua_State* L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   lua_getfield(L, 1, "debug");
   lua_getfield(L, 1, "data_dir");
+  lua_getfield(L, 1, "lazy_schema");
+  lua_getfield(L, 1, "stats");
+  lua_getfield(L, 1, "verify_cache_size");
+  lua_getfield(L, 1, "verify_cache_ttl");
+  lua_getfield(L, 1, "deflate_level");
+  lua_getfield(L, 1, "deflate_mem_level");
 
   saml_init_opts_t opts;
   luaL_argcheck(L, lua_isboolean(L, 2) || lua_isnil(L, 2), 2, "debug must be a boolean");
   opts.debug = lua_toboolean(L, 2);
   opts.data_dir = luaL_checklstring(L, 3, NULL);
-  lua_pop(L, 2);
+  luaL_argcheck(L, lua_isboolean(L, 4) || lua_isnil(L, 4), 4, "lazy_schema must be a boolean");
+  opts.lazy_schema = lua_toboolean(L, 4);
+  luaL_argcheck(L, lua_isboolean(L, 5) || lua_isnil(L, 5), 5, "stats must be a boolean");
+  opts.stats = lua_toboolean(L, 5);
+  opts.verify_cache_size = luaL_optinteger(L, 6, 0);
+  opts.verify_cache_ttl = luaL_optinteger(L, 7, 300);
+  opts.batch_threads = 0;
+  opts.deflate_level = luaL_optinteger(L, 8, 0);
+  opts.deflate_mem_level = luaL_optinteger(L, 9, 0);
+  lua_pop(L, 8);
 
   if (saml_init(&opts) < 0) {
     lua_pushstring(L, "saml initialization failed");
@@ -150,6 +233,92 @@ static int shutdown(lua_State* L) {
 }
 
 
+/***
+Start or stop recording stage latencies; see @{01-Installation.md}
+@function stats_enable
+@bool enabled
+*/
+static int stats_enable(lua_State* L) {
+  lua_settop(L, 1);
+  luaL_checktype(L, 1, LUA_TBOOLEAN);
+  saml_stats_enable(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+/***
+Discard the stage latencies recorded so far
+@function stats_reset
+*/
+static int stats_reset(lua_State* L) {
+  saml_stats_reset();
+  return 0;
+}
+
+
+#define SETSTAT(n, v) (lua_pushliteral(L, n), lua_pushnumber(L, v), lua_settable(L, -3))
+
+
+/***
+Summarize the stage latencies recorded by every thread of this process
+@function stats
+@treturn table stage name => { count, bytes, mean, p50, p90, p99, p999, max }, latencies in microseconds
+*/
+static int stats(lua_State* L) {
+  saml_stats_t* snapshot = malloc(sizeof(saml_stats_t));
+  if (snapshot == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+  saml_stats_snapshot(snapshot);
+
+  lua_createtable(L, 0, SAML_STAGE_COUNT);
+  for (int i = 0; i < SAML_STAGE_COUNT; i++) {
+    saml_stage_stats_t* stage = snapshot->stages + i;
+    lua_pushstring(L, saml_stats_stage_name(i));
+    lua_createtable(L, 0, 8);
+    SETSTAT("count", stage->count);
+    SETSTAT("bytes", stage->bytes);
+    SETSTAT("mean", stage->count == 0 ? 0 : stage->total_ns / 1e3 / stage->count);
+    SETSTAT("p50", saml_stats_percentile(stage, 0.5) / 1e3);
+    SETSTAT("p90", saml_stats_percentile(stage, 0.9) / 1e3);
+    SETSTAT("p99", saml_stats_percentile(stage, 0.99) / 1e3);
+    SETSTAT("p999", saml_stats_percentile(stage, 0.999) / 1e3);
+    SETSTAT("max", stage->max_ns / 1e3);
+    lua_settable(L, -3);
+  }
+  free(snapshot);
+  return 1;
+}
+
+
+/***
+Count the lookups made by the verify cache; see @{01-Installation.md}
+@function verify_cache_stats
+@treturn table { hits, misses, evictions, entries }
+*/
+static int verify_cache_stats(lua_State* L) {
+  saml_verify_cache_stats_t cache_stats;
+  saml_verify_cache_stats(&cache_stats);
+
+  lua_createtable(L, 0, 4);
+  SETSTAT("hits", cache_stats.hits);
+  SETSTAT("misses", cache_stats.misses);
+  SETSTAT("evictions", cache_stats.evictions);
+  SETSTAT("entries", cache_stats.entries);
+  return 1;
+}
+
+
+/***
+Forget every binding in the verify cache, e.g. after a key is revoked
+@function verify_cache_clear
+*/
+static int verify_cache_clear(lua_State* L) {
+  saml_verify_cache_clear();
+  return 0;
+}
+
+
 static int base64_encode(lua_State* L) {
   lua_settop(L, 1);
 
@@ -451,24 +620,8 @@ static int doc_session_index(lua_State* L) {
 }
 
 
-/***
-Get the map of attributes in the document's assertion
-@function doc_attrs
-@tparam xmlDoc* doc
-@treturn table attributes
-*/
-static int doc_attrs(lua_State* L) {
-  lua_settop(L, 1);
-  xmlDoc* doc = doc_check(L, 1);
-  lua_pop(L, 1);
-
-  saml_attr_t* attrs;
-  size_t attrs_len;
-  if (saml_doc_attrs(doc, &attrs, &attrs_len) < 0) {
-    lua_pushnil(L);
-    return 1;
-  }
-
+// Pushes attributes as doc_attrs returns them: a value, or a list if there is more than one
+static void attrs_push(lua_State* L, saml_attr_t* attrs, size_t attrs_len) {
   lua_newtable(L);
   for (int i = 0; i < attrs_len; i++) {
     if (attrs[i].name != NULL) {
@@ -500,6 +653,28 @@ static int doc_attrs(lua_State* L) {
       lua_settable(L, -3);
     }
   }
+}
+
+
+/***
+Get the map of attributes in the document's assertion
+@function doc_attrs
+@tparam xmlDoc* doc
+@treturn table attributes
+*/
+static int doc_attrs(lua_State* L) {
+  lua_settop(L, 1);
+  xmlDoc* doc = doc_check(L, 1);
+  lua_pop(L, 1);
+
+  saml_attr_t* attrs;
+  size_t attrs_len;
+  if (saml_doc_attrs(doc, &attrs, &attrs_len) < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  attrs_push(L, attrs, attrs_len);
   saml_attrs_free(attrs, attrs_len);
   return 1;
 }
@@ -620,6 +795,26 @@ static int key_add_cert_file(lua_State* L) {
 }
 
 
+/***
+Name a key, so that a trust store can pick it by the KeyName of a signature's KeyInfo
+@function key_set_name
+@tparam xmlSecKey* key
+@tparam string name
+@treturn bool success
+*/
+static int key_set_name(lua_State* L) {
+  lua_settop(L, 2);
+  xmlSecKey* key = key_check(L, 1);
+  luaL_argcheck(L, key != NULL, 1, "`xmlSecKey*' expected");
+
+  const char* name = luaL_checklstring(L, 2, NULL);
+  lua_pop(L, 2);
+
+  lua_pushboolean(L, xmlSecKeySetName(key, (const xmlChar*)name) == 0);
+  return 1;
+}
+
+
 /***
 Create a keys manager with zero or more keys
 @function create_keys_manager
@@ -683,6 +878,335 @@ static int create_keys_mngr(lua_State* L) {
 }
 
 
+/***
+Create an empty trust store, which holds keys by the entity ID of the issuer they verify
+@function trust_create
+@treturn ?saml_trust_t* trust
+@treturn ?string error
+@usage
+local trust = saml.trust_create()
+saml.trust_add(trust, "https://idp.example.com", saml.key_read_file("/path/to/cert.pem", saml.KeyDataFormatCertPem))
+local doc, err = saml.binding_post_parse(content, trust)
+*/
+static int trust_create(lua_State* L) {
+  saml_trust_t* trust = saml_trust_create();
+  if (trust == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, "create trust store failed");
+    return 2;
+  }
+  trust_new(L, trust);
+  lua_pushnil(L);
+  return 2;
+}
+
+
+/***
+Add a copy of a key to the keys trusted for an issuer.  An issuer may have any number of keys, e.g. an old and a
+new one while its certificate is rolled over.
+@function trust_add
+@tparam saml_trust_t* trust
+@string issuer
+@tparam xmlSecKey* key
+@treturn bool success
+*/
+static int trust_add(lua_State* L) {
+  lua_settop(L, 3);
+  saml_trust_t* trust = trust_check(L, 1);
+  const char* issuer = luaL_checkstring(L, 2);
+  xmlSecKey* key = key_check(L, 3);
+  int res = saml_trust_add(trust, issuer, key);
+  lua_pop(L, 3);
+  lua_pushboolean(L, res == 0);
+  return 1;
+}
+
+
+/***
+Remove every key trusted for an issuer
+@function trust_remove
+@tparam saml_trust_t* trust
+@string issuer
+@treturn bool whether the issuer had any keys
+*/
+static int trust_remove(lua_State* L) {
+  lua_settop(L, 2);
+  saml_trust_t* trust = trust_check(L, 1);
+  const char* issuer = luaL_checkstring(L, 2);
+  int res = saml_trust_remove(trust, issuer);
+  lua_pop(L, 2);
+  lua_pushboolean(L, res == 0);
+  return 1;
+}
+
+
+/***
+Write the certificates of every key in a trust store to a file for @{trust_open}.  The file replaces any at
+the path in one step.
+@function trust_write
+@tparam saml_trust_t* trust
+@string path
+@treturn bool success
+*/
+static int trust_write(lua_State* L) {
+  lua_settop(L, 2);
+  saml_trust_t* trust = trust_check(L, 1);
+  const char* path = luaL_checkstring(L, 2);
+  int res = saml_trust_write(trust, path);
+  lua_pop(L, 2);
+  lua_pushboolean(L, res == 0);
+  return 1;
+}
+
+
+/***
+Open a trust store from a file written by @{trust_write}.  The file is mapped rather than read, so workers that
+fork after the master opens it, e.g. in `init_by_lua`, share its pages, and the certificates of an issuer are
+only parsed in a worker that verifies one of its documents.
+@function trust_open
+@string path
+@treturn ?saml_trust_t* trust
+@treturn ?string error
+@usage
+-- init_by_lua
+saml.trust_share("idps", assert(saml.trust_open("/var/lib/saml/idps.trust")))
+*/
+static int trust_open(lua_State* L) {
+  lua_settop(L, 1);
+  const char* path = luaL_checkstring(L, 1);
+  saml_trust_t* trust = saml_trust_open(path);
+  lua_pop(L, 1);
+  if (trust == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, "open trust store failed");
+    return 2;
+  }
+  trust_new(L, trust);
+  lua_pushnil(L);
+  return 2;
+}
+
+
+/***
+Map the file of a trust store from @{trust_open} again, after a new one was written to its path.  Keys read
+from the old file are forgotten, but those added or removed with @{trust_add} and @{trust_remove} are kept.
+Each worker has its own mapping, so each has to reload it, e.g. from a timer.
+@function trust_reload
+@tparam saml_trust_t* trust
+@treturn bool success
+*/
+static int trust_reload(lua_State* L) {
+  lua_settop(L, 1);
+  saml_trust_t* trust = trust_check(L, 1);
+  int res = saml_trust_reload(trust);
+  lua_pop(L, 1);
+  lua_pushboolean(L, res == 0);
+  return 1;
+}
+
+
+// Keys registered with key_share, for Lua states on other threads such as the ones ngx.run_worker_thread
+// runs.  Every state gets its own copy, so a userdata is never used by two threads.
+typedef struct shared_key {
+  char* name;
+  xmlSecKey* key;
+  struct shared_key* next;
+} shared_key_t;
+
+static pthread_mutex_t shared_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_key_t* shared_keys = NULL;
+
+
+/***
+Make a copy of a key available to every Lua state in the process under a name, replacing any key already
+shared under it.  Sharing nil removes the name.
+@function key_share
+@string name
+@tparam ?xmlSecKey* key
+@treturn bool success
+*/
+static int key_share(lua_State* L) {
+  lua_settop(L, 2);
+  size_t name_len;
+  const char* name = luaL_checklstring(L, 1, &name_len);
+  xmlSecKey* copy = NULL;
+  if (!lua_isnil(L, 2)) {
+    copy = xmlSecKeyDuplicate(key_check(L, 2));
+    if (copy == NULL) {
+      lua_pop(L, 2);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+
+  pthread_mutex_lock(&shared_keys_lock);
+  shared_key_t** link = &shared_keys;
+  while (*link != NULL && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  shared_key_t* shared = *link;
+  if (shared != NULL) {
+    saml_key_free(shared->key);
+    if (copy != NULL) {
+      shared->key = copy;
+    } else {
+      *link = shared->next;
+      free(shared->name);
+      free(shared);
+    }
+  } else if (copy != NULL) {
+    shared = malloc(sizeof(shared_key_t));
+    char* shared_name = malloc(name_len + 1);
+    if (shared == NULL || shared_name == NULL) {
+      pthread_mutex_unlock(&shared_keys_lock);
+      free(shared);
+      free(shared_name);
+      xmlSecKeyDestroy(copy);
+      lua_pop(L, 2);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+    memcpy(shared_name, name, name_len + 1);
+    shared->name = shared_name;
+    shared->key = copy;
+    shared->next = shared_keys;
+    shared_keys = shared;
+  }
+  pthread_mutex_unlock(&shared_keys_lock);
+
+  lua_pop(L, 2);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/***
+Get a copy of a key shared with @{key_share}
+@function key_shared
+@string name
+@treturn ?xmlSecKey*
+*/
+static int key_shared(lua_State* L) {
+  lua_settop(L, 1);
+  const char* name = luaL_checklstring(L, 1, NULL);
+
+  xmlSecKey* copy = NULL;
+  pthread_mutex_lock(&shared_keys_lock);
+  for (shared_key_t* shared = shared_keys; shared != NULL; shared = shared->next) {
+    if (strcmp(shared->name, name) == 0) {
+      copy = xmlSecKeyDuplicate(shared->key);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shared_keys_lock);
+  lua_pop(L, 1);
+
+  if (copy == NULL) {
+    lua_pushnil(L);
+  } else {
+    key_new(L, copy);
+  }
+  return 1;
+}
+
+
+// Trust stores registered with trust_share.  Unlike a key, a store may be used by any number of threads at once,
+// so every state gets a reference to the same one rather than a copy.
+typedef struct shared_trust {
+  char* name;
+  saml_trust_t* trust;
+  struct shared_trust* next;
+} shared_trust_t;
+
+static pthread_mutex_t shared_trusts_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_trust_t* shared_trusts = NULL;
+
+
+/***
+Make a trust store available to every Lua state in the process under a name, replacing any store already
+shared under it.  Keys added to or removed from the store later are seen by every state.  Sharing nil removes
+the name.
+@function trust_share
+@string name
+@tparam ?saml_trust_t* trust
+@treturn bool success
+*/
+static int trust_share(lua_State* L) {
+  lua_settop(L, 2);
+  size_t name_len;
+  const char* name = luaL_checklstring(L, 1, &name_len);
+  saml_trust_t* trust = lua_isnil(L, 2) ? NULL : trust_check(L, 2);
+
+  pthread_mutex_lock(&shared_trusts_lock);
+  shared_trust_t** link = &shared_trusts;
+  while (*link != NULL && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  shared_trust_t* shared = *link;
+  if (shared != NULL) {
+    saml_trust_free(shared->trust);
+    if (trust != NULL) {
+      shared->trust = saml_trust_ref(trust);
+    } else {
+      *link = shared->next;
+      free(shared->name);
+      free(shared);
+    }
+  } else if (trust != NULL) {
+    shared = malloc(sizeof(shared_trust_t));
+    char* shared_name = malloc(name_len + 1);
+    if (shared == NULL || shared_name == NULL) {
+      pthread_mutex_unlock(&shared_trusts_lock);
+      free(shared);
+      free(shared_name);
+      lua_pop(L, 2);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+    memcpy(shared_name, name, name_len + 1);
+    shared->name = shared_name;
+    shared->trust = saml_trust_ref(trust);
+    shared->next = shared_trusts;
+    shared_trusts = shared;
+  }
+  pthread_mutex_unlock(&shared_trusts_lock);
+
+  lua_pop(L, 2);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/***
+Get a trust store shared with @{trust_share}
+@function trust_shared
+@string name
+@treturn ?saml_trust_t*
+*/
+static int trust_shared(lua_State* L) {
+  lua_settop(L, 1);
+  const char* name = luaL_checklstring(L, 1, NULL);
+
+  saml_trust_t* trust = NULL;
+  pthread_mutex_lock(&shared_trusts_lock);
+  for (shared_trust_t* shared = shared_trusts; shared != NULL; shared = shared->next) {
+    if (strcmp(shared->name, name) == 0) {
+      trust = saml_trust_ref(shared->trust);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shared_trusts_lock);
+  lua_pop(L, 1);
+
+  if (trust == NULL) {
+    lua_pushnil(L);
+  } else {
+    trust_new(L, trust);
+  }
+  return 1;
+}
+
+
 /***
 Find a transform by href
 @function find_transform_by_href
@@ -695,7 +1219,10 @@ static int find_transform_by_href(lua_State* L) {
   const xmlChar* href = (xmlChar*)luaL_checklstring(L, 1, NULL);
   lua_pop(L, 1);
 
-  xmlSecTransformId transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), href, xmlSecTransformUriTypeAny);
+  xmlSecTransformId transform_id = saml_find_transform((char*)href);
+  if (transform_id == NULL) {
+    transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), href, xmlSecTransformUriTypeAny);
+  }
   if (transform_id == NULL) {
     lua_pushnil(L);
   } else {
@@ -727,29 +1254,49 @@ static int sign_binary(lua_State* L) {
 
   lua_pop(L, 3);
 
-  xmlSecTransformCtx* ctx = saml_sign_binary(key, transform_id, data, data_len);
-  if (ctx == NULL) {
+  str_t sig;
+  if (saml_sign_binary_str(key, transform_id, data, data_len, &sig) < 0) {
     lua_pushnil(L);
     lua_pushstring(L, "saml sign failed");
   } else {
-    lua_pushlstring(L, (char*)xmlSecBufferGetData(ctx->result), xmlSecBufferGetSize(ctx->result));
-    xmlSecTransformCtxDestroy(ctx);
+    lua_pushlstring(L, sig.data, sig.len);
+    str_free(&sig);
     lua_pushnil(L);
   }
   return 2;
 }
 
 
+// A digest method given as either a transform or its href at i, reported as argument arg; NULL if nil
+static xmlSecTransformId digest_check(lua_State* L, int i, int arg) {
+  xmlSecTransformId digest_id = NULL;
+  if (lua_type(L, i) == LUA_TSTRING) {
+    digest_id = saml_find_digest(lua_tostring(L, i));
+    luaL_argcheck(L, digest_id != NULL, arg, "unknown digest");
+  } else if (!lua_isnil(L, i)) {
+    digest_id = (xmlSecTransformId)lua_touserdata(L, i);
+    luaL_argcheck(L, digest_id != NULL, arg, "digest must be an `xmlSecTransformId` or href");
+  }
+  return digest_id;
+}
+
+
 int sign_get_opts(lua_State* L, int i, saml_doc_opts_t* opts) {
   opts->id_attr = NULL;
   opts->insert_after_ns = NULL;
   opts->insert_after_el = NULL;
+  opts->digest_id = NULL;
 
   if (lua_isnil(L, i)) {
     return i;
   }
 
   luaL_checktype(L, i, LUA_TTABLE);
+
+  lua_getfield(L, i, "digest");
+  opts->digest_id = digest_check(L, i + 1, i);
+  lua_pop(L, 1);
+
   lua_getfield(L, i, "id_attr");
   lua_getfield(L, i, "insert_after");
 
@@ -781,7 +1328,8 @@ Sign an XML document (mutates the input)
 @tparam xmlSecKey* key
 @tparam xmlSecTransformId transform_id
 @tparam xmlDoc* doc
-@tparam[opt={}] table options
+@tparam[opt={}] table options `id_attr`, `insert_after` as `{namespace, element}` and `digest`, the transform
+or href of the reference digest, which defaults to SHA-256
 @treturn ?string error
 */
 static int sign_doc(lua_State* L) {
@@ -856,6 +1404,181 @@ static int sign_xml(lua_State* L) {
 }
 
 
+/***
+Create a signer, which keeps the signature template and encoded certificate for a key, to sign many documents
+faster than @{sign_doc}.  The key is copied.
+@function signer_create
+@tparam xmlSecKey* key
+@tparam xmlSecTransformId transform_id
+@tparam[opt] xmlSecTransformId|string digest the transform or href of the reference digest, SHA-256 by default
+@treturn ?saml_signer_t* signer
+@treturn ?string error
+*/
+static int signer_create(lua_State* L) {
+  lua_settop(L, 3);
+
+  xmlSecKey* key = key_check(L, 1);
+
+  xmlSecTransformId transform_id = (xmlSecTransformId)lua_touserdata(L, 2);
+  luaL_argcheck(L, transform_id != NULL, 2, "`xmlSecTransformId` expected");
+
+  xmlSecTransformId digest_id = digest_check(L, 3, 3);
+
+  lua_settop(L, 0);
+
+  saml_signer_t* signer = saml_signer_create(key, transform_id, digest_id);
+  if (signer == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, "create signer failed");
+    return 2;
+  }
+  signer_new(L, signer);
+  lua_pushnil(L);
+  return 2;
+}
+
+
+/***
+Sign an XML document with a signer (mutates the input)
+@function signer_sign_doc
+@tparam saml_signer_t* signer
+@tparam xmlDoc* doc
+@tparam[opt={}] table options as for @{sign_doc}, except that the digest is the signer's
+@treturn ?string error
+*/
+static int signer_sign_doc(lua_State* L) {
+  lua_settop(L, 3);
+
+  saml_signer_t* signer = signer_check(L, 1);
+  xmlDoc* doc = doc_check(L, 2);
+
+  saml_doc_opts_t opts;
+  lua_pop(L, sign_get_opts(L, 3, &opts));
+
+  int res = saml_signer_sign_doc(signer, doc, &opts);
+  if (res == 0) {
+    lua_pushnil(L);
+  } else {
+    lua_pushstring(L, "saml sign failed");
+  }
+  return 1;
+}
+
+
+// Fills attrs from the table of name to a string or list of strings at i, using a userdata pushed on the stack
+static void response_get_attrs(lua_State* L, int i, saml_response_t* response) {
+  size_t attrs_len = 0, values_len = 0;
+  lua_pushnil(L);
+  while (lua_next(L, i) != 0) {
+    luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, 2, "attribute names must be strings");
+    if (lua_type(L, -1) == LUA_TTABLE) {
+      values_len += (size_t)luaL_len(L, -1);
+    } else {
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "attribute values must be strings or lists of strings");
+      values_len++;
+    }
+    attrs_len++;
+    lua_pop(L, 1);
+  }
+
+  saml_attr_t* attrs = (saml_attr_t*)lua_newuserdata(L, attrs_len * sizeof(saml_attr_t) + values_len * sizeof(xmlChar*));
+  xmlChar** values = (xmlChar**)(attrs + attrs_len);
+  size_t n = 0;
+  lua_pushnil(L);
+  while (lua_next(L, i) != 0) {
+    attrs[n].name = (xmlChar*)lua_tostring(L, -2);
+    attrs[n].values = values;
+    if (lua_type(L, -1) == LUA_TTABLE) {
+      attrs[n].num_values = (int)luaL_len(L, -1);
+      for (int j = 0; j < attrs[n].num_values; j++) {
+        lua_rawgeti(L, -1, j + 1);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "attribute values must be strings or lists of strings");
+        *values++ = (xmlChar*)lua_tostring(L, -1);
+        lua_pop(L, 1);
+      }
+    } else {
+      attrs[n].num_values = 1;
+      *values++ = (xmlChar*)lua_tostring(L, -1);
+    }
+    n++;
+    lua_pop(L, 1);
+  }
+  response->attrs = attrs;
+  response->attrs_len = attrs_len;
+}
+
+
+/***
+Build a signed Response without parsing or building a document, which is several times faster than
+@{sign_xml} for the same result
+@function response_build
+@tparam saml_signer_t* signer
+@tparam table response fields `id`, `issue_instant`, `issuer`, and optionally `destination`, `in_response_to`
+and `status_code`.  An Assertion is added if `assertion_id` is set, with `name_id` and optionally
+`name_id_format`, `sp_name_qualifier`, `not_before`, `not_on_or_after`, `audience`, `session_index`,
+`authn_context_class_ref` and `attrs`, a table of names to a string or list of strings.
+@treturn ?string signed xml
+@treturn ?string error
+*/
+static int response_build(lua_State* L) {
+  lua_settop(L, 2);
+
+  saml_signer_t* signer = signer_check(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  saml_response_t response;
+  memset(&response, 0, sizeof(saml_response_t));
+  struct {
+    const char* name;
+    char** value;
+  } fields[] = {
+    { "id", &response.id },
+    { "issue_instant", &response.issue_instant },
+    { "destination", &response.destination },
+    { "in_response_to", &response.in_response_to },
+    { "issuer", &response.issuer },
+    { "status_code", &response.status_code },
+    { "assertion_id", &response.assertion_id },
+    { "name_id", &response.name_id },
+    { "name_id_format", &response.name_id_format },
+    { "sp_name_qualifier", &response.sp_name_qualifier },
+    { "not_before", &response.not_before },
+    { "not_on_or_after", &response.not_on_or_after },
+    { "audience", &response.audience },
+    { "session_index", &response.session_index },
+    { "authn_context_class_ref", &response.authn_context_class_ref },
+  };
+  // The strings stay referenced by the table, so they can be popped
+  for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    lua_getfield(L, 2, fields[i].name);
+    if (!lua_isnil(L, -1)) {
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "response fields must be strings");
+      *fields[i].value = (char*)lua_tostring(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+
+  lua_getfield(L, 2, "attrs");
+  if (!lua_isnil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    response_get_attrs(L, 3, &response);
+  }
+
+  str_t xml;
+  int res = saml_response_build(signer, &response, &xml);
+  lua_settop(L, 0);
+  if (res == 0) {
+    lua_pushlstring(L, xml.data, xml.len);
+    lua_pushnil(L);
+    str_free(&xml);
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, res > 0 ? "invalid response" : "build response failed");
+  }
+  return 2;
+}
+
+
 /***
 Verify a signature for a string
 @function verify_binary
@@ -935,6 +1658,108 @@ static int verify_doc(lua_State* L) {
 }
 
 
+static void summary_set(lua_State* L, const char* key, xmlChar* value) {
+  if (value != NULL) {
+    lua_pushstring(L, (char*)value);
+    lua_setfield(L, -2, key);
+  }
+}
+
+
+/***
+Verify the signature of a XML document without parsing it into an `xmlDoc*` first, and read the fields most
+callers need from it.  The results are the same as `doc_read_memory` and `verify_doc`, but the usual SAML
+signature (one reference to the root, with the enveloped and exclusive c14n transforms) is checked as the
+document is parsed.
+@function verify_xml
+@tparam xmlSecKeysMngr* mngr
+@tparam string xml
+@tparam[opt={}] table options `id_attr`
+@treturn ?bool valid
+@treturn ?table summary when valid: `id`, `issuer`, `name_id`, `status_code`, `session_index`, `attrs` as
+`doc_attrs` returns them, and `streamed`, false if the document had to be parsed
+@treturn ?string error
+*/
+static int verify_xml(lua_State* L) {
+  lua_settop(L, 3);
+
+  xmlSecKeysMngr* mngr = keys_mngr_check(L, 1);
+  luaL_argcheck(L, mngr != NULL, 1, "`xmlSecKeysMngr*' expected");
+
+  size_t xml_len;
+  const char* xml = luaL_checklstring(L, 2, &xml_len);
+
+  saml_doc_opts_t opts = { .id_attr = NULL };
+  if (!lua_isnil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "id_attr");
+    if (!lua_isnil(L, 4)) {
+      opts.id_attr = (xmlChar*)luaL_checklstring(L, 4, NULL);
+    }
+  }
+
+  saml_summary_t summary;
+  int res = saml_verify_xml(mngr, xml, xml_len, &opts, &summary);
+  lua_settop(L, 0);
+  if (res < 0) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushstring(L, "saml verify failed");
+    return 3;
+  }
+
+  lua_pushboolean(L, res == 0);
+  if (res != 0) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    return 3;
+  }
+
+  lua_newtable(L);
+  summary_set(L, "id", summary.id);
+  summary_set(L, "issuer", summary.issuer);
+  summary_set(L, "name_id", summary.name_id);
+  summary_set(L, "status_code", summary.status_code);
+  summary_set(L, "session_index", summary.session_index);
+  attrs_push(L, summary.attrs, summary.attrs_len);
+  lua_setfield(L, -2, "attrs");
+  lua_pushboolean(L, summary.streamed);
+  lua_setfield(L, -2, "streamed");
+  saml_summary_free(&summary);
+  lua_pushnil(L);
+  return 3;
+}
+
+
+// The bindings need the href itself for the SigAlg parameter, so unlike sign_binary they take it as a string
+static char* sig_alg_check(lua_State* L, int i) {
+  return (char*)luaL_checklstring(L, i, NULL);
+}
+
+
+// With the resolver of a parse function at index 1 and the parsed doc at index 2, leaves the doc at index 1
+// and the key or keys manager to verify it with at index 2.  A table of them by issuer is looked up here, so
+// only a function has to be called into.
+static void binding_resolve(lua_State* L, xmlDoc* doc) {
+  if (lua_type(L, 1) == LUA_TTABLE) {
+    xmlChar* issuer = saml_doc_issuer(doc);
+    if (issuer == NULL) {
+      lua_pushnil(L);
+    } else {
+      lua_getfield(L, 1, (char*)issuer);
+      xmlFree(issuer);
+    }
+    lua_remove(L, 1);
+    return;
+  }
+
+  // copy the doc userdata and put it on the bottom of the stack so it remains after lua_call
+  lua_pushvalue(L, 2);
+  lua_insert(L, 1);
+  lua_call(L, 1, 1);
+}
+
+
 static int binding_redirect_create(lua_State* L) {
   lua_settop(L, 5);
 
@@ -943,7 +1768,7 @@ static int binding_redirect_create(lua_State* L) {
 
   char* saml_type = (char*)luaL_checklstring(L, 2, NULL);
   char* content = (char*)luaL_checklstring(L, 3, NULL);
-  char* sig_alg = (char*)luaL_checklstring(L, 4, NULL);
+  char* sig_alg = sig_alg_check(L, 4);
   char* relay_state = (char*)luaL_checklstring(L, 5, NULL);
   lua_pop(L, 5);
 
@@ -967,7 +1792,10 @@ static int binding_redirect_parse(lua_State* L) {
   char* saml_type = (char*)luaL_checklstring(L, 1, NULL);
 
   luaL_checktype(L, 2, LUA_TTABLE);
-  luaL_checktype(L, 3, LUA_TFUNCTION);
+  saml_trust_t* trust = NULL;
+  if (lua_type(L, 3) != LUA_TFUNCTION && lua_type(L, 3) != LUA_TTABLE) {
+    trust = trust_check(L, 3);
+  }
 
   lua_getfield(L, 2, saml_type);
   char* content = (char*)luaL_checkstring(L, 4);
@@ -984,12 +1812,28 @@ static int binding_redirect_parse(lua_State* L) {
     relay_state = (char*)lua_tostring(L, 7);
   }
 
-  // leave only the cert_from_doc function on the stack
+  // leave only the cert_from_doc function, table or trust store on the stack
   lua_pop(L, 4);
   lua_remove(L, 1);
   lua_remove(L, 1);
 
   xmlDoc* doc = NULL;
+  if (trust != NULL) {
+    lua_pop(L, 1);
+    int res = saml_binding_redirect_parse_trust(trust, saml_type, content, sig_alg, relay_state, signature, &doc);
+    if (doc != NULL) {
+      doc_new(L, doc);
+    } else {
+      lua_pushnil(L);
+    }
+    if (res != SAML_OK) {
+      lua_pushstring(L, saml_binding_error_msg(res));
+    } else {
+      lua_pushnil(L);
+    }
+    return 2;
+  }
+
   int res = saml_binding_redirect_parse(content, sig_alg, &doc);
   if (res != SAML_OK) {
     lua_pop(L, 1);
@@ -1003,10 +1847,7 @@ static int binding_redirect_parse(lua_State* L) {
   }
 
   doc_new(L, doc);
-  // copy the doc userdata and put it on the bottom of the stack so it remains after lua_call
-  lua_pushvalue(L, 2);
-  lua_insert(L, 1);
-  lua_call(L, 1, 1);
+  binding_resolve(L, doc);
   if (lua_isnil(L, 2)) {
     lua_pop(L, 1);
     lua_pushstring(L, "no cert");
@@ -1034,7 +1875,7 @@ static int binding_post_create(lua_State* L) {
 
   char* saml_type = (char*)luaL_checklstring(L, 2, NULL);
   char* content = (char*)luaL_checklstring(L, 3, NULL);
-  char* sig_alg = (char*)luaL_checklstring(L, 4, NULL);
+  char* sig_alg = sig_alg_check(L, 4);
   char* relay_state = NULL;
   if (!lua_isnil(L, 5)) {
     relay_state = (char*)luaL_checklstring(L, 5, NULL);
@@ -1056,16 +1897,62 @@ static int binding_post_create(lua_State* L) {
 }
 
 
+/***
+Create a post binding from a parsed document, which is signed in place (mutates the input)
+@function binding_post_create_doc
+@tparam xmlSecKey* key
+@tparam string saml_type
+@tparam xmlDoc* doc
+@tparam string sig_alg href
+@tparam ?string relay_state
+@tparam string destination
+@treturn ?string html
+@treturn ?string error
+*/
+static int binding_post_create_doc(lua_State* L) {
+  lua_settop(L, 6);
+
+  xmlSecKey* key = key_check(L, 1);
+  luaL_argcheck(L, key != NULL, 1, "`xmlSecKey*' expected");
+
+  char* saml_type = (char*)luaL_checklstring(L, 2, NULL);
+  xmlDoc* doc = doc_check(L, 3);
+  char* sig_alg = sig_alg_check(L, 4);
+  char* relay_state = NULL;
+  if (!lua_isnil(L, 5)) {
+    relay_state = (char*)luaL_checklstring(L, 5, NULL);
+  }
+  char* destination = (char*)luaL_checklstring(L, 6, NULL);
+  lua_pop(L, 6);
+
+  str_t html;
+  saml_binding_status_t res = saml_binding_post_create_doc(key, saml_type, doc, sig_alg, relay_state, destination, &html);
+  if (res != SAML_OK) {
+    lua_pushnil(L);
+    lua_pushstring(L, saml_binding_error_msg(res));
+  } else {
+    lua_pushlstring(L, html.data, html.len);
+    lua_pushnil(L);
+    str_free(&html);
+  }
+  return 2;
+}
+
+
 static int binding_post_parse(lua_State* L) {
   lua_settop(L, 2);
 
   char* content = (char*)luaL_checklstring(L, 1, NULL);
-  luaL_checktype(L, 2, LUA_TFUNCTION);
+  saml_trust_t* trust = NULL;
+  if (lua_type(L, 2) != LUA_TFUNCTION && lua_type(L, 2) != LUA_TTABLE) {
+    trust = trust_check(L, 2);
+  }
 
   lua_remove(L, 1);
 
   xmlDoc* doc = NULL;
-  saml_binding_status_t res = saml_binding_post_parse(content, &doc);
+  unsigned char digest[SAML_CONTENT_DIGEST_LEN];
+  saml_binding_status_t res = saml_binding_post_parse_cached(content, digest, &doc);
   if (res != SAML_OK) {
     lua_pop(L, 1);
     if (doc != NULL) {
@@ -1077,11 +1964,20 @@ static int binding_post_parse(lua_State* L) {
     return 2;
   }
 
+  if (trust != NULL) {
+    lua_pop(L, 1);
+    doc_new(L, doc);
+    res = saml_binding_post_verify_trust_cached(trust, doc, digest);
+    if (res != SAML_OK) {
+      lua_pushstring(L, saml_binding_error_msg(res));
+    } else {
+      lua_pushnil(L);
+    }
+    return 2;
+  }
+
   doc_new(L, doc);
-  // copy the doc userdata and put it on the bottom of the stack so it remains after lua_call
-  lua_pushvalue(L, 2);
-  lua_insert(L, 1);
-  lua_call(L, 1, 1);
+  binding_resolve(L, doc);
   if (lua_isnil(L, 2)) {
     lua_pop(L, 1);
     lua_pushstring(L, "no cert");
@@ -1090,7 +1986,7 @@ static int binding_post_parse(lua_State* L) {
   xmlSecKeysMngr* mngr = keys_mngr_check(L, 2);
   lua_pop(L, 1);
 
-  res = saml_binding_post_verify(mngr, doc);
+  res = saml_binding_post_verify_cached(mngr, doc, digest);
 
   if (res != SAML_OK) {
     lua_pushstring(L, saml_binding_error_msg(res));
@@ -1105,6 +2001,11 @@ static int binding_post_parse(lua_State* L) {
 static const struct luaL_Reg saml_funcs[] = {
   {"init", init},
   {"shutdown", shutdown},
+  {"stats_enable", stats_enable},
+  {"stats_reset", stats_reset},
+  {"stats", stats},
+  {"verify_cache_stats", verify_cache_stats},
+  {"verify_cache_clear", verify_cache_clear},
 
   {"base64_encode", base64_encode},
   {"base64_decode", base64_decode},
@@ -1129,18 +2030,34 @@ static const struct luaL_Reg saml_funcs[] = {
   {"key_read_file", key_read_file},
   {"key_add_cert_memory", key_add_cert_memory},
   {"key_add_cert_file", key_add_cert_file},
+  {"key_set_name", key_set_name},
   {"create_keys_manager", create_keys_mngr},
+  {"trust_create", trust_create},
+  {"trust_add", trust_add},
+  {"trust_remove", trust_remove},
+  {"trust_write", trust_write},
+  {"trust_open", trust_open},
+  {"trust_reload", trust_reload},
+  {"key_share", key_share},
+  {"key_shared", key_shared},
+  {"trust_share", trust_share},
+  {"trust_shared", trust_shared},
 
   {"find_transform_by_href", find_transform_by_href},
   {"sign_binary", sign_binary},
   {"sign_doc", sign_doc},
   {"sign_xml", sign_xml},
+  {"signer_create", signer_create},
+  {"signer_sign_doc", signer_sign_doc},
+  {"response_build", response_build},
   {"verify_binary", verify_binary},
   {"verify_doc", verify_doc},
+  {"verify_xml", verify_xml},
 
   {"binding_redirect_create", binding_redirect_create},
   {"binding_redirect_parse", binding_redirect_parse},
   {"binding_post_create", binding_post_create},
+  {"binding_post_create_doc", binding_post_create_doc},
   {"binding_post_parse", binding_post_parse},
   {NULL, NULL}
 };
@@ -1165,6 +2082,8 @@ int luaopen_saml(lua_State* L) {
   create_mt(L, "xmlDoc*", doc_mt);
   create_mt(L, "xmlSecKey*", key_mt);
   create_mt(L, "xmlSecKeysMngr*", keys_mngr_mt);
+  create_mt(L, "saml_signer_t*", signer_mt);
+  create_mt(L, "saml_trust_t*", trust_mt);
 
 #if (LUA_VERSION_NUM >= 502)
   luaL_newlib(L, saml_funcs);
@@ -1182,6 +2101,24 @@ int luaopen_saml(lua_State* L) {
   SETCONST("STATUS_RESPONDER", SAML_STATUS_RESPONDER);
   SETCONST("STATUS_VERSION_MISMATCH", SAML_STATUS_VERSION_MISMATCH);
 
+  // signature methods, for the sig_alg arguments
+  SETCONST("HrefRsaSha1", (char*)xmlSecHrefRsaSha1);
+  SETCONST("HrefRsaSha256", (char*)xmlSecHrefRsaSha256);
+  SETCONST("HrefRsaSha384", (char*)xmlSecHrefRsaSha384);
+  SETCONST("HrefRsaSha512", (char*)xmlSecHrefRsaSha512);
+#ifndef XMLSEC_NO_ECDSA
+  SETCONST("HrefEcdsaSha1", (char*)xmlSecHrefEcdsaSha1);
+  SETCONST("HrefEcdsaSha256", (char*)xmlSecHrefEcdsaSha256);
+  SETCONST("HrefEcdsaSha384", (char*)xmlSecHrefEcdsaSha384);
+  SETCONST("HrefEcdsaSha512", (char*)xmlSecHrefEcdsaSha512);
+#endif
+
+  // digest methods, for the digest options of sign_doc and sign_xml
+  SETCONST("HrefSha1", (char*)xmlSecHrefSha1);
+  SETCONST("HrefSha256", (char*)xmlSecHrefSha256);
+  SETCONST("HrefSha384", (char*)xmlSecHrefSha384);
+  SETCONST("HrefSha512", (char*)xmlSecHrefSha512);
+
   // export of keysdata.h:xmlSecKeyDataFormat
   SETENUM("KeyDataFormatUnknown", xmlSecKeyDataFormatUnknown);
   SETENUM("KeyDataFormatBinary", xmlSecKeyDataFormatBinary);
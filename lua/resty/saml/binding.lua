@@ -10,7 +10,7 @@ local _M = {}
 --[[---
 Create a redirect binding
 @tparam xmlSecKey* key
-@tparam table params
+@tparam table params SigAlg must be an href
 @treturn ?string signature
 @treturn ?string error
 @see saml.sign_binary
@@ -30,7 +30,8 @@ end
 --[[---
 Parse a redirect binding
 @tparam string saml_type either SAMLRequest or SAMLResponse
-@tparam func cert_from_doc determine the signing public key from the document
+@tparam func|table|saml_trust_t* cert_from_doc determine the signing public key from the document, or find
+  it by the document's issuer in a table of keys or a trust store
 @treturn ?xmlDoc* doc
 @treturn ?table args
 @treturn ?string error
@@ -48,7 +49,7 @@ Create a post binding
 @tparam xmlSecKey* key
 @tparam string saml_type
 @tparam string content
-@tparam string sig_alg
+@tparam string sig_alg href
 @tparam string relay_state
 @tparam string destination
 @treturn ?string html
@@ -59,10 +60,27 @@ function _M.create_post(key, saml_type, content, sig_alg, relay_state, destinati
   return saml.binding_post_create(key, saml_type, content, sig_alg, relay_state, destination)
 end
 
+--[[---
+Create a post binding from a document, which is signed in place instead of being serialized and parsed again
+@tparam xmlSecKey* key
+@tparam string saml_type
+@tparam xmlDoc* doc
+@tparam string sig_alg href
+@tparam string relay_state
+@tparam string destination
+@treturn ?string html
+@treturn ?string error
+@see saml.sign_doc
+]]
+function _M.create_post_doc(key, saml_type, doc, sig_alg, relay_state, destination)
+  return saml.binding_post_create_doc(key, saml_type, doc, sig_alg, relay_state, destination)
+end
+
 --[[---
 Parse a post binding
 @tparam string saml_type either SAMLRequest or SAMLResponse
-@tparam func key_mngr_from_doc determine the signing public key from the document
+@tparam func|table|saml_trust_t* key_mngr_from_doc determine the signing public key from the document, or
+  find it by the document's issuer in a table of keys managers or a trust store
 @treturn ?xmlDoc* doc
 @treturn ?table args
 @treturn ?string error
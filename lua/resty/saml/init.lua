@@ -3,10 +3,12 @@ Namespace for all library functions
 @module resty.saml
 @see saml
 @see resty.saml.binding
+@see resty.saml.thread
 ]]
 
 local _M = require "saml"
 
 _M.binding = require "resty.saml.binding"
+_M.thread = require "resty.saml.thread"
 
 return _M
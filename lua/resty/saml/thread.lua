@@ -0,0 +1,114 @@
+--[[---
+The same bindings as @{resty.saml.binding}, with the signing, verification and XML work done on an nginx
+thread pool, so that a slow RSA operation holds up only the request that needs it rather than every request
+on the worker.  The calling coroutine yields until the result is ready.
+
+This needs `ngx.run_worker_thread` (lua-nginx-module 0.10.21, OpenResty 1.21.4) and a `thread_pool` directive
+in the main block of nginx.conf.  Without it, everything runs inline.
+
+Keys cannot be passed to another thread, so they are shared by name with `saml.key_share` beforehand, e.g. in
+`init_by_lua`.  A trust store shared with `saml.trust_share` can be named in place of a certificate, and is
+used before a key shared under the same name.  Signature algorithms are given as hrefs.
+@module resty.saml.thread
+@usage
+-- nginx.conf: thread_pool saml threads=4;
+saml.key_share("sp", assert(saml.key_read_file("/ssl/sp.key", saml.KeyDataFormatPem)))
+saml.key_share("idp", assert(saml.key_read_file("/ssl/idp.crt", saml.KeyDataFormatCertPem)))
+...
+local summary, args, err = require("resty.saml.thread").parse_post("SAMLResponse", { ["https://idp"] = "idp" })
+]]
+
+local worker = require "resty.saml.worker"
+
+local _M = {
+  --- Name of the thread pool
+  pool = "saml",
+}
+
+local function run(fn, ...)
+  local run_worker_thread = ngx.run_worker_thread
+  if not run_worker_thread then
+    return worker[fn](...)
+  end
+
+  local ok, res, err = run_worker_thread(_M.pool, "resty.saml.worker", fn, ...)
+  if not ok then return nil, res end
+  return res, err
+end
+
+--[[---
+Create a redirect binding
+@string key_name name the signing key was shared under
+@tparam table params SigAlg must be an href
+@treturn ?string signature
+@treturn ?string error
+@see resty.saml.binding.create_redirect
+]]
+function _M.create_redirect(key_name, params)
+  local saml_type
+  if params.SAMLRequest then
+    saml_type = "SAMLRequest"
+  elseif params.SAMLResponse then
+    saml_type = "SAMLResponse"
+  end
+  assert(saml_type, "no saml request or response")
+
+  return run("create_redirect", key_name, saml_type, params[saml_type], params.SigAlg, params.RelayState)
+end
+
+--[[---
+Parse a redirect binding
+@string saml_type either SAMLRequest or SAMLResponse
+@tparam string|table certs name of the shared certificate or trust store, or a table of names by issuer
+@treturn ?table summary `id`, `issuer`, `name_id`, `status_code`, `session_index` and `attrs` of the document,
+  which like the document @{resty.saml.binding} returns is there on some errors as well
+@treturn ?table args
+@treturn ?string error
+@see resty.saml.binding.parse_redirect
+]]
+function _M.parse_redirect(saml_type, certs)
+  if ngx.req.get_method() ~= "GET" then return nil, nil, "method not allowed" end
+  local args = ngx.req.get_uri_args()
+  local summary, err = run("parse_redirect", saml_type, args, certs)
+  return summary, args, err
+end
+
+--[[---
+Create a post binding
+@string key_name name the signing key was shared under
+@string saml_type
+@string content
+@string sig_alg href
+@string relay_state
+@string destination
+@treturn ?string html
+@treturn ?string error
+@see resty.saml.binding.create_post
+]]
+function _M.create_post(key_name, saml_type, content, sig_alg, relay_state, destination)
+  return run("create_post", key_name, saml_type, content, sig_alg, relay_state, destination)
+end
+
+--[[---
+Parse a post binding
+@string saml_type either SAMLRequest or SAMLResponse
+@tparam string|table certs name of the shared certificate or trust store, or a table of names by issuer
+@treturn ?table summary `id`, `issuer`, `name_id`, `status_code`, `session_index` and `attrs` of the document,
+  which like the document @{resty.saml.binding} returns is there on some errors as well
+@treturn ?table args
+@treturn ?string error
+@see resty.saml.binding.parse_post
+]]
+function _M.parse_post(saml_type, certs)
+  if ngx.req.get_method() ~= "POST" then return nil, nil, "method not allowed" end
+
+  ngx.req.read_body()
+  local args, err = ngx.req.get_post_args()
+  if not args then return nil, nil, err end
+
+  if not args[saml_type] then return nil, args, "no " .. saml_type end
+  local summary, err = run("parse_post", args[saml_type], certs)
+  return summary, args, err
+end
+
+return _M
@@ -0,0 +1,113 @@
+--[[---
+The half of @{resty.saml.thread} that runs on a worker thread.  Only strings, numbers, booleans and tables can
+be passed between Lua states, so keys are referred to by the name they were shared under with `saml.key_share`
+and parsed documents are returned as a summary of their fields.
+@module resty.saml.worker
+]]
+
+local saml = require "saml"
+
+local _M = {}
+
+local function shared_key(name)
+  local key = saml.key_shared(name)
+  if not key then return nil, "no shared key " .. tostring(name) end
+  return key
+end
+
+-- A trust store shared under the name is used as it is, so the issuer is looked up and the document verified
+-- without calling back into Lua
+local function shared_trust(certs)
+  return type(certs) == "string" and saml.trust_shared(certs)
+end
+
+-- certs is either the name of one shared certificate or a table of names by issuer
+local function cert_name(certs, doc)
+  if type(certs) == "table" then
+    return certs[saml.doc_issuer(doc)]
+  end
+  return certs
+end
+
+-- The fields of the document in the shape saml.verify_xml returns them, read here since serializing the document
+-- to parse it again on the other side would cost more than reading them
+local function summarize(doc, err)
+  if not doc then return nil, err end
+  return {
+    id = saml.doc_id(doc),
+    issuer = saml.doc_issuer(doc),
+    name_id = saml.doc_name_id(doc),
+    status_code = saml.doc_status_code(doc),
+    session_index = saml.doc_session_index(doc),
+    attrs = saml.doc_attrs(doc),
+  }, err
+end
+
+--[[---
+@string key_name
+@string saml_type
+@string content
+@string sig_alg href
+@string relay_state
+@treturn ?string query string
+@treturn ?string error
+@see saml.binding_redirect_create
+]]
+function _M.create_redirect(key_name, saml_type, content, sig_alg, relay_state)
+  local key, err = shared_key(key_name)
+  if not key then return nil, err end
+  return saml.binding_redirect_create(key, saml_type, content, sig_alg, relay_state)
+end
+
+--[[---
+@string saml_type either SAMLRequest or SAMLResponse
+@tparam table args query string arguments
+@tparam string|table certs
+@treturn ?table summary
+@treturn ?string error
+@see saml.binding_redirect_parse
+]]
+function _M.parse_redirect(saml_type, args, certs)
+  local trust = shared_trust(certs)
+  if trust then return summarize(saml.binding_redirect_parse(saml_type, args, trust)) end
+  return summarize(saml.binding_redirect_parse(saml_type, args, function(doc)
+    local name = cert_name(certs, doc)
+    return name and saml.key_shared(name)
+  end))
+end
+
+--[[---
+@string key_name
+@string saml_type
+@string content
+@string sig_alg href
+@tparam ?string relay_state
+@string destination
+@treturn ?string html
+@treturn ?string error
+@see saml.binding_post_create
+]]
+function _M.create_post(key_name, saml_type, content, sig_alg, relay_state, destination)
+  local key, err = shared_key(key_name)
+  if not key then return nil, err end
+  return saml.binding_post_create(key, saml_type, content, sig_alg, relay_state, destination)
+end
+
+--[[---
+@string content base64 encoded document
+@tparam string|table certs
+@treturn ?table summary
+@treturn ?string error
+@see saml.binding_post_parse
+]]
+function _M.parse_post(content, certs)
+  local trust = shared_trust(certs)
+  if trust then return summarize(saml.binding_post_parse(content, trust)) end
+  return summarize(saml.binding_post_parse(content, function(doc)
+    local name = cert_name(certs, doc)
+    local cert = name and saml.key_shared(name)
+    return cert and (saml.create_keys_manager({ cert }))
+  end))
+end
+
+return _M
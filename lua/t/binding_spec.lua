@@ -16,7 +16,7 @@ describe("binding", function()
 
     authn_request = assert(utils.readfile(TEST_DATA_DIR .. "authn_request.xml"))
 
-    local err = saml.init({ data_dir=assert(os.getenv("DATA_DIR")) })
+    local err = saml.init({ data_dir=assert(os.getenv("DATA_DIR")), verify_cache_size=16 })
     if err then print(err) assert(nil) end
 
     key = assert(saml.key_read_file(TEST_DATA_DIR .. "sp.key", saml.KeyDataFormatPem))
@@ -55,6 +55,14 @@ describe("binding", function()
       assert.is_nil(query_string)
     end)
 
+    it("errors for a digest or c14n href as sig alg", function()
+      for _, href in ipairs({ saml.HrefSha256, "http://www.w3.org/2001/10/xml-exc-c14n#" }) do
+        local query_string, err = binding.create_redirect(key, { SigAlg = href, SAMLRequest = authn_request, RelayState = "/" })
+        assert.are.equal("invalid signature algorithm", err)
+        assert.is_nil(query_string)
+      end
+    end)
+
     it("creates a full query string", function()
       local query_string, err = binding.create_redirect(key, { SigAlg = utils.xmlSecHrefRsaSha512, SAMLRequest = authn_request, RelayState = "/" })
       assert.is_nil(err)
@@ -135,6 +143,16 @@ describe("binding", function()
       assert.is_not_nil(doc)
     end)
 
+    it("errors for a digest or c14n href as sig alg", function()
+      for _, href in ipairs({ saml.HrefSha256, "http://www.w3.org/2001/10/xml-exc-c14n#" }) do
+        valid_args.SigAlg = href
+        local doc, args, err = binding.parse_redirect("SAMLRequest", cb)
+        assert.are.equal("invalid signature algorithm", err)
+        doc, args, err = binding.parse_redirect("SAMLRequest", saml.trust_create())
+        assert.are.equal("invalid signature algorithm", err)
+      end
+    end)
+
     it("errors for verify failure", function()
       valid_args.Signature = "c2lnCG=="
       local doc, args, err = binding.parse_redirect("SAMLRequest", cb)
@@ -149,6 +167,85 @@ describe("binding", function()
       assert.are.equal("id-80", saml.doc_id(doc))
     end)
 
+    it("verifies a query string signed using ecdsa-sha256", function()
+      local ec_key = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-p256.key", saml.KeyDataFormatPem))
+      local ec_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-p256.crt", saml.KeyDataFormatCertPem))
+      local query_string = assert(binding.create_redirect(ec_key, { SigAlg = saml.HrefEcdsaSha256, SAMLRequest = authn_request, RelayState = "/" }))
+      local args = {}
+      for name, value in query_string:gmatch("([^&=]+)=([^&]*)") do
+        args[name] = saml.uri_decode(value)
+      end
+      ngx.req.get_uri_args.returns(args)
+
+      local doc, _, err = binding.parse_redirect("SAMLRequest", function(doc) return ec_cert end)
+      assert.is_nil(err)
+      assert.is_not_nil(doc)
+      doc, _, err = binding.parse_redirect("SAMLRequest", cb)
+      assert.are.equal("signature does not match", err)
+    end)
+
+    it("round trips a message that compresses many times over", function()
+      local padded = authn_request:gsub("</samlp:AuthnRequest>", string.rep("<!-- padding -->", 20000) .. "</samlp:AuthnRequest>")
+      local query_string = assert(binding.create_redirect(key, { SigAlg = utils.xmlSecHrefRsaSha512, SAMLRequest = padded, RelayState = "/" }))
+      local args = {}
+      for name, value in query_string:gmatch("([^&=]+)=([^&]*)") do
+        args[name] = saml.uri_decode(value)
+      end
+      assert.is_true(#args.SAMLRequest < #padded / 50)
+      ngx.req.get_uri_args.returns(args)
+
+      local doc, _, err = binding.parse_redirect("SAMLRequest", cb)
+      assert.is_nil(err)
+      assert.are.equal(saml.doc_id(assert(saml.doc_read_memory(padded))), saml.doc_id(doc))
+    end)
+
+    it("finds the cert by issuer in a table", function()
+      local doc, args, err = binding.parse_redirect("SAMLRequest", { ["http://localhost:8088"] = cert })
+      assert.is_nil(err)
+      assert.are.equal("id-80", saml.doc_id(doc))
+      doc, args, err = binding.parse_redirect("SAMLRequest", { ["http://idp.example.com/metadata.php"] = cert })
+      assert.are.equal("no cert", err)
+      assert.is_not_nil(doc)
+    end)
+
+    it("verifies with any key trusted for the issuer", function()
+      local trust = assert(saml.trust_create())
+      local idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+      assert.is_true(saml.trust_add(trust, "http://localhost:8088", idp_cert))
+      local doc, args, err = binding.parse_redirect("SAMLRequest", trust)
+      assert.are.equal("signature does not match", err)
+      assert.is_nil(doc)
+
+      assert.is_true(saml.trust_add(trust, "http://localhost:8088", cert))
+      doc, args, err = binding.parse_redirect("SAMLRequest", trust)
+      assert.is_nil(err)
+      assert.are.equal("id-80", saml.doc_id(doc))
+    end)
+
+    it("errors for an issuer with no trusted keys", function()
+      local trust = assert(saml.trust_create())
+      assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", cert))
+      local doc, args, err = binding.parse_redirect("SAMLRequest", trust)
+      assert.are.equal("no trusted key for issuer", err)
+      assert.is_nil(doc)
+    end)
+
+    it("checks the signature of a forged request before parsing it", function()
+      local trust = assert(saml.trust_create())
+      assert.is_true(saml.trust_add(trust, "http://localhost:8088", cert))
+      valid_args.Signature = valid_args.Signature:gsub("^....", "AAAA")
+      saml.stats_enable(true)
+      saml.stats_reset()
+      local doc, args, err = binding.parse_redirect("SAMLRequest", trust)
+      local stats = saml.stats()
+      saml.stats_enable(false)
+      assert.are.equal("signature does not match", err)
+      assert.is_nil(doc)
+      assert.are.equal(1, stats.verify_binary.count)
+      assert.are.equal(0, stats.xml_parse.count)
+      assert.are.equal(0, stats.xsd_validate.count)
+    end)
+
   end)
 
   describe(".create_post()", function()
@@ -159,6 +256,14 @@ describe("binding", function()
       assert.is_nil(html)
     end)
 
+    it("errors for a digest or c14n href as sig algorithm", function()
+      for _, href in ipairs({ saml.HrefSha256, "http://www.w3.org/2001/10/xml-exc-c14n#" }) do
+        local html, err = binding.create_post(key, "SAMLRequest", authn_request, href, "/", "dest")
+        assert.are.equal("invalid signature algorithm", err)
+        assert.is_nil(html)
+      end
+    end)
+
     it("errors for bad xml", function()
       local html, err = binding.create_post(key, "SAMLRequest", "xml", utils.xmlSecHrefRsaSha512, "/", "dest")
       assert.are.equal("content is not valid xml", err)
@@ -178,6 +283,52 @@ describe("binding", function()
   end)
 
 
+  describe(".create_post_doc()", function()
+
+    it("errors for bad sig algorithm", function()
+      local doc = assert(saml.doc_read_memory(authn_request))
+      local html, err = binding.create_post_doc(key, "SAMLRequest", doc, "rsa", "/", "dest")
+      assert.are.equal("invalid signature algorithm", err)
+      assert.is_nil(html)
+    end)
+
+    it("signs the document in place and returns the form", function()
+      local doc = assert(saml.doc_read_memory(authn_request))
+      local html, err = binding.create_post_doc(key, "SAMLRequest", doc, saml.HrefRsaSha256, "/", "dest")
+      assert.is_nil(err)
+      assert.truthy(html:find('action="dest"', 1, true))
+
+      local signed = saml.doc_serialize(doc)
+      assert.truthy(signed:find("SignatureValue", 1, true))
+      local encoded = html:match('name="SAMLRequest" value="([^"]+)"')
+      assert.are.equal(signed, saml.base64_decode(encoded))
+    end)
+
+    it("streams the bytes of doc_serialize for each encoding and base64 padding", function()
+      -- é in each encoding, repeated so the document spans several of libxml2's output flushes
+      for encoding, e in pairs({ ["UTF-8"] = "\195\169", ["ISO-8859-1"] = "\233" }) do
+        local remainders = {}
+        for pad = 0, 2 do
+          local provider = string.rep("SP t" .. e .. "st", 2000) .. string.rep("x", pad)
+          local xml = '<?xml version="1.0" encoding="' .. encoding .. '"?>\n' .. authn_request:gsub('ProviderName="SP test"', 'ProviderName="' .. provider .. '"')
+          local doc = assert(saml.doc_read_memory(xml))
+          local html, err = binding.create_post_doc(key, "SAMLRequest", doc, saml.HrefRsaSha256, "/", "dest")
+          assert.is_nil(err)
+
+          local signed = saml.doc_serialize(doc)
+          assert.truthy(signed:find(e, 1, true))
+          local encoded = html:match('name="SAMLRequest" value="([^"]+)"')
+          assert.are.equal(saml.base64_encode(signed), encoded)
+          assert.are.equal(signed, saml.base64_decode(encoded))
+          remainders[#signed % 3] = true
+        end
+        assert.are.same({ [0] = true, true, true }, remainders)
+      end
+    end)
+
+  end)
+
+
   describe(".parse_post()", function()
     local mngr, post_args, response
     local cb = function(doc) return mngr end
@@ -259,6 +410,184 @@ describe("binding", function()
       assert.are.equal("_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6", saml.doc_id(doc))
       assert.are.same(post_args, args)
     end)
+
+    it("skips validation and verification of a response it has verified", function()
+      assert.is_nil(select(3, binding.parse_post("SAMLResponse", cb)))
+      local before = saml.verify_cache_stats()
+      local doc, args, err = binding.parse_post("SAMLResponse", cb)
+      assert.is_nil(err)
+      assert.are.equal("_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6", saml.doc_id(doc))
+      assert.are.equal(before.hits + 2, saml.verify_cache_stats().hits)
+    end)
+
+    it("verifies a response signed using ecdsa-sha384", function()
+      local ec_key = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-p384.key", saml.KeyDataFormatPem))
+      assert(saml.key_add_cert_file(ec_key, TEST_DATA_DIR .. "sp-ec-p384.crt", saml.KeyDataFormatCertPem))
+      local ec_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-p384.crt", saml.KeyDataFormatCertPem))
+      local ec_mngr = assert(saml.create_keys_manager({ ec_cert }))
+      local content = assert(utils.readfile(TEST_DATA_DIR .. "response.xml"))
+      local html = assert(binding.create_post(ec_key, "SAMLResponse", content, saml.HrefEcdsaSha384, "/", "dest"))
+      post_args.SAMLResponse = html:match('name="SAMLResponse" value="([^"]+)"')
+
+      local doc, args, err = binding.parse_post("SAMLResponse", function(doc) return ec_mngr end)
+      assert.is_nil(err)
+      assert.is_not_nil(doc)
+    end)
+
+    it("verifies a cached response again for a key manager without its key", function()
+      assert.is_nil(select(3, binding.parse_post("SAMLResponse", cb)))
+      local idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+      local other = saml.create_keys_manager({ idp_cert })
+      local doc, args, err = binding.parse_post("SAMLResponse", function(doc) return other end)
+      assert.is_not_nil(err)
+    end)
+
+    it("finds the keys manager by issuer in a table", function()
+      local doc, args, err = binding.parse_post("SAMLResponse", { ["http://idp.example.com/metadata.php"] = mngr })
+      assert.is_nil(err)
+      assert.are.equal("_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6", saml.doc_id(doc))
+      doc, args, err = binding.parse_post("SAMLResponse", { ["http://localhost:8088"] = mngr })
+      assert.are.equal("no cert", err)
+      assert.is_not_nil(doc)
+    end)
+
+    it("verifies with the keys trusted for the issuer", function()
+      local trust = assert(saml.trust_create())
+      local idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+      assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", idp_cert))
+      assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", cert))
+      local doc, args, err = binding.parse_post("SAMLResponse", trust)
+      assert.is_nil(err)
+      assert.are.equal("_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6", saml.doc_id(doc))
+
+      assert.is_true(saml.trust_remove(trust, "http://idp.example.com/metadata.php"))
+      assert.is_false(saml.trust_remove(trust, "http://idp.example.com/metadata.php"))
+      doc, args, err = binding.parse_post("SAMLResponse", trust)
+      assert.are.equal("no trusted key for issuer", err)
+      assert.is_not_nil(doc)
+    end)
+
+    it("verifies with a trust store opened from a file", function()
+      local path = os.tmpname()
+      local trust = assert(saml.trust_create())
+      local idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+      assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", idp_cert))
+      assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", cert))
+      assert.is_true(saml.trust_write(trust, path))
+
+      local opened = assert(saml.trust_open(path))
+      local doc, args, err = binding.parse_post("SAMLResponse", opened)
+      assert.is_nil(err)
+      assert.are.equal("_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6", saml.doc_id(doc))
+
+      assert.is_true(saml.trust_remove(trust, "http://idp.example.com/metadata.php"))
+      assert.is_true(saml.trust_add(trust, "http://sp.example.com/demo1/metadata.php", cert))
+      assert.is_true(saml.trust_write(trust, path))
+      doc, args, err = binding.parse_post("SAMLResponse", opened)
+      assert.is_nil(err)
+      assert.is_true(saml.trust_reload(opened))
+      doc, args, err = binding.parse_post("SAMLResponse", opened)
+      assert.are.equal("no trusted key for issuer", err)
+      os.remove(path)
+    end)
+
+    it("errors for a trust store file that is not one", function()
+      local path = os.tmpname()
+      local f = assert(io.open(path, "w"))
+      f:write("not a trust store")
+      f:close()
+      local trust, err = saml.trust_open(path)
+      assert.is_nil(trust)
+      assert.are.equal("open trust store failed", err)
+      os.remove(path)
+    end)
+
+    describe("with a certificate in the signature", function()
+      local idp_cert, ec_cert
+
+      setup(function()
+        idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+        ec_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-p256.crt", saml.KeyDataFormatCertPem))
+      end)
+
+      before_each(function()
+        local content = assert(utils.readfile(TEST_DATA_DIR .. "response.xml"))
+        local html = assert(binding.create_post(key, "SAMLResponse", content, saml.HrefRsaSha256, "/", "dest"))
+        post_args.SAMLResponse = html:match('name="SAMLResponse" value="([^"]+)"')
+      end)
+
+      after_each(function()
+        saml.stats_enable(false)
+        saml.stats_reset()
+      end)
+
+      it("verifies with only the trusted key it names", function()
+        local trust = assert(saml.trust_create())
+        assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", idp_cert))
+        assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", ec_cert))
+        assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", cert))
+        saml.stats_enable(true)
+        saml.stats_reset()
+        local doc, args, err = binding.parse_post("SAMLResponse", trust)
+        assert.is_nil(err)
+        assert.is_not_nil(doc)
+        assert.are.equal(1, saml.stats().verify_doc.count)
+      end)
+
+      it("errors without verifying when the certificate is not trusted", function()
+        local trust = assert(saml.trust_create())
+        assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", idp_cert))
+        saml.stats_enable(true)
+        saml.stats_reset()
+        local doc, args, err = binding.parse_post("SAMLResponse", trust)
+        assert.are.equal("signing certificate is not trusted for issuer", err)
+        assert.is_not_nil(doc)
+        assert.are.equal(0, saml.stats().verify_doc.count)
+      end)
+
+      it("errors without verifying when a trusted KeyName comes with an untrusted certificate", function()
+        local named = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+        assert.is_true(saml.key_set_name(named, "idp"))
+        local trust = assert(saml.trust_create())
+        assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", named))
+
+        local signed = saml.base64_decode(post_args.SAMLResponse)
+        for _, replacement in ipairs({ "%1<KeyName>idp</KeyName>%2", "%1%2<KeyName>idp</KeyName>" }) do
+          local named_signed, n = signed:gsub("(<KeyInfo>)(.-</X509Data>)", replacement)
+          assert.are.equal(1, n)
+          post_args.SAMLResponse = saml.base64_encode(named_signed)
+          saml.stats_enable(true)
+          saml.stats_reset()
+          local doc, args, err = binding.parse_post("SAMLResponse", trust)
+          assert.are.equal("signing certificate is not trusted for issuer", err)
+          assert.are.equal(0, saml.stats().verify_doc.count)
+        end
+      end)
+    end)
+  end)
+
+
+  describe("saml.base64_decode()", function()
+
+    it("decodes each padding length", function()
+      assert.are.equal("A", saml.base64_decode("QQ=="))
+      assert.are.equal("AB", saml.base64_decode("QUI="))
+      assert.are.equal("ABC", saml.base64_decode("QUJD"))
+      assert.are.equal("ABCD", saml.base64_decode("QUJDRA=="))
+      assert.are.equal("", saml.base64_decode(""))
+    end)
+
+    it("returns nil for padding before the end of the input", function()
+      for _, encoded in ipairs({ "=AAA", "A=AA", "AA=A", "QQ=A", "A===", "====", "AAA=AAAA", "AA==AAAA", "QQ==QQ==" }) do
+        assert.is_nil(saml.base64_decode(encoded), encoded)
+      end
+    end)
+
+    it("returns nil for input that is not a whole number of quadruplets", function()
+      assert.is_nil(saml.base64_decode("QQ"))
+      assert.is_nil(saml.base64_decode("QUJDR"))
+    end)
+
   end)
 
 end)
@@ -5,10 +5,13 @@ local TEST_DATA_DIR = os.getenv("TEST_DATA_DIR")
 describe("sig", function()
   local saml
   local key, cert, transform_sha256, transform_sha512
+  local ec_keys = {}
 
   local binary_data = "agBv0s1vhMpOxGbsoj1lMPCoYyUOAivpBxZlTyozJcgSmLwCWp1uijM2UTHo"
   local binary_signature_rsa_sha256 = "OEBg0Lv7V2aueh5HjiSQJh2Fw5lOm+HPocomlGepvcYAHDcSNXrFmCixOUqmCh9c5Pti3tQ0lOm5qCZ/aMJr7YkTiMYaNE7C3fjYYyDBCj0zoKZIo7UQ966DFe6ezZtBlVUtiuhTcNmeQ67Bk2BE5TRwzKWu0Ahy2LICzQC99gOtzfGgU+pWi+l4IcIrGq3v+aUGcVigWPKh3TVcVyhYr/V5qt+zoSxH6LDvE2Z49UKsuaOSQFhHnKb91SZOncWGh7K01JumAoq4ADyjTfDFExTXE0HVecgwbEI7xlnyVgI/I4OfqPHHDdLk3TuaWpfoq1rLFCJQwMjE+jlm1++kZA=="
   local binary_signature_rsa_sha512 = "OajQbB55E5B/heKbhcUaBvKiArrmYdfs4nJLU39rSk/3e5yvy9F9osnWAeJUu9xnThDnmBrvWSFeDnQIe2Y/hhypEHesdMsPG6R+RkFbQxv4icU+oEDh8wFetDEByuyueox/zqA+z6X9knt8+ufs6Mdfw0UIcxbg9rgNaB75JleI/ye9f97sAXc8K5lmZ6IHst200TX6Bw5Onpf2OLKOmsMdekLLdTmUew4ynNmeMlOdE20EUJvsH3y7WRBbW3JI8ffLBT4NHNyOfvt0CCOmynpmbEjfGg7jsq6J3bl4rZVrlDovMhuP3iyxjiwtj5gq44g++FYtYw8aQGXfBb28wA=="
+  local binary_signature_ecdsa_sha256 = "jF979kZyZKZCfBb8SQV6lOe80EHgYmSgqicFTmWcTos6wSxZZ6fTdKHGDsbzA6jgM6Jyxo61aEmFrGNUvAUsoQ=="
+  local binary_signature_ecdsa_sha384 = "+08t6hHAGOpv8uDL7MDNctqRQht8n+LJg5IO93UD8VOZhBXFeFF1G2t95pfkRaykVCcPp94ShFlzZTNg8r1JU189gOskMDwMpHKiVBEuMyIK5grfTcrL8TXmpLGF3xV0"
 
   setup(function()
     saml = require "saml"
@@ -22,6 +25,15 @@ describe("sig", function()
 
     transform_sha256 = assert(saml.find_transform_by_href(utils.xmlSecHrefRsaSha256))
     transform_sha512 = assert(saml.find_transform_by_href(utils.xmlSecHrefRsaSha512))
+
+    for _, curve in ipairs({ "p256", "p384" }) do
+      local ec_key = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-" .. curve .. ".key", saml.KeyDataFormatPem))
+      assert(saml.key_add_cert_file(ec_key, TEST_DATA_DIR .. "sp-ec-" .. curve .. ".crt", saml.KeyDataFormatCertPem))
+      ec_keys[curve] = {
+        key = ec_key,
+        cert = assert(saml.key_read_file(TEST_DATA_DIR .. "sp-ec-" .. curve .. ".crt", saml.KeyDataFormatCertPem)),
+      }
+    end
   end)
 
 
@@ -39,6 +51,22 @@ describe("sig", function()
       assert.are.equal(saml.base64_encode(result), binary_signature_rsa_sha512)
     end)
 
+    it("generates verifiable bytes using ecdsa-sha256", function()
+      local transform = saml.find_transform_by_href(saml.HrefEcdsaSha256)
+      local result, err = saml.sign_binary(ec_keys.p256.key, transform, binary_data)
+      assert.is_nil(err)
+      assert.are.equal(64, #result)
+      assert.is_true(saml.verify_binary(ec_keys.p256.cert, transform, binary_data, result))
+    end)
+
+    it("generates verifiable bytes using ecdsa-sha384", function()
+      local transform = saml.find_transform_by_href(saml.HrefEcdsaSha384)
+      local result, err = saml.sign_binary(ec_keys.p384.key, transform, binary_data)
+      assert.is_nil(err)
+      assert.are.equal(96, #result)
+      assert.is_true(saml.verify_binary(ec_keys.p384.cert, transform, binary_data, result))
+    end)
+
   end)
 
 
@@ -74,6 +102,154 @@ describe("sig", function()
       assert.are.equal(expected, result)
     end)
 
+    it("digests with sha256 by default", function()
+      local result, err = saml.sign_xml(key, transform_sha256, input)
+      assert.is_nil(err)
+      assert.is_not_nil(result:find('<DigestMethod Algorithm="' .. saml.HrefSha256 .. '"/>', 1, true))
+    end)
+
+    it("digests with the given digest method", function()
+      for _, digest in ipairs({ saml.HrefSha512, saml.find_transform_by_href(saml.HrefSha512) }) do
+        local result, err = saml.sign_xml(key, transform_sha256, input, { digest = digest })
+        assert.is_nil(err)
+        assert.is_not_nil(result:find('<DigestMethod Algorithm="' .. saml.HrefSha512 .. '"/>', 1, true))
+        assert.is_true(saml.verify_doc(assert(saml.create_keys_manager({ cert })), assert(saml.doc_read_memory(result))))
+      end
+    end)
+
+    it("errors for a digest that is not a digest method", function()
+      local result, err = saml.sign_xml(key, transform_sha256, input, { digest = transform_sha256 })
+      assert.are.equal(err, "saml sign failed")
+      assert.is_nil(result)
+      assert.has_error(function() saml.sign_xml(key, transform_sha256, input, { digest = "urn:unknown" }) end)
+    end)
+
+    it("generates a verifiable document using ecdsa-sha384", function()
+      local result, err = saml.sign_xml(ec_keys.p384.key, saml.find_transform_by_href(saml.HrefEcdsaSha384), input)
+      assert.is_nil(err)
+      local mngr = assert(saml.create_keys_manager({ ec_keys.p384.cert }))
+      assert.is_true(saml.verify_doc(mngr, assert(saml.doc_read_memory(result))))
+    end)
+
+  end)
+
+
+  describe(".signer_sign_doc()", function()
+    local opts = { id_attr = "ID", insert_after = { "urn:oasis:names:tc:SAML:2.0:assertion", "Issuer" } }
+    local input, response
+
+    setup(function()
+      input = assert(utils.readfile(TEST_DATA_DIR .. "simple-input.xml"))
+      response = assert(utils.readfile(TEST_DATA_DIR .. "response.xml"))
+    end)
+
+    it("errors for a digest that is not a digest method", function()
+      local signer, err = saml.signer_create(key, transform_sha256, transform_sha512)
+      assert.are.equal("create signer failed", err)
+      assert.is_nil(signer)
+    end)
+
+    it("errors for document with no id_attr", function()
+      local signer = assert(saml.signer_create(key, transform_sha256))
+      local doc = assert(saml.doc_read_memory(input))
+      assert.are.equal("saml sign failed", saml.signer_sign_doc(signer, doc, { id_attr = "ID" }))
+    end)
+
+    it("generates the same document as sign_doc", function()
+      local signer = assert(saml.signer_create(key, transform_sha256, saml.HrefSha512))
+      for _, case in ipairs({ { input }, { response, opts }, { response, opts } }) do
+        local expected = assert(saml.doc_read_memory(case[1]))
+        assert.is_nil(saml.sign_doc(key, transform_sha256, expected, { digest = saml.HrefSha512, id_attr = case[2] and case[2].id_attr, insert_after = case[2] and case[2].insert_after }))
+        local doc = assert(saml.doc_read_memory(case[1]))
+        assert.is_nil(saml.signer_sign_doc(signer, doc, case[2]))
+        assert.are.equal(saml.doc_serialize(expected), saml.doc_serialize(doc))
+      end
+    end)
+
+    it("generates a verifiable document using ecdsa-sha256", function()
+      local signer = assert(saml.signer_create(ec_keys.p256.key, saml.find_transform_by_href(saml.HrefEcdsaSha256)))
+      local doc = assert(saml.doc_read_memory(response))
+      assert.is_nil(saml.signer_sign_doc(signer, doc, opts))
+      local mngr = assert(saml.create_keys_manager({ ec_keys.p256.cert }))
+      assert.is_true(saml.verify_doc(mngr, doc, { id_attr = "ID" }))
+    end)
+
+    it("generates verifiable documents with the thread's copy of the key", function()
+      local signer = assert(saml.signer_create(key, transform_sha256))
+      local mngr = assert(saml.create_keys_manager({ cert }))
+      -- The first signature makes the copy and the second finds it
+      for _ = 1, 2 do
+        local doc = assert(saml.doc_read_memory(response))
+        assert.is_nil(saml.signer_sign_doc(signer, doc, opts))
+        assert.is_true(saml.verify_doc(mngr, doc, { id_attr = "ID" }))
+      end
+    end)
+
+    it("does not sign with the copies of a freed signer", function()
+      local signer = assert(saml.signer_create(key, transform_sha256))
+      assert.is_nil(saml.signer_sign_doc(signer, assert(saml.doc_read_memory(response)), opts))
+      signer = nil
+      collectgarbage()
+
+      local idp_key = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.key", saml.KeyDataFormatPem))
+      local idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+      signer = assert(saml.signer_create(idp_key, transform_sha256))
+      local doc = assert(saml.doc_read_memory(response))
+      assert.is_nil(saml.signer_sign_doc(signer, doc, opts))
+      assert.is_true(saml.verify_doc(assert(saml.create_keys_manager({ idp_cert })), doc, { id_attr = "ID" }))
+    end)
+
+  end)
+
+
+  describe(".response_build()", function()
+    local response = {
+      id = "_r1",
+      issue_instant = "2024-01-01T00:00:00Z",
+      destination = "https://sp.example.com/acs?a=1&b=2",
+      in_response_to = "_req1",
+      issuer = "https://idp.example.com",
+      assertion_id = "_a1",
+      name_id = "user@example.com",
+      name_id_format = "urn:oasis:names:tc:SAML:1.1:nameid-format:emailAddress",
+      not_before = "2024-01-01T00:00:00Z",
+      not_on_or_after = "2024-01-01T00:05:00Z",
+      audience = "https://sp.example.com",
+      session_index = "_s1",
+      authn_context_class_ref = "urn:oasis:names:tc:SAML:2.0:ac:classes:Password",
+      attrs = { uid = "test", groups = { "a&b", "<c>" } },
+    }
+
+    it("errors for a missing field", function()
+      local signer = assert(saml.signer_create(key, transform_sha256))
+      local xml, err = saml.response_build(signer, { id = "_r1", issue_instant = "2024-01-01T00:00:00Z" })
+      assert.are.equal("invalid response", err)
+      assert.is_nil(xml)
+    end)
+
+    it("generates a valid, verifiable document", function()
+      local signer = assert(saml.signer_create(key, transform_sha256))
+      local xml, err = saml.response_build(signer, response)
+      assert.is_nil(err)
+      local doc = assert(saml.doc_read_memory(xml))
+      assert.is_true(saml.doc_validate(doc))
+      local mngr = assert(saml.create_keys_manager({ cert }))
+      assert.is_true(saml.verify_doc(mngr, doc, { id_attr = "ID" }))
+      assert.are.equal("https://idp.example.com", saml.doc_issuer(doc))
+      assert.are.equal("user@example.com", saml.doc_name_id(doc))
+      assert.are.same(response.attrs, saml.doc_attrs(doc))
+    end)
+
+    it("generates a verifiable document without an assertion using ecdsa-sha256", function()
+      local signer = assert(saml.signer_create(ec_keys.p256.key, saml.find_transform_by_href(saml.HrefEcdsaSha256)))
+      local xml = assert(saml.response_build(signer, { id = "_r1", issue_instant = "2024-01-01T00:00:00Z", issuer = "https://idp.example.com", status_code = saml.STATUS_REQUESTER }))
+      local doc = assert(saml.doc_read_memory(xml))
+      assert.is_true(saml.doc_validate(doc))
+      local mngr = assert(saml.create_keys_manager({ ec_keys.p256.cert }))
+      assert.is_true(saml.verify_doc(mngr, doc, { id_attr = "ID" }))
+      assert.are.equal(saml.STATUS_REQUESTER, saml.doc_status_code(doc))
+    end)
+
   end)
 
 
@@ -97,6 +273,65 @@ describe("sig", function()
       assert.is_true(valid)
     end)
 
+    it("verifies correctly signed content using ecdsa-sha256", function()
+      local transform = saml.find_transform_by_href(saml.HrefEcdsaSha256)
+      local valid, err = saml.verify_binary(ec_keys.p256.cert, transform, binary_data, saml.base64_decode(binary_signature_ecdsa_sha256))
+      assert.is_nil(err)
+      assert.is_true(valid)
+    end)
+
+    it("verifies correctly signed content using ecdsa-sha384", function()
+      local transform = saml.find_transform_by_href(saml.HrefEcdsaSha384)
+      local valid, err = saml.verify_binary(ec_keys.p384.cert, transform, binary_data, saml.base64_decode(binary_signature_ecdsa_sha384))
+      assert.is_nil(err)
+      assert.is_true(valid)
+    end)
+
+    it("rejects ecdsa content verified with the wrong curve", function()
+      local transform = saml.find_transform_by_href(saml.HrefEcdsaSha256)
+      local valid, err = saml.verify_binary(ec_keys.p384.cert, transform, binary_data, saml.base64_decode(binary_signature_ecdsa_sha256))
+      assert.is_nil(err)
+      assert.is_false(valid)
+    end)
+
+    it("round trips rsa and ecdsa signatures", function()
+      local pairs_ = {
+        { key, cert, transform_sha256 },
+        { key, cert, transform_sha512 },
+        { ec_keys.p256.key, ec_keys.p256.cert, saml.find_transform_by_href(saml.HrefEcdsaSha256) },
+        { ec_keys.p384.key, ec_keys.p384.cert, saml.find_transform_by_href(saml.HrefEcdsaSha384) },
+      }
+      -- Twice each, so the second round reuses the contexts the first one prepared
+      for _ = 1, 2 do
+        for _, p in ipairs(pairs_) do
+          local sig = assert(saml.sign_binary(p[1], p[3], binary_data))
+          assert.is_true(saml.verify_binary(p[2], p[3], binary_data, sig))
+          assert.is_false(saml.verify_binary(p[2], p[3], binary_data .. "x", sig))
+        end
+      end
+    end)
+
+    it("rejects content signed with another key", function()
+      local idp_key = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.key", saml.KeyDataFormatPem))
+      local sig = assert(saml.sign_binary(idp_key, transform_sha256, binary_data))
+      local valid, err = saml.verify_binary(cert, transform_sha256, binary_data, sig)
+      assert.is_nil(err)
+      assert.is_false(valid)
+    end)
+
+    it("verifies with keys read after others were freed", function()
+      for _ = 1, 3 do
+        local idp_key = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.key", saml.KeyDataFormatPem))
+        local idp_cert = assert(saml.key_read_file(TEST_DATA_DIR .. "idp.crt", saml.KeyDataFormatCertPem))
+        local sig = assert(saml.sign_binary(idp_key, transform_sha256, binary_data))
+        assert.is_true(saml.verify_binary(idp_cert, transform_sha256, binary_data, sig))
+        assert.is_false(saml.verify_binary(cert, transform_sha256, binary_data, sig))
+        idp_key, idp_cert = nil, nil
+        collectgarbage()
+      end
+      assert.is_true(saml.verify_binary(cert, transform_sha256, binary_data, saml.base64_decode(binary_signature_rsa_sha256)))
+    end)
+
   end)
 
 
@@ -122,6 +357,74 @@ describe("sig", function()
       assert.is_true(valid)
     end)
 
+    it("verifies documents signed using ecdsa", function()
+      for curve, alg in pairs({ p256 = "ecdsa-sha256", p384 = "ecdsa-sha384" }) do
+        local ec_mngr = assert(saml.create_keys_manager({ ec_keys[curve].cert }))
+        local doc = assert(saml.doc_read_file(TEST_DATA_DIR .. "simple-signed-" .. alg .. ".xml"))
+        local valid, err = saml.verify_doc(ec_mngr, doc)
+        assert.is_nil(err)
+        assert.is_true(valid)
+        assert.is_falsy(saml.verify_doc(mngr, doc))
+      end
+    end)
+
+  end)
+
+
+  describe(".verify_xml()", function()
+    local mngr
+
+    setup(function()
+      mngr = assert(saml.create_keys_manager({ cert }))
+    end)
+
+    it("rejects an incorrectly signed document", function()
+      local xml = assert(utils.readfile(TEST_DATA_DIR .. "simple-bad-sig-rsa-sha256.xml"))
+      local valid, summary, err = saml.verify_xml(mngr, xml)
+      assert.is_nil(err)
+      assert.is_nil(summary)
+      assert.is_false(valid)
+    end)
+
+    it("verifies a built response as it is parsed", function()
+      local signer = assert(saml.signer_create(key, transform_sha256))
+      local xml = assert(saml.response_build(signer, {
+        id = "_r1",
+        issue_instant = "2024-01-01T00:00:00Z",
+        issuer = "https://idp.example.com",
+        assertion_id = "_a1",
+        name_id = "user@example.com",
+        session_index = "_s1",
+        authn_context_class_ref = "urn:oasis:names:tc:SAML:2.0:ac:classes:Password",
+        attrs = { uid = "test", groups = { "a&b", "<c>" } },
+      }))
+      local valid, summary, err = saml.verify_xml(mngr, xml, { id_attr = "ID" })
+      assert.is_nil(err)
+      assert.is_true(valid)
+      assert.are.same({
+        id = "_r1",
+        issuer = "https://idp.example.com",
+        name_id = "user@example.com",
+        status_code = saml.STATUS_SUCCESS,
+        session_index = "_s1",
+        attrs = { uid = "test", groups = { "a&b", "<c>" } },
+        streamed = true,
+      }, summary)
+
+      local valid, summary, err = saml.verify_xml(mngr, xml:gsub("user@", "admin@"), { id_attr = "ID" })
+      assert.is_nil(err)
+      assert.is_false(valid)
+    end)
+
+    it("verifies other documents as verify_doc does", function()
+      local xml = assert(utils.readfile(TEST_DATA_DIR .. "simple-signed-rsa-sha256.xml"))
+      local doctype = xml:gsub("<Envelope", "<!DOCTYPE Envelope>\n<Envelope", 1)
+      local valid, summary, err = saml.verify_xml(mngr, doctype)
+      assert.is_nil(err)
+      assert.is_true(valid)
+      assert.is_false(summary.streamed)
+    end)
+
   end)
 
 end)
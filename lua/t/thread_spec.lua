@@ -0,0 +1,128 @@
+local utils = require "utils"
+
+local TEST_DATA_DIR = os.getenv("TEST_DATA_DIR")
+
+describe("thread", function()
+  local thread, saml
+  local key, cert, authn_request, response
+
+  setup(function()
+    thread = require "resty.saml.thread"
+    saml   = require "saml"
+
+    authn_request = assert(utils.readfile(TEST_DATA_DIR .. "authn_request.xml"))
+    response = assert(utils.readfile(TEST_DATA_DIR .. "response-signed.xml.b64"))
+
+    local err = saml.init({ data_dir=assert(os.getenv("DATA_DIR")) })
+    if err then print(err) assert(nil) end
+
+    key = assert(saml.key_read_file(TEST_DATA_DIR .. "sp.key", saml.KeyDataFormatPem))
+    assert(saml.key_add_cert_file(key, TEST_DATA_DIR .. "sp.crt", saml.KeyDataFormatCertPem))
+    cert = assert(saml.key_read_file(TEST_DATA_DIR .. "sp.crt", saml.KeyDataFormatCertPem))
+    assert.is_true(saml.key_share("sp", key))
+    assert.is_true(saml.key_share("sp.crt", cert))
+
+    if not _G.ngx then
+      _G.ngx = { req = {} }
+    end
+    stub(ngx.req, "get_method")
+    stub(ngx.req, "get_post_args")
+    stub(ngx.req, "get_uri_args")
+    stub(ngx.req, "read_body")
+  end)
+
+  teardown(function()
+    ngx.req.get_method:revert()
+    ngx.req.get_post_args:revert()
+    ngx.req.get_uri_args:revert()
+    ngx.req.read_body:revert()
+  end)
+
+
+  describe("saml.key_shared()", function()
+
+    it("returns a copy of the shared key", function()
+      local shared = saml.key_shared("sp")
+      assert.is_not_nil(shared)
+      assert.are_not.equal(key, shared)
+      local sig = assert(saml.sign_binary(shared, saml.find_transform_by_href(utils.xmlSecHrefRsaSha256), "data"))
+      assert.is_true(saml.verify_binary(cert, saml.find_transform_by_href(utils.xmlSecHrefRsaSha256), "data", sig))
+    end)
+
+    it("returns nil for an unknown name", function()
+      assert.is_nil(saml.key_shared("unknown"))
+    end)
+
+    it("forgets a key shared as nil", function()
+      assert.is_true(saml.key_share("tmp", cert))
+      assert.is_not_nil(saml.key_shared("tmp"))
+      assert.is_true(saml.key_share("tmp", nil))
+      assert.is_nil(saml.key_shared("tmp"))
+    end)
+
+  end)
+
+
+  describe(".create_redirect()", function()
+
+    it("errors for an unknown key", function()
+      local query_string, err = thread.create_redirect("unknown", { SigAlg = utils.xmlSecHrefRsaSha512, SAMLRequest = authn_request, RelayState = "/" })
+      assert.are.equal("no shared key unknown", err)
+      assert.is_nil(query_string)
+    end)
+
+    it("signs with the shared key", function()
+      local query_string, err = thread.create_redirect("sp", { SigAlg = utils.xmlSecHrefRsaSha512, SAMLRequest = authn_request, RelayState = "/" })
+      assert.is_nil(err)
+      assert.is_not_nil(query_string:find("&Signature=", 1, true))
+    end)
+
+  end)
+
+
+  describe(".parse_post()", function()
+
+    before_each(function()
+      ngx.req.get_method.returns("POST")
+      ngx.req.get_post_args.returns({ SAMLResponse = response }, nil)
+    end)
+
+    it("errors when no cert is found", function()
+      local summary, args, err = thread.parse_post("SAMLResponse", { ["https://unknown"] = "sp.crt" })
+      assert.are.equal("no cert", err)
+      assert.is_not_nil(summary)
+    end)
+
+    it("returns the fields of the verified document", function()
+      local summary, args, err = thread.parse_post("SAMLResponse", "sp.crt")
+      assert.is_nil(err)
+      local doc = assert(saml.binding_post_parse(response, function() return saml.create_keys_manager({ cert }) end))
+      assert.are.same({
+        id = "_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6",
+        issuer = saml.doc_issuer(doc),
+        name_id = saml.doc_name_id(doc),
+        status_code = saml.doc_status_code(doc),
+        session_index = saml.doc_session_index(doc),
+        attrs = saml.doc_attrs(doc),
+      }, summary)
+    end)
+
+    it("verifies with a shared trust store", function()
+      local trust = assert(saml.trust_create())
+      assert.is_true(saml.trust_share("idps", trust))
+      local summary, args, err = thread.parse_post("SAMLResponse", "idps")
+      assert.are.equal("no trusted key for issuer", err)
+
+      assert.is_true(saml.trust_add(trust, "http://idp.example.com/metadata.php", cert))
+      summary, args, err = thread.parse_post("SAMLResponse", "idps")
+      assert.is_nil(err)
+      assert.are.equal("_8e8dc5f69a98cc4c1ff3427e5ce34606fd672f91e6", summary.id)
+      assert.are.equal("http://idp.example.com/metadata.php", summary.issuer)
+
+      assert.is_true(saml.trust_share("idps", nil))
+      assert.is_nil(saml.trust_shared("idps"))
+    end)
+
+  end)
+
+end)
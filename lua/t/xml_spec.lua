@@ -98,4 +98,29 @@ describe("xml", function()
     end)
   end)
 
+  describe(".stats()", function()
+
+    after_each(function()
+      saml.stats_enable(false)
+      saml.stats_reset()
+    end)
+
+    it("records nothing while disabled", function()
+      saml.stats_reset()
+      assert.is_true(saml.doc_validate(response))
+      assert.are.equal(0, saml.stats().xsd_validate.count)
+    end)
+
+    it("records the stages that ran", function()
+      saml.stats_enable(true)
+      saml.stats_reset()
+      assert.is_true(saml.doc_validate(response))
+      local stats = saml.stats()
+      assert.are.equal(1, stats.xsd_validate.count)
+      assert.is_true(stats.xsd_validate.max > 0)
+      assert.is_true(stats.xsd_validate.p50 <= stats.xsd_validate.max)
+      assert.are.equal(0, stats.verify_doc.count)
+    end)
+  end)
+
 end)
@@ -16,6 +16,8 @@ static char* CAPSULE_XML_DOC = "xmlDoc*";
 static char* CAPSULE_XML_SEC_KEY = "xmlSecKey*";
 static char* CAPSULE_XML_SEC_KEYS_MNGR= "xmlSecKeysMngr*";
 static char* CAPSULE_XML_SEC_TRANSFORM_ID = "xmlSecTransformId";
+static char* CAPSULE_SAML_SIGNER = "saml_signer_t*";
+static char* CAPSULE_SAML_TRUST = "saml_trust_t*";
 
 
 static void xmlDoc_destructor(PyObject* capsule) {
@@ -28,9 +30,7 @@ static void xmlDoc_destructor(PyObject* capsule) {
 
 static void xmlSecKey_destructor(PyObject* capsule) {
   xmlSecKey* key = (xmlSecKey*)PyCapsule_GetPointer(capsule, CAPSULE_XML_SEC_KEY);
-  if (key != NULL) {
-    xmlSecKeyDestroy(key);
-  }
+  saml_key_free(key);
 }
 
 
@@ -42,11 +42,37 @@ static void xmlSecKeysMngr_destructor(PyObject* capsule) {
 }
 
 
+static void saml_signer_destructor(PyObject* capsule) {
+  saml_signer_t* signer = (saml_signer_t*)PyCapsule_GetPointer(capsule, CAPSULE_SAML_SIGNER);
+  if (signer != NULL) {
+    saml_signer_free(signer);
+  }
+}
+
+
+static void saml_trust_destructor(PyObject* capsule) {
+  saml_trust_t* trust = (saml_trust_t*)PyCapsule_GetPointer(capsule, CAPSULE_SAML_TRUST);
+  if (trust != NULL) {
+    saml_trust_free(trust);
+  }
+}
+
+
 static PyObject* init(PyObject* self, PyObject* args, PyObject* kwargs) {
   saml_init_opts_t opts;
   opts.debug = 0;
-  char* keywords[] = { "data_dir", "debug", NULL };
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$p", keywords, &opts.data_dir, &opts.debug)) {
+  opts.lazy_schema = 0;
+  opts.stats = 0;
+  opts.verify_cache_size = 0;
+  opts.verify_cache_ttl = 300;
+  opts.batch_threads = 0;
+  opts.deflate_level = 0;
+  opts.deflate_mem_level = 0;
+  char* keywords[] = { "data_dir", "debug", "lazy_schema", "stats", "verify_cache_size", "verify_cache_ttl", "batch_threads",
+                       "deflate_level", "deflate_mem_level", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$pppiiiii", keywords, &opts.data_dir, &opts.debug, &opts.lazy_schema, &opts.stats,
+                                   &opts.verify_cache_size, &opts.verify_cache_ttl, &opts.batch_threads,
+                                   &opts.deflate_level, &opts.deflate_mem_level)) {
     return NULL;
   }
 
@@ -69,6 +95,88 @@ static PyObject* shutdown(PyObject* self, PyObject* args) {
 }
 
 
+static PyObject* stats_enable(PyObject* self, PyObject* args) {
+  int enabled;
+  if (!PyArg_ParseTuple(args, "p", &enabled)) {
+    return NULL;
+  }
+
+  saml_stats_enable(enabled);
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* stats_reset(PyObject* self, PyObject* args) {
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+
+  saml_stats_reset();
+  Py_RETURN_NONE;
+}
+
+
+// Latencies are in microseconds
+static PyObject* stats(PyObject* self, PyObject* args) {
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+
+  saml_stats_t* snapshot = malloc(sizeof(saml_stats_t));
+  if (snapshot == NULL) {
+    return PyErr_NoMemory();
+  }
+  saml_stats_snapshot(snapshot);
+
+  PyObject* ret = PyDict_New();
+  for (int i = 0; ret != NULL && i < SAML_STAGE_COUNT; i++) {
+    saml_stage_stats_t* stage = snapshot->stages + i;
+    PyObject* val = Py_BuildValue("{s:K,s:K,s:d,s:d,s:d,s:d,s:d,s:d}",
+      "count", (unsigned long long)stage->count,
+      "bytes", (unsigned long long)stage->bytes,
+      "mean", stage->count == 0 ? 0 : stage->total_ns / 1e3 / stage->count,
+      "p50", saml_stats_percentile(stage, 0.5) / 1e3,
+      "p90", saml_stats_percentile(stage, 0.9) / 1e3,
+      "p99", saml_stats_percentile(stage, 0.99) / 1e3,
+      "p999", saml_stats_percentile(stage, 0.999) / 1e3,
+      "max", stage->max_ns / 1e3);
+    if (val == NULL || PyDict_SetItemString(ret, saml_stats_stage_name(i), val) < 0) {
+      Py_XDECREF(val);
+      Py_CLEAR(ret);
+      break;
+    }
+    Py_DECREF(val);
+  }
+  free(snapshot);
+  return ret;
+}
+
+
+static PyObject* verify_cache_stats(PyObject* self, PyObject* args) {
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+
+  saml_verify_cache_stats_t cache_stats;
+  saml_verify_cache_stats(&cache_stats);
+  return Py_BuildValue("{s:K,s:K,s:K,s:K}",
+    "hits", (unsigned long long)cache_stats.hits,
+    "misses", (unsigned long long)cache_stats.misses,
+    "evictions", (unsigned long long)cache_stats.evictions,
+    "entries", (unsigned long long)cache_stats.entries);
+}
+
+
+static PyObject* verify_cache_clear(PyObject* self, PyObject* args) {
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+
+  saml_verify_cache_clear();
+  Py_RETURN_NONE;
+}
+
+
 static PyObject* doc_read_memory(PyObject* self, PyObject* args) {
   int buf_len;
   const char* buf;
@@ -135,7 +243,11 @@ static PyObject* doc_validate(PyObject* self, PyObject* args) {
     return NULL;
   }
 
-  return PyBool_FromLong((long)saml_doc_validate(doc));
+  int valid;
+  Py_BEGIN_ALLOW_THREADS
+  valid = saml_doc_validate(doc);
+  Py_END_ALLOW_THREADS
+  return PyBool_FromLong((long)valid);
 }
 
 
@@ -279,24 +391,8 @@ static PyObject* doc_session_index(PyObject* self, PyObject* args) {
 }
 
 
-static PyObject* doc_attrs(PyObject* self, PyObject* args) {
-  PyObject* capsule;
-  if (!PyArg_ParseTuple(args, "O", &capsule)) {
-    return NULL;
-  }
-
-  xmlDoc* doc = (xmlDoc*)PyCapsule_GetPointer(capsule, CAPSULE_XML_DOC);
-  if (doc == NULL) {
-    PyErr_SetString(SamlError, "invalid document value");
-    return NULL;
-  }
-
-  saml_attr_t* attrs;
-  size_t attrs_len;
-  if (saml_doc_attrs(doc, &attrs, &attrs_len) < 0) {
-    Py_RETURN_NONE;
-  }
-
+// Attributes as doc_attrs returns them: a value, or a list if there is more than one
+static PyObject* attrs_dict(saml_attr_t* attrs, size_t attrs_len) {
   PyObject* ret = PyDict_New();
   PyObject* val;
   for (int i = 0; i < attrs_len; i++) {
@@ -330,7 +426,29 @@ static PyObject* doc_attrs(PyObject* self, PyObject* args) {
       PyDict_SetItemString(ret, (char*)attrs[i].name, val);
     }
   }
+  return ret;
+}
+
+
+static PyObject* doc_attrs(PyObject* self, PyObject* args) {
+  PyObject* capsule;
+  if (!PyArg_ParseTuple(args, "O", &capsule)) {
+    return NULL;
+  }
+
+  xmlDoc* doc = (xmlDoc*)PyCapsule_GetPointer(capsule, CAPSULE_XML_DOC);
+  if (doc == NULL) {
+    PyErr_SetString(SamlError, "invalid document value");
+    return NULL;
+  }
+
+  saml_attr_t* attrs;
+  size_t attrs_len;
+  if (saml_doc_attrs(doc, &attrs, &attrs_len) < 0) {
+    Py_RETURN_NONE;
+  }
 
+  PyObject* ret = attrs_dict(attrs, attrs_len);
   saml_attrs_free(attrs, attrs_len);
   return ret;
 }
@@ -497,13 +615,74 @@ static PyObject* create_keys_mngr(PyObject* self, PyObject* args) {
 }
 
 
+static PyObject* trust_create(PyObject* self, PyObject* args) {
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+
+  saml_trust_t* trust = saml_trust_create();
+  if (trust == NULL) {
+    PyErr_SetString(SamlError, "create trust store failed");
+    return NULL;
+  }
+  return PyCapsule_New((void*)trust, CAPSULE_SAML_TRUST, &saml_trust_destructor);
+}
+
+
+static PyObject* trust_add(PyObject* self, PyObject* args) {
+  PyObject* trust_capsule;
+  char* issuer;
+  PyObject* key_capsule;
+  if (!PyArg_ParseTuple(args, "OsO", &trust_capsule, &issuer, &key_capsule)) {
+    return NULL;
+  }
+
+  saml_trust_t* trust = (saml_trust_t*)PyCapsule_GetPointer(trust_capsule, CAPSULE_SAML_TRUST);
+  if (trust == NULL) {
+    PyErr_SetString(SamlError, "invalid trust value");
+    return NULL;
+  }
+  xmlSecKey* key = (xmlSecKey*)PyCapsule_GetPointer(key_capsule, CAPSULE_XML_SEC_KEY);
+  if (key == NULL) {
+    PyErr_SetString(SamlError, "invalid key value");
+    return NULL;
+  }
+
+  if (saml_trust_add(trust, issuer, key) < 0) {
+    PyErr_SetString(SamlError, "add trusted key failed");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+
+// Returns whether the issuer had any keys
+static PyObject* trust_remove(PyObject* self, PyObject* args) {
+  PyObject* trust_capsule;
+  char* issuer;
+  if (!PyArg_ParseTuple(args, "Os", &trust_capsule, &issuer)) {
+    return NULL;
+  }
+
+  saml_trust_t* trust = (saml_trust_t*)PyCapsule_GetPointer(trust_capsule, CAPSULE_SAML_TRUST);
+  if (trust == NULL) {
+    PyErr_SetString(SamlError, "invalid trust value");
+    return NULL;
+  }
+  return PyBool_FromLong(saml_trust_remove(trust, issuer) == 0);
+}
+
+
 static PyObject* find_transform_by_href(PyObject* self, PyObject* args) {
   xmlChar* href;
   if (!PyArg_ParseTuple(args, "s", &href)) {
     return NULL;
   }
 
-  xmlSecTransformId transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), href, xmlSecTransformUriTypeAny);
+  xmlSecTransformId transform_id = saml_find_transform((char*)href);
+  if (transform_id == NULL) {
+    transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), href, xmlSecTransformUriTypeAny);
+  }
   if (transform_id == NULL) {
     Py_RETURN_NONE;
   } else {
@@ -532,23 +711,33 @@ static PyObject* sign_binary(PyObject* self, PyObject* args) {
     return NULL;
   }
 
-  xmlSecTransformCtx* ctx = saml_sign_binary(key, transform_id, data, data_len);
-  if (ctx == NULL) {
+  str_t sig;
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_sign_binary_str(key, transform_id, data, data_len, &sig);
+  Py_END_ALLOW_THREADS
+  if (res < 0) {
     PyErr_SetString(SamlError, "invalid transform_id value");
     return NULL;
   }
 
-  PyObject* ret = Py_BuildValue("y#", (char*)xmlSecBufferGetData(ctx->result), xmlSecBufferGetSize(ctx->result));
-  xmlSecTransformCtxDestroy(ctx);
+  PyObject* ret = Py_BuildValue("y#", sig.data, sig.len);
+  str_free(&sig);
   return ret;
 }
 
 
 static PyObject* sign_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
-  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL };
+  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL, .digest_id = NULL };
   PyObject *key_capsule, *transform_capsule, *doc_capsule;
-  char* keywords[] = { "id_attr", "insert_after_ns", "insert_after_el", NULL };
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|$sss", keywords, &key_capsule, &transform_capsule, &doc_capsule, &opts.id_attr, &opts.insert_after_ns, &opts.insert_after_el)) {
+  char* digest = NULL;
+  char* keywords[] = { "key", "transform", "doc", "id_attr", "insert_after_ns", "insert_after_el", "digest", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|$ssss", keywords, &key_capsule, &transform_capsule, &doc_capsule, &opts.id_attr, &opts.insert_after_ns, &opts.insert_after_el, &digest)) {
+    return NULL;
+  }
+
+  if (digest != NULL && (opts.digest_id = saml_find_digest(digest)) == NULL) {
+    PyErr_SetString(SamlError, "invalid digest value");
     return NULL;
   }
 
@@ -570,7 +759,10 @@ static PyObject* sign_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
     return NULL;
   }
 
-  int res = saml_sign_doc(key, transform_id, doc, &opts);
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_sign_doc(key, transform_id, doc, &opts);
+  Py_END_ALLOW_THREADS
   if (res == 0) {
     Py_RETURN_NONE;
   } else {
@@ -581,12 +773,18 @@ static PyObject* sign_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
 
 
 static PyObject* sign_xml(PyObject* self, PyObject* args, PyObject* kwargs) {
-  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL };
+  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL, .digest_id = NULL };
   PyObject *key_capsule, *transform_capsule;
   char* data;
   int data_len;
-  char* keywords[] = { "key", "transform", "xml", "id_attr", "insert_after_ns", "insert_after_el", NULL };
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOs#|$sss", keywords, &key_capsule, &transform_capsule, &data, &data_len, &opts.id_attr, &opts.insert_after_ns, &opts.insert_after_el)) {
+  char* digest = NULL;
+  char* keywords[] = { "key", "transform", "xml", "id_attr", "insert_after_ns", "insert_after_el", "digest", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOs#|$ssss", keywords, &key_capsule, &transform_capsule, &data, &data_len, &opts.id_attr, &opts.insert_after_ns, &opts.insert_after_el, &digest)) {
+    return NULL;
+  }
+
+  if (digest != NULL && (opts.digest_id = saml_find_digest(digest)) == NULL) {
+    PyErr_SetString(SamlError, "invalid digest value");
     return NULL;
   }
 
@@ -608,7 +806,10 @@ static PyObject* sign_xml(PyObject* self, PyObject* args, PyObject* kwargs) {
     return NULL;
   }
 
-  int res = saml_sign_doc(key, transform_id, doc, &opts);
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_sign_doc(key, transform_id, doc, &opts);
+  Py_END_ALLOW_THREADS
   if (res == 0) {
     xmlChar* buf;
     int buf_len;
@@ -623,6 +824,224 @@ static PyObject* sign_xml(PyObject* self, PyObject* args, PyObject* kwargs) {
 }
 
 
+static PyObject* signer_create(PyObject* self, PyObject* args, PyObject* kwargs) {
+  PyObject *key_capsule, *transform_capsule;
+  char* digest = NULL;
+  char* keywords[] = { "key", "transform", "digest", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|s", keywords, &key_capsule, &transform_capsule, &digest)) {
+    return NULL;
+  }
+
+  xmlSecKey* key = (xmlSecKey*)PyCapsule_GetPointer(key_capsule, CAPSULE_XML_SEC_KEY);
+  if (key == NULL) {
+    PyErr_SetString(SamlError, "invalid key value");
+    return NULL;
+  }
+
+  xmlSecTransformId transform_id = (xmlSecTransformId)PyCapsule_GetPointer(transform_capsule, CAPSULE_XML_SEC_TRANSFORM_ID);
+  if (transform_id == NULL) {
+    PyErr_SetString(SamlError, "invalid transform_id value");
+    return NULL;
+  }
+
+  xmlSecTransformId digest_id = NULL;
+  if (digest != NULL && (digest_id = saml_find_digest(digest)) == NULL) {
+    PyErr_SetString(SamlError, "invalid digest value");
+    return NULL;
+  }
+
+  saml_signer_t* signer = saml_signer_create(key, transform_id, digest_id);
+  if (signer == NULL) {
+    PyErr_SetString(SamlError, "create signer failed");
+    return NULL;
+  }
+  return PyCapsule_New((void*)signer, CAPSULE_SAML_SIGNER, &saml_signer_destructor);
+}
+
+
+static PyObject* signer_sign_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
+  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL, .digest_id = NULL };
+  PyObject *signer_capsule, *doc_capsule;
+  char* keywords[] = { "signer", "doc", "id_attr", "insert_after_ns", "insert_after_el", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|$sss", keywords, &signer_capsule, &doc_capsule, &opts.id_attr, &opts.insert_after_ns, &opts.insert_after_el)) {
+    return NULL;
+  }
+
+  saml_signer_t* signer = (saml_signer_t*)PyCapsule_GetPointer(signer_capsule, CAPSULE_SAML_SIGNER);
+  if (signer == NULL) {
+    PyErr_SetString(SamlError, "invalid signer value");
+    return NULL;
+  }
+
+  xmlDoc* doc = (xmlDoc*)PyCapsule_GetPointer(doc_capsule, CAPSULE_XML_DOC);
+  if (doc == NULL) {
+    PyErr_SetString(SamlError, "invalid doc value");
+    return NULL;
+  }
+
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_signer_sign_doc(signer, doc, &opts);
+  Py_END_ALLOW_THREADS
+  if (res == 0) {
+    Py_RETURN_NONE;
+  } else {
+    PyErr_SetString(SamlError, "saml sign failed");
+    return NULL;
+  }
+}
+
+
+// Converts a dict of name to a str or list of str, appending what the strings belong to onto held so they stay
+// alive while the GIL is released.  The result must be freed with PyMem_Free.
+static saml_attr_t* attrs_from_dict(PyObject* dict, PyObject* held, size_t* attrs_len) {
+  PyObject* items = PyDict_Items(dict);
+  if (items == NULL || PyList_Append(held, items) < 0) {
+    Py_XDECREF(items);
+    return NULL;
+  }
+  Py_DECREF(items);
+
+  size_t values_len = 0;
+  Py_ssize_t items_len = PyList_GET_SIZE(items);
+  for (Py_ssize_t i = 0; i < items_len; i++) {
+    PyObject* name = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0);
+    PyObject* value = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 1);
+    if (!PyUnicode_Check(name)) {
+      PyErr_SetString(SamlError, "attribute names must be strings");
+      return NULL;
+    }
+    if (PyUnicode_Check(value)) {
+      values_len++;
+      continue;
+    }
+    PyObject* values = PySequence_Tuple(value);
+    if (values == NULL || PyList_Append(held, values) < 0) {
+      Py_XDECREF(values);
+      PyErr_SetString(SamlError, "attribute values must be strings or lists of strings");
+      return NULL;
+    }
+    Py_DECREF(values);
+    values_len += PyTuple_GET_SIZE(values);
+  }
+
+  saml_attr_t* attrs = PyMem_Malloc(items_len * sizeof(saml_attr_t) + values_len * sizeof(xmlChar*));
+  if (attrs == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  xmlChar** next = (xmlChar**)(attrs + items_len);
+  Py_ssize_t held_i = 1;
+  for (Py_ssize_t i = 0; i < items_len; i++) {
+    PyObject* value = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 1);
+    PyObject* values = PyUnicode_Check(value) ? NULL : PyList_GET_ITEM(held, held_i++);
+    attrs[i].name = (xmlChar*)PyUnicode_AsUTF8(PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0));
+    attrs[i].values = next;
+    attrs[i].num_values = values == NULL ? 1 : (int)PyTuple_GET_SIZE(values);
+    for (int j = 0; j < attrs[i].num_values; j++) {
+      PyObject* item = values == NULL ? value : PyTuple_GET_ITEM(values, j);
+      if (!PyUnicode_Check(item)) {
+        PyMem_Free(attrs);
+        PyErr_SetString(SamlError, "attribute values must be strings or lists of strings");
+        return NULL;
+      }
+      *next++ = (xmlChar*)PyUnicode_AsUTF8(item);
+    }
+    if (attrs[i].name == NULL) {
+      PyMem_Free(attrs);
+      return NULL;
+    }
+  }
+  *attrs_len = items_len;
+  return attrs;
+}
+
+
+static PyObject* response_build(PyObject* self, PyObject* args, PyObject* kwargs) {
+  saml_response_t response;
+  memset(&response, 0, sizeof(saml_response_t));
+  PyObject *signer_capsule, *attrs = NULL;
+  char* keywords[] = {
+    "signer", "id", "issue_instant", "destination", "in_response_to", "issuer", "status_code", "assertion_id",
+    "name_id", "name_id_format", "sp_name_qualifier", "not_before", "not_on_or_after", "audience", "session_index",
+    "authn_context_class_ref", "attrs", NULL
+  };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$sssssssssssssssO!", keywords, &signer_capsule,
+        &response.id, &response.issue_instant, &response.destination, &response.in_response_to, &response.issuer,
+        &response.status_code, &response.assertion_id, &response.name_id, &response.name_id_format,
+        &response.sp_name_qualifier, &response.not_before, &response.not_on_or_after, &response.audience,
+        &response.session_index, &response.authn_context_class_ref, &PyDict_Type, &attrs)) {
+    return NULL;
+  }
+
+  saml_signer_t* signer = (saml_signer_t*)PyCapsule_GetPointer(signer_capsule, CAPSULE_SAML_SIGNER);
+  if (signer == NULL) {
+    PyErr_SetString(SamlError, "invalid signer value");
+    return NULL;
+  }
+
+  PyObject* held = PyList_New(0);
+  if (held == NULL) {
+    return NULL;
+  }
+  if (attrs != NULL && (response.attrs = attrs_from_dict(attrs, held, &response.attrs_len)) == NULL) {
+    Py_DECREF(held);
+    return NULL;
+  }
+
+  int res;
+  str_t xml;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_response_build(signer, &response, &xml);
+  Py_END_ALLOW_THREADS
+  PyMem_Free(response.attrs);
+  Py_DECREF(held);
+  if (res != 0) {
+    PyErr_SetString(SamlError, res > 0 ? "invalid response" : "build response failed");
+    return NULL;
+  }
+  PyObject* ret = PyUnicode_FromStringAndSize(xml.data, xml.len);
+  str_free(&xml);
+  return ret;
+}
+
+
+static PyObject* binding_post_create_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
+  PyObject *key_capsule, *doc_capsule;
+  char *saml_type, *sig_alg, *destination;
+  char* relay_state = NULL;
+  char* keywords[] = { "key", "saml_type", "doc", "sig_alg", "relay_state", "destination", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OsOszs", keywords, &key_capsule, &saml_type, &doc_capsule, &sig_alg, &relay_state, &destination)) {
+    return NULL;
+  }
+
+  xmlSecKey* key = (xmlSecKey*)PyCapsule_GetPointer(key_capsule, CAPSULE_XML_SEC_KEY);
+  if (key == NULL) {
+    PyErr_SetString(SamlError, "invalid key value");
+    return NULL;
+  }
+
+  xmlDoc* doc = (xmlDoc*)PyCapsule_GetPointer(doc_capsule, CAPSULE_XML_DOC);
+  if (doc == NULL) {
+    PyErr_SetString(SamlError, "invalid doc value");
+    return NULL;
+  }
+
+  str_t html;
+  saml_binding_status_t res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_binding_post_create_doc(key, saml_type, doc, sig_alg, relay_state, destination, &html);
+  Py_END_ALLOW_THREADS
+  if (res != SAML_OK) {
+    PyErr_SetString(SamlError, saml_binding_error_msg(res));
+    return NULL;
+  }
+  PyObject* ret = Py_BuildValue("s#", html.data, html.len);
+  str_free(&html);
+  return ret;
+}
+
+
 static PyObject* verify_binary(PyObject* self, PyObject* args) {
   PyObject *cert_capsule, *transform_capsule;
   unsigned char *data, *sig;
@@ -643,7 +1062,10 @@ static PyObject* verify_binary(PyObject* self, PyObject* args) {
     return NULL;
   }
 
-  int res = saml_verify_binary(cert, transform_id, data, data_len, sig, sig_len);
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_verify_binary(cert, transform_id, data, data_len, sig, sig_len);
+  Py_END_ALLOW_THREADS
   if (res < 0) {
     PyErr_SetString(SamlError, "saml verify failed");
     return NULL;
@@ -654,7 +1076,7 @@ static PyObject* verify_binary(PyObject* self, PyObject* args) {
 
 
 static PyObject* verify_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
-  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL };
+  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL, .digest_id = NULL };
   PyObject *mngr_capsule, *doc_capsule;
   char* keywords[] = { "mngr", "doc", "id_attr", NULL };
   if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|$s#", keywords, &mngr_capsule, &doc_capsule, &opts.id_attr)) {
@@ -673,7 +1095,10 @@ static PyObject* verify_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
     return NULL;
   }
 
-  int res = saml_verify_doc(mngr, doc, &opts);
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_verify_doc(mngr, doc, &opts);
+  Py_END_ALLOW_THREADS
   if (res < 0) {
     PyErr_SetString(SamlError, "saml verify failed");
     return NULL;
@@ -683,9 +1108,136 @@ static PyObject* verify_doc(PyObject* self, PyObject* args, PyObject* kwargs) {
 }
 
 
+static void summary_set(PyObject* dict, const char* key, xmlChar* value) {
+  PyObject* val = value == NULL ? Py_None : PyUnicode_FromString((char*)value);
+  if (value == NULL) {
+    Py_INCREF(val);
+  }
+  PyDict_SetItemString(dict, key, val);
+  Py_DECREF(val);
+}
+
+
+// Returns (valid, summary), where summary is a dict of what saml_verify_xml read when the document is valid
+static PyObject* verify_xml(PyObject* self, PyObject* args, PyObject* kwargs) {
+  saml_doc_opts_t opts = { .id_attr = NULL, .insert_after_ns = NULL, .insert_after_el = NULL, .digest_id = NULL };
+  PyObject* mngr_capsule;
+  const char* xml;
+  int xml_len;
+  char* keywords[] = { "mngr", "xml", "id_attr", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os#|$s", keywords, &mngr_capsule, &xml, &xml_len, &opts.id_attr)) {
+    return NULL;
+  }
+
+  xmlSecKeysMngr* mngr = (xmlSecKeysMngr*)PyCapsule_GetPointer(mngr_capsule, CAPSULE_XML_SEC_KEYS_MNGR);
+  if (mngr == NULL) {
+    PyErr_SetString(SamlError, "invalid mngr value");
+    return NULL;
+  }
+
+  int res;
+  saml_summary_t summary;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_verify_xml(mngr, xml, xml_len, &opts, &summary);
+  Py_END_ALLOW_THREADS
+  if (res < 0) {
+    PyErr_SetString(SamlError, "saml verify failed");
+    return NULL;
+  } else if (res > 0) {
+    return Py_BuildValue("(OO)", Py_False, Py_None);
+  }
+
+  PyObject* dict = PyDict_New();
+  summary_set(dict, "id", summary.id);
+  summary_set(dict, "issuer", summary.issuer);
+  summary_set(dict, "name_id", summary.name_id);
+  summary_set(dict, "status_code", summary.status_code);
+  summary_set(dict, "session_index", summary.session_index);
+  PyObject* attrs = attrs_dict(summary.attrs, summary.attrs_len);
+  PyDict_SetItemString(dict, "attrs", attrs);
+  Py_DECREF(attrs);
+  PyDict_SetItemString(dict, "streamed", summary.streamed ? Py_True : Py_False);
+  saml_summary_free(&summary);
+  return Py_BuildValue("(ON)", Py_True, dict);
+}
+
+
+// Takes a list of (content, mngr or trust) tuples and returns a list with None for every response that verified and an
+// error message for the others.  The GIL is released while the batch runs.
+static PyObject* verify_batch(PyObject* self, PyObject* args) {
+  PyObject* list;
+  if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list)) {
+    return NULL;
+  }
+
+  // A copy, so the items stay alive even if the list is changed while the GIL is released
+  PyObject* items = PyList_AsTuple(list);
+  if (items == NULL) {
+    return NULL;
+  }
+  Py_ssize_t jobs_len = PyTuple_GET_SIZE(items);
+  saml_verify_job_t* jobs = PyMem_Calloc(jobs_len > 0 ? jobs_len : 1, sizeof(saml_verify_job_t));
+  if (jobs == NULL) {
+    Py_DECREF(items);
+    return PyErr_NoMemory();
+  }
+
+  for (Py_ssize_t i = 0; i < jobs_len; i++) {
+    PyObject* mngr_capsule;
+    if (!PyArg_ParseTuple(PyTuple_GET_ITEM(items, i), "sO", &jobs[i].content, &mngr_capsule)) {
+      PyMem_Free(jobs);
+      Py_DECREF(items);
+      return NULL;
+    }
+    if (PyCapsule_IsValid(mngr_capsule, CAPSULE_SAML_TRUST)) {
+      jobs[i].trust = (saml_trust_t*)PyCapsule_GetPointer(mngr_capsule, CAPSULE_SAML_TRUST);
+    } else {
+      jobs[i].mngr = (xmlSecKeysMngr*)PyCapsule_GetPointer(mngr_capsule, CAPSULE_XML_SEC_KEYS_MNGR);
+    }
+    if (jobs[i].mngr == NULL && jobs[i].trust == NULL) {
+      PyMem_Free(jobs);
+      Py_DECREF(items);
+      PyErr_Format(SamlError, "verify_batch argument [%zd] has an invalid mngr value", i);
+      return NULL;
+    }
+  }
+
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = saml_verify_batch(jobs, jobs_len);
+  Py_END_ALLOW_THREADS
+  Py_DECREF(items);
+  if (res < 0) {
+    PyMem_Free(jobs);
+    PyErr_SetString(SamlError, "could not start verify threads");
+    return NULL;
+  }
+
+  PyObject* ret = PyList_New(jobs_len);
+  for (Py_ssize_t i = 0; ret != NULL && i < jobs_len; i++) {
+    PyObject* val = jobs[i].status == SAML_OK ? Py_None : PyUnicode_FromString(saml_binding_error_msg(jobs[i].status));
+    if (val == NULL) {
+      Py_CLEAR(ret);
+      break;
+    }
+    if (val == Py_None) {
+      Py_INCREF(val);
+    }
+    PyList_SET_ITEM(ret, i, val);
+  }
+  PyMem_Free(jobs);
+  return ret;
+}
+
+
 static PyMethodDef saml_funcs[] = {
   {"init", (PyCFunction)init, METH_VARARGS | METH_KEYWORDS, ""},
   {"shutdown", shutdown, METH_VARARGS, ""},
+  {"stats_enable", stats_enable, METH_VARARGS, ""},
+  {"stats_reset", stats_reset, METH_VARARGS, ""},
+  {"stats", stats, METH_VARARGS, ""},
+  {"verify_cache_stats", verify_cache_stats, METH_VARARGS, ""},
+  {"verify_cache_clear", verify_cache_clear, METH_VARARGS, ""},
 
   {"doc_read_memory", doc_read_memory, METH_VARARGS, ""},
   {"doc_read_file", doc_read_file, METH_VARARGS, ""},
@@ -705,13 +1257,22 @@ static PyMethodDef saml_funcs[] = {
   {"key_add_cert_memory", key_add_cert_memory, METH_VARARGS, ""},
   {"key_add_cert_file", key_add_cert_file, METH_VARARGS, ""},
   {"create_keys_manager", create_keys_mngr, METH_VARARGS, ""},
+  {"trust_create", trust_create, METH_VARARGS, ""},
+  {"trust_add", trust_add, METH_VARARGS, ""},
+  {"trust_remove", trust_remove, METH_VARARGS, ""},
 
   {"find_transform_by_href", find_transform_by_href, METH_VARARGS, ""},
   {"sign_binary", sign_binary, METH_VARARGS, ""},
   {"sign_doc", (PyCFunction)sign_doc, METH_VARARGS | METH_KEYWORDS, ""},
   {"sign_xml", (PyCFunction)sign_xml, METH_VARARGS | METH_KEYWORDS, ""},
+  {"signer_create", (PyCFunction)signer_create, METH_VARARGS | METH_KEYWORDS, ""},
+  {"signer_sign_doc", (PyCFunction)signer_sign_doc, METH_VARARGS | METH_KEYWORDS, ""},
+  {"response_build", (PyCFunction)response_build, METH_VARARGS | METH_KEYWORDS, ""},
+  {"binding_post_create_doc", (PyCFunction)binding_post_create_doc, METH_VARARGS | METH_KEYWORDS, ""},
   {"verify_binary", verify_binary, METH_VARARGS, ""},
   {"verify_doc", (PyCFunction)verify_doc, METH_VARARGS | METH_KEYWORDS, ""},
+  {"verify_xml", (PyCFunction)verify_xml, METH_VARARGS | METH_KEYWORDS, ""},
+  {"verify_batch", verify_batch, METH_VARARGS, ""},
 
   {NULL, NULL, 0, NULL}
 };
@@ -749,6 +1310,24 @@ PyMODINIT_FUNC PyInit_saml(void) {
   PyModule_AddStringConstant(m, "STATUS_RESPONDER", SAML_STATUS_RESPONDER);
   PyModule_AddStringConstant(m, "STATUS_VERSION_MISMATCH", SAML_STATUS_VERSION_MISMATCH);
 
+  // signature methods, for the sig_alg arguments
+  PyModule_AddStringConstant(m, "HrefRsaSha1", (char*)xmlSecHrefRsaSha1);
+  PyModule_AddStringConstant(m, "HrefRsaSha256", (char*)xmlSecHrefRsaSha256);
+  PyModule_AddStringConstant(m, "HrefRsaSha384", (char*)xmlSecHrefRsaSha384);
+  PyModule_AddStringConstant(m, "HrefRsaSha512", (char*)xmlSecHrefRsaSha512);
+#ifndef XMLSEC_NO_ECDSA
+  PyModule_AddStringConstant(m, "HrefEcdsaSha1", (char*)xmlSecHrefEcdsaSha1);
+  PyModule_AddStringConstant(m, "HrefEcdsaSha256", (char*)xmlSecHrefEcdsaSha256);
+  PyModule_AddStringConstant(m, "HrefEcdsaSha384", (char*)xmlSecHrefEcdsaSha384);
+  PyModule_AddStringConstant(m, "HrefEcdsaSha512", (char*)xmlSecHrefEcdsaSha512);
+#endif
+
+  // digest methods, for the digest options of sign_doc and sign_xml
+  PyModule_AddStringConstant(m, "HrefSha1", (char*)xmlSecHrefSha1);
+  PyModule_AddStringConstant(m, "HrefSha256", (char*)xmlSecHrefSha256);
+  PyModule_AddStringConstant(m, "HrefSha384", (char*)xmlSecHrefSha384);
+  PyModule_AddStringConstant(m, "HrefSha512", (char*)xmlSecHrefSha512);
+
   // export of keysdata.h:xmlSecKeyDataFormat
   PyModule_AddIntConstant(m, "KeyDataFormatUnknown", xmlSecKeyDataFormatUnknown);
   PyModule_AddIntConstant(m, "KeyDataFormatBinary", xmlSecKeyDataFormatBinary);
@@ -1,5 +1,6 @@
 from base64 import b64decode, b64encode
 import os
+import threading
 import unittest
 
 import saml
@@ -8,11 +9,14 @@ key = None
 cert = None
 transform_sha256 = None
 transform_sha512 = None
+ec_keys = {}
 TEST_DATA_DIR = os.getenv('TEST_DATA_DIR')
 
 binary_data = b'agBv0s1vhMpOxGbsoj1lMPCoYyUOAivpBxZlTyozJcgSmLwCWp1uijM2UTHo'
 binary_signature_rsa_sha256 = b'OEBg0Lv7V2aueh5HjiSQJh2Fw5lOm+HPocomlGepvcYAHDcSNXrFmCixOUqmCh9c5Pti3tQ0lOm5qCZ/aMJr7YkTiMYaNE7C3fjYYyDBCj0zoKZIo7UQ966DFe6ezZtBlVUtiuhTcNmeQ67Bk2BE5TRwzKWu0Ahy2LICzQC99gOtzfGgU+pWi+l4IcIrGq3v+aUGcVigWPKh3TVcVyhYr/V5qt+zoSxH6LDvE2Z49UKsuaOSQFhHnKb91SZOncWGh7K01JumAoq4ADyjTfDFExTXE0HVecgwbEI7xlnyVgI/I4OfqPHHDdLk3TuaWpfoq1rLFCJQwMjE+jlm1++kZA=='
 binary_signature_rsa_sha512 = b'OajQbB55E5B/heKbhcUaBvKiArrmYdfs4nJLU39rSk/3e5yvy9F9osnWAeJUu9xnThDnmBrvWSFeDnQIe2Y/hhypEHesdMsPG6R+RkFbQxv4icU+oEDh8wFetDEByuyueox/zqA+z6X9knt8+ufs6Mdfw0UIcxbg9rgNaB75JleI/ye9f97sAXc8K5lmZ6IHst200TX6Bw5Onpf2OLKOmsMdekLLdTmUew4ynNmeMlOdE20EUJvsH3y7WRBbW3JI8ffLBT4NHNyOfvt0CCOmynpmbEjfGg7jsq6J3bl4rZVrlDovMhuP3iyxjiwtj5gq44g++FYtYw8aQGXfBb28wA=='
+binary_signature_ecdsa_sha256 = b'jF979kZyZKZCfBb8SQV6lOe80EHgYmSgqicFTmWcTos6wSxZZ6fTdKHGDsbzA6jgM6Jyxo61aEmFrGNUvAUsoQ=='
+binary_signature_ecdsa_sha384 = b'+08t6hHAGOpv8uDL7MDNctqRQht8n+LJg5IO93UD8VOZhBXFeFF1G2t95pfkRaykVCcPp94ShFlzZTNg8r1JU189gOskMDwMpHKiVBEuMyIK5grfTcrL8TXmpLGF3xV0'
 
 
 def setUpModule():
@@ -25,6 +29,11 @@ def setUpModule():
     transform_sha256 = saml.find_transform_by_href('http://www.w3.org/2001/04/xmldsig-more#rsa-sha256')
     transform_sha512 = saml.find_transform_by_href('http://www.w3.org/2001/04/xmldsig-more#rsa-sha512')
 
+    for curve in ('p256', 'p384'):
+        ec_key = saml.key_read_file(TEST_DATA_DIR + 'sp-ec-' + curve + '.key', saml.KeyDataFormatPem)
+        saml.key_add_cert_file(ec_key, TEST_DATA_DIR + 'sp-ec-' + curve + '.crt', saml.KeyDataFormatCertPem)
+        ec_keys[curve] = (ec_key, saml.key_read_file(TEST_DATA_DIR + 'sp-ec-' + curve + '.crt', saml.KeyDataFormatCertPem))
+
 
 class TestSignBinary(unittest.TestCase):
 
@@ -36,6 +45,13 @@ class TestSignBinary(unittest.TestCase):
       result = saml.sign_binary(key, transform_sha512, binary_data)
       self.assertEqual(binary_signature_rsa_sha512, b64encode(result))
 
+    def test_generates_verifiable_bytes_using_ecdsa_sha384(self):
+      ec_key, ec_cert = ec_keys['p384']
+      transform = saml.find_transform_by_href(saml.HrefEcdsaSha384)
+      result = saml.sign_binary(ec_key, transform, binary_data)
+      self.assertEqual(96, len(result))
+      self.assertTrue(saml.verify_binary(ec_cert, transform, binary_data, result))
+
 
 class TestSignXML(unittest.TestCase):
 
@@ -62,6 +78,162 @@ class TestSignXML(unittest.TestCase):
             result = saml.sign_xml(key, transform_sha256, self.input)
             self.assertEqual(expected, result)
 
+    def test_digests_with_sha256_by_default(self):
+        result = saml.sign_xml(key, transform_sha256, self.input)
+        self.assertIn('<DigestMethod Algorithm="%s"/>' % saml.HrefSha256, result)
+
+    def test_digests_with_the_given_digest_method(self):
+        result = saml.sign_xml(key, transform_sha256, self.input, digest=saml.HrefSha512)
+        self.assertIn('<DigestMethod Algorithm="%s"/>' % saml.HrefSha512, result)
+        self.assertTrue(saml.verify_doc(saml.create_keys_manager([ cert ]), saml.doc_read_memory(result)))
+
+    def test_errors_for_an_unknown_digest(self):
+        with self.assertRaisesRegex(saml.error, 'invalid digest value'):
+            saml.sign_xml(key, transform_sha256, self.input, digest='urn:unknown')
+
+
+class TestSigner(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        with open(TEST_DATA_DIR + 'simple-input.xml') as f:
+            cls.input = f.read()
+        with open(TEST_DATA_DIR + 'response.xml') as f:
+            cls.response = f.read()
+
+    def test_errors_for_a_digest_that_is_not_a_digest_method(self):
+        with self.assertRaisesRegex(saml.error, 'create signer failed'):
+            saml.signer_create(key, transform_sha256, saml.HrefRsaSha512)
+
+    def test_errors_for_document_with_no_id_attr(self):
+        signer = saml.signer_create(key, transform_sha256)
+        with self.assertRaisesRegex(saml.error, 'saml sign failed'):
+            saml.signer_sign_doc(signer, saml.doc_read_memory(self.input), id_attr='ID')
+
+    def test_generates_the_same_document_as_sign_doc(self):
+        signer = saml.signer_create(key, transform_sha256)
+        opts = { 'id_attr': 'ID', 'insert_after_ns': saml.XMLNS_ASSERTION, 'insert_after_el': 'Issuer' }
+        for _ in range(2):
+            expected = saml.doc_read_memory(self.response)
+            saml.sign_doc(key, transform_sha256, expected, **opts)
+            doc = saml.doc_read_memory(self.response)
+            saml.signer_sign_doc(signer, doc, **opts)
+            self.assertEqual(saml.doc_serialize(expected), saml.doc_serialize(doc))
+
+    def test_signs_verifiably_with_the_threads_copy_of_the_key(self):
+        signer = saml.signer_create(key, transform_sha256)
+        mngr = saml.create_keys_manager([cert])
+        opts = { 'id_attr': 'ID', 'insert_after_ns': saml.XMLNS_ASSERTION, 'insert_after_el': 'Issuer' }
+        # The first signature makes the copy and the second finds it
+        for _ in range(2):
+            doc = saml.doc_read_memory(self.response)
+            saml.signer_sign_doc(signer, doc, **opts)
+            self.assertTrue(saml.verify_doc(mngr, doc, id_attr='ID'))
+
+    def test_signs_verifiably_from_many_threads_at_once(self):
+        signer = saml.signer_create(key, transform_sha256)
+        mngr = saml.create_keys_manager([cert])
+        opts = { 'id_attr': 'ID', 'insert_after_ns': saml.XMLNS_ASSERTION, 'insert_after_el': 'Issuer' }
+        barrier = threading.Barrier(8)
+        docs = [[saml.doc_read_memory(self.response) for _ in range(16)] for _ in range(8)]
+
+        def sign(thread_docs):
+            barrier.wait()
+            for doc in thread_docs:
+                saml.signer_sign_doc(signer, doc, **opts)
+
+        threads = [threading.Thread(target=sign, args=(thread_docs,)) for thread_docs in docs]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for thread_docs in docs:
+            for doc in thread_docs:
+                self.assertTrue(saml.verify_doc(mngr, doc, id_attr='ID'))
+
+    def test_does_not_sign_with_the_copies_of_a_freed_signer(self):
+        opts = { 'id_attr': 'ID', 'insert_after_ns': saml.XMLNS_ASSERTION, 'insert_after_el': 'Issuer' }
+        signer = saml.signer_create(key, transform_sha256)
+        saml.signer_sign_doc(signer, saml.doc_read_memory(self.response), **opts)
+        del signer
+
+        idp_key = saml.key_read_file(TEST_DATA_DIR + 'idp.key', saml.KeyDataFormatPem)
+        idp_cert = saml.key_read_file(TEST_DATA_DIR + 'idp.crt', saml.KeyDataFormatCertPem)
+        signer = saml.signer_create(idp_key, transform_sha256)
+        doc = saml.doc_read_memory(self.response)
+        saml.signer_sign_doc(signer, doc, **opts)
+        self.assertTrue(saml.verify_doc(saml.create_keys_manager([idp_cert]), doc, id_attr='ID'))
+
+
+class TestResponseBuild(unittest.TestCase):
+
+    response = {
+        'id': '_r1',
+        'issue_instant': '2024-01-01T00:00:00Z',
+        'destination': 'https://sp.example.com/acs?a=1&b=2',
+        'in_response_to': '_req1',
+        'issuer': 'https://idp.example.com',
+        'assertion_id': '_a1',
+        'name_id': 'user@example.com',
+        'not_before': '2024-01-01T00:00:00Z',
+        'not_on_or_after': '2024-01-01T00:05:00Z',
+        'audience': 'https://sp.example.com',
+        'authn_context_class_ref': 'urn:oasis:names:tc:SAML:2.0:ac:classes:Password',
+        'attrs': { 'uid': 'test', 'groups': ['a&b', '<c>'] },
+    }
+
+    def test_errors_for_a_missing_field(self):
+        signer = saml.signer_create(key, transform_sha256)
+        with self.assertRaisesRegex(saml.error, 'invalid response'):
+            saml.response_build(signer, id='_r1', issue_instant='2024-01-01T00:00:00Z')
+
+    def test_errors_for_attribute_values_that_are_not_strings(self):
+        signer = saml.signer_create(key, transform_sha256)
+        with self.assertRaisesRegex(saml.error, 'attribute values must be strings'):
+            saml.response_build(signer, **dict(self.response, attrs={ 'uid': [1] }))
+
+    def test_generates_a_valid_verifiable_document(self):
+        signer = saml.signer_create(key, transform_sha256)
+        doc = saml.doc_read_memory(saml.response_build(signer, **self.response))
+        self.assertTrue(saml.doc_validate(doc))
+        mngr = saml.create_keys_manager([cert])
+        self.assertTrue(saml.verify_doc(mngr, doc, id_attr='ID'))
+        self.assertEqual('user@example.com', saml.doc_name_id(doc))
+        self.assertEqual(self.response['attrs'], saml.doc_attrs(doc))
+
+
+class TestBindingPostCreateDoc(unittest.TestCase):
+
+    def test_errors_for_bad_sig_algorithm(self):
+        doc = saml.doc_read_file(TEST_DATA_DIR + 'authn_request.xml')
+        with self.assertRaisesRegex(saml.error, 'invalid signature algorithm'):
+            saml.binding_post_create_doc(key, 'SAMLRequest', doc, 'rsa', '/', 'dest')
+
+    def test_signs_the_document_in_place_and_returns_the_form(self):
+        doc = saml.doc_read_file(TEST_DATA_DIR + 'authn_request.xml')
+        html = saml.binding_post_create_doc(key, 'SAMLRequest', doc, saml.HrefRsaSha256, None, 'dest')
+        self.assertIn('action="dest"', html)
+        self.assertNotIn('RelayState', html)
+        value = html.split('name="SAMLRequest" value="')[1].split('"')[0]
+        self.assertEqual(saml.doc_serialize(doc), b64decode(value).decode())
+        mngr = saml.create_keys_manager([cert])
+        self.assertTrue(saml.verify_doc(mngr, doc, id_attr='ID'))
+
+    def test_streams_the_bytes_of_doc_serialize_for_each_base64_padding(self):
+        # doc_serialize returns str, so only UTF-8 here; the Lua spec covers ISO-8859-1 too
+        with open(TEST_DATA_DIR + 'authn_request.xml') as f:
+            authn_request = f.read()
+        remainders = set()
+        for pad in range(3):
+            provider = 'SP t\u00e9st' * 2000 + 'x' * pad
+            doc = saml.doc_read_memory('<?xml version="1.0" encoding="UTF-8"?>\n' + authn_request.replace('ProviderName="SP test"', 'ProviderName="' + provider + '"'))
+            html = saml.binding_post_create_doc(key, 'SAMLRequest', doc, saml.HrefRsaSha256, '/', 'dest')
+            signed = saml.doc_serialize(doc).encode()
+            value = html.split('name="SAMLRequest" value="')[1].split('"')[0]
+            self.assertEqual(b64encode(signed).decode(), value)
+            remainders.add(len(signed) % 3)
+        self.assertEqual({ 0, 1, 2 }, remainders)
+
 
 class TestVerifyBinary(unittest.TestCase):
 
@@ -77,6 +249,50 @@ class TestVerifyBinary(unittest.TestCase):
         valid = saml.verify_binary(cert, transform_sha512, binary_data, b64decode(binary_signature_rsa_sha512))
         self.assertTrue(valid)
 
+    def test_verifies_correctly_signed_content_using_ecdsa_sha256(self):
+        transform = saml.find_transform_by_href(saml.HrefEcdsaSha256)
+        valid = saml.verify_binary(ec_keys['p256'][1], transform, binary_data, b64decode(binary_signature_ecdsa_sha256))
+        self.assertTrue(valid)
+
+    def test_verifies_correctly_signed_content_using_ecdsa_sha384(self):
+        transform = saml.find_transform_by_href(saml.HrefEcdsaSha384)
+        valid = saml.verify_binary(ec_keys['p384'][1], transform, binary_data, b64decode(binary_signature_ecdsa_sha384))
+        self.assertTrue(valid)
+
+    def test_rejects_content_for_a_key_of_another_type(self):
+        transform = saml.find_transform_by_href(saml.HrefEcdsaSha256)
+        valid = saml.verify_binary(cert, transform, binary_data, b64decode(binary_signature_ecdsa_sha256))
+        self.assertFalse(valid)
+
+    def test_round_trips_rsa_and_ecdsa_signatures(self):
+        cases = [
+            (key, cert, transform_sha256),
+            (key, cert, transform_sha512),
+            (ec_keys['p256'][0], ec_keys['p256'][1], saml.find_transform_by_href(saml.HrefEcdsaSha256)),
+            (ec_keys['p384'][0], ec_keys['p384'][1], saml.find_transform_by_href(saml.HrefEcdsaSha384)),
+        ]
+        # Twice each, so the second round reuses the contexts the first one prepared
+        for _ in range(2):
+            for k, c, transform in cases:
+                sig = saml.sign_binary(k, transform, binary_data)
+                self.assertTrue(saml.verify_binary(c, transform, binary_data, sig))
+                self.assertFalse(saml.verify_binary(c, transform, binary_data + b'x', sig))
+
+    def test_rejects_content_signed_with_another_key(self):
+        idp_key = saml.key_read_file(TEST_DATA_DIR + 'idp.key', saml.KeyDataFormatPem)
+        sig = saml.sign_binary(idp_key, transform_sha256, binary_data)
+        self.assertFalse(saml.verify_binary(cert, transform_sha256, binary_data, sig))
+
+    def test_verifies_with_keys_read_after_others_were_freed(self):
+        for _ in range(3):
+            idp_key = saml.key_read_file(TEST_DATA_DIR + 'idp.key', saml.KeyDataFormatPem)
+            idp_cert = saml.key_read_file(TEST_DATA_DIR + 'idp.crt', saml.KeyDataFormatCertPem)
+            sig = saml.sign_binary(idp_key, transform_sha256, binary_data)
+            self.assertTrue(saml.verify_binary(idp_cert, transform_sha256, binary_data, sig))
+            self.assertFalse(saml.verify_binary(cert, transform_sha256, binary_data, sig))
+            del idp_key, idp_cert
+        self.assertTrue(saml.verify_binary(cert, transform_sha256, binary_data, b64decode(binary_signature_rsa_sha256)))
+
 
 class TestVerifyDoc(unittest.TestCase):
 
@@ -93,3 +309,68 @@ class TestVerifyDoc(unittest.TestCase):
         doc = saml.doc_read_file(TEST_DATA_DIR + 'simple-signed-rsa-sha256.xml')
         valid = saml.verify_doc(self.mngr, doc)
         self.assertTrue(valid)
+
+    def test_verifies_documents_signed_using_ecdsa(self):
+        for curve, alg in (('p256', 'ecdsa-sha256'), ('p384', 'ecdsa-sha384')):
+            mngr = saml.create_keys_manager([ ec_keys[curve][1] ])
+            doc = saml.doc_read_file(TEST_DATA_DIR + 'simple-signed-' + alg + '.xml')
+            self.assertTrue(saml.verify_doc(mngr, doc))
+
+
+class TestVerifyXML(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.mngr = saml.create_keys_manager([ cert ])
+
+    def test_rejects_an_incorrectly_signed_document(self):
+        with open(TEST_DATA_DIR + 'simple-bad-sig-rsa-sha256.xml') as f:
+            valid, summary = saml.verify_xml(self.mngr, f.read())
+        self.assertFalse(valid)
+        self.assertIsNone(summary)
+
+    def test_verifies_a_built_response_as_it_is_parsed(self):
+        signer = saml.signer_create(key, transform_sha256)
+        xml = saml.response_build(signer, id='_r1', issue_instant='2024-01-01T00:00:00Z', issuer='https://idp.example.com',
+                                  assertion_id='_a1', name_id='user@example.com', attrs={ 'uid': 'test' })
+        valid, summary = saml.verify_xml(self.mngr, xml, id_attr='ID')
+        self.assertTrue(valid)
+        self.assertTrue(summary['streamed'])
+        self.assertEqual('https://idp.example.com', summary['issuer'])
+        self.assertEqual('user@example.com', summary['name_id'])
+        self.assertEqual({ 'uid': 'test' }, summary['attrs'])
+        self.assertFalse(saml.verify_xml(self.mngr, xml.replace('user@', 'admin@'), id_attr='ID')[0])
+
+
+class TestVerifyBatch(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.mngr = saml.create_keys_manager([ cert ])
+        with open(TEST_DATA_DIR + 'response-signed.xml.b64') as f:
+            cls.response = f.read().strip()
+
+    def test_returns_results_in_input_order(self):
+        jobs = [ (self.response, self.mngr), ('xml', self.mngr), (self.response, self.mngr) ]
+        results = saml.verify_batch(jobs)
+        self.assertEqual([ None, 'invalid base64 content', None ], results)
+
+    def test_verifies_with_the_keys_trusted_for_the_issuer(self):
+        trust = saml.trust_create()
+        saml.trust_add(trust, 'http://idp.example.com/metadata.php', ec_keys['p256'][1])
+        saml.trust_add(trust, 'http://idp.example.com/metadata.php', cert)
+        other = saml.trust_create()
+        saml.trust_add(other, 'http://sp.example.com/demo1/metadata.php', cert)
+        results = saml.verify_batch([ (self.response, trust), (self.response, other) ])
+        self.assertEqual([ None, 'no trusted key for issuer' ], results)
+        self.assertTrue(saml.trust_remove(trust, 'http://idp.example.com/metadata.php'))
+        self.assertFalse(saml.trust_remove(trust, 'http://idp.example.com/metadata.php'))
+
+    def test_accepts_an_empty_batch(self):
+        self.assertEqual([], saml.verify_batch([]))
+
+    def test_runs_every_job_of_small_batches_back_to_back(self):
+        # Workers still stealing from one batch when the next is posted must not lose its jobs
+        jobs = [ ('xml', self.mngr) ] * 37
+        for _ in range(2000):
+            self.assertEqual([ 'invalid base64 content' ] * 37, saml.verify_batch(jobs))
@@ -1,3 +1,4 @@
+import ctypes
 import os
 import unittest
 
@@ -6,6 +7,10 @@ import saml
 response = None
 
 
+class MallInfo(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_int) for name in ('arena', 'ordblks', 'smblks', 'hblks', 'hblkhd', 'usmblks', 'fsmblks', 'uordblks', 'fordblks', 'keepcost')]
+
+
 def setUpModule():
     saml.init(os.getenv('DATA_DIR'))
     global response
@@ -57,6 +62,19 @@ class TestAttrs(unittest.TestCase):
             'eduPersonAffiliation': [ 'users', 'examplerole1' ]
         }, attrs)
 
+    def test_frees_the_attribute_values(self):
+        # saml_attrs_free used to leak each attribute's values array, about 100 bytes a call for this response
+        try:
+            mallinfo = ctypes.CDLL(None).mallinfo
+        except AttributeError:
+            self.skipTest('needs glibc')
+        mallinfo.restype = MallInfo
+        saml.doc_attrs(response)
+        before = mallinfo().uordblks
+        for _ in range(10000):
+            saml.doc_attrs(response)
+        self.assertLess(mallinfo().uordblks - before, 64 * 1024)
+
 
 class TestIssuer(unittest.TestCase):
 
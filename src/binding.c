@@ -1,9 +1,3 @@
-#if MAX_MEM_LEVEL >= 8
-#  define DEF_MEM_LEVEL 8
-#else
-#  define DEF_MEM_LEVEL  MAX_MEM_LEVEL
-#endif
-
 static char FORM_PRE[] = "\
 <!doctype html>\n\
 <html>\n\
@@ -43,12 +37,21 @@ static char* ERRORS[] = {
   "document does not validate against schema",
   "invalid signature algorithm",
   "signature does not match",
+  "no trusted key for issuer",
+  "signing certificate is not trusted for issuer",
 };
 
 char* saml_binding_error_msg(saml_binding_status_t status) {
   return ERRORS[status - SAML_ZLIB_ERROR];
 }
 
+static xmlDoc* parse_xml(const char* xml, int xml_len) {
+  uint64_t start = stats_start();
+  xmlDoc* doc = xmlReadMemory(xml, xml_len, "tmp.xml", NULL, 0);
+  stats_record(SAML_STAGE_XML_PARSE, start, xml_len);
+  return doc;
+}
+
 static void redirect_concat_args(char* saml_type, char* content, char* sig_alg, char* relay_state, str_t* query) {
   char* content_uri = saml_uri_encode(content);
   char* sig_alg_uri = saml_uri_encode(sig_alg);
@@ -71,47 +74,37 @@ static void redirect_concat_args(char* saml_type, char* content, char* sig_alg,
 }
 
 saml_binding_status_t saml_binding_redirect_create(xmlSecKey* key, char* saml_type, char* content, char* sig_alg, char* relay_state, str_t* query) {
-  xmlSecTransformId transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), (xmlChar*)sig_alg, xmlSecTransformUriTypeAny);
+  xmlSecTransformId transform_id = saml_find_sig_alg(sig_alg);
   if (transform_id == NULL) {
     return SAML_INVALID_SIG_ALG;
   }
 
   int content_len = strlen(content);
-  z_stream stream = (z_stream){
-    .zalloc   = Z_NULL,
-    .zfree    = Z_NULL,
-    .opaque   = Z_NULL,
-    .next_in  = (unsigned char*)content,
-    .avail_in = content_len,
-  };
-
-  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
-    return SAML_ZLIB_ERROR;
+  byte* deflated;
+  size_t deflated_len;
+  uint64_t start = stats_start();
+  saml_binding_status_t res = compress_deflate((byte*)content, content_len, &deflated, &deflated_len);
+  if (res != SAML_OK) {
+    return res;
   }
+  stats_record(SAML_STAGE_DEFLATE, start, content_len);
 
-  stream.avail_out = deflateBound(&stream, content_len);
-  unsigned char* deflated = malloc(stream.avail_out);
-  stream.next_out = deflated;
-
-  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
-    deflateEnd(&stream);
-    return SAML_ZLIB_ERROR;
-  }
-
-  char* b64_encoded = saml_base64_encode(deflated, stream.total_out);
+  char* b64_encoded = saml_base64_encode(deflated, deflated_len);
+  free(deflated);
 
   redirect_concat_args(saml_type, b64_encoded, sig_alg, relay_state, query);
   free(b64_encoded);
 
-  xmlSecTransformCtx* ctx = saml_sign_binary(key, transform_id, (unsigned char*)query->data, query->len);
-  if (ctx == NULL) {
+  str_t sig;
+  if (saml_sign_binary_str(key, transform_id, (unsigned char*)query->data, query->len, &sig) < 0) {
     str_free(query);
     return SAML_XMLSEC_ERROR;
   }
 
-  char* sig_encoded = saml_base64_encode(xmlSecBufferGetData(ctx->result), xmlSecBufferGetSize(ctx->result));
-  xmlSecTransformCtxDestroy(ctx);
+  char* sig_encoded = saml_base64_encode((byte*)sig.data, sig.len);
+  str_free(&sig);
   char* sig_uri = saml_uri_encode(sig_encoded);
+  free(sig_encoded);
   str_cat(query, "&Signature=", sizeof("&Signature=") - 1);
   str_cat(query, sig_uri, strlen(sig_uri));
   free(sig_uri);
@@ -119,6 +112,66 @@ saml_binding_status_t saml_binding_redirect_create(xmlSecKey* key, char* saml_ty
   return SAML_OK;
 }
 
+// A redirect binding message on its way from base64 to a document.  It is inflated in steps, so that
+// saml_binding_redirect_parse_trust can look at its start before deciding whether to inflate the rest.
+typedef struct {
+  byte* decoded;
+  inflater_t inflater;
+  str_t xml;
+} redirect_msg_t;
+
+
+static saml_binding_status_t redirect_msg_init(redirect_msg_t* msg, char* content) {
+  int decoded_len;
+  msg->decoded = NULL;
+  if (saml_base64_decode(content, strlen(content), &msg->decoded, &decoded_len) < 0) {
+    if (msg->decoded != NULL) {
+      free(msg->decoded);
+    }
+    return SAML_BASE64;
+  }
+
+  saml_binding_status_t res = inflater_start(&msg->inflater, msg->decoded, decoded_len);
+  if (res != SAML_OK) {
+    free(msg->decoded);
+    return res;
+  }
+  // an empty buffer would never grow
+  str_init(&msg->xml, decoded_len * 2 + 64);
+  return SAML_OK;
+}
+
+
+static void redirect_msg_free(redirect_msg_t* msg) {
+  free(msg->decoded);
+  str_free(&msg->xml);
+}
+
+
+// Inflates until the message has at least limit bytes of xml, or all of it
+static saml_binding_status_t redirect_msg_inflate(redirect_msg_t* msg, size_t limit) {
+  uint64_t start = stats_start();
+  size_t consumed;
+  saml_binding_status_t res = inflater_run(&msg->inflater, &msg->xml, limit, &consumed);
+  if (res == SAML_OK) {
+    stats_record(SAML_STAGE_INFLATE, start, consumed);
+  }
+  return res;
+}
+
+
+// Inflates the rest of the message and parses it
+static saml_binding_status_t redirect_msg_parse(redirect_msg_t* msg, xmlDoc** doc) {
+  saml_binding_status_t res = redirect_msg_inflate(msg, SIZE_MAX);
+  if (res != SAML_OK) {
+    return res;
+  }
+
+  *doc = parse_xml((char*)msg->xml.data, msg->xml.len);
+  return *doc == NULL ? SAML_INVALID_XML : SAML_OK;
+}
+
+
 saml_binding_status_t saml_binding_redirect_parse(char* content, char* sig_alg, xmlDoc** doc) {
   if (content == NULL) {
     return SAML_NO_CONTENT;
@@ -126,54 +179,20 @@ saml_binding_status_t saml_binding_redirect_parse(char* content, char* sig_alg,
     return SAML_NO_SIG_ALG;
   }
 
-  xmlSecTransformId transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), (xmlChar*)sig_alg, xmlSecTransformUriTypeAny);
+  xmlSecTransformId transform_id = saml_find_sig_alg(sig_alg);
   if (transform_id == NULL) {
     return SAML_INVALID_SIG_ALG;
   }
 
-  byte* decoded = NULL;
-  int decoded_len;
-  if (saml_base64_decode(content, strlen(content), &decoded, &decoded_len) < 0) {
-    if (decoded != NULL) {
-      free(decoded);
-    }
-    return SAML_BASE64;
+  redirect_msg_t msg;
+  saml_binding_status_t res = redirect_msg_init(&msg, content);
+  if (res != SAML_OK) {
+    return res;
   }
-
-  z_stream stream = (z_stream){
-    .zalloc   = Z_NULL,
-    .zfree    = Z_NULL,
-    .opaque   = Z_NULL,
-    .next_in  = decoded,
-    .avail_in = decoded_len,
-  };
-  if (inflateInit2(&stream, -15) != Z_OK) {
-    return SAML_ZLIB_ERROR;
-  }
-
-  str_t xml;
-  str_init(&xml, decoded_len * 2);
-  int zlib_res;
-  do {
-    stream.next_out = (unsigned char*)xml.data + xml.len;
-    stream.avail_out = xml.total - xml.len;
-    zlib_res = inflate(&stream, Z_NO_FLUSH);
-    xml.len = stream.total_out;
-    if (zlib_res == Z_BUF_ERROR && stream.avail_out == 0) {
-      str_grow(&xml);
-    } else if (zlib_res == Z_BUF_ERROR || zlib_res == Z_DATA_ERROR) {
-      inflateEnd(&stream);
-      return SAML_INVALID_COMPRESSION;
-    } else if (zlib_res != Z_OK && zlib_res != Z_STREAM_END) {
-      inflateEnd(&stream);
-      return SAML_ZLIB_ERROR;
-    }
-  } while (zlib_res != Z_STREAM_END);
-  inflateEnd(&stream);
-
-  *doc = xmlReadMemory((char*)xml.data, xml.len, "tmp.xml", NULL, 0);
-  if (*doc == NULL) {
-    return SAML_INVALID_XML;
+  res = redirect_msg_parse(&msg, doc);
+  redirect_msg_free(&msg);
+  if (res != SAML_OK) {
+    return res;
   }
 
   if (!saml_doc_validate(*doc)) {
@@ -183,7 +202,8 @@ saml_binding_status_t saml_binding_redirect_parse(char* content, char* sig_alg,
   return SAML_OK;
 }
 
-saml_binding_status_t saml_binding_redirect_verify(xmlSecKey* cert, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature) {
+// Tries each key in turn, so that a signature made with any of an issuer's keys verifies
+static saml_binding_status_t redirect_verify(xmlSecKey** certs, size_t certs_len, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature) {
   if (content == NULL) {
     return SAML_NO_CONTENT;
   } else if (sig_alg == NULL) {
@@ -192,7 +212,7 @@ saml_binding_status_t saml_binding_redirect_verify(xmlSecKey* cert, char* saml_t
     return SAML_NO_SIGNATURE;
   }
 
-  xmlSecTransformId transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), (xmlChar*)sig_alg, xmlSecTransformUriTypeAny);
+  xmlSecTransformId transform_id = saml_find_sig_alg(sig_alg);
   if (transform_id == NULL) {
     return SAML_INVALID_SIG_ALG;
   }
@@ -206,26 +226,216 @@ saml_binding_status_t saml_binding_redirect_verify(xmlSecKey* cert, char* saml_t
   str_t query;
   redirect_concat_args(saml_type, content, sig_alg, relay_state, &query);
 
-  int res = saml_verify_binary(cert, transform_id, (unsigned char*)query.data, query.len, sig, sig_len);
+  saml_binding_status_t status = SAML_XMLSEC_ERROR;
+  for (size_t i = 0; i < certs_len && status != SAML_OK; i++) {
+    int res = saml_verify_binary(certs[i], transform_id, (unsigned char*)query.data, query.len, sig, sig_len);
+    if (res == 0) {
+      status = SAML_OK;
+    } else if (res > 0) {
+      status = SAML_INVALID_SIGNATURE;
+    }
+  }
   str_free(&query);
-  if (res < 0) {
-    return SAML_XMLSEC_ERROR;
-  } else if (res == 0) {
-    return SAML_OK;
-  } else {
-    return SAML_INVALID_SIGNATURE;
+  free(sig);
+  return status;
+}
+
+saml_binding_status_t saml_binding_redirect_verify(xmlSecKey* cert, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature) {
+  return redirect_verify(&cert, 1, saml_type, content, sig_alg, relay_state, signature);
+}
+
+saml_binding_status_t saml_binding_redirect_verify_trust(saml_trust_t* trust, xmlDoc* doc, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature) {
+  trust_entry_t* entry = trust_acquire(trust, doc);
+  if (entry == NULL) {
+    return SAML_UNTRUSTED_ISSUER;
   }
+
+  saml_binding_status_t status = redirect_verify(entry->keys, entry->keys_len, saml_type, content, sig_alg, relay_state, signature);
+  trust_release(trust, entry);
+  return status;
 }
 
-saml_binding_status_t saml_binding_post_create(xmlSecKey* key, char* saml_type, char* content, char* sig_alg, char* relay_state, char* destination, str_t* html) {
-  xmlSecTransformId transform_id = xmlSecTransformIdListFindByHref(xmlSecTransformIdsGet(), (xmlChar*)sig_alg, xmlSecTransformUriTypeAny);
-  if (transform_id == NULL) {
+// How much of a message is inflated to find its Issuer before falling back to parsing all of it
+#define REDIRECT_PROBE_LEN 4096
+
+// Offset of pat in xml at or after from, or len
+static size_t redirect_find(const char* xml, size_t len, size_t from, const char* pat) {
+  size_t pat_len = strlen(pat);
+  for (size_t i = from; i + pat_len <= len; i++) {
+    if (memcmp(xml + i, pat, pat_len) == 0) {
+      return i;
+    }
+  }
+  return len;
+}
+
+
+// Offset just after the > that ends the tag starting at from, skipping any in attribute values, or len
+static size_t redirect_tag_end(const char* xml, size_t len, size_t from) {
+  char quote = '\0';
+  for (size_t i = from; i < len; i++) {
+    if (quote != '\0') {
+      quote = xml[i] == quote ? '\0' : quote;
+    } else if (xml[i] == '"' || xml[i] == '\'') {
+      quote = xml[i];
+    } else if (xml[i] == '>') {
+      return i + 1;
+    }
+  }
+  return len;
+}
+
+
+// Finds the text of the Issuer that the root element of a SAML request or response starts with, without
+// parsing.  Returns 1 with the text in issuer, or 0 if there is anything else where it should be, such as a
+// DTD, an entity or another element, in which case the message has to be parsed to find it.  Comments and
+// processing instructions are skipped.  saml_binding_redirect_parse_trust checks the result against the
+// parsed document, so this only has to find it in the messages it can.
+static int redirect_probe_issuer(const char* xml, size_t len, const char** issuer, size_t* issuer_len) {
+  size_t i = 0;
+  int elements = 0;
+  while ((i = redirect_find(xml, len, i, "<")) < len) {
+    if (redirect_find(xml, len, i, "<?") == i) {
+      i = redirect_find(xml, len, i, "?>") + 2;
+      continue;
+    } else if (redirect_find(xml, len, i, "<!--") == i) {
+      i = redirect_find(xml, len, i, "-->") + 3;
+      continue;
+    } else if (i + 1 >= len || xml[i + 1] == '!' || xml[i + 1] == '/') {
+      return 0;
+    }
+
+    size_t name = i + 1, name_end = name;
+    while (name_end < len && strchr(" \t\r\n/>", xml[name_end]) == NULL) {
+      name_end++;
+    }
+    size_t tag_end = redirect_tag_end(xml, len, name_end);
+    if (tag_end == len || xml[tag_end - 2] == '/') {
+      return 0;
+    }
+    if (++elements == 1) {
+      i = tag_end;
+      continue;
+    }
+
+    size_t local = name_end;
+    while (local > name && xml[local - 1] != ':') {
+      local--;
+    }
+    size_t text_end = redirect_find(xml, len, tag_end, "<");
+    if (name_end - local != 6 || memcmp(xml + local, "Issuer", 6) != 0 || text_end == len
+        || redirect_find(xml, len, text_end, "</") != text_end || memchr(xml + tag_end, '&', text_end - tag_end) != NULL) {
+      return 0;
+    }
+    *issuer = xml + tag_end;
+    *issuer_len = text_end - tag_end;
+    return 1;
+  }
+  return 0;
+}
+
+
+// Verify-first parsing with a trust store.  The start of the message is inflated just far enough to find the
+// Issuer, and the query signature is checked with the issuer's keys before the rest is inflated, parsed and
+// validated, so a forged or garbled message costs no more than a signature check.  A message whose Issuer
+// can't be found that way has to be parsed to find it, but is still only validated once it has verified.  The
+// Issuer of the parsed document has to be the one the signature was checked for.  doc is left NULL when the
+// signature is checked before parsing and is not valid.
+saml_binding_status_t saml_binding_redirect_parse_trust(saml_trust_t* trust, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature, xmlDoc** doc) {
+  *doc = NULL;
+  if (content == NULL) {
+    return SAML_NO_CONTENT;
+  } else if (sig_alg == NULL) {
+    return SAML_NO_SIG_ALG;
+  } else if (signature == NULL) {
+    return SAML_NO_SIGNATURE;
+  } else if (saml_find_sig_alg(sig_alg) == NULL) {
     return SAML_INVALID_SIG_ALG;
   }
 
-  xmlDoc* doc = xmlReadMemory(content, strlen(content), "tmp.xml", NULL, 0);
-  if (doc == NULL) {
-    return SAML_INVALID_XML;
+  redirect_msg_t msg;
+  saml_binding_status_t res = redirect_msg_init(&msg, content);
+  if (res != SAML_OK) {
+    return res;
+  }
+  res = redirect_msg_inflate(&msg, REDIRECT_PROBE_LEN);
+  const char* probed;
+  size_t probed_len;
+  char* issuer = NULL;
+  if (res == SAML_OK && redirect_probe_issuer(msg.xml.data, msg.xml.len, &probed, &probed_len)) {
+    issuer = malloc(probed_len + 1);
+    if (issuer == NULL) {
+      redirect_msg_free(&msg);
+      return SAML_XMLSEC_ERROR;
+    }
+    memcpy(issuer, probed, probed_len);
+    issuer[probed_len] = '\0';
+
+    trust_entry_t* entry = trust_acquire_issuer(trust, issuer);
+    if (entry == NULL) {
+      res = SAML_UNTRUSTED_ISSUER;
+    } else {
+      res = redirect_verify(entry->keys, entry->keys_len, saml_type, content, sig_alg, relay_state, signature);
+      trust_release(trust, entry);
+    }
+  }
+  if (res == SAML_OK) {
+    res = redirect_msg_parse(&msg, doc);
+  }
+  redirect_msg_free(&msg);
+  if (res != SAML_OK) {
+    free(issuer);
+    return res;
+  }
+
+  if (issuer == NULL) {
+    res = saml_binding_redirect_verify_trust(trust, *doc, saml_type, content, sig_alg, relay_state, signature);
+  } else {
+    xmlChar* doc_issuer = saml_doc_issuer(*doc);
+    if (doc_issuer == NULL || strcmp((char*)doc_issuer, issuer) != 0) {
+      res = SAML_UNTRUSTED_ISSUER;
+    }
+    xmlFree(doc_issuer);
+    free(issuer);
+  }
+  if (res != SAML_OK) {
+    return res;
+  }
+
+  if (!saml_doc_validate(*doc)) {
+    return SAML_INVALID_DOC;
+  }
+
+  return SAML_OK;
+}
+
+static int post_form_write(void* ctx, const char* buf, int len) {
+  base64_stream_write((base64_stream_t*)ctx, (const byte*)buf, len);
+  return len;
+}
+
+// Serializes doc the same way as xmlDocDumpMemory, but base64-encodes each chunk libxml2 flushes straight onto
+// the end of html, so the message is only ever held once, already encoded.  Returns the serialized length or -1.
+static int post_form_value(xmlDoc* doc, str_t* html) {
+  base64_stream_t b64 = { .out = html, .held_len = 0 };
+  xmlCharEncodingHandler* encoder = NULL;
+  if (doc->encoding != NULL && (encoder = xmlFindCharEncodingHandler((char*)doc->encoding)) == NULL) {
+    return -1;
+  }
+  xmlOutputBuffer* out = xmlOutputBufferCreateIO(post_form_write, NULL, &b64, encoder);
+  if (out == NULL) {
+    xmlCharEncCloseFunc(encoder);
+    return -1;
+  }
+  int len = xmlSaveFileTo(out, doc, (char*)doc->encoding);
+  base64_stream_finish(&b64);
+  return len;
+}
+
+saml_binding_status_t saml_binding_post_create_doc(xmlSecKey* key, char* saml_type, xmlDoc* doc, char* sig_alg, char* relay_state, char* destination, str_t* html) {
+  xmlSecTransformId transform_id = saml_find_sig_alg(sig_alg);
+  if (transform_id == NULL) {
+    return SAML_INVALID_SIG_ALG;
   }
 
   saml_doc_opts_t opts = {
@@ -235,30 +445,26 @@ saml_binding_status_t saml_binding_post_create(xmlSecKey* key, char* saml_type,
   };
   int res = saml_sign_doc(key, transform_id, doc, &opts);
   if (res < 0) {
-    xmlFreeDoc(doc);
     return SAML_XMLSEC_ERROR;
   } else if (res > 0) {
-    xmlFreeDoc(doc);
     return SAML_INVALID_DOC;
   }
 
-  xmlChar* buf;
-  int buf_len;
-  xmlDocDumpMemory(doc, &buf, &buf_len);
-  xmlFree(doc);
-
-  char* result = saml_base64_encode((byte*)buf, buf_len);
-  xmlFree(buf);
-
-  str_init(html, 1024);
+  str_init(html, 4096);
   str_cat(html, FORM_PRE, sizeof(FORM_PRE) - 1);
   str_cat(html, destination, strlen(destination));
 
   str_cat(html, FORM_INPUT_NAME, sizeof(FORM_INPUT_NAME) - 1);
   str_cat(html, saml_type, strlen(saml_type));
   str_cat(html, FORM_INPUT_VALUE, sizeof(FORM_INPUT_VALUE) - 1);
-  str_cat(html, result, strlen(result));
-  free(result);
+
+  uint64_t start = stats_start();
+  int len = post_form_value(doc, html);
+  stats_record(SAML_STAGE_XML_SERIALIZE, start, len < 0 ? 0 : len);
+  if (len < 0) {
+    str_free(html);
+    return SAML_XMLSEC_ERROR;
+  }
 
   if (relay_state != NULL) {
     str_cat(html, FORM_INPUT_NAME, sizeof(FORM_INPUT_NAME) - 1);
@@ -267,44 +473,118 @@ saml_binding_status_t saml_binding_post_create(xmlSecKey* key, char* saml_type,
     str_cat(html, relay_state, strlen(relay_state));
   }
   str_cat(html, FORM_POST, sizeof(FORM_POST) - 1);
-
   return SAML_OK;
 }
 
-saml_binding_status_t saml_binding_post_parse(char* content, xmlDoc** doc) {
+saml_binding_status_t saml_binding_post_create(xmlSecKey* key, char* saml_type, char* content, char* sig_alg, char* relay_state, char* destination, str_t* html) {
+  if (saml_find_sig_alg(sig_alg) == NULL) {
+    return SAML_INVALID_SIG_ALG;
+  }
+
+  xmlDoc* doc = parse_xml(content, strlen(content));
+  if (doc == NULL) {
+    return SAML_INVALID_XML;
+  }
+
+  saml_binding_status_t res = saml_binding_post_create_doc(key, saml_type, doc, sig_alg, relay_state, destination, html);
+  xmlFreeDoc(doc);
+  return res;
+}
+
+saml_binding_status_t saml_binding_post_parse_cached(char* content, unsigned char* content_digest, xmlDoc** doc) {
   if (content == NULL) {
     return SAML_NO_CONTENT;
   }
 
+  int content_len = strlen(content);
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  int validated = 0;
+  if (content_digest != NULL) {
+    SHA256((unsigned char*)content, content_len, digest);
+    validated = CTX.cache_size > 0 && cache_lookup(digest, NULL);
+  }
+
   byte* decoded = NULL;
   int decoded_len;
-  if (saml_base64_decode(content, strlen(content), &decoded, &decoded_len) < 0) {
+  if (saml_base64_decode(content, content_len, &decoded, &decoded_len) < 0) {
     if (decoded != NULL) {
       free(decoded);
     }
     return SAML_BASE64;
   }
 
-  *doc = xmlReadMemory((char*)decoded, decoded_len, "tmp.xml", NULL, 0);
+  *doc = parse_xml((char*)decoded, decoded_len);
+  free(decoded);
   if (*doc == NULL) {
     return SAML_INVALID_XML;
   }
 
-  if (!saml_doc_validate(*doc)) {
+  if (!validated && !saml_doc_validate(*doc)) {
     return SAML_INVALID_DOC;
   }
 
+  // Only now, so that a digest that is cached always belongs to content that passed validation
+  if (content_digest != NULL) {
+    memcpy(content_digest, digest, SHA256_DIGEST_LENGTH);
+  }
   return SAML_OK;
 }
 
-saml_binding_status_t saml_binding_post_verify(xmlSecKeysMngr* mngr, xmlDoc* doc) {
+saml_binding_status_t saml_binding_post_parse(char* content, xmlDoc** doc) {
+  return saml_binding_post_parse_cached(content, NULL, doc);
+}
+
+saml_binding_status_t saml_binding_post_verify_cached(xmlSecKeysMngr* mngr, xmlDoc* doc, const unsigned char* content_digest) {
+  int cacheable = CTX.cache_size > 0 && content_digest != NULL;
+  if (cacheable && cache_lookup(content_digest, mngr)) {
+    return SAML_OK;
+  }
+
   saml_doc_opts_t opts = { .id_attr = (xmlChar*)"ID" };
-  int res = saml_verify_doc(mngr, doc, &opts);
+  unsigned char key_digest[SHA256_DIGEST_LENGTH];
+  int key_digested = 0;
+  int res = verify_doc(mngr, doc, &opts, cacheable ? key_digest : NULL, &key_digested);
   if (res < 0) {
     return SAML_XMLSEC_ERROR;
   } else if (res == 0) {
+    if (key_digested) {
+      cache_insert(content_digest, key_digest);
+    }
     return SAML_OK;
   } else {
     return SAML_INVALID_SIGNATURE;
   }
 }
+
+saml_binding_status_t saml_binding_post_verify(xmlSecKeysMngr* mngr, xmlDoc* doc) {
+  return saml_binding_post_verify_cached(mngr, doc, NULL);
+}
+
+saml_binding_status_t saml_binding_post_verify_trust_cached(saml_trust_t* trust, xmlDoc* doc, const unsigned char* content_digest) {
+  trust_entry_t* entry = trust_acquire(trust, doc);
+  if (entry == NULL) {
+    return SAML_UNTRUSTED_ISSUER;
+  }
+
+  saml_binding_status_t status = SAML_XMLSEC_ERROR;
+  int selected = trust_select(entry, doc);
+  if (selected == TRUST_NONE) {
+    status = SAML_UNTRUSTED_KEY;
+  } else if (selected != TRUST_ALL) {
+    status = saml_binding_post_verify_cached(entry->key_infos[selected].mngr, doc, content_digest);
+  } else {
+    // As with redirect_verify, a key that does not fit the signature at all is no reason to stop
+    for (size_t i = 0; i < entry->keys_len && status != SAML_OK; i++) {
+      saml_binding_status_t res = saml_binding_post_verify_cached(entry->key_infos[i].mngr, doc, content_digest);
+      if (res != SAML_XMLSEC_ERROR) {
+        status = res;
+      }
+    }
+  }
+  trust_release(trust, entry);
+  return status;
+}
+
+saml_binding_status_t saml_binding_post_verify_trust(saml_trust_t* trust, xmlDoc* doc) {
+  return saml_binding_post_verify_trust_cached(trust, doc, NULL);
+}
@@ -0,0 +1,342 @@
+// A Response that is written out in its exclusive canonical form (https://www.w3.org/TR/xml-exc-c14n/), with
+// attributes in order, empty elements given end tags, each namespace declared on the elements that use it and
+// text escaped as c14n escapes it, needs no canonicalization to be digested: the bytes are hashed as they are
+// written.  Once the Response is done, SignedInfo is signed and the Signature is inserted after the Issuer.
+//
+// xs is only used in xsi:type values, which c14n does not look into, so its declaration is written but not
+// digested, as is the Signature, which the enveloped transform removes.
+
+#define XMLNS_DSIG "http://www.w3.org/2000/09/xmldsig#"
+
+static const char* ATTRNAME_FORMAT_BASIC = "urn:oasis:names:tc:SAML:2.0:attrname-format:basic";
+static const char* SIGNED_INFO_XMLNS = "<SignedInfo xmlns=\"" XMLNS_DSIG "\">";
+
+typedef struct {
+  str_t* out;     // NULL when the bytes are only digested
+  EVP_MD_CTX* md; // NULL when the bytes are not digested
+  int error;
+} build_t;
+
+
+static void build_raw(build_t* b, const char* data, int len) {
+  if (b->out != NULL) {
+    str_cat(b->out, data, len);
+  }
+  if (b->md != NULL && EVP_DigestUpdate(b->md, data, len) != 1) {
+    b->error = 1;
+  }
+}
+
+
+#define build_lit(b, s) build_raw(b, s, sizeof(s) - 1)
+
+
+static void build_str(build_t* b, const char* s) {
+  build_raw(b, s, strlen(s));
+}
+
+
+// Escapes text as c14n does: &, < and > in text, and &, <, ", tab, newline and carriage return in attributes
+static void build_escaped_len(build_t* b, const char* s, int len, int attr) {
+  const char* run = s;
+  const char* end = s + len;
+  for (; s < end; s++) {
+    const char* esc;
+    switch (*s) {
+      case '&': esc = "&amp;"; break;
+      case '<': esc = "&lt;"; break;
+      case '>': esc = attr ? NULL : "&gt;"; break;
+      case '"': esc = attr ? "&quot;" : NULL; break;
+      case '\t': esc = attr ? "&#x9;" : NULL; break;
+      case '\n': esc = attr ? "&#xA;" : NULL; break;
+      case '\r': esc = "&#xD;"; break;
+      default: esc = NULL; break;
+    }
+    if (esc != NULL) {
+      build_raw(b, run, s - run);
+      build_str(b, esc);
+      run = s + 1;
+    }
+  }
+  build_raw(b, run, s - run);
+}
+
+
+static void build_escaped(build_t* b, const char* s, int attr) {
+  build_escaped_len(b, s, strlen(s), attr);
+}
+
+
+// Callers pass attributes in c14n order, which for unqualified attributes is by name
+static void build_attr(build_t* b, const char* name, const char* value) {
+  if (value == NULL) {
+    return;
+  }
+  build_lit(b, " ");
+  build_str(b, name);
+  build_lit(b, "=\"");
+  build_escaped(b, value, 1);
+  build_lit(b, "\"");
+}
+
+
+// <tag>text</tag>, where open is the start tag without its closing >
+static void build_leaf(build_t* b, const char* open, const char* close, const char* text) {
+  build_str(b, open);
+  build_lit(b, ">");
+  build_escaped(b, text, 0);
+  build_str(b, close);
+}
+
+
+// Whether s can be written as XML 1.0 text
+static int build_valid(const char* s) {
+  if (s == NULL) {
+    return 1;
+  }
+  if (!xmlCheckUTF8((const xmlChar*)s)) {
+    return 0;
+  }
+  for (; *s != '\0'; s++) {
+    if ((unsigned char)*s < 0x20 && *s != '\t' && *s != '\n' && *s != '\r') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static int build_response_valid(const saml_response_t* r) {
+  if (r->id == NULL || r->issue_instant == NULL || r->issuer == NULL) {
+    return 0;
+  }
+  if (r->assertion_id != NULL && r->name_id == NULL) {
+    return 0;
+  }
+
+  const char* fields[] = {
+    r->id, r->issue_instant, r->destination, r->in_response_to, r->issuer, r->status_code, r->assertion_id,
+    r->name_id, r->name_id_format, r->sp_name_qualifier, r->not_before, r->not_on_or_after, r->audience,
+    r->session_index, r->authn_context_class_ref,
+  };
+  for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    if (!build_valid(fields[i])) {
+      return 0;
+    }
+  }
+  for (size_t i = 0; i < r->attrs_len; i++) {
+    if (r->attrs[i].name == NULL || !build_valid((char*)r->attrs[i].name)) {
+      return 0;
+    }
+    for (int j = 0; j < r->attrs[i].num_values; j++) {
+      if (r->attrs[i].values[j] == NULL || !build_valid((char*)r->attrs[i].values[j])) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+
+static void build_assertion(build_t* b, const saml_response_t* r) {
+  build_lit(b, "<saml:Assertion xmlns:saml=\"urn:oasis:names:tc:SAML:2.0:assertion\"");
+  build_attr(b, "ID", r->assertion_id);
+  build_attr(b, "IssueInstant", r->issue_instant);
+  build_lit(b, " Version=\"2.0\">");
+  build_leaf(b, "<saml:Issuer", "</saml:Issuer>", r->issuer);
+
+  build_lit(b, "<saml:Subject><saml:NameID");
+  build_attr(b, "Format", r->name_id_format);
+  build_attr(b, "SPNameQualifier", r->sp_name_qualifier);
+  build_leaf(b, "", "</saml:NameID>", r->name_id);
+  build_lit(b, "<saml:SubjectConfirmation Method=\"urn:oasis:names:tc:SAML:2.0:cm:bearer\"><saml:SubjectConfirmationData");
+  build_attr(b, "InResponseTo", r->in_response_to);
+  build_attr(b, "NotOnOrAfter", r->not_on_or_after);
+  build_attr(b, "Recipient", r->destination);
+  build_lit(b, "></saml:SubjectConfirmationData></saml:SubjectConfirmation></saml:Subject>");
+
+  if (r->not_before != NULL || r->not_on_or_after != NULL || r->audience != NULL) {
+    build_lit(b, "<saml:Conditions");
+    build_attr(b, "NotBefore", r->not_before);
+    build_attr(b, "NotOnOrAfter", r->not_on_or_after);
+    build_lit(b, ">");
+    if (r->audience != NULL) {
+      build_lit(b, "<saml:AudienceRestriction>");
+      build_leaf(b, "<saml:Audience", "</saml:Audience>", r->audience);
+      build_lit(b, "</saml:AudienceRestriction>");
+    }
+    build_lit(b, "</saml:Conditions>");
+  }
+
+  if (r->authn_context_class_ref != NULL) {
+    build_lit(b, "<saml:AuthnStatement");
+    build_attr(b, "AuthnInstant", r->issue_instant);
+    build_attr(b, "SessionIndex", r->session_index);
+    build_lit(b, "><saml:AuthnContext>");
+    build_leaf(b, "<saml:AuthnContextClassRef", "</saml:AuthnContextClassRef>", r->authn_context_class_ref);
+    build_lit(b, "</saml:AuthnContext></saml:AuthnStatement>");
+  }
+
+  if (r->attrs_len > 0) {
+    build_lit(b, "<saml:AttributeStatement>");
+    for (size_t i = 0; i < r->attrs_len; i++) {
+      build_lit(b, "<saml:Attribute");
+      build_attr(b, "Name", (char*)r->attrs[i].name);
+      build_attr(b, "NameFormat", ATTRNAME_FORMAT_BASIC);
+      build_lit(b, ">");
+      for (int j = 0; j < r->attrs[i].num_values; j++) {
+        build_lit(b, "<saml:AttributeValue xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"");
+        EVP_MD_CTX* md = b->md;
+        b->md = NULL;
+        build_lit(b, " xmlns:xs=\"http://www.w3.org/2001/XMLSchema\"");
+        b->md = md;
+        build_leaf(b, " xsi:type=\"xs:string\"", "</saml:AttributeValue>", (char*)r->attrs[i].values[j]);
+      }
+      build_lit(b, "</saml:Attribute>");
+    }
+    build_lit(b, "</saml:AttributeStatement>");
+  }
+
+  build_lit(b, "</saml:Assertion>");
+}
+
+
+// SignedInfo in its canonical form, which declares the dsig namespace as the apex of the c14n
+static int build_signed_info(saml_signer_t* signer, const char* id, unsigned char* digest, unsigned int digest_len, str_t* out) {
+  char* digest_b64 = saml_base64_encode(digest, digest_len);
+  if (digest_b64 == NULL) {
+    return -1;
+  }
+
+  str_init(out, 1024);
+  build_t b = { .out = out };
+  build_str(&b, SIGNED_INFO_XMLNS);
+  build_lit(&b, "\n<CanonicalizationMethod Algorithm=\"http://www.w3.org/2001/10/xml-exc-c14n#\"></CanonicalizationMethod>");
+  build_lit(&b, "\n<SignatureMethod");
+  build_attr(&b, "Algorithm", (char*)signer->transform_id->href);
+  build_lit(&b, "></SignatureMethod>\n<Reference URI=\"#");
+  build_escaped(&b, id, 1);
+  build_lit(&b, "\">\n<Transforms>");
+  build_lit(&b, "\n<Transform Algorithm=\"http://www.w3.org/2000/09/xmldsig#enveloped-signature\"></Transform>");
+  build_lit(&b, "\n<Transform Algorithm=\"http://www.w3.org/2001/10/xml-exc-c14n#\"></Transform>");
+  build_lit(&b, "\n</Transforms>\n<DigestMethod");
+  build_attr(&b, "Algorithm", (char*)signer->digest_id->href);
+  build_lit(&b, "></DigestMethod>\n<DigestValue>");
+  build_str(&b, digest_b64);
+  build_lit(&b, "</DigestValue>\n</Reference>\n</SignedInfo>");
+  free(digest_b64);
+  return 0;
+}
+
+
+static const EVP_MD* build_md(xmlSecTransformId digest_id) {
+  if (digest_id == xmlSecTransformSha1Id) {
+    return EVP_sha1();
+  } else if (digest_id == xmlSecTransformSha256Id) {
+    return EVP_sha256();
+  } else if (digest_id == xmlSecTransformSha384Id) {
+    return EVP_sha384();
+  } else if (digest_id == xmlSecTransformSha512Id) {
+    return EVP_sha512();
+  }
+  return NULL;
+}
+
+
+// Writes the Signature for the digested Response into sig
+static int build_signature(saml_signer_t* signer, const char* id, unsigned char* digest, unsigned int digest_len, str_t* sig) {
+  str_t signed_info;
+  if (build_signed_info(signer, id, digest, digest_len, &signed_info) < 0) {
+    return -1;
+  }
+
+  str_t value;
+  if (saml_sign_binary_str(signer_key(signer), signer->transform_id, (unsigned char*)signed_info.data, signed_info.len, &value) < 0) {
+    str_free(&signed_info);
+    return -1;
+  }
+  char* value_b64 = saml_base64_encode((byte*)value.data, value.len);
+  str_free(&value);
+  if (value_b64 == NULL) {
+    str_free(&signed_info);
+    return -1;
+  }
+
+  // In the document, SignedInfo inherits the namespace from Signature
+  int xmlns_len = strlen(SIGNED_INFO_XMLNS);
+  str_init(sig, signed_info.len + strlen(value_b64) + signer->key_info.len + 256);
+  build_t b = { .out = sig };
+  build_lit(&b, "<Signature xmlns=\"" XMLNS_DSIG "\">\n<SignedInfo>");
+  build_raw(&b, signed_info.data + xmlns_len, signed_info.len - xmlns_len);
+  build_lit(&b, "\n<SignatureValue>");
+  build_str(&b, value_b64);
+  build_lit(&b, "</SignatureValue>\n");
+  build_raw(&b, signer->key_info.data, signer->key_info.len);
+  build_lit(&b, "\n</Signature>");
+
+  free(value_b64);
+  str_free(&signed_info);
+  return 0;
+}
+
+
+int saml_response_build(saml_signer_t* signer, const saml_response_t* response, str_t* xml) {
+  if (!build_response_valid(response)) {
+    saml_log("invalid response fields");
+    return 1;
+  }
+
+  const EVP_MD* md = build_md(signer->digest_id);
+  if (md == NULL) {
+    saml_log("unsupported digest method");
+    return -1;
+  }
+  EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+  if (md_ctx == NULL || EVP_DigestInit_ex(md_ctx, md, NULL) != 1) {
+    saml_log("digest init failed");
+    EVP_MD_CTX_free(md_ctx);
+    return -1;
+  }
+
+  uint64_t start = stats_start();
+  str_t body;
+  str_init(&body, 4096);
+  build_t b = { .out = &body, .md = md_ctx };
+  build_lit(&b, "<samlp:Response xmlns:samlp=\"urn:oasis:names:tc:SAML:2.0:protocol\"");
+  build_attr(&b, "Destination", response->destination);
+  build_attr(&b, "ID", response->id);
+  build_attr(&b, "InResponseTo", response->in_response_to);
+  build_attr(&b, "IssueInstant", response->issue_instant);
+  build_lit(&b, " Version=\"2.0\">");
+  build_leaf(&b, "<saml:Issuer xmlns:saml=\"urn:oasis:names:tc:SAML:2.0:assertion\"", "</saml:Issuer>", response->issuer);
+  int sig_offset = body.len;
+
+  build_lit(&b, "<samlp:Status><samlp:StatusCode");
+  build_attr(&b, "Value", response->status_code != NULL ? response->status_code : SAML_STATUS_SUCCESS);
+  build_lit(&b, "></samlp:StatusCode></samlp:Status>");
+  if (response->assertion_id != NULL) {
+    build_assertion(&b, response);
+  }
+  build_lit(&b, "</samlp:Response>");
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  int res = b.error || EVP_DigestFinal_ex(md_ctx, digest, &digest_len) != 1 ? -1 : 0;
+  EVP_MD_CTX_free(md_ctx);
+
+  str_t sig;
+  if (res < 0 || build_signature(signer, response->id, digest, digest_len, &sig) < 0) {
+    saml_log("sign response failed");
+    str_free(&body);
+    return -1;
+  }
+
+  str_init(xml, body.len + sig.len);
+  str_cat(xml, body.data, sig_offset);
+  str_cat(xml, sig.data, sig.len);
+  str_cat(xml, body.data + sig_offset, body.len - sig_offset);
+  stats_record(SAML_STAGE_SIGN_DOC, start, xml->len);
+  str_free(&sig);
+  str_free(&body);
+  return 0;
+}
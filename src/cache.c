@@ -0,0 +1,233 @@
+// Browsers re-POST a response when the user goes back or refreshes, and load balancers retry, so the same
+// SAMLResponse often arrives more than once.  Once a POST binding has been validated and verified, the digest
+// of its content is remembered along with the digest of the key that verified it.  Later copies skip schema
+// validation and signature verification for as long as the entry lives and that key is still in the keys
+// manager.  Entries are evicted least recently used first and expire after a fixed time.  Replays are still
+// the caller's problem: a cache hit means the bytes are authentic, not that they are fresh.
+//
+// saml_binding_post_parse_cached hands the content digest to the caller once the document has passed
+// validation, and the caller passes it on to saml_binding_post_verify_cached with the same document.
+
+#if SAML_CONTENT_DIGEST_LEN != SHA256_DIGEST_LENGTH
+#  error "the content digest is a SHA-256"
+#endif
+
+// Different keys verifying the same content is unusual, so only this many are compared
+#define CACHE_KEYS_MAX 4
+
+
+static void cache_reset(saml_ctx_t* ctx) {
+  memset(ctx->cache_buckets, 0, (ctx->cache_mask + 1) * sizeof(cache_entry_t*));
+  ctx->cache_head = ctx->cache_tail = NULL;
+  ctx->cache_unused = NULL;
+  for (int i = ctx->cache_size - 1; i >= 0; i--) {
+    ctx->cache_entries[i].next = ctx->cache_unused;
+    ctx->cache_unused = ctx->cache_entries + i;
+  }
+  ctx->cache_stats.entries = 0;
+}
+
+
+static void cache_free(saml_ctx_t* ctx);
+
+static int cache_init(saml_ctx_t* ctx, int size, int ttl) {
+  cache_free(ctx);
+  if (size <= 0 || ttl <= 0) {
+    return 0;
+  }
+
+  uint64_t buckets = 1;
+  while (buckets < 2 * (uint64_t)size) {
+    buckets <<= 1;
+  }
+  ctx->cache_entries = calloc(size, sizeof(cache_entry_t));
+  ctx->cache_buckets = calloc(buckets, sizeof(cache_entry_t*));
+  if (ctx->cache_entries == NULL || ctx->cache_buckets == NULL) {
+    free(ctx->cache_entries);
+    free(ctx->cache_buckets);
+    ctx->cache_entries = NULL;
+    ctx->cache_buckets = NULL;
+    saml_log("could not allocate verify cache");
+    return -1;
+  }
+
+  ctx->cache_size = size;
+  ctx->cache_mask = buckets - 1;
+  ctx->cache_ttl_ns = (uint64_t)ttl * 1000000000;
+  memset(&ctx->cache_stats, 0, sizeof(saml_verify_cache_stats_t));
+  cache_reset(ctx);
+  return 0;
+}
+
+
+static void cache_free(saml_ctx_t* ctx) {
+  free(ctx->cache_entries);
+  free(ctx->cache_buckets);
+  ctx->cache_entries = NULL;
+  ctx->cache_buckets = NULL;
+  ctx->cache_size = 0;
+}
+
+
+// The digests are already uniformly distributed, so the first bytes make a fine hash
+static cache_entry_t** cache_bucket(const unsigned char* msg_digest) {
+  uint64_t hash;
+  memcpy(&hash, msg_digest, sizeof(hash));
+  return CTX.cache_buckets + (hash & CTX.cache_mask);
+}
+
+
+static void cache_unlink(cache_entry_t* entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    CTX.cache_head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    CTX.cache_tail = entry->prev;
+  }
+}
+
+
+static void cache_push(cache_entry_t* entry) {
+  entry->prev = NULL;
+  entry->next = CTX.cache_head;
+  if (entry->next != NULL) {
+    entry->next->prev = entry;
+  } else {
+    CTX.cache_tail = entry;
+  }
+  CTX.cache_head = entry;
+}
+
+
+static void cache_remove(cache_entry_t* entry) {
+  cache_entry_t** link = cache_bucket(entry->msg_digest);
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  cache_unlink(entry);
+  entry->next = CTX.cache_unused;
+  CTX.cache_unused = entry;
+  CTX.cache_stats.entries--;
+}
+
+
+// Copies the key digests of up to max live entries for the content, which become the most recently used, and
+// returns how many there are.  Expired entries are dropped along the way.
+static int cache_find(const unsigned char* msg_digest, unsigned char (*key_digests)[SHA256_DIGEST_LENGTH], int max) {
+  uint64_t now = stats_now();
+  int found = 0;
+  pthread_mutex_lock(&CTX.cache_lock);
+  cache_entry_t* entry = *cache_bucket(msg_digest);
+  while (entry != NULL) {
+    cache_entry_t* chain = entry->chain;
+    if (memcmp(entry->msg_digest, msg_digest, SHA256_DIGEST_LENGTH) == 0) {
+      if (entry->expires <= now) {
+        cache_remove(entry);
+      } else {
+        if (found < max) {
+          memcpy(key_digests[found], entry->key_digest, SHA256_DIGEST_LENGTH);
+        }
+        found++;
+        cache_unlink(entry);
+        cache_push(entry);
+      }
+    }
+    entry = chain;
+  }
+  pthread_mutex_unlock(&CTX.cache_lock);
+  return found;
+}
+
+
+// Any key will do when mngr is NULL, since schema validation does not depend on it
+static int cache_lookup(const unsigned char* msg_digest, xmlSecKeysMngr* mngr) {
+  unsigned char found[CACHE_KEYS_MAX][SHA256_DIGEST_LENGTH];
+  int found_len = cache_find(msg_digest, found, CACHE_KEYS_MAX);
+  if (found_len > CACHE_KEYS_MAX) {
+    found_len = CACHE_KEYS_MAX;
+  }
+
+  int hit = found_len > 0 && mngr == NULL;
+  xmlSecKeyStore* store = mngr == NULL ? NULL : xmlSecKeysMngrGetKeysStore(mngr);
+  if (found_len > 0 && store != NULL && xmlSecKeyStoreCheckId(store, xmlSecSimpleKeysStoreId)) {
+    // Only keys that were added to the manager are trusted this way; one that came from an X509 chain in the
+    // document is simply never found here, and the document is verified again
+    xmlSecPtrList* keys = xmlSecSimpleKeysStoreGetKeys(store);
+    xmlSecSize keys_len = keys == NULL ? 0 : xmlSecPtrListGetSize(keys);
+    for (xmlSecSize i = 0; i < keys_len && !hit; i++) {
+      unsigned char key_digest[SHA256_DIGEST_LENGTH];
+      xmlSecKey* key = (xmlSecKey*)xmlSecPtrListGetItem(keys, i);
+      if (key == NULL || evp_key_digest(key, key_digest) < 0) {
+        continue;
+      }
+      for (int j = 0; j < found_len && !hit; j++) {
+        hit = memcmp(found[j], key_digest, SHA256_DIGEST_LENGTH) == 0;
+      }
+    }
+  }
+
+  pthread_mutex_lock(&CTX.cache_lock);
+  if (hit) {
+    CTX.cache_stats.hits++;
+  } else {
+    CTX.cache_stats.misses++;
+  }
+  pthread_mutex_unlock(&CTX.cache_lock);
+  return hit;
+}
+
+
+static void cache_insert(const unsigned char* msg_digest, const unsigned char* key_digest) {
+  uint64_t now = stats_now();
+  pthread_mutex_lock(&CTX.cache_lock);
+  cache_entry_t** bucket = cache_bucket(msg_digest);
+  cache_entry_t* entry = *bucket;
+  while (entry != NULL && (memcmp(entry->msg_digest, msg_digest, SHA256_DIGEST_LENGTH) != 0
+                           || memcmp(entry->key_digest, key_digest, SHA256_DIGEST_LENGTH) != 0)) {
+    entry = entry->chain;
+  }
+
+  if (entry != NULL) {
+    // Two threads verified the same content at once
+    cache_unlink(entry);
+  } else {
+    if (CTX.cache_unused == NULL) {
+      if (CTX.cache_tail->expires > now) {
+        CTX.cache_stats.evictions++;
+      }
+      cache_remove(CTX.cache_tail);
+    }
+    entry = CTX.cache_unused;
+    CTX.cache_unused = entry->next;
+    memcpy(entry->msg_digest, msg_digest, SHA256_DIGEST_LENGTH);
+    memcpy(entry->key_digest, key_digest, SHA256_DIGEST_LENGTH);
+    entry->chain = *bucket;
+    *bucket = entry;
+    CTX.cache_stats.entries++;
+  }
+  entry->expires = now + CTX.cache_ttl_ns;
+  cache_push(entry);
+  pthread_mutex_unlock(&CTX.cache_lock);
+}
+
+
+void saml_verify_cache_stats(saml_verify_cache_stats_t* stats) {
+  pthread_mutex_lock(&CTX.cache_lock);
+  *stats = CTX.cache_stats;
+  pthread_mutex_unlock(&CTX.cache_lock);
+}
+
+
+// Drops every entry, e.g. after a key has been revoked.  The counters keep going.
+void saml_verify_cache_clear() {
+  pthread_mutex_lock(&CTX.cache_lock);
+  if (CTX.cache_size > 0) {
+    cache_reset(&CTX);
+  }
+  pthread_mutex_unlock(&CTX.cache_lock);
+}
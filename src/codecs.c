@@ -1,6 +1,6 @@
 static const char BASE64_ENCODE_TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-char* saml_base64_encode(const byte* c, int len) {
+static char* base64_encode(const byte* c, int len) {
   char* out = malloc(ceil(len * 4 / 3) + 4); // up to 3 bytes in padding
   char* out_i = out;
   int a[3];
@@ -36,6 +36,57 @@ char* saml_base64_encode(const byte* c, int len) {
   return out;
 }
 
+// Base64 for data that arrives in chunks, e.g. from an xmlOutputBuffer, encoded straight onto the end of out.
+// Up to two bytes that do not make a whole group are held until the next write or base64_stream_finish.
+typedef struct {
+  str_t* out;
+  byte held[2];
+  int held_len;
+} base64_stream_t;
+
+static inline void base64_group(char* out, const byte* c, int len) {
+  uint32_t sum = c[0] << 16 | (len > 1 ? c[1] << 8 : 0) | (len > 2 ? c[2] : 0);
+  out[0] = BASE64_ENCODE_TABLE[(sum >> 18) & 0x3f];
+  out[1] = BASE64_ENCODE_TABLE[(sum >> 12) & 0x3f];
+  out[2] = len > 1 ? BASE64_ENCODE_TABLE[(sum >> 6) & 0x3f] : '=';
+  out[3] = len > 2 ? BASE64_ENCODE_TABLE[sum & 0x3f] : '=';
+}
+
+static void base64_stream_write(base64_stream_t* s, const byte* c, int len) {
+  while (s->out->total - s->out->len < (s->held_len + len) / 3 * 4) {
+    str_grow(s->out);
+  }
+  char* out = s->out->data + s->out->len;
+
+  if (s->held_len > 0 && s->held_len + len >= 3) {
+    byte group[3];
+    memcpy(group, s->held, s->held_len);
+    memcpy(group + s->held_len, c, 3 - s->held_len);
+    c += 3 - s->held_len;
+    len -= 3 - s->held_len;
+    s->held_len = 0;
+    base64_group(out, group, 3);
+    out += 4;
+  }
+  for (; len >= 3; len -= 3, c += 3, out += 4) {
+    base64_group(out, c, 3);
+  }
+  memcpy(s->held + s->held_len, c, len);
+  s->held_len += len;
+  s->out->len = out - s->out->data;
+}
+
+static void base64_stream_finish(base64_stream_t* s) {
+  if (s->held_len > 0) {
+    while (s->out->total - s->out->len < 4) {
+      str_grow(s->out);
+    }
+    base64_group(s->out->data + s->out->len, s->held, s->held_len);
+    s->out->len += 4;
+    s->held_len = 0;
+  }
+}
+
 static int base64_is_valid(byte c) {
   return (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') || c == '+' || c == '/') ? 1 : 0;
 }
@@ -55,8 +106,10 @@ static char base64_sub(byte c) {
   }
 }
 
-int saml_base64_decode(const char* in, int in_len, byte** out, int* out_len) {
+// Padding is only accepted in place of the last one or two characters.  On error *out is NULL.
+static int base64_decode(const char* in, int in_len, byte** out, int* out_len) {
   if (in_len % 4 != 0) {
+    *out = NULL;
     return -1; // isn't padded correctly
   }
 
@@ -72,12 +125,14 @@ int saml_base64_decode(const char* in, int in_len, byte** out, int* out_len) {
     for(i = 3; i >= 0; i--) {
       if (base64_is_valid(*in)) {
         sum = sum + (base64_sub(*in++) << (i * 6));
-      } else if (*in == '=') {
+      } else if (*in == '=' && i <= 1 && stop - in == i + 1 && (i == 0 || in[1] == '=')) {
         in++;
         i++;
         break;
       } else {
-        return -1;
+        free(*out);
+        *out = NULL;
+        return -1; // padding can only take the place of the last one or two characters of the input
       }
     }
     if (i == 3) break; // this should never happen because it implies an entire quadruplet of padding
@@ -94,6 +149,20 @@ int saml_base64_decode(const char* in, int in_len, byte** out, int* out_len) {
   return 0;
 }
 
+char* saml_base64_encode(const byte* c, int len) {
+  uint64_t start = stats_start();
+  char* out = base64_encode(c, len);
+  stats_record(SAML_STAGE_BASE64_ENCODE, start, len);
+  return out;
+}
+
+int saml_base64_decode(const char* in, int in_len, byte** out, int* out_len) {
+  uint64_t start = stats_start();
+  int res = base64_decode(in, in_len, out, out_len);
+  stats_record(SAML_STAGE_BASE64_DECODE, start, in_len);
+  return res;
+}
+
 static int uri_is_unreserved(char c) {
   return (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~') ? 1 : 0;
 }
@@ -0,0 +1,239 @@
+// Redirect bindings carry raw DEFLATE (RFC 1951).  By default it is compressed and inflated with zlib; built with
+// SAML_LIBDEFLATE (make DEFLATE=libdeflate), libdeflate does it in one shot instead, which suits messages that are
+// small and entirely in memory.  Either way each thread keeps its compressor and decompressor in its thread
+// context, since both allocate tens to hundreds of KB of state.
+
+#if MAX_MEM_LEVEL >= 8
+#  define DEF_MEM_LEVEL 8
+#else
+#  define DEF_MEM_LEVEL  MAX_MEM_LEVEL
+#endif
+
+#ifdef SAML_LIBDEFLATE
+
+// No DEFLATE stream expands by more than this, so a message that does not fit in this many times its compressed
+// size is not valid
+#define DEFLATE_MAX_RATIO 1032
+#define DEFLATE_MAX_LEVEL 12
+
+typedef struct {
+  const byte* in;
+  size_t in_len;
+  int ended;
+} inflater_t;
+
+#else
+
+#define DEFLATE_MAX_LEVEL 9
+
+typedef struct {
+  z_stream* stream; // the thread's, reset for every message
+  int ended;
+} inflater_t;
+
+#endif
+
+
+static int compress_init(saml_ctx_t* ctx, int level, int mem_level) {
+  if (level < 0 || level > DEFLATE_MAX_LEVEL || mem_level < 0 || mem_level > MAX_MEM_LEVEL) {
+    saml_log("deflate_level or deflate_mem_level is out of range");
+    return -1;
+  }
+  ctx->deflate_level = level == 0 ? 6 : level;
+  ctx->deflate_mem_level = mem_level == 0 ? DEF_MEM_LEVEL : mem_level;
+  return 0;
+}
+
+
+#ifdef SAML_LIBDEFLATE
+
+static void compress_thread_free(saml_thread_ctx_t* tctx) {
+  if (tctx->compressor != NULL) {
+    libdeflate_free_compressor(tctx->compressor);
+  }
+  if (tctx->decompressor != NULL) {
+    libdeflate_free_decompressor(tctx->decompressor);
+  }
+}
+
+
+// Compresses all of in into a new buffer of libdeflate's bound for it
+static saml_binding_status_t compress_deflate(const byte* in, size_t in_len, byte** out, size_t* out_len) {
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
+    return SAML_ZLIB_ERROR;
+  } else if (tctx->compressor == NULL && (tctx->compressor = libdeflate_alloc_compressor(CTX.deflate_level)) == NULL) {
+    return SAML_ZLIB_ERROR;
+  }
+
+  size_t bound = libdeflate_deflate_compress_bound(tctx->compressor, in_len);
+  byte* buf = malloc(bound);
+  if (buf == NULL) {
+    return SAML_ZLIB_ERROR;
+  }
+  *out_len = libdeflate_deflate_compress(tctx->compressor, in, in_len, buf, bound);
+  if (*out_len == 0) {
+    free(buf);
+    return SAML_ZLIB_ERROR;
+  }
+  *out = buf;
+  return SAML_OK;
+}
+
+
+static saml_binding_status_t inflater_start(inflater_t* inf, const byte* in, size_t in_len) {
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
+    return SAML_ZLIB_ERROR;
+  } else if (tctx->decompressor == NULL && (tctx->decompressor = libdeflate_alloc_decompressor()) == NULL) {
+    return SAML_ZLIB_ERROR;
+  }
+  inf->in = in;
+  inf->in_len = in_len;
+  inf->ended = 0;
+  return SAML_OK;
+}
+
+
+// libdeflate only inflates whole messages, so limit is ignored.  out is grown until the message fits.
+static saml_binding_status_t inflater_run(inflater_t* inf, str_t* out, size_t limit, size_t* consumed) {
+  *consumed = 0;
+  if (inf->ended) {
+    return SAML_OK;
+  }
+
+  struct libdeflate_decompressor* decompressor = thread_ctx()->decompressor;
+  size_t in_used, out_used;
+  for (;;) {
+    enum libdeflate_result res = libdeflate_deflate_decompress_ex(decompressor, inf->in, inf->in_len, out->data, out->total, &in_used, &out_used);
+    if (res == LIBDEFLATE_SUCCESS) {
+      break;
+    } else if (res != LIBDEFLATE_INSUFFICIENT_SPACE || (size_t)out->total >= inf->in_len * DEFLATE_MAX_RATIO) {
+      return SAML_INVALID_COMPRESSION;
+    }
+    out->len = 0;
+    str_grow(out);
+  }
+  out->len = out_used;
+  inf->ended = 1;
+  *consumed = in_used;
+  return SAML_OK;
+}
+
+#else
+
+static void compress_thread_free(saml_thread_ctx_t* tctx) {
+  if (tctx->deflate_stream != NULL) {
+    deflateEnd(tctx->deflate_stream);
+    free(tctx->deflate_stream);
+  }
+  if (tctx->inflate_stream != NULL) {
+    inflateEnd(tctx->inflate_stream);
+    free(tctx->inflate_stream);
+  }
+}
+
+
+// A stream left mid-message by an error is reset too
+static z_stream* thread_deflate_stream() {
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
+    return NULL;
+  } else if (tctx->deflate_stream != NULL) {
+    return deflateReset(tctx->deflate_stream) == Z_OK ? tctx->deflate_stream : NULL;
+  }
+
+  z_stream* stream = calloc(1, sizeof(z_stream));
+  if (stream == NULL) {
+    return NULL;
+  }
+  if (deflateInit2(stream, CTX.deflate_level, Z_DEFLATED, -15, CTX.deflate_mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(stream);
+    return NULL;
+  }
+  tctx->deflate_stream = stream;
+  return stream;
+}
+
+
+static z_stream* thread_inflate_stream() {
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
+    return NULL;
+  } else if (tctx->inflate_stream != NULL) {
+    return inflateReset(tctx->inflate_stream) == Z_OK ? tctx->inflate_stream : NULL;
+  }
+
+  z_stream* stream = calloc(1, sizeof(z_stream));
+  if (stream == NULL) {
+    return NULL;
+  }
+  if (inflateInit2(stream, -15) != Z_OK) {
+    free(stream);
+    return NULL;
+  }
+  tctx->inflate_stream = stream;
+  return stream;
+}
+
+
+static saml_binding_status_t compress_deflate(const byte* in, size_t in_len, byte** out, size_t* out_len) {
+  z_stream* stream = thread_deflate_stream();
+  if (stream == NULL) {
+    return SAML_ZLIB_ERROR;
+  }
+
+  stream->next_in = (byte*)in;
+  stream->avail_in = in_len;
+  stream->avail_out = deflateBound(stream, in_len);
+  *out = malloc(stream->avail_out);
+  if (*out == NULL) {
+    return SAML_ZLIB_ERROR;
+  }
+  stream->next_out = *out;
+
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+    free(*out);
+    return SAML_ZLIB_ERROR;
+  }
+  *out_len = stream->total_out;
+  return SAML_OK;
+}
+
+
+static saml_binding_status_t inflater_start(inflater_t* inf, const byte* in, size_t in_len) {
+  inf->stream = thread_inflate_stream();
+  if (inf->stream == NULL) {
+    return SAML_ZLIB_ERROR;
+  }
+  inf->stream->next_in = (byte*)in;
+  inf->stream->avail_in = in_len;
+  inf->ended = 0;
+  return SAML_OK;
+}
+
+
+// Inflates into out until it holds at least limit bytes, or all of the message
+static saml_binding_status_t inflater_run(inflater_t* inf, str_t* out, size_t limit, size_t* consumed) {
+  uLong in = inf->stream->total_in;
+  int zlib_res = Z_OK;
+  while (!inf->ended && out->len < limit) {
+    inf->stream->next_out = (unsigned char*)out->data + out->len;
+    inf->stream->avail_out = out->total - out->len;
+    zlib_res = inflate(inf->stream, Z_NO_FLUSH);
+    out->len = inf->stream->total_out;
+    if (zlib_res == Z_STREAM_END) {
+      inf->ended = 1;
+    } else if (zlib_res == Z_BUF_ERROR && inf->stream->avail_out == 0) {
+      str_grow(out);
+    } else if (zlib_res == Z_BUF_ERROR || zlib_res == Z_DATA_ERROR) {
+      return SAML_INVALID_COMPRESSION;
+    } else if (zlib_res != Z_OK) {
+      return SAML_ZLIB_ERROR;
+    }
+  }
+  *consumed = inf->stream->total_in - in;
+  return SAML_OK;
+}
+
+#endif
@@ -0,0 +1,298 @@
+// Library state is split in two.  The saml_ctx_t is built once by saml_init and is read-only afterwards, so
+// it can be shared by every thread.  Everything that libxml2 does not allow to be shared (schema validation
+// and XPath contexts) lives in a saml_thread_ctx_t that is created the first time a thread needs it.  The
+// exceptions are the stats bookkeeping, the verify cache and the batch thread pool, which are guarded by their
+// own locks; see stats.c, cache.c and pool.c.
+
+// Open addressing table of the signature and digest algorithms, see sig.c.  xmlsec-openssl registers about thirty.
+#define TRANSFORMS_SIZE 128
+
+typedef struct {
+  const xmlChar* href;
+  xmlSecTransformId id;
+} transform_entry_t;
+
+// Redirect binding signatures are computed with OpenSSL directly when the algorithm is one of these, using
+// contexts that are kept per thread; see evp.c
+#define EVP_ALGS_MAX 16
+#define EVP_CTX_POOL_SIZE 8
+#define EVP_RETIRED_SIZE 64
+
+typedef struct {
+  xmlSecTransformId transform_id;
+  const EVP_MD* md;
+  int pkey_type;
+} evp_alg_t;
+
+typedef struct {
+  EVP_PKEY_CTX* pkey_ctx;
+  EVP_MD_CTX* md_ctx;
+  EVP_PKEY* pkey;
+  const evp_alg_t* alg;
+  xmlSecTransformOperation operation;
+  uint64_t last_used;
+} evp_ctx_t;
+
+// Signers keep copies of their private key for the threads that sign with them, see sig.c.  Each thread finds
+// its copy through a small cache of its own, by the signer's id, which is never reused.
+#define SIGNER_REPLICAS_MAX 64
+#define SIGNER_CACHE_SIZE 8
+
+typedef struct {
+  uint64_t signer_id;
+  xmlSecKey* key;             // owned by the signer
+  uint64_t last_used;
+} signer_replica_t;
+
+// POST bindings that have been validated and verified, see cache.c
+typedef struct cache_entry_t {
+  unsigned char msg_digest[SHA256_DIGEST_LENGTH]; // of the base64 content, as received
+  unsigned char key_digest[SHA256_DIGEST_LENGTH]; // of the public key that verified it
+  uint64_t expires;
+  struct cache_entry_t* prev; // LRU order, most recent first
+  struct cache_entry_t* next;
+  struct cache_entry_t* chain; // hash bucket
+} cache_entry_t;
+
+// Each saml_verify_batch worker owns a range of the jobs and steals from the others once it is done; see pool.c
+typedef struct {
+  pthread_mutex_t lock;
+  saml_verify_job_t* jobs;
+  size_t next;
+  size_t end;
+} pool_queue_t;
+
+typedef struct stats_node_t {
+  saml_stats_t stats;
+  uint64_t generation; // the CTX.stats_generation the stats were counted in, see stats.c
+  struct stats_node_t* prev;
+  struct stats_node_t* next;
+} stats_node_t;
+
+struct saml_ctx_t {
+  int debug;
+  char xsd_path[256];
+  xmlSchema* schema;
+  pthread_mutex_t schema_lock;
+  pthread_key_t thread_key;
+  transform_entry_t transforms[TRANSFORMS_SIZE];
+  evp_alg_t evp_algs[EVP_ALGS_MAX];
+  int evp_algs_len;
+  pthread_mutex_t evp_retired_lock;
+  EVP_PKEY* evp_retired[EVP_RETIRED_SIZE]; // keys passed to saml_key_free, only ever compared; see evp.c
+  uint64_t evp_retired_count;
+
+  volatile int stats_enabled;
+  pthread_mutex_t stats_lock;
+  stats_node_t* stats_nodes;  // one per thread that has recorded anything
+  saml_stats_t stats_retired; // totals of the threads that have exited since
+  uint64_t stats_generation;  // bumped by every reset
+
+  int cache_size; // 0 when disabled
+  uint64_t cache_ttl_ns;
+  pthread_mutex_t cache_lock;
+  cache_entry_t* cache_entries;  // cache_size of them, allocated by saml_init
+  cache_entry_t** cache_buckets; // cache_mask + 1 of them
+  uint64_t cache_mask;
+  cache_entry_t* cache_head;
+  cache_entry_t* cache_tail;
+  cache_entry_t* cache_unused;
+  saml_verify_cache_stats_t cache_stats;
+
+  pthread_mutex_t signer_lock;
+  uint64_t signer_next_id;
+
+  int deflate_level;     // from saml_init_opts_t, see compress.c
+  int deflate_mem_level;
+
+  int batch_threads; // from saml_init_opts_t
+  int pool_size;     // 0 until the first batch starts the pool
+  pthread_t* pool_threads;
+  pool_queue_t* pool_queues;
+  pthread_mutex_t pool_batch_lock; // held for the whole of a batch
+  pthread_mutex_t pool_lock;       // guards the rest
+  pthread_cond_t pool_work;
+  pthread_cond_t pool_done;
+  uint64_t pool_generation;
+  size_t pool_pending;
+  int pool_stopping;
+};
+
+typedef enum {
+  XPATH_ATTRIBUTES,
+  XPATH_NAME_ID,
+  XPATH_SESSION_INDEX,
+  XPATH_STATUS_CODE,
+  XPATH_COUNT,
+} saml_xpath_t;
+
+static const char* XPATHS[] = {
+  "//samlp:Response/saml:Assertion/saml:AttributeStatement/saml:Attribute",
+  "//samlp:Response/saml:Assertion/saml:Subject/saml:NameID",
+  "//samlp:Response/saml:Assertion/saml:AuthnStatement/@SessionIndex",
+  "//samlp:*/samlp:Status/samlp:StatusCode/@Value",
+};
+
+typedef struct {
+  xmlSchemaValidCtxt* validate_ctx;
+  xmlXPathContext* xpath_ctx;
+  xmlXPathCompExpr* xpaths[XPATH_COUNT];
+  stats_node_t* stats;
+  evp_ctx_t evp_ctxs[EVP_CTX_POOL_SIZE];
+  uint64_t evp_ctx_clock;
+  uint64_t evp_retired_seen;
+  signer_replica_t signer_replicas[SIGNER_CACHE_SIZE];
+  uint64_t signer_clock;
+#ifdef SAML_LIBDEFLATE
+  struct libdeflate_compressor* compressor; // redirect binding (de)compression, see compress.c
+  struct libdeflate_decompressor* decompressor;
+#else
+  z_stream* deflate_stream; // redirect binding streams, reset between messages; see compress.c
+  z_stream* inflate_stream;
+#endif
+} saml_thread_ctx_t;
+
+static saml_ctx_t CTX = {
+  .debug = 1,
+  .schema = NULL,
+  .schema_lock = PTHREAD_MUTEX_INITIALIZER,
+  .evp_retired_lock = PTHREAD_MUTEX_INITIALIZER,
+  .stats_enabled = 0,
+  .stats_lock = PTHREAD_MUTEX_INITIALIZER,
+  .stats_nodes = NULL,
+  .cache_size = 0,
+  .cache_lock = PTHREAD_MUTEX_INITIALIZER,
+  .signer_lock = PTHREAD_MUTEX_INITIALIZER,
+  .signer_next_id = 1,
+  .pool_size = 0,
+  .pool_batch_lock = PTHREAD_MUTEX_INITIALIZER,
+  .pool_lock = PTHREAD_MUTEX_INITIALIZER,
+  .pool_work = PTHREAD_COND_INITIALIZER,
+  .pool_done = PTHREAD_COND_INITIALIZER,
+};
+
+static void stats_node_free(stats_node_t* node);
+static void evp_ctx_free(evp_ctx_t* ectx);
+static void compress_thread_free(saml_thread_ctx_t* tctx);
+
+static void ingoreGenericError(void* ctx, const char* msg, ...) {};
+static void ingoreStructuredError(void* userData, xmlError* error) {};
+
+
+static void saml_log(char* msg) {
+  if (CTX.debug) {
+    fprintf(stderr, "%s\n", msg);
+  }
+}
+
+
+// The protocol XSD only imports the assertion, xmldsig and xenc schemas.  None of the authn-context
+// schemas are ever loaded because saml:AuthnContextDecl is declared as anyType.
+static int schema_load(saml_ctx_t* ctx) {
+  xmlSchemaParserCtxt* parser_ctx = xmlSchemaNewParserCtxt(ctx->xsd_path);
+  if (parser_ctx == NULL) {
+    saml_log("could not create XSD schema parsing context");
+    return -1;
+  }
+
+  ctx->schema = xmlSchemaParse(parser_ctx);
+  xmlSchemaFreeParserCtxt(parser_ctx);
+  if (ctx->schema == NULL) {
+    saml_log("could not parse XSD schema");
+    return -1;
+  }
+  return 0;
+}
+
+
+static void thread_ctx_free(void* data) {
+  saml_thread_ctx_t* tctx = (saml_thread_ctx_t*)data;
+  if (tctx->validate_ctx != NULL) {
+    xmlSchemaFreeValidCtxt(tctx->validate_ctx);
+  }
+  if (tctx->xpath_ctx != NULL) {
+    xmlXPathFreeContext(tctx->xpath_ctx);
+  }
+  for (int i = 0; i < XPATH_COUNT; i++) {
+    xmlXPathFreeCompExpr(tctx->xpaths[i]);
+  }
+  if (tctx->stats != NULL) {
+    stats_node_free(tctx->stats);
+  }
+  for (int i = 0; i < EVP_CTX_POOL_SIZE; i++) {
+    evp_ctx_free(tctx->evp_ctxs + i);
+  }
+  compress_thread_free(tctx);
+  free(tctx);
+}
+
+
+static saml_thread_ctx_t* thread_ctx_new() {
+  // libxml2 keeps its error handlers in thread-local storage, so silence them for every new thread
+  if (!CTX.debug) {
+    xmlSetGenericErrorFunc(NULL, ingoreGenericError);
+    xmlSetStructuredErrorFunc(NULL, ingoreStructuredError);
+  }
+
+  saml_thread_ctx_t* tctx = calloc(1, sizeof(saml_thread_ctx_t));
+  if (tctx == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < XPATH_COUNT; i++) {
+    tctx->xpaths[i] = xmlXPathCompile((const xmlChar*)XPATHS[i]);
+  }
+
+  tctx->xpath_ctx = xmlXPathNewContext(NULL);
+  if (tctx->xpath_ctx == NULL
+      || xmlXPathRegisterNs(tctx->xpath_ctx, (xmlChar*)"saml", (xmlChar*)SAML_XMLNS_ASSERTION) < 0
+      || xmlXPathRegisterNs(tctx->xpath_ctx, (xmlChar*)"samlp", (xmlChar*)SAML_XMLNS_PROTOCOL) < 0) {
+    thread_ctx_free(tctx);
+    saml_log("could not create xpath context");
+    return NULL;
+  }
+
+  if (pthread_setspecific(CTX.thread_key, tctx) != 0) {
+    thread_ctx_free(tctx);
+    saml_log("could not store thread context");
+    return NULL;
+  }
+  return tctx;
+}
+
+
+static saml_thread_ctx_t* thread_ctx() {
+  saml_thread_ctx_t* tctx = (saml_thread_ctx_t*)pthread_getspecific(CTX.thread_key);
+  return tctx == NULL ? thread_ctx_new() : tctx;
+}
+
+
+// Each thread gets its own validation context for the shared schema, which is compiled on first use when
+// saml_init was called with lazy_schema.
+static xmlSchemaValidCtxt* thread_validate_ctx(saml_thread_ctx_t* tctx) {
+  if (tctx->validate_ctx != NULL) {
+    return tctx->validate_ctx;
+  }
+
+  pthread_mutex_lock(&CTX.schema_lock);
+  int res = CTX.schema == NULL ? schema_load(&CTX) : 0;
+  pthread_mutex_unlock(&CTX.schema_lock);
+  if (res < 0) {
+    return NULL;
+  }
+
+  tctx->validate_ctx = xmlSchemaNewValidCtxt(CTX.schema);
+  if (tctx->validate_ctx == NULL) {
+    saml_log("could not create XSD schema validation context");
+  }
+  return tctx->validate_ctx;
+}
+
+
+void saml_thread_cleanup() {
+  saml_thread_ctx_t* tctx = (saml_thread_ctx_t*)pthread_getspecific(CTX.thread_key);
+  if (tctx != NULL) {
+    pthread_setspecific(CTX.thread_key, NULL);
+    thread_ctx_free(tctx);
+  }
+}
@@ -0,0 +1,367 @@
+// A redirect binding signature is a bare PKCS#1 v1.5 or ECDSA signature over the query string, so it does not
+// need xmlsec's transform machinery.  The query is hashed with EVP_Digest and signed or verified with an
+// EVP_PKEY_CTX that is prepared once per thread, key and algorithm.  Other algorithms (and keys that are not
+// RSA or EC) go through xmlsec.
+
+#if !defined(XMLSEC_NO_ECDSA) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+#  define SAML_EVP_ECDSA 1
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#  define EVP_MD_CTX_new EVP_MD_CTX_create
+#  define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+
+static const EVP_MD* evp_md(const char* name) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  // An explicitly fetched digest skips the provider lookup that EVP_get_digestbyname's result does on every use
+  return EVP_MD_fetch(NULL, name, NULL);
+#else
+  return EVP_get_digestbyname(name);
+#endif
+}
+
+
+static void evp_alg_add(saml_ctx_t* ctx, xmlSecTransformId transform_id, const char* md_name, int pkey_type) {
+  const EVP_MD* md = evp_md(md_name);
+  if (md == NULL || ctx->evp_algs_len == EVP_ALGS_MAX) {
+    return; // xmlsec will handle it
+  }
+  ctx->evp_algs[ctx->evp_algs_len++] = (evp_alg_t){ .transform_id = transform_id, .md = md, .pkey_type = pkey_type };
+}
+
+
+static void evp_algs_init(saml_ctx_t* ctx) {
+  ctx->evp_algs_len = 0;
+  evp_alg_add(ctx, xmlSecTransformRsaSha1Id, "SHA1", EVP_PKEY_RSA);
+  evp_alg_add(ctx, xmlSecTransformRsaSha224Id, "SHA224", EVP_PKEY_RSA);
+  evp_alg_add(ctx, xmlSecTransformRsaSha256Id, "SHA256", EVP_PKEY_RSA);
+  evp_alg_add(ctx, xmlSecTransformRsaSha384Id, "SHA384", EVP_PKEY_RSA);
+  evp_alg_add(ctx, xmlSecTransformRsaSha512Id, "SHA512", EVP_PKEY_RSA);
+#ifdef SAML_EVP_ECDSA
+  evp_alg_add(ctx, xmlSecTransformEcdsaSha1Id, "SHA1", EVP_PKEY_EC);
+  evp_alg_add(ctx, xmlSecTransformEcdsaSha224Id, "SHA224", EVP_PKEY_EC);
+  evp_alg_add(ctx, xmlSecTransformEcdsaSha256Id, "SHA256", EVP_PKEY_EC);
+  evp_alg_add(ctx, xmlSecTransformEcdsaSha384Id, "SHA384", EVP_PKEY_EC);
+  evp_alg_add(ctx, xmlSecTransformEcdsaSha512Id, "SHA512", EVP_PKEY_EC);
+#endif
+}
+
+
+static void evp_algs_free(saml_ctx_t* ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  for (int i = 0; i < ctx->evp_algs_len; i++) {
+    EVP_MD_free((EVP_MD*)ctx->evp_algs[i].md);
+  }
+#endif
+  ctx->evp_algs_len = 0;
+}
+
+
+static void evp_ctx_free(evp_ctx_t* ectx) {
+  if (ectx->pkey_ctx != NULL) {
+    EVP_PKEY_CTX_free(ectx->pkey_ctx);
+  }
+  if (ectx->md_ctx != NULL) {
+    EVP_MD_CTX_free(ectx->md_ctx);
+  }
+  memset(ectx, 0, sizeof(evp_ctx_t));
+}
+
+
+static EVP_PKEY_CTX* evp_pkey_ctx_new(EVP_PKEY* pkey, const evp_alg_t* alg, xmlSecTransformOperation operation) {
+  EVP_PKEY_CTX* pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+  if (pkey_ctx == NULL) {
+    return NULL;
+  }
+
+  int res = operation == xmlSecTransformOperationSign ? EVP_PKEY_sign_init(pkey_ctx) : EVP_PKEY_verify_init(pkey_ctx);
+  if (res <= 0 || EVP_PKEY_CTX_set_signature_md(pkey_ctx, alg->md) <= 0
+      || (alg->pkey_type == EVP_PKEY_RSA && EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, RSA_PKCS1_PADDING) <= 0)) {
+    EVP_PKEY_CTX_free(pkey_ctx);
+    return NULL;
+  }
+  return pkey_ctx;
+}
+
+
+static const evp_alg_t* evp_alg_find(xmlSecTransformId transform_id) {
+  for (int i = 0; i < CTX.evp_algs_len; i++) {
+    if (CTX.evp_algs[i].transform_id == transform_id) {
+      return CTX.evp_algs + i;
+    }
+  }
+  return NULL;
+}
+
+
+// True when the algorithm is RSA and the key EC or vice versa, e.g. a SigAlg that does not match the
+// certificate on file.  No signature can verify then, which xmlsec would report as an error instead.
+static int evp_key_mismatch(xmlSecKey* key, xmlSecTransformId transform_id) {
+  const evp_alg_t* alg = evp_alg_find(transform_id);
+  xmlSecKeyData* value = xmlSecKeyGetValue(key);
+  if (alg == NULL || value == NULL) {
+    return 0;
+  }
+  if (xmlSecKeyDataCheckId(value, xmlSecKeyDataRsaId)) {
+    return alg->pkey_type != EVP_PKEY_RSA;
+  }
+#ifdef SAML_EVP_ECDSA
+  if (xmlSecKeyDataCheckId(value, xmlSecKeyDataEcdsaId)) {
+    return alg->pkey_type != EVP_PKEY_EC;
+  }
+#endif
+  return 0;
+}
+
+
+// The key's EVP_PKEY when it is an RSA or EC key, which are the only ones that get a context here
+static EVP_PKEY* evp_key_pkey(xmlSecKey* key) {
+  xmlSecKeyData* value = xmlSecKeyGetValue(key);
+  if (value == NULL) {
+    return NULL;
+  }
+#ifdef SAML_EVP_ECDSA
+  if (!xmlSecKeyDataCheckId(value, xmlSecKeyDataRsaId) && !xmlSecKeyDataCheckId(value, xmlSecKeyDataEcdsaId)) {
+    return NULL;
+  }
+#else
+  if (!xmlSecKeyDataCheckId(value, xmlSecKeyDataRsaId)) {
+    return NULL;
+  }
+#endif
+  return xmlSecOpenSSLEvpKeyDataGetEvp(value);
+}
+
+
+// Drops the calling thread's contexts for keys that were freed since it last looked, so that it does not keep
+// their EVP_PKEYs alive.  A thread that is more than EVP_RETIRED_SIZE keys behind drops all of its contexts.
+static void evp_ctxs_drop_retired(saml_thread_ctx_t* tctx) {
+  pthread_mutex_lock(&CTX.evp_retired_lock);
+  uint64_t count = CTX.evp_retired_count;
+  for (int i = 0; i < EVP_CTX_POOL_SIZE; i++) {
+    evp_ctx_t* ectx = tctx->evp_ctxs + i;
+    if (ectx->pkey_ctx == NULL) {
+      continue;
+    }
+    int retired = count - tctx->evp_retired_seen > EVP_RETIRED_SIZE;
+    for (uint64_t n = tctx->evp_retired_seen; n < count && !retired; n++) {
+      retired = CTX.evp_retired[n % EVP_RETIRED_SIZE] == ectx->pkey;
+    }
+    if (retired) {
+      evp_ctx_free(ectx);
+    }
+  }
+  pthread_mutex_unlock(&CTX.evp_retired_lock);
+  tctx->evp_retired_seen = count;
+}
+
+
+// Has every thread drop its contexts for the key, which is about to be freed
+static void evp_key_retire(xmlSecKey* key) {
+  EVP_PKEY* pkey = evp_key_pkey(key);
+  if (pkey == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&CTX.evp_retired_lock);
+  CTX.evp_retired[CTX.evp_retired_count % EVP_RETIRED_SIZE] = pkey;
+  __atomic_store_n(&CTX.evp_retired_count, CTX.evp_retired_count + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&CTX.evp_retired_lock);
+}
+
+
+void saml_key_free(xmlSecKey* key) {
+  if (key == NULL) {
+    return;
+  }
+  evp_key_retire(key);
+  xmlSecKeyDestroy(key);
+}
+
+
+// Find or prepare the calling thread's context for (key, algorithm, operation), evicting the least recently
+// used one when the pool is full.  Returns NULL when xmlsec has to do the work instead.
+static evp_ctx_t* evp_ctx_acquire(xmlSecKey* key, xmlSecTransformId transform_id, xmlSecTransformOperation operation) {
+  const evp_alg_t* alg = evp_alg_find(transform_id);
+  if (alg == NULL) {
+    return NULL;
+  }
+
+  EVP_PKEY* pkey = evp_key_pkey(key);
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (pkey == NULL || EVP_PKEY_base_id(pkey) != alg->pkey_type || tctx == NULL) {
+    return NULL;
+  }
+
+  // The EVP_PKEY_CTX holds a reference to pkey, so while the entry lives its address can't be reused by
+  // another key.  Entries for keys that have been freed since are dropped first.
+  if (__atomic_load_n(&CTX.evp_retired_count, __ATOMIC_ACQUIRE) != tctx->evp_retired_seen) {
+    evp_ctxs_drop_retired(tctx);
+  }
+  evp_ctx_t* lru = tctx->evp_ctxs;
+  for (int i = 0; i < EVP_CTX_POOL_SIZE; i++) {
+    evp_ctx_t* ectx = tctx->evp_ctxs + i;
+    if (ectx->pkey_ctx != NULL && ectx->pkey == pkey && ectx->alg == alg && ectx->operation == operation) {
+      ectx->last_used = ++tctx->evp_ctx_clock;
+      return ectx;
+    }
+    if (ectx->last_used < lru->last_used) {
+      lru = ectx;
+    }
+  }
+
+  evp_ctx_free(lru);
+  lru->pkey_ctx = evp_pkey_ctx_new(pkey, alg, operation);
+  lru->md_ctx = EVP_MD_CTX_new();
+  if (lru->pkey_ctx == NULL || lru->md_ctx == NULL) {
+    evp_ctx_free(lru);
+    ERR_clear_error();
+    return NULL;
+  }
+  lru->pkey = pkey;
+  lru->alg = alg;
+  lru->operation = operation;
+  lru->last_used = ++tctx->evp_ctx_clock;
+  return lru;
+}
+
+
+static int evp_digest(evp_ctx_t* ectx, unsigned char* data, size_t data_len, unsigned char* digest, unsigned int* digest_len) {
+  return EVP_DigestInit_ex(ectx->md_ctx, ectx->alg->md, NULL) == 1
+    && EVP_DigestUpdate(ectx->md_ctx, data, data_len) == 1
+    && EVP_DigestFinal_ex(ectx->md_ctx, digest, digest_len) == 1 ? 0 : -1;
+}
+
+
+#ifdef SAML_EVP_ECDSA
+// XML DSig encodes an ECDSA signature as r || s, each padded to the size of the curve order, where OpenSSL uses
+// a DER sequence
+static int ecdsa_der_to_raw(EVP_PKEY* pkey, const unsigned char* der, size_t der_len, str_t* sig) {
+  ECDSA_SIG* ecdsa_sig = d2i_ECDSA_SIG(NULL, &der, der_len);
+  if (ecdsa_sig == NULL) {
+    return -1;
+  }
+
+  const BIGNUM *r, *s;
+  ECDSA_SIG_get0(ecdsa_sig, &r, &s);
+  int n = (EVP_PKEY_bits(pkey) + 7) / 8;
+  str_init(sig, 2 * n);
+  int res = BN_bn2binpad(r, (unsigned char*)sig->data, n) == n && BN_bn2binpad(s, (unsigned char*)sig->data + n, n) == n ? 0 : -1;
+  ECDSA_SIG_free(ecdsa_sig);
+  if (res < 0) {
+    str_free(sig);
+    return -1;
+  }
+  sig->len = 2 * n;
+  return 0;
+}
+
+
+static int ecdsa_raw_to_der(EVP_PKEY* pkey, const unsigned char* sig, size_t sig_len, unsigned char** der) {
+  int n = (EVP_PKEY_bits(pkey) + 7) / 8;
+  if (sig_len != 2 * n) {
+    return -1;
+  }
+
+  ECDSA_SIG* ecdsa_sig = ECDSA_SIG_new();
+  BIGNUM* r = BN_bin2bn(sig, n, NULL);
+  BIGNUM* s = BN_bin2bn(sig + n, n, NULL);
+  if (ecdsa_sig == NULL || r == NULL || s == NULL || ECDSA_SIG_set0(ecdsa_sig, r, s) != 1) {
+    BN_free(r);
+    BN_free(s);
+    ECDSA_SIG_free(ecdsa_sig);
+    return -1;
+  }
+
+  *der = NULL;
+  int der_len = i2d_ECDSA_SIG(ecdsa_sig, der);
+  ECDSA_SIG_free(ecdsa_sig);
+  return der_len;
+}
+#endif
+
+
+static int evp_sign(evp_ctx_t* ectx, unsigned char* data, size_t data_len, str_t* sig) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  if (evp_digest(ectx, data, data_len, digest, &digest_len) < 0) {
+    ERR_clear_error();
+    saml_log("digest failed");
+    return -1;
+  }
+
+  size_t out_len = EVP_PKEY_size(ectx->pkey);
+  unsigned char* out = malloc(out_len);
+  if (out == NULL) {
+    saml_log("could not allocate signature");
+    return -1;
+  }
+  if (EVP_PKEY_sign(ectx->pkey_ctx, out, &out_len, digest, digest_len) <= 0) {
+    free(out);
+    ERR_clear_error();
+    saml_log("signature execution failed");
+    return -1;
+  }
+
+#ifdef SAML_EVP_ECDSA
+  if (ectx->alg->pkey_type == EVP_PKEY_EC) {
+    int res = ecdsa_der_to_raw(ectx->pkey, out, out_len, sig);
+    free(out);
+    return res;
+  }
+#endif
+  sig->data = (char*)out;
+  sig->len = sig->total = out_len;
+  return 0;
+}
+
+
+static int evp_verify(evp_ctx_t* ectx, unsigned char* data, size_t data_len, unsigned char* sig, size_t sig_len) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  if (evp_digest(ectx, data, data_len, digest, &digest_len) < 0) {
+    ERR_clear_error();
+    saml_log("digest failed");
+    return -1;
+  }
+
+  unsigned char* der = NULL;
+#ifdef SAML_EVP_ECDSA
+  if (ectx->alg->pkey_type == EVP_PKEY_EC) {
+    int der_len = ecdsa_raw_to_der(ectx->pkey, sig, sig_len, &der);
+    if (der_len < 0) {
+      return 1; // not a signature this key could have made
+    }
+    sig = der;
+    sig_len = der_len;
+  }
+#endif
+
+  // Anything but a positive answer means the signature does not match; OpenSSL reports malformed signatures
+  // as errors rather than mismatches
+  int res = EVP_PKEY_verify(ectx->pkey_ctx, sig, sig_len, digest, digest_len) == 1 ? 0 : 1;
+  OPENSSL_free(der);
+  ERR_clear_error();
+  return res;
+}
+
+
+// SHA-256 of the DER SubjectPublicKeyInfo, so a key matches whether it was loaded from a key or a certificate
+static int evp_key_digest(xmlSecKey* key, unsigned char* digest) {
+  xmlSecKeyData* value = xmlSecKeyGetValue(key);
+  if (value == NULL || !(xmlSecKeyDataGetType(value) & (xmlSecKeyDataTypePublic | xmlSecKeyDataTypePrivate))) {
+    return -1;
+  }
+
+  EVP_PKEY* pkey = xmlSecOpenSSLEvpKeyDataGetEvp(value);
+  unsigned char* der = NULL;
+  int der_len = pkey == NULL ? -1 : i2d_PUBKEY(pkey, &der);
+  if (der_len <= 0) {
+    ERR_clear_error();
+    return -1;
+  }
+  SHA256(der, der_len, digest);
+  OPENSSL_free(der);
+  return 0;
+}
@@ -0,0 +1,206 @@
+// saml_verify_batch splits the jobs into one contiguous range per worker.  A worker takes jobs from the front
+// of its own range and, once that is empty, steals the back half of the fullest range left, so a few slow
+// documents can't hold up the whole batch.  Jobs take hundreds of microseconds each, which makes a mutex per
+// range plenty.
+//
+// A worker can still be looking for work when the next batch is posted, so it may steal jobs of the new batch,
+// and find that its own range was refilled in the meantime.  The queues hand out job pointers, never indexes
+// into whichever batch the worker thinks it is on, and a thief only replaces its own range while it is empty.
+
+
+static saml_verify_job_t* pool_take(pool_queue_t* queue) {
+  saml_verify_job_t* job = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->next < queue->end) {
+    job = queue->jobs + queue->next++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return job;
+}
+
+
+static saml_verify_job_t* pool_steal(int self) {
+  pool_queue_t* victim = NULL;
+  size_t most = 0;
+  for (int i = 1; i < CTX.pool_size; i++) {
+    pool_queue_t* queue = CTX.pool_queues + (self + i) % CTX.pool_size;
+    pthread_mutex_lock(&queue->lock);
+    size_t left = queue->next < queue->end ? queue->end - queue->next : 0;
+    pthread_mutex_unlock(&queue->lock);
+    if (left > most) {
+      victim = queue;
+      most = left;
+    }
+  }
+  if (victim == NULL) {
+    return NULL;
+  }
+
+  // The victim may have been emptied since, and the thief's own range refilled by the next batch, in which case
+  // it takes from that instead.  Both are locked in index order, as another thief may be stealing from this one.
+  pool_queue_t* own = CTX.pool_queues + self;
+  pool_queue_t* first = own < victim ? own : victim;
+  pool_queue_t* second = own < victim ? victim : own;
+  pthread_mutex_lock(&first->lock);
+  pthread_mutex_lock(&second->lock);
+  saml_verify_job_t* job = NULL;
+  if (own->next < own->end) {
+    job = own->jobs + own->next++;
+  } else if (victim->next < victim->end) {
+    // The first stolen job is run right away, the rest go in the thief's own queue for others to steal back
+    size_t stolen = (victim->end - victim->next + 1) / 2;
+    own->jobs = victim->jobs;
+    own->next = victim->end - stolen + 1;
+    own->end = victim->end;
+    victim->end -= stolen;
+    job = own->jobs + own->next - 1;
+  }
+  pthread_mutex_unlock(&second->lock);
+  pthread_mutex_unlock(&first->lock);
+  return job;
+}
+
+
+static void pool_run(saml_verify_job_t* job) {
+  xmlDoc* doc = NULL;
+  unsigned char digest[SAML_CONTENT_DIGEST_LEN];
+  job->status = saml_binding_post_parse_cached(job->content, digest, &doc);
+  if (job->status == SAML_OK && job->mngr != NULL) {
+    job->status = saml_binding_post_verify_cached(job->mngr, doc, digest);
+  } else if (job->status == SAML_OK) {
+    job->status = saml_binding_post_verify_trust_cached(job->trust, doc, digest);
+  }
+  if (doc != NULL) {
+    xmlFreeDoc(doc);
+  }
+}
+
+
+static void* pool_work(void* arg) {
+  int self = (int)(intptr_t)arg;
+  uint64_t generation = 0;
+  for (;;) {
+    pthread_mutex_lock(&CTX.pool_lock);
+    while (!CTX.pool_stopping && CTX.pool_generation == generation) {
+      pthread_cond_wait(&CTX.pool_work, &CTX.pool_lock);
+    }
+    generation = CTX.pool_generation;
+    int stopping = CTX.pool_stopping;
+    pthread_mutex_unlock(&CTX.pool_lock);
+    if (stopping) {
+      break;
+    }
+
+    saml_verify_job_t* job;
+    while ((job = pool_take(CTX.pool_queues + self)) != NULL || (job = pool_steal(self)) != NULL) {
+      pool_run(job);
+      pthread_mutex_lock(&CTX.pool_lock);
+      if (--CTX.pool_pending == 0) {
+        pthread_cond_signal(&CTX.pool_done);
+      }
+      pthread_mutex_unlock(&CTX.pool_lock);
+    }
+  }
+
+  saml_thread_cleanup();
+  return NULL;
+}
+
+
+static void pool_stop() {
+  if (CTX.pool_size == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&CTX.pool_lock);
+  CTX.pool_stopping = 1;
+  pthread_cond_broadcast(&CTX.pool_work);
+  pthread_mutex_unlock(&CTX.pool_lock);
+  for (int i = 0; i < CTX.pool_size; i++) {
+    pthread_join(CTX.pool_threads[i], NULL);
+  }
+  for (int i = 0; i < CTX.pool_size; i++) {
+    pthread_mutex_destroy(&CTX.pool_queues[i].lock);
+  }
+  free(CTX.pool_threads);
+  free(CTX.pool_queues);
+  CTX.pool_threads = NULL;
+  CTX.pool_queues = NULL;
+  CTX.pool_size = 0;
+  CTX.pool_stopping = 0;
+}
+
+
+static int pool_start() {
+  int size = CTX.batch_threads > 0 ? CTX.batch_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (size < 1) {
+    size = 1;
+  }
+
+  CTX.pool_threads = calloc(size, sizeof(pthread_t));
+  CTX.pool_queues = calloc(size, sizeof(pool_queue_t));
+  if (CTX.pool_threads == NULL || CTX.pool_queues == NULL) {
+    free(CTX.pool_threads);
+    free(CTX.pool_queues);
+    CTX.pool_threads = NULL;
+    CTX.pool_queues = NULL;
+    saml_log("could not allocate thread pool");
+    return -1;
+  }
+  for (int i = 0; i < size; i++) {
+    pthread_mutex_init(&CTX.pool_queues[i].lock, NULL);
+  }
+
+  // pool_size is what pool_stop joins, so it only counts the threads that started
+  for (CTX.pool_size = 0; CTX.pool_size < size; CTX.pool_size++) {
+    if (pthread_create(CTX.pool_threads + CTX.pool_size, NULL, pool_work, (void*)(intptr_t)CTX.pool_size) != 0) {
+      break;
+    }
+  }
+  if (CTX.pool_size == 0) {
+    free(CTX.pool_threads);
+    free(CTX.pool_queues);
+    CTX.pool_threads = NULL;
+    CTX.pool_queues = NULL;
+    saml_log("could not start thread pool");
+    return -1;
+  }
+  return 0;
+}
+
+
+int saml_verify_batch(saml_verify_job_t* jobs, size_t jobs_len) {
+  pthread_mutex_lock(&CTX.pool_batch_lock);
+  if (CTX.pool_size == 0 && pool_start() < 0) {
+    pthread_mutex_unlock(&CTX.pool_batch_lock);
+    return -1;
+  }
+  if (jobs_len == 0) {
+    pthread_mutex_unlock(&CTX.pool_batch_lock);
+    return 0;
+  }
+
+  pthread_mutex_lock(&CTX.pool_lock);
+  CTX.pool_pending = jobs_len;
+  pthread_mutex_unlock(&CTX.pool_lock);
+
+  for (int i = 0; i < CTX.pool_size; i++) {
+    pool_queue_t* queue = CTX.pool_queues + i;
+    pthread_mutex_lock(&queue->lock);
+    queue->jobs = jobs;
+    queue->next = jobs_len * i / CTX.pool_size;
+    queue->end = jobs_len * (i + 1) / CTX.pool_size;
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  pthread_mutex_lock(&CTX.pool_lock);
+  CTX.pool_generation++;
+  pthread_cond_broadcast(&CTX.pool_work);
+  while (CTX.pool_pending > 0) {
+    pthread_cond_wait(&CTX.pool_done, &CTX.pool_lock);
+  }
+  pthread_mutex_unlock(&CTX.pool_lock);
+
+  pthread_mutex_unlock(&CTX.pool_batch_lock);
+  return 0;
+}
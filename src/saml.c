@@ -1,17 +1,30 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libxml/xmlmemory.h>
+#include <libxml/c14n.h>
 #include <libxml/xmlerror.h>
 #include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <libxml/SAX2.h>
 #include <libxml/tree.h>
+#include <libxml/uri.h>
 #include <libxml/valid.h>
 #include <libxml/xmlstring.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <libxml/xmlschemas.h>
+#include <libxml/xmlsave.h>
 
 #include <xmlsec/xmlsec.h>
 #include <xmlsec/xmltree.h>
@@ -19,14 +32,25 @@
 #include <xmlsec/templates.h>
 #include <xmlsec/crypto.h>
 #include <xmlsec/errors.h>
+#include <xmlsec/openssl/evp.h>
+#include <xmlsec/openssl/x509.h>
+
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
 
 #include <zlib.h>
+#ifdef SAML_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 #include "saml.h"
 
 static const char* XSD_MAIN = "/xsd/saml-schema-protocol-2.0.xsd";
-static xmlXPathCompExpr *XPATH_ATTRIBUTES, *XPATH_NAME_ID, *XPATH_SESSION_INDEX, *XPATH_STATUS_CODE;
-static xmlSchemaValidCtxt* XML_SCHEMA_VALIDATE_CTX;
 
 const char* SAML_XMLNS_ASSERTION = "urn:oasis:names:tc:SAML:2.0:assertion";
 const char* SAML_XMLNS_PROTOCOL = "urn:oasis:names:tc:SAML:2.0:protocol";
@@ -39,32 +63,30 @@ const char* SAML_STATUS_REQUESTER = "urn:oasis:names:tc:SAML:2.0:status:Requeste
 const char* SAML_STATUS_RESPONDER = "urn:oasis:names:tc:SAML:2.0:status:Responder";
 const char* SAML_STATUS_VERSION_MISMATCH = "urn:oasis:names:tc:SAML:2.0:status:VersionMismatch";
 
-static int DEBUG_ENABLED = 1;
-static void ingoreGenericError(void* ctx, const char* msg, ...) {};
-static void ingoreStructuredError(void* userData, xmlError* error) {};
-
-
-static void saml_log(char* msg) {
-  if (DEBUG_ENABLED) {
-    fprintf(stderr, "%s\n", msg);
-  }
-}
-
 
+#include "ctx.c"
+#include "stats.c"
 #include "str.c"
 #include "codecs.c"
 #include "xml.c"
+#include "evp.c"
 #include "sig.c"
+#include "build.c"
+#include "stream.c"
+#include "trust.c"
+#include "cache.c"
+#include "compress.c"
 #include "binding.c"
+#include "pool.c"
 
 
 int saml_init(saml_init_opts_t* opts) {
   xmlInitParser();
 
-  XPATH_ATTRIBUTES = xmlXPathCompile((const xmlChar*)"//samlp:Response/saml:Assertion/saml:AttributeStatement/saml:Attribute");
-  XPATH_NAME_ID = xmlXPathCompile((const xmlChar*)"//samlp:Response/saml:Assertion/saml:Subject/saml:NameID");
-  XPATH_SESSION_INDEX = xmlXPathCompile((const xmlChar*)"//samlp:Response/saml:Assertion/saml:AuthnStatement/@SessionIndex");
-  XPATH_STATUS_CODE = xmlXPathCompile((const xmlChar*)"//samlp:*/samlp:Status/samlp:StatusCode/@Value");
+  if (pthread_key_create(&CTX.thread_key, thread_ctx_free) != 0) {
+    saml_log("could not create thread context key");
+    return -1;
+  }
 
   // https://www.aleksey.com/xmlsec/api/xmlsec-notes-init-shutdown.html
   if (xmlSecInit() < 0) {
@@ -72,32 +94,17 @@ int saml_init(saml_init_opts_t* opts) {
     return -1;
   }
 
-  char data_dir[256];
   int data_dir_len = strlen(opts->data_dir);
   int xsd_main_len = strlen(XSD_MAIN);
-  if (data_dir_len > sizeof(data_dir) - xsd_main_len - 1) {
+  if (data_dir_len > sizeof(CTX.xsd_path) - xsd_main_len - 1) {
     saml_log("data_dir path is too long");
     return -1;
   }
-  memcpy(data_dir, opts->data_dir, data_dir_len);
-  memcpy(data_dir + data_dir_len, XSD_MAIN, xsd_main_len);
-  data_dir[data_dir_len + xsd_main_len] = '\0';
+  memcpy(CTX.xsd_path, opts->data_dir, data_dir_len);
+  memcpy(CTX.xsd_path + data_dir_len, XSD_MAIN, xsd_main_len);
+  CTX.xsd_path[data_dir_len + xsd_main_len] = '\0';
 
-  xmlSchemaParserCtxt* parser_ctx = xmlSchemaNewParserCtxt(data_dir);
-  if (parser_ctx == NULL) {
-    saml_log("could not create XSD schema parsing context");
-    return -1;
-  }
-
-  xmlSchema* schema = xmlSchemaParse(parser_ctx);
-  if (schema == NULL) {
-    saml_log("could not parse XSD schema");
-    return -1;
-  }
-
-  XML_SCHEMA_VALIDATE_CTX = xmlSchemaNewValidCtxt(schema);
-  if (XML_SCHEMA_VALIDATE_CTX == NULL) {
-    saml_log("could not create XSD schema validation context");
+  if (!opts->lazy_schema && schema_load(&CTX) < 0) {
     return -1;
   }
 
@@ -116,27 +123,49 @@ int saml_init(saml_init_opts_t* opts) {
     return -1;
   }
 
+  if (transforms_index(&CTX) < 0) {
+    return -1;
+  }
+  evp_algs_init(&CTX);
+
   if (!opts->debug) {
-    DEBUG_ENABLED = 0;
+    CTX.debug = 0;
     xmlSetGenericErrorFunc(NULL, ingoreGenericError);
     xmlSetStructuredErrorFunc(NULL, ingoreStructuredError);
     xmlSecErrorsSetCallback(NULL);
   }
 
+  if (cache_init(&CTX, opts->verify_cache_size, opts->verify_cache_ttl) < 0) {
+    return -1;
+  }
+
+  if (compress_init(&CTX, opts->deflate_level, opts->deflate_mem_level) < 0) {
+    return -1;
+  }
+
+  CTX.batch_threads = opts->batch_threads;
+  CTX.stats_enabled = opts->stats;
   return 0;
 }
 
 
 void saml_shutdown() {
+  // Other threads must have exited or called saml_thread_cleanup by now, and the batch pool is stopped here.
+  // The thread contexts hold OpenSSL contexts, so they go first.
+  pool_stop();
+  saml_thread_cleanup();
+  pthread_key_delete(CTX.thread_key);
+  evp_algs_free(&CTX);
+  cache_free(&CTX);
+
   // https://www.aleksey.com/xmlsec/api/xmlsec-notes-init-shutdown.html
   xmlSecCryptoShutdown();
   xmlSecCryptoAppShutdown();
   xmlSecShutdown();
 
-  xmlSchemaFreeValidCtxt(XML_SCHEMA_VALIDATE_CTX);
-  xmlXPathFreeCompExpr(XPATH_ATTRIBUTES);
-  xmlXPathFreeCompExpr(XPATH_NAME_ID);
-  xmlXPathFreeCompExpr(XPATH_SESSION_INDEX);
-  xmlXPathFreeCompExpr(XPATH_STATUS_CODE);
+  if (CTX.schema != NULL) {
+    xmlSchemaFree(CTX.schema);
+    CTX.schema = NULL;
+  }
   xmlCleanupParser();
 }
@@ -1,22 +1,24 @@
 #ifndef _SAML_H
 #define _SAML_H
 
+#include <stdint.h>
+
 #include <libxml/xmlstring.h>
 #include <libxml/tree.h>
 
 #include <xmlsec/xmlsec.h>
 #include <xmlsec/transforms.h>
 
-const char* SAML_XMLNS_ASSERTION;
-const char* SAML_XMLNS_PROTOCOL;
+extern const char* SAML_XMLNS_ASSERTION;
+extern const char* SAML_XMLNS_PROTOCOL;
 
-const char* SAML_BINDING_HTTP_POST;
-const char* SAML_BINDING_HTTP_REDIRECT;
+extern const char* SAML_BINDING_HTTP_POST;
+extern const char* SAML_BINDING_HTTP_REDIRECT;
 
-const char* SAML_STATUS_SUCCESS;
-const char* SAML_STATUS_REQUESTER;
-const char* SAML_STATUS_RESPONDER;
-const char* SAML_STATUS_VERSION_MISMATCH;
+extern const char* SAML_STATUS_SUCCESS;
+extern const char* SAML_STATUS_REQUESTER;
+extern const char* SAML_STATUS_RESPONDER;
+extern const char* SAML_STATUS_VERSION_MISMATCH;
 
 typedef unsigned char byte;
 
@@ -28,12 +30,20 @@ typedef struct {
 typedef struct {
   int debug;
   const char* data_dir;
+  int lazy_schema; // defer compiling the XSD until the first call to saml_doc_validate
+  int stats;       // start recording stage latencies immediately, see saml_stats_enable
+  int verify_cache_size; // number of verified POST bindings to remember; see saml_binding_post_parse_cached
+  int verify_cache_ttl;  // seconds to remember each for; the cache is disabled unless both are positive
+  int batch_threads;     // size of the saml_verify_batch thread pool, 0 for one per core
+  int deflate_level;     // zlib level 1-9 for redirect bindings, 0 for zlib's default
+  int deflate_mem_level; // zlib memLevel 1-9, 0 for 8
 } saml_init_opts_t;
 
 typedef struct {
   xmlChar* id_attr;
   xmlChar* insert_after_ns;
   xmlChar* insert_after_el;
+  xmlSecTransformId digest_id; // DigestMethod of the Reference saml_sign_doc creates, NULL for SHA-256
 } saml_doc_opts_t;
 
 typedef struct {
@@ -57,6 +67,8 @@ typedef enum {
   SAML_INVALID_DOC,
   SAML_INVALID_SIG_ALG,
   SAML_INVALID_SIGNATURE,
+  SAML_UNTRUSTED_ISSUER,
+  SAML_UNTRUSTED_KEY,
 } saml_binding_status_t;
 
 char* saml_binding_error_msg(saml_binding_status_t status);
@@ -73,8 +85,62 @@ int saml_base64_decode(const char* in, int in_len, byte** out, int* out_len);
 char* saml_uri_encode(const char* in);
 int saml_uri_decode(const char* in, char** out);
 
+// Library state shared by all threads, created by saml_init and resolved implicitly by every other function
+typedef struct saml_ctx_t saml_ctx_t;
+
 int saml_init(saml_init_opts_t*);
 void saml_shutdown();
+void saml_thread_cleanup();
+
+typedef enum {
+  SAML_STAGE_BASE64_DECODE,
+  SAML_STAGE_BASE64_ENCODE,
+  SAML_STAGE_INFLATE,
+  SAML_STAGE_DEFLATE,
+  SAML_STAGE_XML_PARSE,
+  SAML_STAGE_XML_SERIALIZE,
+  SAML_STAGE_XSD_VALIDATE,
+  SAML_STAGE_SIGN_BINARY,
+  SAML_STAGE_VERIFY_BINARY,
+  SAML_STAGE_SIGN_DOC,
+  SAML_STAGE_VERIFY_DOC,
+  SAML_STAGE_COUNT,
+} saml_stage_t;
+
+// Latencies are bucketed HdrHistogram style: 8 linear sub-buckets for every power of two nanoseconds, so a
+// percentile is never off by more than 12.5%.  The last bucket collects everything above ~137s.
+#define SAML_STATS_SUB_BUCKETS 8
+#define SAML_STATS_BUCKETS (35 * SAML_STATS_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[SAML_STATS_BUCKETS];
+} saml_stage_stats_t;
+
+typedef struct {
+  saml_stage_stats_t stages[SAML_STAGE_COUNT];
+} saml_stats_t;
+
+void saml_stats_enable(int enabled);
+// Threads that are recording meanwhile clear their own counters, see stats.c.  A snapshot taken after this
+// returns counts nothing recorded before it was called.
+void saml_stats_reset();
+void saml_stats_snapshot(saml_stats_t* stats);
+const char* saml_stats_stage_name(saml_stage_t stage);
+uint64_t saml_stats_percentile(const saml_stage_stats_t* stage, double p);
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions; // entries dropped to make room before they expired
+  uint64_t entries;
+} saml_verify_cache_stats_t;
+
+void saml_verify_cache_stats(saml_verify_cache_stats_t* stats);
+void saml_verify_cache_clear();
 
 int saml_doc_validate(xmlDoc* doc);
 xmlChar* saml_doc_issuer(xmlDoc* doc);
@@ -84,15 +150,144 @@ xmlChar* saml_doc_session_index(xmlDoc* doc);
 int saml_doc_attrs(xmlDoc* doc, saml_attr_t** attrs, size_t* attrs_len);
 void saml_attrs_free(saml_attr_t* attrs, size_t attrs_len);
 
+// Hash lookup of the signature and digest algorithms indexed by saml_init, NULL for any other href
+xmlSecTransformId saml_find_transform(const char* href);
+// The same, but only for a signature method (which is what every binding's SigAlg must be), or a digest method
+xmlSecTransformId saml_find_sig_alg(const char* href);
+xmlSecTransformId saml_find_digest(const char* href);
+
 xmlSecTransformCtx* saml_sign_binary(xmlSecKey* key, xmlSecTransformId transform_id, unsigned char* data, size_t data_len);
+// Like saml_sign_binary, but returns the signature in sig.  RSA and ECDSA signatures are computed with OpenSSL
+// directly, reusing a context that is kept per thread, key and algorithm; saml_verify_binary does the same.
+int saml_sign_binary_str(xmlSecKey* key, xmlSecTransformId transform_id, unsigned char* data, size_t data_len, str_t* sig);
 int saml_verify_binary(xmlSecKey* cert, xmlSecTransformId transform_id, unsigned char* data, size_t data_len, unsigned char* sig, size_t sig_len);
+// xmlSecKeyDestroy for a key that may have been passed to the two above, so that the contexts threads keep for
+// it are dropped the next time each of them signs or verifies, instead of holding on to the key until they exit
+void saml_key_free(xmlSecKey* key);
 int saml_sign_doc(xmlSecKey* key, xmlSecTransformId transform_id, xmlDoc* doc, saml_doc_opts_t* opts);
 int saml_verify_doc(xmlSecKeysMngr* mngr, xmlDoc* doc, saml_doc_opts_t* opts);
 
+// What saml_verify_xml reads from a document it verifies, as the saml_doc_* functions would read it
+typedef struct {
+  xmlChar* id;            // the root's opts->id_attr
+  xmlChar* issuer;
+  xmlChar* name_id;
+  xmlChar* status_code;
+  xmlChar* session_index;
+  saml_attr_t* attrs;
+  size_t attrs_len;
+  int streamed;           // 0 if the document was parsed and passed to saml_verify_doc
+} saml_summary_t;
+
+// Same results as parsing xml and calling saml_verify_doc, but a document signed the way SAML documents
+// usually are (see stream.c) is verified as it is parsed, without building it.  summary may be NULL; otherwise
+// it is filled when the result is 0 and must be freed with saml_summary_free.
+int saml_verify_xml(xmlSecKeysMngr* mngr, const char* xml, size_t xml_len, saml_doc_opts_t* opts, saml_summary_t* summary);
+void saml_summary_free(saml_summary_t* summary);
+
+// A key with its <dsig:Signature> template already built and its certificate already encoded, for signing
+// many documents with one key.  Safe to share between threads once created; each thread that signs with it
+// gets a copy of the private key of its own, so they don't contend for the one OpenSSL key.
+typedef struct {
+  xmlSecKey* key;                 // copy owned by the signer
+  xmlSecTransformId transform_id;
+  xmlSecTransformId digest_id;
+  xmlDoc* tmpl_doc;
+  xmlNode* tmpl;                  // <dsig:Signature/> with KeyInfo written
+  str_t key_info;                 // the same KeyInfo serialized, for saml_response_build
+  struct saml_signer_replicas* replicas; // the threads' copies of key, see sig.c
+} saml_signer_t;
+
+// digest_id may be NULL for SHA-256
+saml_signer_t* saml_signer_create(xmlSecKey* key, xmlSecTransformId transform_id, xmlSecTransformId digest_id);
+void saml_signer_free(saml_signer_t* signer);
+// Same result as saml_sign_doc with the signer's key and algorithms; opts->digest_id is ignored
+int saml_signer_sign_doc(saml_signer_t* signer, xmlDoc* doc, saml_doc_opts_t* opts);
+
+typedef struct {
+  char* id;
+  char* issue_instant;
+  char* destination;             // optional
+  char* in_response_to;          // optional
+  char* issuer;
+  char* status_code;             // NULL for SAML_STATUS_SUCCESS
+  // The Assertion is left out when assertion_id is NULL
+  char* assertion_id;
+  char* name_id;
+  char* name_id_format;          // optional
+  char* sp_name_qualifier;       // optional
+  char* not_before;              // optional, with not_on_or_after for Conditions
+  char* not_on_or_after;         // optional, also bounds the SubjectConfirmationData
+  char* audience;                // optional
+  char* session_index;           // optional
+  char* authn_context_class_ref; // no AuthnStatement if NULL
+  saml_attr_t* attrs;            // written with the basic NameFormat and xs:string values
+  size_t attrs_len;
+} saml_response_t;
+
+// Writes a signed <samlp:Response/> to xml (which must be freed with str_free on success) without building or
+// parsing a tree.  The Response is written in its exclusive canonical form and digested as it is written, and
+// the Signature is inserted after its Issuer, as saml_binding_post_create would.  Returns 1 if a required field
+// is missing or a value is not valid UTF-8 text, -1 on other errors.
+int saml_response_build(saml_signer_t* signer, const saml_response_t* response, str_t* xml);
+
+// Trusted keys by issuer entity ID, for verifying documents from many issuers with one store.  An issuer can
+// have several keys, e.g. while it rolls over its certificate, and a signature made with any of them verifies.
+// Lookups and changes are safe from any thread, and the store is freed when its last reference is.
+typedef struct saml_trust saml_trust_t;
+
+saml_trust_t* saml_trust_create();
+saml_trust_t* saml_trust_ref(saml_trust_t* trust);
+void saml_trust_free(saml_trust_t* trust);
+// Adds a copy of key to the issuer's keys
+int saml_trust_add(saml_trust_t* trust, const char* issuer, xmlSecKey* key);
+int saml_trust_remove(saml_trust_t* trust, const char* issuer);
+// A store compiled to a file by saml_trust_write is mapped by saml_trust_open and shared by every process that
+// opens it, or forks after opening it.  Only the certificates of keys are written, and an issuer's are parsed
+// the first time it is looked up.  saml_trust_reload maps the file at the same path again.
+saml_trust_t* saml_trust_open(const char* path);
+int saml_trust_reload(saml_trust_t* trust);
+int saml_trust_write(saml_trust_t* trust, const char* path);
+
 saml_binding_status_t saml_binding_redirect_create(xmlSecKey* key, char* saml_type, char* content, char* sig_alg, char* relay_state, str_t* query);
 saml_binding_status_t saml_binding_redirect_parse(char* content, char* sig_alg, xmlDoc** doc);
 saml_binding_status_t saml_binding_redirect_verify(xmlSecKey* cert, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature);
+// Verifies with the trusted keys of the document's Issuer, or returns SAML_UNTRUSTED_ISSUER if there are none
+saml_binding_status_t saml_binding_redirect_verify_trust(saml_trust_t* trust, xmlDoc* doc, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature);
+// saml_binding_redirect_parse and saml_binding_redirect_verify_trust in one, but the signature is checked before
+// the message is parsed whenever its Issuer can be read without parsing it.  *doc is NULL on an error found
+// before parsing.
+saml_binding_status_t saml_binding_redirect_parse_trust(saml_trust_t* trust, char* saml_type, char* content, char* sig_alg, char* relay_state, char* signature, xmlDoc** doc);
 saml_binding_status_t saml_binding_post_create(xmlSecKey* key, char* saml_type, char* content, char* sig_alg, char* relay_state, char* destination, str_t* html);
+// The same from a document that is already parsed, without serializing and parsing it again.  doc is signed in
+// place, so it should not be signed already, and is still the caller's to free.
+saml_binding_status_t saml_binding_post_create_doc(xmlSecKey* key, char* saml_type, xmlDoc* doc, char* sig_alg, char* relay_state, char* destination, str_t* html);
 saml_binding_status_t saml_binding_post_parse(char* content, xmlDoc** doc);
 saml_binding_status_t saml_binding_post_verify(xmlSecKeysMngr* mngr, xmlDoc* doc);
+// Verifies with the one trusted key that the signature's KeyInfo names by certificate, SKI or KeyName, or else
+// tries each of the issuer's keys.  Returns SAML_UNTRUSTED_KEY without verifying when the KeyInfo carries
+// certificates or SKIs and none of them belongs to a trusted key.
+saml_binding_status_t saml_binding_post_verify_trust(saml_trust_t* trust, xmlDoc* doc);
+
+// The same three with the verify cache (see saml_init_opts_t).  post_parse_cached fills content_digest
+// (SAML_CONTENT_DIGEST_LEN bytes) when it returns SAML_OK, and the digest is then passed with the document to
+// one of the verify calls.  Content that has already passed both skips schema validation and signature
+// verification, as long as the key that verified it is still trusted.  Both calls count towards the cache
+// hits and misses.  Detecting replays is up to the caller.
+#define SAML_CONTENT_DIGEST_LEN 32
+saml_binding_status_t saml_binding_post_parse_cached(char* content, unsigned char* content_digest, xmlDoc** doc);
+saml_binding_status_t saml_binding_post_verify_cached(xmlSecKeysMngr* mngr, xmlDoc* doc, const unsigned char* content_digest);
+saml_binding_status_t saml_binding_post_verify_trust_cached(saml_trust_t* trust, xmlDoc* doc, const unsigned char* content_digest);
+
+typedef struct {
+  char* content;                // as passed to saml_binding_post_parse
+  xmlSecKeysMngr* mngr;         // may be shared between jobs
+  saml_trust_t* trust;          // used instead when mngr is NULL
+  saml_binding_status_t status; // set by saml_verify_batch
+} saml_verify_job_t;
+
+// Runs saml_binding_post_parse_cached and saml_binding_post_verify_cached for every job on a pool of threads that is started
+// by the first call, and returns once all are done.  Batches from different threads run one after the other.
+// Returns -1 if the pool could not be started, 0 otherwise.
+int saml_verify_batch(saml_verify_job_t* jobs, size_t jobs_len);
 #endif
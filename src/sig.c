@@ -1,4 +1,75 @@
-xmlSecTransformCtx* saml_sign_binary(xmlSecKey* key, xmlSecTransformId transform_id, unsigned char* data, size_t data_len) {
+static uint32_t href_hash(const xmlChar* href) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  while (*href != '\0') {
+    hash = (hash ^ *href++) * 16777619u;
+  }
+  return hash;
+}
+
+
+// Index every registered signature and digest algorithm by href.  Called by saml_init once xmlsec-crypto
+// has registered its transforms; read-only afterwards.
+static int transforms_index(saml_ctx_t* ctx) {
+  memset(ctx->transforms, 0, sizeof(ctx->transforms));
+  xmlSecPtrList* list = xmlSecTransformIdsGet();
+  xmlSecSize size = xmlSecPtrListGetSize(list);
+  int count = 0;
+  for (xmlSecSize i = 0; i < size; i++) {
+    xmlSecTransformId id = (xmlSecTransformId)xmlSecPtrListGetItem(list, i);
+    if (id == NULL || id->href == NULL || !(id->usage & (xmlSecTransformUsageSignatureMethod | xmlSecTransformUsageDigestMethod))) {
+      continue;
+    }
+    if (++count > TRANSFORMS_SIZE / 2) {
+      saml_log("too many transforms to index");
+      return -1;
+    }
+
+    uint32_t slot = href_hash(id->href) & (TRANSFORMS_SIZE - 1);
+    while (ctx->transforms[slot].href != NULL && !xmlStrEqual(ctx->transforms[slot].href, id->href)) {
+      slot = (slot + 1) & (TRANSFORMS_SIZE - 1);
+    }
+    if (ctx->transforms[slot].href == NULL) { // like xmlSecTransformIdListFindByHref, the first one wins
+      ctx->transforms[slot].href = id->href;
+      ctx->transforms[slot].id = id;
+    }
+  }
+  return 0;
+}
+
+
+xmlSecTransformId saml_find_transform(const char* href) {
+  if (href == NULL) {
+    return NULL;
+  }
+
+  uint32_t slot = href_hash((const xmlChar*)href) & (TRANSFORMS_SIZE - 1);
+  while (CTX.transforms[slot].href != NULL) {
+    if (xmlStrEqual(CTX.transforms[slot].href, (const xmlChar*)href)) {
+      return CTX.transforms[slot].id;
+    }
+    slot = (slot + 1) & (TRANSFORMS_SIZE - 1);
+  }
+  return NULL;
+}
+
+
+static xmlSecTransformId find_transform_usage(const char* href, xmlSecTransformUsage usage) {
+  xmlSecTransformId id = saml_find_transform(href);
+  return id != NULL && (id->usage & usage) ? id : NULL;
+}
+
+
+xmlSecTransformId saml_find_sig_alg(const char* href) {
+  return find_transform_usage(href, xmlSecTransformUsageSignatureMethod);
+}
+
+
+xmlSecTransformId saml_find_digest(const char* href) {
+  return find_transform_usage(href, xmlSecTransformUsageDigestMethod);
+}
+
+
+static xmlSecTransformCtx* binary_ctx_create(xmlSecKey* key, xmlSecTransformId transform_id, xmlSecTransformOperation operation, xmlSecTransform** transform) {
   xmlSecTransformCtx* ctx = xmlSecTransformCtxCreate();
   if (ctx == NULL) {
     saml_log("transform ctx create failed");
@@ -17,92 +88,119 @@ xmlSecTransformCtx* saml_sign_binary(xmlSecKey* key, xmlSecTransformId transform
     return NULL;
   }
 
-  xmlSecTransform* transform = xmlSecTransformCtxCreateAndAppend(ctx, transform_id);
-  if (transform == NULL) {
+  *transform = xmlSecTransformCtxCreateAndAppend(ctx, transform_id);
+  if (*transform == NULL) {
     xmlSecTransformCtxDestroy(ctx);
     saml_log("transform add to context failed");
     return NULL;
   }
 
-  transform->operation = xmlSecTransformOperationSign;
+  (*transform)->operation = operation;
 
-  if (xmlSecTransformSetKey(transform, key) < 0) {
+  if (xmlSecTransformSetKey(*transform, key) < 0) {
     xmlSecTransformCtxDestroy(ctx);
     saml_log("set key failed");
     return NULL;
   }
+  return ctx;
+}
 
+
+static int binary_sign(xmlSecTransformCtx* ctx, unsigned char* data, size_t data_len) {
+  uint64_t start = stats_start();
   if (xmlSecTransformCtxBinaryExecute(ctx, data, data_len) < 0) {
-    xmlSecTransformCtxDestroy(ctx);
     saml_log("signature execution failed");
-    return NULL;
+    return -1;
   }
+  stats_record(SAML_STAGE_SIGN_BINARY, start, data_len);
 
   if (ctx->status != xmlSecTransformStatusFinished) {
-    xmlSecTransformCtxDestroy(ctx);
     saml_log("signature status unknown");
-    return NULL;
+    return -1;
   }
-
-  return ctx;
+  return 0;
 }
 
 
-int saml_verify_binary(xmlSecKey* cert, xmlSecTransformId transform_id, unsigned char* data, size_t data_len, unsigned char* sig, size_t sig_len) {
-  xmlSecTransformCtx* ctx = xmlSecTransformCtxCreate();
-  if (ctx == NULL) {
-    saml_log("transform ctx create failed");
+static int binary_verify(xmlSecTransformCtx* ctx, xmlSecTransform* transform, unsigned char* data, size_t data_len, unsigned char* sig, size_t sig_len) {
+  uint64_t start = stats_start();
+  if (xmlSecTransformCtxBinaryExecute(ctx, data, data_len) < 0) {
+    saml_log("binary execution failed");
     return -1;
   }
 
-  if (xmlSecTransformCtxInitialize(ctx) < 0) {
-    xmlSecTransformCtxDestroy(ctx);
-    saml_log("transform ctx create failed");
+  if (ctx->status != xmlSecTransformStatusFinished) {
+    saml_log("transform context status unknown");
     return -1;
   }
 
-  if (xmlSecPtrListAdd(&ctx->enabledTransforms, (void*)transform_id) < 0) {
-    xmlSecTransformCtxDestroy(ctx);
-    saml_log("transform enable failed");
+  if (xmlSecTransformVerify(transform, sig, sig_len, ctx) < 0) {
+    saml_log("transform verify failed");
     return -1;
   }
+  stats_record(SAML_STAGE_VERIFY_BINARY, start, data_len);
+
+  return transform->status == xmlSecTransformStatusOk ? 0 : 1;
+}
+
+
+xmlSecTransformCtx* saml_sign_binary(xmlSecKey* key, xmlSecTransformId transform_id, unsigned char* data, size_t data_len) {
+  xmlSecTransform* transform;
+  xmlSecTransformCtx* ctx = binary_ctx_create(key, transform_id, xmlSecTransformOperationSign, &transform);
+  if (ctx == NULL) {
+    return NULL;
+  }
 
-  xmlSecTransform* transform = xmlSecTransformCtxCreateAndAppend(ctx, transform_id);
-  if (transform == NULL) {
+  if (binary_sign(ctx, data, data_len) < 0) {
     xmlSecTransformCtxDestroy(ctx);
-    saml_log("transform add to context failed");
-    return -1;
+    return NULL;
   }
+  return ctx;
+}
 
-  transform->operation = xmlSecTransformOperationVerify;
 
-  if (xmlSecTransformSetKey(transform, cert) < 0) {
-    xmlSecTransformCtxDestroy(ctx);
-    saml_log("set key failed");
-    return -1;
+int saml_sign_binary_str(xmlSecKey* key, xmlSecTransformId transform_id, unsigned char* data, size_t data_len, str_t* sig) {
+  evp_ctx_t* ectx = evp_ctx_acquire(key, transform_id, xmlSecTransformOperationSign);
+  if (ectx != NULL) {
+    uint64_t start = stats_start();
+    int res = evp_sign(ectx, data, data_len, sig);
+    stats_record(SAML_STAGE_SIGN_BINARY, start, data_len);
+    return res;
   }
 
-  if (xmlSecTransformCtxBinaryExecute(ctx, data, data_len) < 0) {
-    xmlSecTransformCtxDestroy(ctx);
-    saml_log("binary execution failed");
+  xmlSecTransformCtx* ctx = saml_sign_binary(key, transform_id, data, data_len);
+  if (ctx == NULL) {
     return -1;
   }
 
-  if (ctx->status != xmlSecTransformStatusFinished) {
-    xmlSecTransformCtxDestroy(ctx);
-    saml_log("transform context status unknown");
-    return -1;
+  int sig_len = xmlSecBufferGetSize(ctx->result);
+  str_init(sig, sig_len + 1);
+  str_cat(sig, (char*)xmlSecBufferGetData(ctx->result), sig_len);
+  xmlSecTransformCtxDestroy(ctx);
+  return 0;
+}
+
+
+int saml_verify_binary(xmlSecKey* cert, xmlSecTransformId transform_id, unsigned char* data, size_t data_len, unsigned char* sig, size_t sig_len) {
+  evp_ctx_t* ectx = evp_ctx_acquire(cert, transform_id, xmlSecTransformOperationVerify);
+  if (ectx != NULL) {
+    uint64_t start = stats_start();
+    int res = evp_verify(ectx, data, data_len, sig, sig_len);
+    stats_record(SAML_STAGE_VERIFY_BINARY, start, data_len);
+    return res;
+  } else if (evp_key_mismatch(cert, transform_id)) {
+    return 1;
   }
 
-  if (xmlSecTransformVerify(transform, sig, sig_len, ctx) < 0) {
-    xmlSecTransformCtxDestroy(ctx);
-    saml_log("transform verify failed");
+  xmlSecTransform* transform;
+  xmlSecTransformCtx* ctx = binary_ctx_create(cert, transform_id, xmlSecTransformOperationVerify, &transform);
+  if (ctx == NULL) {
     return -1;
   }
 
-  int status = transform->status == xmlSecTransformStatusOk ? 0 : 1;
+  int res = binary_verify(ctx, transform, data, data_len, sig, sig_len);
   xmlSecTransformCtxDestroy(ctx);
-  return status;
+  return res;
 }
 
 
@@ -113,6 +211,7 @@ static void add_id(xmlDoc* doc, xmlNode* node, const xmlChar* name) {
       xmlChar* value = xmlNodeListGetString(doc, attr->children, 1);
       if (value != NULL) {
         xmlAddID(NULL, doc, value, attr);
+        xmlFree(value);
       }
       return;
     }
@@ -121,83 +220,105 @@ static void add_id(xmlDoc* doc, xmlNode* node, const xmlChar* name) {
 }
 
 
-int saml_sign_doc(xmlSecKey* key, xmlSecTransformId transform_id, xmlDoc* doc, saml_doc_opts_t* opts) {
-  xmlNode* root = xmlDocGetRootElement(doc);
-  if (root == NULL) {
-    saml_log("no root node");
+// Registers the id attribute of root and writes the reference to it into uri, which is left as "#" when there
+// is no id_attr.  Returns 1 if root has no such attribute.
+static int sig_ref_uri(xmlDoc* doc, xmlNode* root, saml_doc_opts_t* opts, xmlChar* uri, size_t uri_len) {
+  uri[0] = '#';
+  uri[1] = '\0';
+  if (opts->id_attr == NULL) {
+    return 0;
+  }
+
+  xmlChar* id = xmlGetProp(root, opts->id_attr);
+  if (id == NULL) {
+    saml_log("no ID property on document root");
     return 1;
   }
+  strncat((char*)uri, (char*)id, uri_len - 2);
+  xmlFree(id);
+  add_id(doc, root, opts->id_attr);
+  return 0;
+}
 
-  const xmlChar uri[80] = "#\0";
-  if (opts->id_attr != NULL) {
-    xmlChar* id = xmlGetProp(root, opts->id_attr);
-    if (id == NULL) {
-      saml_log("no ID property on document root");
-      return 1;
-    }
-    strncat((char*)uri, (char*)id, sizeof(uri) - 2);
-    xmlFree(id);
-    add_id(doc, root, opts->id_attr);
+
+// <dsig:Signature/> with one Reference, to uri unless it is NULL, and an empty X509Certificate in its KeyInfo
+static xmlNode* sig_tmpl_create(xmlDoc* doc, xmlSecTransformId transform_id, xmlSecTransformId digest_id, const xmlChar* uri) {
+  if (!(digest_id->usage & xmlSecTransformUsageDigestMethod)) {
+    saml_log("not a digest method");
+    return NULL;
   }
 
-  // <dsig:Signature/>
   xmlNode* sig = xmlSecTmplSignatureCreate(doc, xmlSecTransformExclC14NId, transform_id, NULL);
   if (sig == NULL) {
     saml_log("create signature template failed");
-    return -1;
-  }
-
-  if (opts->insert_after_ns != NULL && opts->insert_after_el != NULL) {
-    xmlNode* target = xmlSecFindNode(root, opts->insert_after_el, opts->insert_after_ns);
-    if (target == NULL) {
-      saml_log("insertion point node not found");
-      return 1;
-    }
-
-    if (xmlAddNextSibling(target, sig) == NULL) {
-      saml_log("adding signature node failed");
-      return -1;
-    }
-  } else {
-    xmlAddChild(root, sig);
+    return NULL;
   }
 
   // <dsig:Reference/>
-  xmlNode* ref = xmlSecTmplSignatureAddReference(sig, xmlSecTransformSha1Id, NULL, (opts->id_attr == NULL) ? NULL : uri, NULL);
+  xmlNode* ref = xmlSecTmplSignatureAddReference(sig, digest_id, NULL, uri, NULL);
   if (ref == NULL) {
     saml_log("add reference to signature template failed");
-    return -1;
+    goto error;
   }
 
   if (xmlSecTmplReferenceAddTransform(ref, xmlSecTransformEnvelopedId) == NULL) {
     saml_log("add enveloped transform to reference failed");
-    return -1;
+    goto error;
   }
 
   if (xmlSecTmplReferenceAddTransform(ref, xmlSecTransformExclC14NId) == NULL) {
     saml_log("add c14n transform to reference failed");
-    return -1;
+    goto error;
   }
 
   // <dsig:KeyInfo/>
   xmlNode* key_info = xmlSecTmplSignatureEnsureKeyInfo(sig, NULL);
   if (key_info == NULL) {
     saml_log("add key info to sign node failed");
-    return -1;
+    goto error;
   }
- 
+
   // <dsig:X509Data/>
   xmlNode* x509_data = xmlSecTmplKeyInfoAddX509Data(key_info);
   if (x509_data == NULL) {
     saml_log("add x509 data to node failed");
-    return -1;
+    goto error;
   }
 
   if (xmlSecTmplX509DataAddCertificate(x509_data) == NULL) {
     saml_log("add x509 cert to node failed");
+    goto error;
+  }
+  return sig;
+
+error:
+  xmlFreeNode(sig);
+  return NULL;
+}
+
+
+// Returns 1 if the node to insert after is not found
+static int sig_insert(xmlNode* root, xmlNode* sig, saml_doc_opts_t* opts) {
+  if (opts->insert_after_ns == NULL || opts->insert_after_el == NULL) {
+    xmlAddChild(root, sig);
+    return 0;
+  }
+
+  xmlNode* target = xmlSecFindNode(root, opts->insert_after_el, opts->insert_after_ns);
+  if (target == NULL) {
+    saml_log("insertion point node not found");
+    return 1;
+  }
+
+  if (xmlAddNextSibling(target, sig) == NULL) {
+    saml_log("adding signature node failed");
     return -1;
   }
+  return 0;
+}
 
+
+static int sig_sign(xmlSecKey* key, xmlNode* sig) {
   xmlSecDSigCtx* ctx = xmlSecDSigCtxCreate(NULL);
   if (ctx == NULL) {
     saml_log("create signature context failed");
@@ -205,7 +326,9 @@ int saml_sign_doc(xmlSecKey* key, xmlSecTransformId transform_id, xmlDoc* doc, s
   }
 
   ctx->signKey = key;
+  uint64_t start = stats_start();
   int res = xmlSecDSigCtxSign(ctx, sig);
+  stats_record(SAML_STAGE_SIGN_DOC, start, 0);
   ctx->signKey = NULL; // The signKey is lua userdata, so xmlsec should not manage it
 
   if (res < 0) {
@@ -220,7 +343,289 @@ int saml_sign_doc(xmlSecKey* key, xmlSecTransformId transform_id, xmlDoc* doc, s
 }
 
 
-int saml_verify_doc(xmlSecKeysMngr* mngr, xmlDoc* doc, saml_doc_opts_t* opts) {
+int saml_sign_doc(xmlSecKey* key, xmlSecTransformId transform_id, xmlDoc* doc, saml_doc_opts_t* opts) {
+  xmlNode* root = xmlDocGetRootElement(doc);
+  if (root == NULL) {
+    saml_log("no root node");
+    return 1;
+  }
+
+  xmlChar uri[80];
+  if (sig_ref_uri(doc, root, opts, uri, sizeof(uri)) != 0) {
+    return 1;
+  }
+
+  xmlSecTransformId digest_id = opts->digest_id != NULL ? opts->digest_id : xmlSecTransformSha256Id;
+  xmlNode* sig = sig_tmpl_create(doc, transform_id, digest_id, (opts->id_attr == NULL) ? NULL : uri);
+  if (sig == NULL) {
+    return -1;
+  }
+
+  int res = sig_insert(root, sig, opts);
+  if (res != 0) {
+    xmlFreeNode(sig);
+    return res;
+  }
+  return sig_sign(key, sig);
+}
+
+
+// OpenSSL keys are shared by reference: every signature with one takes a reference to it and, for RSA, a lock
+// around its blinding when the thread is not the one that first used it.  With many threads signing with one
+// key, that is enough to stop throughput from scaling, so a signer gives each thread a key of its own, parsed
+// from the DER of the private key the first time the thread signs.  A signer has at most SIGNER_REPLICAS_MAX
+// of them, which threads beyond that share.
+struct saml_signer_replicas {
+  pthread_mutex_t lock;
+  uint64_t id;
+  unsigned char* der;
+  int der_len;
+  xmlSecKey* keys[SIGNER_REPLICAS_MAX];
+  int keys_len;
+  int next;                   // the copy to share next once there are SIGNER_REPLICAS_MAX
+};
+
+
+// NULL when the key is not an RSA or EC private key, which is then used as it is
+static struct saml_signer_replicas* signer_replicas_create(xmlSecKey* key) {
+  xmlSecKeyData* value = xmlSecKeyGetValue(key);
+  if (value == NULL || (xmlSecKeyGetType(key) & xmlSecKeyDataTypePrivate) == 0) {
+    return NULL;
+  }
+#ifdef SAML_EVP_ECDSA
+  if (!xmlSecKeyDataCheckId(value, xmlSecKeyDataRsaId) && !xmlSecKeyDataCheckId(value, xmlSecKeyDataEcdsaId)) {
+    return NULL;
+  }
+#else
+  if (!xmlSecKeyDataCheckId(value, xmlSecKeyDataRsaId)) {
+    return NULL;
+  }
+#endif
+  EVP_PKEY* pkey = xmlSecOpenSSLEvpKeyDataGetEvp(value);
+  if (pkey == NULL) {
+    return NULL;
+  }
+
+  struct saml_signer_replicas* replicas = calloc(1, sizeof(struct saml_signer_replicas));
+  if (replicas == NULL) {
+    return NULL;
+  }
+  replicas->der_len = i2d_PrivateKey(pkey, &replicas->der);
+  if (replicas->der_len <= 0) {
+    free(replicas);
+    ERR_clear_error();
+    return NULL;
+  }
+  pthread_mutex_init(&replicas->lock, NULL);
+
+  pthread_mutex_lock(&CTX.signer_lock);
+  replicas->id = CTX.signer_next_id++;
+  pthread_mutex_unlock(&CTX.signer_lock);
+  return replicas;
+}
+
+
+static void signer_replicas_free(struct saml_signer_replicas* replicas) {
+  for (int i = 0; i < replicas->keys_len; i++) {
+    saml_key_free(replicas->keys[i]);
+  }
+  OPENSSL_cleanse(replicas->der, replicas->der_len);
+  OPENSSL_free(replicas->der);
+  pthread_mutex_destroy(&replicas->lock);
+  free(replicas);
+}
+
+
+static xmlSecKey* signer_replica_create(struct saml_signer_replicas* replicas) {
+  const unsigned char* der = replicas->der;
+  EVP_PKEY* pkey = d2i_AutoPrivateKey(NULL, &der, replicas->der_len);
+  xmlSecKeyData* value = pkey == NULL ? NULL : xmlSecOpenSSLEvpKeyAdopt(pkey);
+  if (value == NULL) {
+    if (pkey != NULL) {
+      EVP_PKEY_free(pkey);
+    }
+    ERR_clear_error();
+    return NULL;
+  }
+
+  xmlSecKey* key = xmlSecKeyCreate();
+  if (key == NULL || xmlSecKeySetValue(key, value) < 0) {
+    if (key != NULL) {
+      xmlSecKeyDestroy(key);
+    }
+    xmlSecKeyDataDestroy(value);
+    return NULL;
+  }
+  return key;
+}
+
+
+// The calling thread's copy of the signer's key, or the signer's own if it has no copies
+static xmlSecKey* signer_key(saml_signer_t* signer) {
+  struct saml_signer_replicas* replicas = signer->replicas;
+  saml_thread_ctx_t* tctx = replicas == NULL ? NULL : thread_ctx();
+  if (tctx == NULL) {
+    return signer->key;
+  }
+
+  signer_replica_t* lru = tctx->signer_replicas;
+  for (int i = 0; i < SIGNER_CACHE_SIZE; i++) {
+    signer_replica_t* replica = tctx->signer_replicas + i;
+    if (replica->signer_id == replicas->id) {
+      replica->last_used = ++tctx->signer_clock;
+      return replica->key;
+    }
+    if (replica->last_used < lru->last_used) {
+      lru = replica;
+    }
+  }
+
+  pthread_mutex_lock(&replicas->lock);
+  xmlSecKey* key = replicas->keys_len < SIGNER_REPLICAS_MAX ? signer_replica_create(replicas) : NULL;
+  if (key != NULL) {
+    replicas->keys[replicas->keys_len++] = key;
+  } else if (replicas->keys_len > 0) {
+    key = replicas->keys[replicas->next++ % replicas->keys_len];
+  }
+  pthread_mutex_unlock(&replicas->lock);
+  if (key == NULL) {
+    return signer->key;
+  }
+
+  lru->signer_id = replicas->id;
+  lru->key = key;
+  lru->last_used = ++tctx->signer_clock;
+  return key;
+}
+
+
+saml_signer_t* saml_signer_create(xmlSecKey* key, xmlSecTransformId transform_id, xmlSecTransformId digest_id) {
+  saml_signer_t* signer = calloc(1, sizeof(saml_signer_t));
+  if (signer == NULL) {
+    return NULL;
+  }
+  signer->transform_id = transform_id;
+  signer->digest_id = digest_id != NULL ? digest_id : xmlSecTransformSha256Id;
+
+  signer->key = xmlSecKeyDuplicate(key);
+  signer->tmpl_doc = xmlNewDoc((xmlChar*)"1.0");
+  if (signer->key == NULL || signer->tmpl_doc == NULL) {
+    saml_log("create signer failed");
+    goto error;
+  }
+  signer->replicas = signer_replicas_create(signer->key);
+
+  signer->tmpl = sig_tmpl_create(signer->tmpl_doc, transform_id, signer->digest_id, (xmlChar*)"#");
+  if (signer->tmpl == NULL) {
+    goto error;
+  }
+  xmlDocSetRootElement(signer->tmpl_doc, signer->tmpl);
+
+  // Written once here, so signing never encodes the certificate again
+  xmlNode* key_info = xmlSecFindChild(signer->tmpl, xmlSecNodeKeyInfo, xmlSecDSigNs);
+  xmlSecKeyInfoCtx* key_info_ctx = xmlSecKeyInfoCtxCreate(NULL);
+  if (key_info_ctx == NULL) {
+    saml_log("create key info context failed");
+    goto error;
+  }
+  key_info_ctx->mode = xmlSecKeyInfoModeWrite;
+  key_info_ctx->keyReq.keyType = xmlSecKeyDataTypePublic; // what KeyInfo may reveal
+  int res = xmlSecKeyInfoNodeWrite(key_info, signer->key, key_info_ctx);
+  xmlSecKeyInfoCtxDestroy(key_info_ctx);
+  if (res < 0) {
+    saml_log("write key info failed");
+    goto error;
+  }
+
+  xmlBuffer* buf = xmlBufferCreate();
+  if (buf == NULL || xmlNodeDump(buf, signer->tmpl_doc, key_info, 0, 0) < 0) {
+    saml_log("serialize key info failed");
+    xmlBufferFree(buf);
+    goto error;
+  }
+  str_init(&signer->key_info, xmlBufferLength(buf) + 1);
+  str_cat(&signer->key_info, (char*)xmlBufferContent(buf), xmlBufferLength(buf));
+  xmlBufferFree(buf);
+  return signer;
+
+error:
+  saml_signer_free(signer);
+  return NULL;
+}
+
+
+void saml_signer_free(saml_signer_t* signer) {
+  if (signer == NULL) {
+    return;
+  }
+  saml_key_free(signer->key);
+  if (signer->tmpl_doc != NULL) {
+    xmlFreeDoc(signer->tmpl_doc);
+  }
+  if (signer->key_info.data != NULL) {
+    str_free(&signer->key_info);
+  }
+  if (signer->replicas != NULL) {
+    signer_replicas_free(signer->replicas);
+  }
+  free(signer);
+}
+
+
+int saml_signer_sign_doc(saml_signer_t* signer, xmlDoc* doc, saml_doc_opts_t* opts) {
+  xmlNode* root = xmlDocGetRootElement(doc);
+  if (root == NULL) {
+    saml_log("no root node");
+    return 1;
+  }
+
+  xmlChar uri[80];
+  if (sig_ref_uri(doc, root, opts, uri, sizeof(uri)) != 0) {
+    return 1;
+  }
+
+  xmlNode* sig = xmlDocCopyNode(signer->tmpl, doc, 1);
+  if (sig == NULL) {
+    saml_log("copy signature template failed");
+    return -1;
+  }
+
+  xmlNode* signed_info = xmlSecFindChild(sig, xmlSecNodeSignedInfo, xmlSecDSigNs);
+  xmlNode* ref = signed_info == NULL ? NULL : xmlSecFindChild(signed_info, xmlSecNodeReference, xmlSecDSigNs);
+  xmlNode* key_info = xmlSecFindChild(sig, xmlSecNodeKeyInfo, xmlSecDSigNs);
+  if (ref == NULL || key_info == NULL || key_info->prev == NULL) {
+    saml_log("invalid signature template");
+    xmlFreeNode(sig);
+    return -1;
+  }
+
+  if (opts->id_attr != NULL) {
+    xmlSetProp(ref, xmlSecAttrURI, uri);
+  } else {
+    xmlUnsetProp(ref, xmlSecAttrURI);
+  }
+
+  // KeyInfo is already written and not covered by the signature, so it is left out while signing and put back
+  // where it was afterwards
+  xmlNode* key_info_prev = key_info->prev;
+  xmlUnlinkNode(key_info);
+
+  int res = sig_insert(root, sig, opts);
+  if (res != 0) {
+    xmlFreeNode(key_info);
+    xmlFreeNode(sig);
+    return res;
+  }
+
+  res = sig_sign(signer_key(signer), sig);
+  xmlAddNextSibling(key_info_prev, key_info);
+  return res;
+}
+
+
+// When key_digest is not NULL and the signature is valid, it receives the digest of the key that verified it
+// and key_digested is set, unless the key could not be digested; see evp_key_digest.
+static int verify_doc(xmlSecKeysMngr* mngr, xmlDoc* doc, saml_doc_opts_t* opts, unsigned char* key_digest, int* key_digested) {
   xmlNode* root = xmlDocGetRootElement(doc);
   if (root == NULL) {
     return 1;
@@ -244,13 +649,24 @@ int saml_verify_doc(xmlSecKeysMngr* mngr, xmlDoc* doc, saml_doc_opts_t* opts) {
 
   //ctx->enabledReferenceUris = xmlSecTransformUriTypeNone & xmlSecTransformUriTypeEmpty & xmlSecTransformUriTypeSameDocument;
   ctx->enabledReferenceUris = 0x0003;
-  if (xmlSecDSigCtxVerify(ctx, sig) < 0) {
+  uint64_t start = stats_start();
+  int res = xmlSecDSigCtxVerify(ctx, sig);
+  stats_record(SAML_STAGE_VERIFY_DOC, start, 0);
+  if (res < 0) {
     xmlSecDSigCtxDestroy(ctx);
     saml_log("signature verify failed");
     return -1;
   }
 
   int status = ctx->status == xmlSecDSigStatusSucceeded ? 0 : 1;
+  if (status == 0 && key_digest != NULL) {
+    *key_digested = ctx->signKey != NULL && evp_key_digest(ctx->signKey, key_digest) == 0;
+  }
   xmlSecDSigCtxDestroy(ctx);
   return status;
 }
+
+
+int saml_verify_doc(xmlSecKeysMngr* mngr, xmlDoc* doc, saml_doc_opts_t* opts) {
+  return verify_doc(mngr, doc, opts, NULL, NULL);
+}
@@ -0,0 +1,211 @@
+// Stage latencies are recorded into a saml_stats_t owned by the calling thread, so the hot path takes no
+// locks.  The lock only guards the list of per-thread nodes, which is walked by snapshots and resets and
+// changed when a thread records for the first time or exits.  Only the owning thread writes its counters,
+// and it does so with relaxed atomic stores that snapshots read with relaxed atomic loads: each counter is
+// either before or after a given sample, though the counters of one stage may be a sample apart.
+//
+// A reset can't clear counters that other threads are writing, so it bumps CTX.stats_generation instead.
+// Each thread clears its own counters the next time it records and sees the generation has moved, and until
+// then snapshots leave them out.  After saml_stats_reset returns, a snapshot counts only samples that were
+// recorded after the reset started; one that was being recorded while it ran may be counted or lost.
+
+static const char* STAGE_NAMES[] = {
+  "base64_decode",
+  "base64_encode",
+  "inflate",
+  "deflate",
+  "xml_parse",
+  "xml_serialize",
+  "xsd_validate",
+  "sign_binary",
+  "verify_binary",
+  "sign_doc",
+  "verify_doc",
+};
+
+
+static uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Returns 0 when stats are disabled, which stats_record treats as "nothing to record"
+static inline uint64_t stats_start() {
+  return CTX.stats_enabled ? stats_now() : 0;
+}
+
+
+static int stats_bucket(uint64_t ns) {
+  if (ns < SAML_STATS_SUB_BUCKETS) {
+    return (int)ns;
+  }
+
+  int shift = 63 - __builtin_clzll(ns) - 3; // 3 == log2(SAML_STATS_SUB_BUCKETS)
+  int bucket = (shift + 1) * SAML_STATS_SUB_BUCKETS + (int)((ns >> shift) & (SAML_STATS_SUB_BUCKETS - 1));
+  return bucket < SAML_STATS_BUCKETS ? bucket : SAML_STATS_BUCKETS - 1;
+}
+
+
+// Lowest value that falls in the bucket
+static uint64_t stats_bucket_ns(int bucket) {
+  if (bucket < SAML_STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / SAML_STATS_SUB_BUCKETS - 1;
+  return (uint64_t)(SAML_STATS_SUB_BUCKETS + bucket % SAML_STATS_SUB_BUCKETS) << shift;
+}
+
+
+#define STATS_LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STATS_ADD(v, n) __atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+
+// src may be a node that its thread is recording into
+static void stats_merge(saml_stats_t* dst, const saml_stats_t* src) {
+  for (int i = 0; i < SAML_STAGE_COUNT; i++) {
+    saml_stage_stats_t* d = dst->stages + i;
+    const saml_stage_stats_t* s = src->stages + i;
+    d->count += STATS_LOAD(s->count);
+    d->bytes += STATS_LOAD(s->bytes);
+    d->total_ns += STATS_LOAD(s->total_ns);
+    uint64_t max_ns = STATS_LOAD(s->max_ns);
+    if (max_ns > d->max_ns) {
+      d->max_ns = max_ns;
+    }
+    for (int j = 0; j < SAML_STATS_BUCKETS; j++) {
+      d->buckets[j] += STATS_LOAD(s->buckets[j]);
+    }
+  }
+}
+
+
+// Whether the node's counters were recorded since the last reset.  Called with the lock held, so the
+// generation can't move meanwhile.
+static int stats_node_current(stats_node_t* node) {
+  return __atomic_load_n(&node->generation, __ATOMIC_ACQUIRE) == CTX.stats_generation;
+}
+
+
+static stats_node_t* stats_node_new() {
+  stats_node_t* node = calloc(1, sizeof(stats_node_t));
+  if (node == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&CTX.stats_lock);
+  node->generation = CTX.stats_generation;
+  node->next = CTX.stats_nodes;
+  if (node->next != NULL) {
+    node->next->prev = node;
+  }
+  CTX.stats_nodes = node;
+  pthread_mutex_unlock(&CTX.stats_lock);
+  return node;
+}
+
+
+// Called when the owning thread exits, so its samples are kept in the retired totals
+static void stats_node_free(stats_node_t* node) {
+  pthread_mutex_lock(&CTX.stats_lock);
+  if (stats_node_current(node)) {
+    stats_merge(&CTX.stats_retired, &node->stats);
+  }
+  if (node->prev != NULL) {
+    node->prev->next = node->next;
+  } else {
+    CTX.stats_nodes = node->next;
+  }
+  if (node->next != NULL) {
+    node->next->prev = node->prev;
+  }
+  pthread_mutex_unlock(&CTX.stats_lock);
+  free(node);
+}
+
+
+static void stats_record(saml_stage_t stage, uint64_t start, size_t bytes) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t ns = stats_now() - start;
+
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
+    return;
+  }
+  if (tctx->stats == NULL && (tctx->stats = stats_node_new()) == NULL) {
+    return;
+  }
+
+  // Snapshots skip the counters until the new generation is published, so they never see them half cleared
+  stats_node_t* node = tctx->stats;
+  uint64_t generation = __atomic_load_n(&CTX.stats_generation, __ATOMIC_ACQUIRE);
+  if (node->generation != generation) {
+    memset(&node->stats, 0, sizeof(saml_stats_t));
+    __atomic_store_n(&node->generation, generation, __ATOMIC_RELEASE);
+  }
+
+  saml_stage_stats_t* s = node->stats.stages + stage;
+  STATS_ADD(s->count, 1);
+  STATS_ADD(s->bytes, bytes);
+  STATS_ADD(s->total_ns, ns);
+  if (ns > s->max_ns) {
+    __atomic_store_n(&s->max_ns, ns, __ATOMIC_RELAXED);
+  }
+  STATS_ADD(s->buckets[stats_bucket(ns)], 1);
+}
+
+
+void saml_stats_enable(int enabled) {
+  CTX.stats_enabled = enabled;
+}
+
+
+void saml_stats_reset() {
+  pthread_mutex_lock(&CTX.stats_lock);
+  memset(&CTX.stats_retired, 0, sizeof(saml_stats_t));
+  __atomic_store_n(&CTX.stats_generation, CTX.stats_generation + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&CTX.stats_lock);
+}
+
+
+void saml_stats_snapshot(saml_stats_t* stats) {
+  memset(stats, 0, sizeof(saml_stats_t));
+  pthread_mutex_lock(&CTX.stats_lock);
+  stats_merge(stats, &CTX.stats_retired);
+  for (stats_node_t* node = CTX.stats_nodes; node != NULL; node = node->next) {
+    if (stats_node_current(node)) {
+      stats_merge(stats, &node->stats);
+    }
+  }
+  pthread_mutex_unlock(&CTX.stats_lock);
+}
+
+
+const char* saml_stats_stage_name(saml_stage_t stage) {
+  return (stage >= 0 && stage < SAML_STAGE_COUNT) ? STAGE_NAMES[stage] : NULL;
+}
+
+
+// p is a fraction, e.g. 0.99.  The result is the lower bound of the bucket holding that sample, capped by the
+// largest latency actually seen.
+uint64_t saml_stats_percentile(const saml_stage_stats_t* stage, double p) {
+  if (stage->count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)ceil(p * stage->count);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < SAML_STATS_BUCKETS; i++) {
+    seen += stage->buckets[i];
+    if (seen >= rank) {
+      uint64_t ns = stats_bucket_ns(i);
+      return ns < stage->max_ns ? ns : stage->max_ns;
+    }
+  }
+  return stage->max_ns;
+}
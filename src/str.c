@@ -10,12 +10,11 @@ void str_free(str_t* str) {
 }
 
 
+// realloc rather than malloc and copy: large buffers are usually extended or remapped in place, so growing
+// does not briefly need the old and the new copy at once
 void str_grow(str_t* str) {
   str->total = 2 * str->total;
-  char* data = malloc(str->total);
-  memcpy(data, str->data, str->len);
-  free(str->data);
-  str->data = data;
+  str->data = realloc(str->data, str->total);
 }
 
 
@@ -0,0 +1,802 @@
+// saml_verify_xml checks the signature SAML documents carry - one Reference to the root element with the
+// enveloped-signature and exclusive c14n transforms, and SignedInfo in exclusive c14n - while the document is
+// parsed with SAX, without building it.  The root is written out in its canonical form as it is parsed, as
+// build.c writes a Response, and digested from the moment the Reference has been read.  Only the Signature is
+// built as a tree, so that libxml2 canonicalizes its SignedInfo and xmlsec finds the key from its KeyInfo just
+// as they do for saml_verify_doc.  Documents outside this profile, such as ones with a DTD, an
+// InclusiveNamespaces prefix list or a Reference to another element, are verified by saml_verify_doc instead.
+
+typedef enum {
+  STREAM_OK,
+  STREAM_FALLBACK, // outside the profile
+  STREAM_ERROR,
+} stream_status_t;
+
+typedef struct {
+  const xmlChar* prefix; // NULL for the default namespace
+  const xmlChar* uri;
+  int depth;
+} stream_ns_t;
+
+typedef struct {
+  stream_ns_t* items;
+  int len;
+  int total;
+} stream_ns_list_t;
+
+typedef struct {
+  const xmlChar* name;
+  const xmlChar* uri;
+} stream_el_t;
+
+typedef struct {
+  xmlParserCtxt* parser;
+  xmlSecKeysMngr* mngr;
+  saml_doc_opts_t* opts;
+  stream_status_t status;
+
+  // Names are interned in the parser's dictionary, so they are kept as pointers
+  int depth;               // of the innermost open element, 1 for the root
+  stream_el_t* path;       // the open elements, by depth
+  int path_total;
+  stream_ns_list_t declared; // namespaces declared by the open elements
+  stream_ns_list_t rendered; // namespaces written out by the open elements
+  stream_ns_list_t scratch;
+  int* order;
+  int order_total;
+  const xmlChar** sig_ns;
+  int sig_ns_total;
+  int top_level_pi;
+  int whole_doc;           // the Reference URI is empty
+
+  build_t c14n;
+  str_t head;              // the canonical form until the Reference has been read
+  int sig_depth;           // of the Signature while it is built, -1 before it and 0 after
+  EVP_MD_CTX* md_ctx;
+  byte* digest;            // from DigestValue
+  int digest_len;
+  xmlSecTransformId transform_id;
+  byte* sig;               // from SignatureValue
+  int sig_len;
+  str_t signed_info;       // canonical
+  xmlSecKey* key;
+
+  saml_summary_t* summary;
+  str_t text;              // of the element being summarized
+  int text_depth;          // 0 when there is none
+  int text_seen;
+  xmlChar** text_dst;
+  int attr_depth;          // of the Attribute whose values are being read, 0 when there is none
+  int issuer_done;
+  int name_id_done;
+  int session_index_done;
+} stream_t;
+
+
+static void stream_stop(stream_t* s, stream_status_t status) {
+  if (s->status == STREAM_OK) {
+    s->status = status;
+  }
+  xmlStopParser(s->parser);
+}
+
+
+static int stream_grow(void** items, int* total, int len, size_t size) {
+  if (len < *total) {
+    return 0;
+  }
+  int new_total = *total == 0 ? 16 : *total;
+  while (new_total <= len) {
+    new_total *= 2;
+  }
+  void* new_items = realloc(*items, new_total * size);
+  if (new_items == NULL) {
+    return -1;
+  }
+  *items = new_items;
+  *total = new_total;
+  return 0;
+}
+
+
+static void stream_ns_push(stream_t* s, stream_ns_list_t* list, const xmlChar* prefix, const xmlChar* uri) {
+  if (stream_grow((void**)&list->items, &list->total, list->len, sizeof(stream_ns_t)) < 0) {
+    stream_stop(s, STREAM_ERROR);
+    return;
+  }
+  stream_ns_t* ns = list->items + list->len++;
+  ns->prefix = prefix;
+  ns->uri = uri;
+  ns->depth = s->depth;
+}
+
+
+// libxml2 fails to canonicalize a document with any relative namespace URI, used or not
+static int stream_ns_relative(const xmlChar* uri) {
+  if (uri == NULL || uri[0] == '\0') {
+    return 0;
+  }
+  xmlURI* parsed = xmlParseURI((char*)uri);
+  int res = parsed == NULL || parsed->scheme == NULL || parsed->scheme[0] == '\0';
+  xmlFreeURI(parsed);
+  return res;
+}
+
+
+static void stream_ns_pop(stream_ns_list_t* list, int depth) {
+  while (list->len > 0 && list->items[list->len - 1].depth >= depth) {
+    list->len--;
+  }
+}
+
+
+// The innermost namespace for prefix in list, or NULL
+static const xmlChar* stream_ns_find(stream_ns_list_t* list, const xmlChar* prefix) {
+  for (int i = list->len - 1; i >= 0; i--) {
+    if (xmlStrEqual(list->items[i].prefix, prefix)) {
+      return list->items[i].uri;
+    }
+  }
+  return NULL;
+}
+
+
+// Adds the namespace an element or attribute uses to scratch, unless it is already in effect in the output
+static void stream_ns_use(stream_t* s, const xmlChar* prefix, const xmlChar* uri) {
+  if (xmlStrEqual(prefix, (xmlChar*)"xml")) {
+    return;
+  }
+  if (prefix != NULL && uri == NULL) {
+    // An undeclared prefix, which the parser has reported
+    stream_stop(s, STREAM_FALLBACK);
+    return;
+  }
+  for (int i = 0; i < s->scratch.len; i++) {
+    if (xmlStrEqual(s->scratch.items[i].prefix, prefix)) {
+      return;
+    }
+  }
+
+  const xmlChar* rendered = stream_ns_find(&s->rendered, prefix);
+  if (prefix == NULL) {
+    // xmlns="" is only written to undo a default namespace written above
+    uri = uri == NULL ? (xmlChar*)"" : uri;
+    if (xmlStrEqual(uri, rendered == NULL ? (xmlChar*)"" : rendered)) {
+      return;
+    }
+  } else if (rendered != NULL && xmlStrEqual(rendered, uri)) {
+    return;
+  }
+  stream_ns_push(s, &s->scratch, prefix, uri);
+}
+
+
+static int stream_ns_cmp(const stream_ns_t* a, const stream_ns_t* b) {
+  if (a->prefix == NULL || b->prefix == NULL) {
+    return a->prefix == NULL ? (b->prefix == NULL ? 0 : -1) : 1;
+  }
+  return xmlStrcmp(a->prefix, b->prefix);
+}
+
+
+// Attributes are in the SAX2 layout of localname, prefix, URI, value and end
+static int stream_attr_cmp(const xmlChar** a, const xmlChar** b) {
+  int res = xmlStrcmp(a[2] == NULL ? (xmlChar*)"" : a[2], b[2] == NULL ? (xmlChar*)"" : b[2]);
+  return res != 0 ? res : xmlStrcmp(a[0], b[0]);
+}
+
+
+static void stream_qname(stream_t* s, const xmlChar* prefix, const xmlChar* localname) {
+  if (prefix != NULL) {
+    build_str(&s->c14n, (char*)prefix);
+    build_lit(&s->c14n, ":");
+  }
+  build_str(&s->c14n, (char*)localname);
+}
+
+
+static void stream_c14n_start(stream_t* s, const xmlChar* localname, const xmlChar* prefix, const xmlChar* uri,
+                              int nb_attributes, const xmlChar** attributes) {
+  s->scratch.len = 0;
+  stream_ns_use(s, prefix, uri);
+  for (int i = 0; i < nb_attributes && s->status == STREAM_OK; i++) {
+    if (attributes[5 * i + 1] != NULL) {
+      stream_ns_use(s, attributes[5 * i + 1], attributes[5 * i + 2]);
+    }
+  }
+  // Once the parser is stopped, its input and so the attributes are gone
+  if (s->status != STREAM_OK) {
+    return;
+  }
+  if (stream_grow((void**)&s->order, &s->order_total, nb_attributes, sizeof(int)) < 0) {
+    stream_stop(s, STREAM_ERROR);
+    return;
+  }
+
+  // Both lists are short, so they are insertion sorted
+  stream_ns_t* ns = s->scratch.items;
+  for (int i = 1; i < s->scratch.len; i++) {
+    stream_ns_t tmp = ns[i];
+    int j = i;
+    for (; j > 0 && stream_ns_cmp(ns + j - 1, &tmp) > 0; j--) {
+      ns[j] = ns[j - 1];
+    }
+    ns[j] = tmp;
+  }
+  for (int i = 0; i < nb_attributes; i++) {
+    int j = i;
+    for (; j > 0 && stream_attr_cmp(attributes + 5 * s->order[j - 1], attributes + 5 * i) > 0; j--) {
+      s->order[j] = s->order[j - 1];
+    }
+    s->order[j] = i;
+  }
+
+  build_lit(&s->c14n, "<");
+  stream_qname(s, prefix, localname);
+  for (int i = 0; i < s->scratch.len; i++) {
+    build_lit(&s->c14n, " xmlns");
+    if (ns[i].prefix != NULL) {
+      build_lit(&s->c14n, ":");
+      build_str(&s->c14n, (char*)ns[i].prefix);
+    }
+    build_lit(&s->c14n, "=\"");
+    build_escaped(&s->c14n, (char*)ns[i].uri, 1);
+    build_lit(&s->c14n, "\"");
+  }
+  for (int i = 0; i < nb_attributes; i++) {
+    const xmlChar** attr = attributes + 5 * s->order[i];
+    build_lit(&s->c14n, " ");
+    stream_qname(s, attr[1], attr[0]);
+    build_lit(&s->c14n, "=\"");
+    build_escaped_len(&s->c14n, (char*)attr[3], attr[4] - attr[3], 1);
+    build_lit(&s->c14n, "\"");
+  }
+  build_lit(&s->c14n, ">");
+  for (int i = 0; i < s->scratch.len; i++) {
+    stream_ns_push(s, &s->rendered, ns[i].prefix, ns[i].uri);
+  }
+}
+
+
+static int stream_is(stream_t* s, int depth, const char* uri, const char* name) {
+  return depth >= 1 && xmlStrEqual(s->path[depth].name, (xmlChar*)name) && xmlStrEqual(s->path[depth].uri, (xmlChar*)uri);
+}
+
+
+// The first attribute named name, in any namespace as xmlGetProp finds it, or in none as XPath does
+static const xmlChar** stream_attr(const xmlChar* name, int any_ns, int nb_attributes, const xmlChar** attributes) {
+  for (int i = 0; i < nb_attributes; i++) {
+    if (xmlStrEqual(attributes[5 * i], name) && (any_ns || attributes[5 * i + 2] == NULL)) {
+      return attributes + 5 * i;
+    }
+  }
+  return NULL;
+}
+
+
+static xmlChar* stream_attr_dup(const char* name, int any_ns, int nb_attributes, const xmlChar** attributes) {
+  const xmlChar** attr = stream_attr((xmlChar*)name, any_ns, nb_attributes, attributes);
+  return attr == NULL ? NULL : xmlStrndup(attr[3], attr[4] - attr[3]);
+}
+
+
+static void stream_text_start(stream_t* s, xmlChar** dst) {
+  s->text_depth = s->depth;
+  s->text_seen = 0;
+  s->text.len = 0;
+  s->text_dst = dst;
+}
+
+
+// Reads the summary fields as the saml_doc_* functions find them in a document
+static void stream_summary_start(stream_t* s, int nb_attributes, const xmlChar** attributes) {
+  saml_summary_t* summary = s->summary;
+  int d = s->depth;
+  const char* A = SAML_XMLNS_ASSERTION;
+  const char* P = SAML_XMLNS_PROTOCOL;
+
+  if (d == 1) {
+    if (s->opts->id_attr != NULL) {
+      summary->id = stream_attr_dup((char*)s->opts->id_attr, 1, nb_attributes, attributes);
+    }
+  } else if (d == 2 && !s->issuer_done && xmlStrEqual(s->path[d].name, (xmlChar*)"Issuer")) {
+    s->issuer_done = 1;
+    stream_text_start(s, &summary->issuer);
+  } else if (summary->status_code == NULL && stream_is(s, d, P, "StatusCode") && stream_is(s, d - 1, P, "Status")
+             && d >= 3 && xmlStrEqual(s->path[d - 2].uri, (xmlChar*)P)) {
+    summary->status_code = stream_attr_dup("Value", 0, nb_attributes, attributes);
+  } else if (!s->name_id_done && stream_is(s, d, A, "NameID") && stream_is(s, d - 1, A, "Subject")
+             && stream_is(s, d - 2, A, "Assertion") && stream_is(s, d - 3, P, "Response")) {
+    s->name_id_done = 1;
+    stream_text_start(s, &summary->name_id);
+  } else if (!s->session_index_done && stream_is(s, d, A, "AuthnStatement") && stream_is(s, d - 1, A, "Assertion")
+             && stream_is(s, d - 2, P, "Response") && xmlStrEqual(s->path[1].name, (xmlChar*)"Response")) {
+    summary->session_index = stream_attr_dup("SessionIndex", 0, nb_attributes, attributes);
+    s->session_index_done = summary->session_index != NULL;
+  } else if (!s->session_index_done && stream_is(s, d, P, "SessionIndex")
+             && xmlStrEqual(s->path[1].name, (xmlChar*)"LogoutRequest")) {
+    s->session_index_done = 1;
+    stream_text_start(s, &summary->session_index);
+  } else if (stream_is(s, d, A, "Attribute") && stream_is(s, d - 1, A, "AttributeStatement")
+             && stream_is(s, d - 2, A, "Assertion") && stream_is(s, d - 3, P, "Response")) {
+    if (summary->attrs_len % 16 == 0) {
+      saml_attr_t* attrs = realloc(summary->attrs, (summary->attrs_len + 16) * sizeof(saml_attr_t));
+      if (attrs == NULL) {
+        stream_stop(s, STREAM_ERROR);
+        return;
+      }
+      summary->attrs = attrs;
+    }
+    saml_attr_t* attr = summary->attrs + summary->attrs_len++;
+    attr->name = stream_attr_dup("Name", 1, nb_attributes, attributes);
+    attr->values = NULL;
+    attr->num_values = 0;
+    s->attr_depth = attr->name == NULL ? 0 : d;
+  } else if (s->attr_depth != 0 && d == s->attr_depth + 1) {
+    saml_attr_t* attr = summary->attrs + summary->attrs_len - 1;
+    xmlChar** values = realloc(attr->values, (attr->num_values + 1) * sizeof(xmlChar*));
+    if (values == NULL) {
+      stream_stop(s, STREAM_ERROR);
+      return;
+    }
+    attr->values = values;
+    attr->values[attr->num_values] = NULL;
+    stream_text_start(s, attr->values + attr->num_values++);
+  }
+}
+
+
+static void stream_summary_end(stream_t* s) {
+  if (s->text_depth == s->depth) {
+    *s->text_dst = s->text_seen ? xmlStrndup((xmlChar*)s->text.data, s->text.len) : NULL;
+    s->text_depth = 0;
+  }
+  if (s->attr_depth == s->depth) {
+    s->attr_depth = 0;
+  }
+}
+
+
+static int stream_visible(void* signed_info, xmlNode* node, xmlNode* parent) {
+  xmlNode* n = node == NULL || node->type == XML_NAMESPACE_DECL ? parent : node;
+  while (n != NULL && n != signed_info) {
+    n = n->parent;
+  }
+  return n != NULL;
+}
+
+
+// Decodes the base64 text of node, which may be broken into lines
+static int stream_base64(xmlNode* node, byte** out, int* out_len) {
+  xmlChar* text = xmlNodeGetContent(node);
+  if (text == NULL) {
+    return -1;
+  }
+  int len = 0;
+  for (xmlChar* c = text; *c != '\0'; c++) {
+    if (*c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') {
+      text[len++] = *c;
+    }
+  }
+  int res = saml_base64_decode((char*)text, len, out, out_len);
+  xmlFree(text);
+  return res;
+}
+
+
+// An element with no element children and the given Algorithm
+static int stream_method(xmlNode* node, const xmlChar* name, const xmlChar* href) {
+  if (!xmlSecCheckNodeName(node, name, xmlSecDSigNs) || xmlSecGetNextElementNode(node->children) != NULL) {
+    return 0;
+  }
+  xmlChar* alg = xmlGetProp(node, xmlSecAttrAlgorithm);
+  int res = xmlStrEqual(alg, href);
+  xmlFree(alg);
+  return res;
+}
+
+
+static xmlSecTransformId stream_method_id(xmlNode* node, const xmlChar* name, xmlSecTransformUsage usage) {
+  if (!xmlSecCheckNodeName(node, name, xmlSecDSigNs) || xmlSecGetNextElementNode(node->children) != NULL) {
+    return NULL;
+  }
+  xmlChar* alg = xmlGetProp(node, xmlSecAttrAlgorithm);
+  xmlSecTransformId id = alg == NULL ? NULL : saml_find_transform((char*)alg);
+  xmlFree(alg);
+  return id != NULL && (id->usage & usage) ? id : NULL;
+}
+
+
+// The key xmlsec would choose, from KeyInfo or else the keys manager
+static xmlSecKey* stream_key(stream_t* s, xmlNode* key_info) {
+  xmlSecKeyInfoCtx ctx;
+  if (xmlSecKeyInfoCtxInitialize(&ctx, s->mngr) < 0) {
+    return NULL;
+  }
+  ctx.mode = xmlSecKeyInfoModeRead;
+
+  xmlSecKey* key = NULL;
+  xmlSecTransform* method = xmlSecTransformCreate(s->transform_id);
+  if (method != NULL) {
+    method->operation = xmlSecTransformOperationVerify;
+    if (xmlSecTransformSetKeyReq(method, &ctx.keyReq) == 0 && s->mngr->getKey != NULL) {
+      key = s->mngr->getKey(key_info, &ctx);
+    }
+    xmlSecTransformDestroy(method);
+  }
+  if (key != NULL && !xmlSecKeyMatch(key, NULL, &ctx.keyReq)) {
+    xmlSecKeyDestroy(key);
+    key = NULL;
+  }
+  xmlSecKeyInfoCtxFinalize(&ctx);
+  return key;
+}
+
+
+// Reads the Signature once it has been built, and starts digesting the root
+static stream_status_t stream_signature(stream_t* s, xmlNode* sig) {
+  xmlNode* signed_info = xmlSecGetNextElementNode(sig->children);
+  if (!xmlSecCheckNodeName(signed_info, xmlSecNodeSignedInfo, xmlSecDSigNs)) {
+    return STREAM_FALLBACK;
+  }
+  xmlNode* node = xmlSecGetNextElementNode(signed_info->children);
+  if (!stream_method(node, xmlSecNodeCanonicalizationMethod, xmlSecTransformExclC14NId->href)) {
+    return STREAM_FALLBACK;
+  }
+  node = xmlSecGetNextElementNode(node->next);
+  s->transform_id = stream_method_id(node, xmlSecNodeSignatureMethod, xmlSecTransformUsageSignatureMethod);
+  xmlNode* ref = s->transform_id == NULL ? NULL : xmlSecGetNextElementNode(node->next);
+  if (!xmlSecCheckNodeName(ref, xmlSecNodeReference, xmlSecDSigNs) || xmlSecGetNextElementNode(ref->next) != NULL) {
+    return STREAM_FALLBACK;
+  }
+
+  // The reference must be to the whole document, or to the root by the ID saml_verify_doc registers
+  xmlChar* uri = xmlGetProp(ref, xmlSecAttrURI);
+  s->whole_doc = uri == NULL || uri[0] == '\0';
+  int to_root = s->whole_doc || (uri[0] == '#' && s->opts->id_attr != NULL && s->summary->id != NULL && s->summary->id[0] != '\0'
+                                 && xmlStrEqual(uri + 1, s->summary->id));
+  xmlFree(uri);
+  if (!to_root) {
+    return STREAM_FALLBACK;
+  }
+
+  node = xmlSecGetNextElementNode(ref->children);
+  xmlNode* transform = xmlSecCheckNodeName(node, xmlSecNodeTransforms, xmlSecDSigNs) ? xmlSecGetNextElementNode(node->children) : NULL;
+  if (!stream_method(transform, xmlSecNodeTransform, xmlSecTransformEnvelopedId->href)) {
+    return STREAM_FALLBACK;
+  }
+  transform = xmlSecGetNextElementNode(transform->next);
+  if (!stream_method(transform, xmlSecNodeTransform, xmlSecTransformExclC14NId->href)
+      || xmlSecGetNextElementNode(transform->next) != NULL) {
+    return STREAM_FALLBACK;
+  }
+  node = xmlSecGetNextElementNode(node->next);
+  const EVP_MD* md = build_md(stream_method_id(node, xmlSecNodeDigestMethod, xmlSecTransformUsageDigestMethod));
+  node = md == NULL ? NULL : xmlSecGetNextElementNode(node->next);
+  if (!xmlSecCheckNodeName(node, xmlSecNodeDigestValue, xmlSecDSigNs) || xmlSecGetNextElementNode(node->next) != NULL
+      || stream_base64(node, &s->digest, &s->digest_len) < 0) {
+    return STREAM_FALLBACK;
+  }
+
+  node = xmlSecGetNextElementNode(signed_info->next);
+  if (!xmlSecCheckNodeName(node, xmlSecNodeSignatureValue, xmlSecDSigNs) || stream_base64(node, &s->sig, &s->sig_len) < 0) {
+    return STREAM_FALLBACK;
+  }
+  node = xmlSecGetNextElementNode(node->next);
+  s->key = stream_key(s, xmlSecCheckNodeName(node, xmlSecNodeKeyInfo, xmlSecDSigNs) ? node : NULL);
+
+  xmlOutputBuffer* buf = xmlAllocOutputBuffer(NULL);
+  if (buf == NULL || xmlC14NExecute(sig->doc, stream_visible, signed_info, XML_C14N_EXCLUSIVE_1_0, NULL, 0, buf) < 0) {
+    xmlOutputBufferClose(buf);
+    saml_log("canonicalize SignedInfo failed");
+    return STREAM_ERROR;
+  }
+  str_init(&s->signed_info, xmlBufUse(buf->buffer) + 1);
+  str_cat(&s->signed_info, (char*)xmlBufContent(buf->buffer), xmlBufUse(buf->buffer));
+  xmlOutputBufferClose(buf);
+
+  s->md_ctx = EVP_MD_CTX_new();
+  if (s->md_ctx == NULL || EVP_DigestInit_ex(s->md_ctx, md, NULL) != 1
+      || EVP_DigestUpdate(s->md_ctx, s->head.data, s->head.len) != 1) {
+    saml_log("digest init failed");
+    return STREAM_ERROR;
+  }
+  s->c14n.out = NULL;
+  s->c14n.md = s->md_ctx;
+  return STREAM_OK;
+}
+
+
+static void stream_start_document(void* ctx) {
+  stream_t* s = (stream_t*)ctx;
+  xmlSAX2StartDocument(s->parser);
+}
+
+
+static void stream_end_document(void* ctx) {
+  stream_t* s = (stream_t*)ctx;
+  xmlSAX2EndDocument(s->parser);
+}
+
+
+static void stream_internal_subset(void* ctx, const xmlChar* name, const xmlChar* external_id, const xmlChar* system_id) {
+  stream_stop((stream_t*)ctx, STREAM_FALLBACK);
+}
+
+
+static void stream_start_element(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* uri,
+                                 int nb_namespaces, const xmlChar** namespaces,
+                                 int nb_attributes, int nb_defaulted, const xmlChar** attributes) {
+  stream_t* s = (stream_t*)ctx;
+  s->depth++;
+  if (stream_grow((void**)&s->path, &s->path_total, s->depth, sizeof(stream_el_t)) < 0) {
+    stream_stop(s, STREAM_ERROR);
+    return;
+  }
+  s->path[s->depth].name = localname;
+  s->path[s->depth].uri = uri;
+  for (int i = 0; i < nb_namespaces && s->status == STREAM_OK; i++) {
+    if (stream_ns_relative(namespaces[2 * i + 1])) {
+      stream_stop(s, STREAM_FALLBACK);
+    } else {
+      stream_ns_push(s, &s->declared, namespaces[2 * i], namespaces[2 * i + 1]);
+    }
+  }
+  if (s->status != STREAM_OK) {
+    return;
+  }
+
+  // libxml2 registers xml:id attributes as IDs, which could make the Reference resolve to another element
+  if (stream_attr((xmlChar*)"id", 1, nb_attributes, attributes) != NULL) {
+    for (int i = 0; i < nb_attributes; i++) {
+      if (xmlStrEqual(attributes[5 * i], (xmlChar*)"id") && xmlStrEqual(attributes[5 * i + 1], (xmlChar*)"xml")) {
+        stream_stop(s, STREAM_FALLBACK);
+        return;
+      }
+    }
+  }
+
+  if (s->sig_depth > 0) {
+    xmlSAX2StartElementNs(s->parser, localname, prefix, uri, nb_namespaces, namespaces, nb_attributes, nb_defaulted, attributes);
+    return;
+  }
+
+  if (s->sig_depth < 0 && s->depth >= 2 && xmlStrEqual(localname, xmlSecNodeSignature) && xmlStrEqual(uri, xmlSecDSigNs)) {
+    // The Signature becomes the root of the parser's document, declaring every namespace in scope
+    int len = 0;
+    if (stream_grow((void**)&s->sig_ns, &s->sig_ns_total, 2 * s->declared.len, sizeof(xmlChar*)) < 0) {
+      stream_stop(s, STREAM_ERROR);
+      return;
+    }
+    for (int i = s->declared.len - 1; i >= 0; i--) {
+      int j = 0;
+      for (; j < len && !xmlStrEqual(s->sig_ns[2 * j], s->declared.items[i].prefix); j++);
+      if (j == len) {
+        s->sig_ns[2 * len] = s->declared.items[i].prefix;
+        s->sig_ns[2 * len++ + 1] = s->declared.items[i].uri;
+      }
+    }
+    s->sig_depth = s->depth;
+    xmlSAX2StartElementNs(s->parser, localname, prefix, uri, len, s->sig_ns, nb_attributes, nb_defaulted, attributes);
+    return;
+  }
+
+  stream_c14n_start(s, localname, prefix, uri, nb_attributes, attributes);
+  if (s->status == STREAM_OK) {
+    stream_summary_start(s, nb_attributes, attributes);
+  }
+}
+
+
+static void stream_end_element(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* uri) {
+  stream_t* s = (stream_t*)ctx;
+  if (s->status == STREAM_OK) {
+    if (s->sig_depth > 0) {
+      xmlSAX2EndElementNs(s->parser, localname, prefix, uri);
+      if (s->depth == s->sig_depth) {
+        s->sig_depth = 0;
+        stream_status_t status = stream_signature(s, xmlDocGetRootElement(s->parser->myDoc));
+        if (status != STREAM_OK) {
+          stream_stop(s, status);
+        }
+      }
+    } else {
+      build_lit(&s->c14n, "</");
+      stream_qname(s, prefix, localname);
+      build_lit(&s->c14n, ">");
+      stream_summary_end(s);
+    }
+  }
+  stream_ns_pop(&s->declared, s->depth);
+  stream_ns_pop(&s->rendered, s->depth);
+  s->depth--;
+}
+
+
+static void stream_characters(void* ctx, const xmlChar* ch, int len) {
+  stream_t* s = (stream_t*)ctx;
+  if (s->status != STREAM_OK || s->depth == 0) {
+    return;
+  }
+  if (s->sig_depth > 0) {
+    xmlSAX2Characters(s->parser, ch, len);
+    return;
+  }
+  build_escaped_len(&s->c14n, (char*)ch, len, 0);
+  if (s->text_depth == s->depth) {
+    str_cat(&s->text, (char*)ch, len);
+    s->text_seen = 1;
+  }
+}
+
+
+static void stream_processing_instruction(void* ctx, const xmlChar* target, const xmlChar* data) {
+  stream_t* s = (stream_t*)ctx;
+  if (s->status != STREAM_OK) {
+    return;
+  }
+  if (s->depth == 0) {
+    s->top_level_pi = 1;
+  } else if (s->sig_depth > 0) {
+    xmlSAX2ProcessingInstruction(s->parser, target, data);
+  } else {
+    build_lit(&s->c14n, "<?");
+    build_str(&s->c14n, (char*)target);
+    if (data != NULL && data[0] != '\0') {
+      build_lit(&s->c14n, " ");
+      build_str(&s->c14n, (char*)data);
+    }
+    build_lit(&s->c14n, "?>");
+  }
+}
+
+
+// Returns as saml_verify_doc, or 2 if the document is outside the profile.  Comments are left out of the
+// canonical form, so they are not handled at all.
+static int stream_verify(stream_t* s, const char* xml, int xml_len) {
+  xmlSAXHandler sax;
+  memset(&sax, 0, sizeof(xmlSAXHandler));
+  sax.initialized = XML_SAX2_MAGIC;
+  sax.startDocument = stream_start_document;
+  sax.endDocument = stream_end_document;
+  sax.internalSubset = stream_internal_subset;
+  sax.startElementNs = stream_start_element;
+  sax.endElementNs = stream_end_element;
+  sax.characters = stream_characters;
+  sax.ignorableWhitespace = stream_characters;
+  sax.cdataBlock = stream_characters;
+  sax.processingInstruction = stream_processing_instruction;
+
+  // Without a DTD, only the predefined entities and character references are substituted
+  s->parser = xmlCreatePushParserCtxt(&sax, s, NULL, 0, "tmp.xml");
+  if (s->parser == NULL || xmlCtxtUseOptions(s->parser, XML_PARSE_NOENT | XML_PARSE_NONET) != 0) {
+    saml_log("create parser failed");
+    return -1;
+  }
+  xmlParseChunk(s->parser, xml, xml_len, 1);
+
+  if (s->status == STREAM_OK && !s->parser->nsWellFormed) {
+    s->status = STREAM_FALLBACK;
+  }
+  if (s->status == STREAM_OK && s->whole_doc && s->top_level_pi) {
+    s->status = STREAM_FALLBACK;
+  }
+  if (s->status != STREAM_OK) {
+    return s->status == STREAM_ERROR ? -1 : 2;
+  }
+  if (!s->parser->wellFormed || s->sig_depth != 0) {
+    return 1;
+  }
+
+  if (s->key == NULL) {
+    saml_log("signature verify failed");
+    return -1;
+  }
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  if (s->c14n.error || EVP_DigestFinal_ex(s->md_ctx, digest, &digest_len) != 1) {
+    saml_log("digest failed");
+    return -1;
+  }
+  if (digest_len != s->digest_len || memcmp(digest, s->digest, digest_len) != 0) {
+    return 1;
+  }
+  return saml_verify_binary(s->key, s->transform_id, (unsigned char*)s->signed_info.data, s->signed_info.len, s->sig, s->sig_len);
+}
+
+
+static void stream_free(stream_t* s) {
+  if (s->parser != NULL) {
+    xmlFreeDoc(s->parser->myDoc);
+    xmlFreeParserCtxt(s->parser);
+  }
+  free(s->path);
+  free(s->declared.items);
+  free(s->rendered.items);
+  free(s->scratch.items);
+  free(s->order);
+  free(s->sig_ns);
+  str_free(&s->head);
+  str_free(&s->text);
+  EVP_MD_CTX_free(s->md_ctx);
+  free(s->digest);
+  free(s->sig);
+  str_free(&s->signed_info);
+  if (s->key != NULL) {
+    xmlSecKeyDestroy(s->key);
+  }
+}
+
+
+static void summary_from_doc(xmlDoc* doc, saml_doc_opts_t* opts, saml_summary_t* summary) {
+  xmlNode* root = xmlDocGetRootElement(doc);
+  summary->id = opts->id_attr == NULL ? NULL : xmlGetProp(root, opts->id_attr);
+  summary->issuer = saml_doc_issuer(doc);
+  summary->name_id = saml_doc_name_id(doc);
+  summary->status_code = saml_doc_status_code(doc);
+  summary->session_index = saml_doc_session_index(doc);
+  if (saml_doc_attrs(doc, &summary->attrs, &summary->attrs_len) < 0) {
+    summary->attrs = NULL;
+    summary->attrs_len = 0;
+  }
+}
+
+
+int saml_verify_xml(xmlSecKeysMngr* mngr, const char* xml, size_t xml_len, saml_doc_opts_t* opts, saml_summary_t* summary) {
+  saml_summary_t tmp;
+  saml_summary_t* sum = summary != NULL ? summary : &tmp;
+  memset(sum, 0, sizeof(saml_summary_t));
+  if (xml_len > INT_MAX) {
+    return 1;
+  }
+
+  stream_t s;
+  memset(&s, 0, sizeof(stream_t));
+  s.mngr = mngr;
+  s.opts = opts;
+  s.status = STREAM_OK;
+  s.sig_depth = -1;
+  s.summary = sum;
+  str_init(&s.head, 4096);
+  str_init(&s.text, 256);
+  s.c14n.out = &s.head;
+
+  uint64_t start = stats_start();
+  int res = stream_verify(&s, xml, xml_len);
+  stream_free(&s);
+  if (res != 2) {
+    stats_record(SAML_STAGE_VERIFY_DOC, start, xml_len);
+    sum->streamed = 1;
+    if (res != 0 || summary == NULL) {
+      saml_summary_free(sum);
+    }
+    return res;
+  }
+
+  saml_summary_free(sum);
+  start = stats_start();
+  xmlDoc* doc = xmlReadMemory(xml, xml_len, "tmp.xml", NULL, 0);
+  stats_record(SAML_STAGE_XML_PARSE, start, xml_len);
+  if (doc == NULL) {
+    return 1;
+  }
+  res = saml_verify_doc(mngr, doc, opts);
+  if (res == 0 && summary != NULL) {
+    summary_from_doc(doc, opts, summary);
+  }
+  xmlFreeDoc(doc);
+  return res;
+}
+
+
+void saml_summary_free(saml_summary_t* summary) {
+  xmlFree(summary->id);
+  xmlFree(summary->issuer);
+  xmlFree(summary->name_id);
+  xmlFree(summary->status_code);
+  xmlFree(summary->session_index);
+  saml_attrs_free(summary->attrs, summary->attrs_len);
+  int streamed = summary->streamed;
+  memset(summary, 0, sizeof(saml_summary_t));
+  summary->streamed = streamed;
+}
@@ -0,0 +1,829 @@
+// A trust store maps issuer entity IDs to the keys that may sign for them, so finding an issuer's keys is one
+// hash lookup rather than a search through every key.  xmlsec picks the first key in a manager that fits the
+// signature and does not try the others, so each key gets a manager of its own, and the KeyInfo of a signature
+// is used to pick the one key to verify with; see trust_select.
+//
+// Entries are never changed once they are in the table: adding a key replaces the issuer's entry with a new
+// one, and an entry that is being verified with lives on until its last user releases it, so the lock is only
+// held to look it up.
+//
+// A store can also be compiled to a file with saml_trust_write and opened with saml_trust_open, which maps it
+// rather than reading it.  Pages of the file are shared by every process that maps it, including the nginx
+// workers forked after the master opened it, and an issuer's certificates are only parsed into keys the first
+// time one of its documents is verified in a process.  The file is in the host's byte order; it is a cache of
+// the federation metadata for the machine it was written on, not a format to exchange.
+
+#define TRUST_BUCKETS_MIN 16
+
+// trust_select results other than a key's index
+#define TRUST_ALL  -1
+#define TRUST_NONE -2
+
+#define TRUST_MAGIC "samltrs1"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#  define ASN1_STRING_get0_data ASN1_STRING_data
+#endif
+
+// What a KeyInfo can name a trusted key by.  The certificate and subject key identifier are digested as the
+// base64 a KeyInfo carries them in, so a document's are matched without decoding or parsing them.
+typedef struct {
+  xmlSecKeysMngr* mngr;       // holds only this key, and owns it
+  int has_cert;
+  unsigned char cert_digest[SHA256_DIGEST_LENGTH];
+  int has_ski;
+  unsigned char ski_digest[SHA256_DIGEST_LENGTH];
+} trust_key_t;
+
+typedef struct trust_entry {
+  char* issuer;
+  uint32_t hash;
+  int refs;                   // one for the table, one for each verification using it
+  xmlSecKey** keys;           // in the order they were added
+  trust_key_t* key_infos;     // key_infos[i] is about keys[i]
+  size_t keys_len;            // 0 for an issuer removed from a store that has a file
+  int from_file;              // read from the file, so dropped when it is reloaded
+  struct trust_entry* chain;
+} trust_entry_t;
+
+// A compiled file is this header, then its records sorted by hash and issuer, then the issuers and DER
+// certificates the records point into.  An issuer with several keys has a record for each, in the order they
+// were added.
+typedef struct {
+  char magic[8];
+  uint32_t records_len;
+  uint32_t reserved;
+} trust_header_t;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t issuer_off;
+  uint32_t issuer_len;
+  uint32_t cert_off;
+  uint32_t cert_len;
+} trust_record_t;
+
+struct saml_trust {
+  pthread_mutex_t lock;
+  int refs;
+  trust_entry_t** buckets;
+  uint32_t mask;
+  size_t entries_len;
+  char* path;                 // the file it was opened from, if any
+  unsigned char* map;         // that file, mapped read-only
+  size_t map_len;
+  const trust_record_t* records;
+  uint32_t records_len;
+};
+
+
+saml_trust_t* saml_trust_create() {
+  saml_trust_t* trust = calloc(1, sizeof(saml_trust_t));
+  trust_entry_t** buckets = calloc(TRUST_BUCKETS_MIN, sizeof(trust_entry_t*));
+  if (trust == NULL || buckets == NULL) {
+    free(trust);
+    free(buckets);
+    saml_log("could not allocate trust store");
+    return NULL;
+  }
+
+  pthread_mutex_init(&trust->lock, NULL);
+  trust->refs = 1;
+  trust->buckets = buckets;
+  trust->mask = TRUST_BUCKETS_MIN - 1;
+  return trust;
+}
+
+
+saml_trust_t* saml_trust_ref(saml_trust_t* trust) {
+  pthread_mutex_lock(&trust->lock);
+  trust->refs++;
+  pthread_mutex_unlock(&trust->lock);
+  return trust;
+}
+
+
+static void trust_entry_free(trust_entry_t* entry) {
+  for (size_t i = 0; i < entry->keys_len; i++) {
+    evp_key_retire(entry->keys[i]);
+    xmlSecKeysMngrDestroy(entry->key_infos[i].mngr);
+  }
+  free(entry->key_infos);
+  free(entry->keys);
+  free(entry->issuer);
+  free(entry);
+}
+
+
+// Drops a reference to the entry, which must not be in the table any more if it is the last one
+static void trust_entry_unref(saml_trust_t* trust, trust_entry_t* entry) {
+  pthread_mutex_lock(&trust->lock);
+  int refs = --entry->refs;
+  pthread_mutex_unlock(&trust->lock);
+  if (refs == 0) {
+    trust_entry_free(entry);
+  }
+}
+
+
+void saml_trust_free(saml_trust_t* trust) {
+  if (trust == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&trust->lock);
+  int refs = --trust->refs;
+  pthread_mutex_unlock(&trust->lock);
+  if (refs > 0) {
+    return;
+  }
+
+  // That was the last reference, so no verification can be using an entry now
+  for (uint32_t i = 0; i <= trust->mask; i++) {
+    trust_entry_t* entry = trust->buckets[i];
+    while (entry != NULL) {
+      trust_entry_t* chain = entry->chain;
+      trust_entry_free(entry);
+      entry = chain;
+    }
+  }
+  free(trust->buckets);
+  if (trust->map != NULL) {
+    munmap(trust->map, trust->map_len);
+  }
+  free(trust->path);
+  pthread_mutex_destroy(&trust->lock);
+  free(trust);
+}
+
+
+// Returns the link that points to the issuer's entry, or the NULL at the end of its bucket
+static trust_entry_t** trust_find(saml_trust_t* trust, const char* issuer, uint32_t hash) {
+  trust_entry_t** link = trust->buckets + (hash & trust->mask);
+  while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->issuer, issuer) != 0)) {
+    link = &(*link)->chain;
+  }
+  return link;
+}
+
+
+// Doubles the buckets once there are more issuers than buckets.  Failing to grow only makes the chains longer.
+static void trust_grow(saml_trust_t* trust) {
+  if (trust->entries_len <= trust->mask) {
+    return;
+  }
+
+  uint32_t mask = 2 * trust->mask + 1;
+  trust_entry_t** buckets = calloc((size_t)mask + 1, sizeof(trust_entry_t*));
+  if (buckets == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i <= trust->mask; i++) {
+    trust_entry_t* entry = trust->buckets[i];
+    while (entry != NULL) {
+      trust_entry_t* chain = entry->chain;
+      entry->chain = buckets[entry->hash & mask];
+      buckets[entry->hash & mask] = entry;
+      entry = chain;
+    }
+  }
+  free(trust->buckets);
+  trust->buckets = buckets;
+  trust->mask = mask;
+}
+
+
+static xmlSecKeysMngr* trust_mngr_create(xmlSecKey* key) {
+  xmlSecKeysMngr* mngr = xmlSecKeysMngrCreate();
+  if (mngr == NULL || xmlSecCryptoAppDefaultKeysMngrInit(mngr) < 0) {
+    if (mngr != NULL) {
+      xmlSecKeysMngrDestroy(mngr);
+    }
+    saml_log("initialize keys manager failed");
+    return NULL;
+  }
+
+  xmlSecKey* copy = xmlSecKeyDuplicate(key); // the manager owns it
+  if (copy == NULL || xmlSecCryptoAppDefaultKeysMngrAdoptKey(mngr, copy) < 0) {
+    if (copy != NULL) {
+      xmlSecKeyDestroy(copy);
+    }
+    xmlSecKeysMngrDestroy(mngr);
+    saml_log("adopt key failed");
+    return NULL;
+  }
+  return mngr;
+}
+
+
+// SHA-256 of the base64 of data, as a KeyInfo would have it without line breaks
+static int trust_digest(const unsigned char* data, int data_len, unsigned char* digest) {
+  char* encoded = base64_encode(data, data_len);
+  if (encoded == NULL) {
+    return -1;
+  }
+  SHA256((unsigned char*)encoded, strlen(encoded), digest);
+  free(encoded);
+  return 0;
+}
+
+
+static X509* trust_key_cert(xmlSecKey* key) {
+  // A key read from a certificate has it as its only one, not as the key certificate
+  xmlSecKeyData* data = xmlSecKeyGetData(key, xmlSecOpenSSLKeyDataX509Id);
+  X509* cert = data == NULL ? NULL : xmlSecOpenSSLKeyDataX509GetKeyCert(data);
+  if (cert == NULL && data != NULL && xmlSecOpenSSLKeyDataX509GetCertsSize(data) > 0) {
+    cert = xmlSecOpenSSLKeyDataX509GetCert(data, 0);
+  }
+  return cert;
+}
+
+
+static void trust_key_ids(xmlSecKey* key, trust_key_t* key_info) {
+  X509* cert = trust_key_cert(key);
+  if (cert == NULL) {
+    return; // a bare public key can only be tried
+  }
+
+  unsigned char* der = NULL;
+  int der_len = i2d_X509(cert, &der);
+  if (der_len > 0) {
+    key_info->has_cert = trust_digest(der, der_len, key_info->cert_digest) == 0;
+    OPENSSL_free(der);
+  }
+
+  ASN1_OCTET_STRING* ski = X509_get_ext_d2i(cert, NID_subject_key_identifier, NULL, NULL);
+  if (ski != NULL) {
+    key_info->has_ski = trust_digest(ASN1_STRING_get0_data(ski), ASN1_STRING_length(ski), key_info->ski_digest) == 0;
+    ASN1_OCTET_STRING_free(ski);
+  }
+  ERR_clear_error();
+}
+
+
+// Copies of the keys of prev, if any, and then key, if any
+static trust_entry_t* trust_entry_create(const char* issuer, uint32_t hash, trust_entry_t* prev, xmlSecKey* key) {
+  size_t keys_len = (prev != NULL ? prev->keys_len : 0) + (key != NULL ? 1 : 0);
+  size_t issuer_len = strlen(issuer);
+  trust_entry_t* entry = calloc(1, sizeof(trust_entry_t));
+  if (entry == NULL || (entry->issuer = malloc(issuer_len + 1)) == NULL
+      || (keys_len > 0 && ((entry->keys = malloc(keys_len * sizeof(xmlSecKey*))) == NULL
+                           || (entry->key_infos = calloc(keys_len, sizeof(trust_key_t))) == NULL))) {
+    if (entry != NULL) {
+      trust_entry_free(entry);
+    }
+    saml_log("could not allocate trust store entry");
+    return NULL;
+  }
+  memcpy(entry->issuer, issuer, issuer_len + 1);
+  entry->hash = hash;
+  entry->refs = 1;
+
+  for (size_t i = 0; i < keys_len; i++) {
+    xmlSecKeysMngr* mngr = trust_mngr_create(prev != NULL && i < prev->keys_len ? prev->keys[i] : key);
+    if (mngr == NULL) {
+      trust_entry_free(entry);
+      return NULL;
+    }
+    xmlSecPtrList* keys = xmlSecSimpleKeysStoreGetKeys(xmlSecKeysMngrGetKeysStore(mngr));
+    entry->keys[i] = (xmlSecKey*)xmlSecPtrListGetItem(keys, 0);
+    entry->key_infos[i].mngr = mngr;
+    entry->keys_len++;
+    trust_key_ids(entry->keys[i], entry->key_infos + i);
+  }
+  return entry;
+}
+
+
+// The file's records for the issuer, if it has any
+static const trust_record_t* trust_records(saml_trust_t* trust, const char* issuer, uint32_t hash, size_t* records_len) {
+  size_t lo = 0, hi = trust->records_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (trust->records[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  size_t issuer_len = strlen(issuer);
+  const trust_record_t* first = NULL;
+  *records_len = 0;
+  for (size_t i = lo; i < trust->records_len && trust->records[i].hash == hash; i++) {
+    const trust_record_t* record = trust->records + i;
+    int match = record->issuer_len == issuer_len && memcmp(trust->map + record->issuer_off, issuer, issuer_len) == 0;
+    if (match) {
+      first = first != NULL ? first : record;
+      (*records_len)++;
+    } else if (first != NULL) {
+      break;
+    }
+  }
+  return first;
+}
+
+
+// Parses the issuer's certificates from the file into a new entry, or returns NULL if it has none there
+static trust_entry_t* trust_entry_read(saml_trust_t* trust, const char* issuer, uint32_t hash) {
+  size_t records_len;
+  const trust_record_t* records = trust_records(trust, issuer, hash, &records_len);
+  trust_entry_t* entry = NULL;
+  for (size_t i = 0; i < records_len; i++) {
+    xmlSecKey* key = xmlSecCryptoAppKeyLoadMemory(trust->map + records[i].cert_off, records[i].cert_len, xmlSecKeyDataFormatCertDer, NULL, NULL, NULL);
+    if (key == NULL) {
+      saml_log("could not read certificate from trust store file");
+      continue;
+    }
+    trust_entry_t* next = trust_entry_create(issuer, hash, entry, key);
+    xmlSecKeyDestroy(key);
+    if (next == NULL) {
+      continue;
+    }
+    if (entry != NULL) {
+      trust_entry_free(entry);
+    }
+    entry = next;
+  }
+  if (entry != NULL) {
+    entry->from_file = 1;
+  }
+  return entry;
+}
+
+
+// As trust_find, but an issuer that is only in the file gets its entry read first.  That happens with the lock
+// held, so the file stays mapped while it is read; it is once per issuer and process.
+static trust_entry_t** trust_lookup(saml_trust_t* trust, const char* issuer, uint32_t hash) {
+  trust_entry_t** link = trust_find(trust, issuer, hash);
+  if (*link != NULL || trust->records_len == 0) {
+    return link;
+  }
+
+  trust_entry_t* entry = trust_entry_read(trust, issuer, hash);
+  if (entry == NULL) {
+    return link;
+  }
+  *link = entry;
+  trust->entries_len++;
+  trust_grow(trust);
+  return trust_find(trust, issuer, hash);
+}
+
+
+int saml_trust_add(saml_trust_t* trust, const char* issuer, xmlSecKey* key) {
+  uint32_t hash = href_hash((const xmlChar*)issuer);
+  pthread_mutex_lock(&trust->lock);
+  trust_entry_t** link = trust_lookup(trust, issuer, hash);
+  trust_entry_t* prev = *link;
+  trust_entry_t* entry = trust_entry_create(issuer, hash, prev, key);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&trust->lock);
+    return -1;
+  }
+
+  if (prev != NULL) {
+    entry->chain = prev->chain;
+    *link = entry;
+  } else {
+    entry->chain = *link;
+    *link = entry;
+    trust->entries_len++;
+    trust_grow(trust);
+  }
+  pthread_mutex_unlock(&trust->lock);
+
+  if (prev != NULL) {
+    trust_entry_unref(trust, prev);
+  }
+  return 0;
+}
+
+
+// Drops every key of the issuer.  Returns 1 if it had none.  With a file, an empty entry is left in place so
+// that the issuer's keys are not read from it again.
+int saml_trust_remove(saml_trust_t* trust, const char* issuer) {
+  uint32_t hash = href_hash((const xmlChar*)issuer);
+  pthread_mutex_lock(&trust->lock);
+  trust_entry_t** link = trust_lookup(trust, issuer, hash);
+  trust_entry_t* entry = *link;
+  if (entry == NULL || entry->keys_len == 0) {
+    pthread_mutex_unlock(&trust->lock);
+    return 1;
+  }
+
+  trust_entry_t* empty = trust->records_len > 0 ? trust_entry_create(issuer, hash, NULL, NULL) : NULL;
+  if (empty != NULL) {
+    empty->chain = entry->chain;
+    *link = empty;
+  } else {
+    *link = entry->chain;
+    trust->entries_len--;
+  }
+  pthread_mutex_unlock(&trust->lock);
+
+  trust_entry_unref(trust, entry);
+  return 0;
+}
+
+
+// Maps a compiled file and checks that everything its records point to is in it
+static int trust_map(const char* path, unsigned char** map, size_t* map_len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    saml_log("could not open trust store file");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(trust_header_t) || (uint64_t)st.st_size > UINT32_MAX) {
+    close(fd);
+    saml_log("invalid trust store file");
+    return -1;
+  }
+  *map_len = st.st_size;
+  *map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (*map == MAP_FAILED) {
+    saml_log("could not map trust store file");
+    return -1;
+  }
+
+  const trust_header_t* header = (const trust_header_t*)*map;
+  const trust_record_t* records = (const trust_record_t*)(*map + sizeof(trust_header_t));
+  int valid = memcmp(header->magic, TRUST_MAGIC, sizeof(header->magic)) == 0
+    && header->records_len <= (*map_len - sizeof(trust_header_t)) / sizeof(trust_record_t);
+  for (uint32_t i = 0; valid && i < header->records_len; i++) {
+    valid = (uint64_t)records[i].issuer_off + records[i].issuer_len <= *map_len
+      && (uint64_t)records[i].cert_off + records[i].cert_len <= *map_len
+      && (i == 0 || records[i - 1].hash <= records[i].hash);
+  }
+  if (!valid) {
+    munmap(*map, *map_len);
+    saml_log("invalid trust store file");
+    return -1;
+  }
+  return 0;
+}
+
+
+// Opens a file written by saml_trust_write.  Keys added to or removed from the store afterwards are kept in
+// memory on top of the file.
+saml_trust_t* saml_trust_open(const char* path) {
+  saml_trust_t* trust = saml_trust_create();
+  if (trust == NULL) {
+    return NULL;
+  }
+  size_t path_len = strlen(path);
+  if ((trust->path = malloc(path_len + 1)) == NULL) {
+    saml_trust_free(trust);
+    saml_log("could not allocate trust store");
+    return NULL;
+  }
+  memcpy(trust->path, path, path_len + 1);
+
+  if (saml_trust_reload(trust) < 0) {
+    saml_trust_free(trust);
+    return NULL;
+  }
+  return trust;
+}
+
+
+// Maps the file again, e.g. after a new one has been renamed over it, and forgets the keys read from the old
+// one.  Verifications already using them finish with them.  An issuer changed with saml_trust_add or
+// saml_trust_remove keeps its keys, and a store is left as it was if the new file can't be mapped.
+int saml_trust_reload(saml_trust_t* trust) {
+  if (trust->path == NULL) {
+    saml_log("trust store has no file");
+    return -1;
+  }
+  unsigned char* map;
+  size_t map_len;
+  if (trust_map(trust->path, &map, &map_len) < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&trust->lock);
+  unsigned char* old_map = trust->map;
+  size_t old_map_len = trust->map_len;
+  trust->map = map;
+  trust->map_len = map_len;
+  trust->records = (const trust_record_t*)(map + sizeof(trust_header_t));
+  trust->records_len = ((const trust_header_t*)map)->records_len;
+
+  trust_entry_t* dropped = NULL;
+  for (uint32_t i = 0; i <= trust->mask; i++) {
+    trust_entry_t** link = trust->buckets + i;
+    while (*link != NULL) {
+      trust_entry_t* entry = *link;
+      if (entry->from_file) {
+        *link = entry->chain;
+        entry->chain = dropped;
+        dropped = entry;
+        trust->entries_len--;
+      } else {
+        link = &entry->chain;
+      }
+    }
+  }
+  pthread_mutex_unlock(&trust->lock);
+
+  if (old_map != NULL) {
+    munmap(old_map, old_map_len);
+  }
+  while (dropped != NULL) {
+    trust_entry_t* chain = dropped->chain;
+    trust_entry_unref(trust, dropped);
+    dropped = chain;
+  }
+  return 0;
+}
+
+
+typedef struct {
+  const char* issuer;
+  size_t issuer_len;
+  uint32_t hash;
+  const unsigned char* cert;
+  size_t cert_len;
+  unsigned char* der;         // owned copy of cert, if it was encoded from a key
+  size_t order;
+} trust_out_t;
+
+
+static int trust_out_cmp(const void* a, const void* b) {
+  const trust_out_t* x = a;
+  const trust_out_t* y = b;
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  size_t len = x->issuer_len < y->issuer_len ? x->issuer_len : y->issuer_len;
+  int cmp = memcmp(x->issuer, y->issuer, len);
+  if (cmp != 0 || x->issuer_len != y->issuer_len) {
+    return cmp != 0 ? cmp : (x->issuer_len < y->issuer_len ? -1 : 1);
+  }
+  return x->order < y->order ? -1 : 1;
+}
+
+
+// Collects the certificate of every key in the store, in memory and in its file.  Returns -1 for a key without
+// a certificate, which the file has no way to hold.
+static int trust_out_collect(saml_trust_t* trust, trust_out_t** outs, size_t* outs_len) {
+  size_t cap = trust->records_len;
+  for (uint32_t i = 0; i <= trust->mask; i++) {
+    for (trust_entry_t* entry = trust->buckets[i]; entry != NULL; entry = entry->chain) {
+      cap += entry->keys_len;
+    }
+  }
+  *outs = calloc(cap > 0 ? cap : 1, sizeof(trust_out_t));
+  *outs_len = 0;
+  if (*outs == NULL) {
+    saml_log("could not allocate trust store file");
+    return -1;
+  }
+
+  for (uint32_t i = 0; i <= trust->mask; i++) {
+    for (trust_entry_t* entry = trust->buckets[i]; entry != NULL; entry = entry->chain) {
+      for (size_t k = 0; k < entry->keys_len; k++) {
+        X509* cert = trust_key_cert(entry->keys[k]);
+        trust_out_t* out = *outs + *outs_len;
+        int der_len = cert == NULL ? -1 : i2d_X509(cert, &out->der);
+        if (der_len <= 0) {
+          saml_log("trusted key has no certificate to write");
+          return -1;
+        }
+        out->issuer = entry->issuer;
+        out->issuer_len = strlen(entry->issuer);
+        out->hash = entry->hash;
+        out->cert = out->der;
+        out->cert_len = der_len;
+        out->order = (*outs_len)++;
+      }
+    }
+  }
+
+  // Issuers that are in memory, even with no keys left, replace the file's
+  for (uint32_t i = 0; i < trust->records_len; i++) {
+    const trust_record_t* record = trust->records + i;
+    char* issuer = malloc(record->issuer_len + 1);
+    if (issuer == NULL) {
+      saml_log("could not allocate trust store file");
+      return -1;
+    }
+    memcpy(issuer, trust->map + record->issuer_off, record->issuer_len);
+    issuer[record->issuer_len] = '\0';
+    int in_memory = *trust_find(trust, issuer, record->hash) != NULL;
+    free(issuer);
+    if (in_memory) {
+      continue;
+    }
+    trust_out_t* out = *outs + *outs_len;
+    out->issuer = (const char*)trust->map + record->issuer_off;
+    out->issuer_len = record->issuer_len;
+    out->hash = record->hash;
+    out->cert = trust->map + record->cert_off;
+    out->cert_len = record->cert_len;
+    out->order = (*outs_len)++;
+  }
+  return 0;
+}
+
+
+static int trust_write_all(int fd, const void* data, size_t len) {
+  const char* p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+static int trust_out_write(int fd, trust_out_t* outs, size_t outs_len) {
+  trust_header_t header = {0};
+  memcpy(header.magic, TRUST_MAGIC, sizeof(header.magic));
+  header.records_len = outs_len;
+  if (trust_write_all(fd, &header, sizeof(header)) < 0) {
+    return -1;
+  }
+
+  uint64_t off = sizeof(trust_header_t) + outs_len * sizeof(trust_record_t);
+  for (size_t i = 0; i < outs_len; i++) {
+    trust_record_t record = {
+      .hash = outs[i].hash,
+      .issuer_off = off,
+      .issuer_len = outs[i].issuer_len,
+      .cert_off = off + outs[i].issuer_len,
+      .cert_len = outs[i].cert_len,
+    };
+    off += outs[i].issuer_len + outs[i].cert_len;
+    if (off > UINT32_MAX || trust_write_all(fd, &record, sizeof(record)) < 0) {
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < outs_len; i++) {
+    if (trust_write_all(fd, outs[i].issuer, outs[i].issuer_len) < 0 || trust_write_all(fd, outs[i].cert, outs[i].cert_len) < 0) {
+      return -1;
+    }
+  }
+  return fsync(fd);
+}
+
+
+// Writes the certificates of every key in the store to a file for saml_trust_open.  The file is written next to
+// path and renamed over it, so a process that opens or reloads it never sees half of one.
+int saml_trust_write(saml_trust_t* trust, const char* path) {
+  size_t path_len = strlen(path);
+  char* tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+  if (tmp_path == NULL) {
+    saml_log("could not allocate trust store file");
+    return -1;
+  }
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  trust_out_t* outs = NULL;
+  size_t outs_len = 0;
+  int fd = -1;
+  pthread_mutex_lock(&trust->lock);
+  int res = trust_out_collect(trust, &outs, &outs_len);
+  if (res == 0) {
+    qsort(outs, outs_len, sizeof(trust_out_t), trust_out_cmp);
+    if ((fd = mkstemp(tmp_path)) < 0) {
+      saml_log("could not create trust store file");
+      res = -1;
+    } else if (trust_out_write(fd, outs, outs_len) < 0) {
+      saml_log("could not write trust store file");
+      res = -1;
+    }
+  }
+  pthread_mutex_unlock(&trust->lock);
+
+  if (fd >= 0 && (close(fd) < 0 || res < 0 || rename(tmp_path, path) < 0)) {
+    if (res == 0) {
+      saml_log("could not write trust store file");
+    }
+    unlink(tmp_path);
+    res = -1;
+  }
+  for (size_t i = 0; outs != NULL && i < outs_len; i++) {
+    OPENSSL_free(outs[i].der);
+  }
+  free(outs);
+  free(tmp_path);
+  return res;
+}
+
+
+// Finds the issuer's keys, which stay valid until trust_release even if they are replaced
+static trust_entry_t* trust_acquire_issuer(saml_trust_t* trust, const char* issuer) {
+  uint32_t hash = href_hash((const xmlChar*)issuer);
+  pthread_mutex_lock(&trust->lock);
+  trust_entry_t* entry = *trust_lookup(trust, issuer, hash);
+  if (entry != NULL && entry->keys_len == 0) {
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    entry->refs++;
+  }
+  pthread_mutex_unlock(&trust->lock);
+  return entry;
+}
+
+
+static trust_entry_t* trust_acquire(saml_trust_t* trust, xmlDoc* doc) {
+  xmlChar* issuer = saml_doc_issuer(doc);
+  if (issuer == NULL) {
+    return NULL;
+  }
+  trust_entry_t* entry = trust_acquire_issuer(trust, (const char*)issuer);
+  xmlFree(issuer);
+  return entry;
+}
+
+
+static void trust_release(saml_trust_t* trust, trust_entry_t* entry) {
+  trust_entry_unref(trust, entry);
+}
+
+
+// SHA-256 of the base64 text of a KeyInfo element, leaving out the whitespace it may be wrapped with.  Returns
+// -1 for an empty one, such as an unfilled template leaves.
+static int trust_node_digest(xmlNode* node, unsigned char* digest) {
+  xmlChar* text = xmlNodeGetContent(node);
+  if (text == NULL) {
+    return -1;
+  }
+
+  size_t len = 0;
+  for (xmlChar* c = text; *c != '\0'; c++) {
+    if (!IS_BLANK_CH(*c)) {
+      text[len++] = *c;
+    }
+  }
+  if (len > 0) {
+    SHA256(text, len, digest);
+  }
+  xmlFree(text);
+  return len > 0 ? 0 : -1;
+}
+
+
+// Which of the entry's keys the KeyInfo of the document's signature names, so that only that key is tried.  Every
+// X509Certificate and X509SKI is matched against the trusted keys' certificates first, and if there are any but
+// none match, the signature can't be verified by a trusted key and TRUST_NONE is returned, whatever KeyName says.
+// Only without them is a KeyName matched against the keys' names, and otherwise ignored, since many IdPs put
+// arbitrary text there.  TRUST_ALL means the KeyInfo names no key, and every key has to be tried.
+static int trust_select(trust_entry_t* entry, xmlDoc* doc) {
+  xmlNode* root = xmlDocGetRootElement(doc);
+  xmlNode* sig = root == NULL ? NULL : xmlSecFindNode(root, xmlSecNodeSignature, xmlSecDSigNs);
+  xmlNode* key_info = sig == NULL ? NULL : xmlSecFindChild(sig, xmlSecNodeKeyInfo, xmlSecDSigNs);
+  if (key_info == NULL) {
+    return TRUST_ALL;
+  }
+
+  int selected = TRUST_ALL;
+  for (xmlNode* node = xmlSecGetNextElementNode(key_info->children); node != NULL; node = xmlSecGetNextElementNode(node->next)) {
+    if (!xmlSecCheckNodeName(node, xmlSecNodeX509Data, xmlSecDSigNs)) {
+      continue;
+    }
+    for (xmlNode* x509 = xmlSecGetNextElementNode(node->children); x509 != NULL; x509 = xmlSecGetNextElementNode(x509->next)) {
+      int is_cert = xmlSecCheckNodeName(x509, xmlSecNodeX509Certificate, xmlSecDSigNs);
+      unsigned char digest[SHA256_DIGEST_LENGTH];
+      if ((!is_cert && !xmlSecCheckNodeName(x509, xmlSecNodeX509SKI, xmlSecDSigNs)) || trust_node_digest(x509, digest) < 0) {
+        continue;
+      }
+      for (size_t i = 0; i < entry->keys_len; i++) {
+        trust_key_t* key_info = entry->key_infos + i;
+        if (is_cert ? key_info->has_cert && memcmp(key_info->cert_digest, digest, SHA256_DIGEST_LENGTH) == 0
+                    : key_info->has_ski && memcmp(key_info->ski_digest, digest, SHA256_DIGEST_LENGTH) == 0) {
+          return i;
+        }
+      }
+      selected = TRUST_NONE;
+    }
+  }
+  if (selected == TRUST_NONE) {
+    return TRUST_NONE;
+  }
+
+  for (xmlNode* node = xmlSecGetNextElementNode(key_info->children); node != NULL; node = xmlSecGetNextElementNode(node->next)) {
+    if (!xmlSecCheckNodeName(node, xmlSecNodeKeyName, xmlSecDSigNs)) {
+      continue;
+    }
+    xmlChar* name = xmlNodeGetContent(node);
+    for (size_t i = 0; name != NULL && i < entry->keys_len; i++) {
+      const xmlChar* key_name = xmlSecKeyGetName(entry->keys[i]);
+      if (key_name != NULL && xmlStrEqual(key_name, name)) {
+        xmlFree(name);
+        return i;
+      }
+    }
+    xmlFree(name);
+  }
+  return TRUST_ALL;
+}
@@ -1,26 +1,32 @@
 int saml_doc_validate(xmlDoc* doc) {
-  return xmlSchemaValidateDoc(XML_SCHEMA_VALIDATE_CTX, doc) == 0 ? 1 : 0;
-}
-
-
-static xmlXPathObject* eval_xpath(xmlDoc* doc, xmlXPathCompExpr* xpath) {
-  xmlXPathContext* ctx = xmlXPathNewContext(doc);
-  if (ctx == NULL) {
-    return NULL;
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
+    return 0;
   }
 
-  if (xmlXPathRegisterNs(ctx, (xmlChar*)"saml", (xmlChar*)SAML_XMLNS_ASSERTION) < 0) {
-    xmlXPathFreeContext(ctx);
-    return NULL;
+  xmlSchemaValidCtxt* validate_ctx = thread_validate_ctx(tctx);
+  if (validate_ctx == NULL) {
+    return 0;
   }
 
-  if (xmlXPathRegisterNs(ctx, (xmlChar*)"samlp", (xmlChar*)SAML_XMLNS_PROTOCOL) < 0) {
-    xmlXPathFreeContext(ctx);
+  uint64_t start = stats_start();
+  int res = xmlSchemaValidateDoc(validate_ctx, doc);
+  stats_record(SAML_STAGE_XSD_VALIDATE, start, 0);
+  return res == 0 ? 1 : 0;
+}
+
+
+static xmlXPathObject* eval_xpath(xmlDoc* doc, saml_xpath_t xpath) {
+  saml_thread_ctx_t* tctx = thread_ctx();
+  if (tctx == NULL) {
     return NULL;
   }
 
-  xmlXPathObject* obj = xmlXPathCompiledEval(xpath, ctx);
-  xmlXPathFreeContext(ctx);
+  xmlXPathContext* ctx = tctx->xpath_ctx;
+  ctx->doc = doc;
+  ctx->node = NULL;
+  xmlXPathObject* obj = xmlXPathCompiledEval(tctx->xpaths[xpath], ctx);
+  ctx->doc = NULL;
   return obj;
 }
 
@@ -180,6 +186,7 @@ void saml_attrs_free(saml_attr_t* attrs, size_t attrs_len) {
           xmlFree(attrs[i].values[j]);
         }
       }
+      free(attrs[i].values);
     }
   }
   free(attrs);